@@ -25,6 +25,8 @@
 #include <sys/ioctl.h>
 #include <sys/sysinfo.h>
 #include <linux/if_packet.h>
+#include <linux/filter.h>
+#include <netinet/in.h>
 #include <net/if.h>
 #include <net/ethernet.h> /* the L2 protocols */
 
@@ -86,6 +88,7 @@ struct thread_storage {
   pthread_t tid;            /* Thread ID */
   pthread_attr_t thread_attributes;
   int sockfd;               /* Socket owned by this thread */
+  int cpu;                  /* CPU to which this thread is pinned, or -1 */
   const char *if_name;      /* The name of the interface to bind the socket to */
   uint8_t *mapped_buffer;   /* The pointer to the mmap()'d region */
   struct tpacket_block_desc **block_header; /* The pointer to each block in the mmap()'d region */
@@ -397,6 +400,186 @@ void *stats_thread_func(void *statst_arg) {
 }
 
 
+/*
+ * flow_fanout_filter[] is the classic BPF program used with
+ * PACKET_FANOUT_CBPF for --fanout=flow.  The kernel sends each packet
+ * to the socket whose index is the value returned by the program,
+ * modulo the number of sockets in the fanout group.  The program
+ * returns a hash of the source and destination addresses, and of the
+ * source and destination ports of TCP, UDP, and SCTP packets, that is
+ * symmetric (the addresses and the ports are each combined with
+ * exclusive-or before they are mixed), so that both directions of a
+ * flow go to the same thread, unlike PACKET_FANOUT_HASH, which uses
+ * the kernel's flow hash, whose value for the two directions of a
+ * flow may differ, as when it is computed by the NIC.  The ports of
+ * an IPv4 fragment are ignored, so that all of the fragments of a
+ * packet go to the same thread; packets that are neither IPv4 nor
+ * IPv6 all go to the first thread.
+ */
+static struct sock_filter flow_fanout_filter[] = {
+  BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),  /* A = ethertype */
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 24),                 /* IPv4? */
+  BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 12),              /* A = source address */
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),                                      /* X = A */
+  BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 16),              /* A = destination address */
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),                               /* A ^= X */
+  BPF_STMT(BPF_ST, 0),                                                  /* M[0] = A */
+  BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, SKF_NET_OFF + 6),               /* A = flags and fragment offset */
+  BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3fff, 53, 0),                  /* fragment: no ports */
+  BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, SKF_NET_OFF + 9),               /* A = protocol */
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 2, 0),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 1, 0),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_SCTP, 0, 49),
+  BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, SKF_NET_OFF + 0),               /* A = version and header length */
+  BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xf),
+  BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 2),                               /* A = header length in bytes */
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),                                      /* X = A */
+  BPF_STMT(BPF_LD  | BPF_H   | BPF_IND, SKF_NET_OFF + 0),               /* A = source port */
+  BPF_STMT(BPF_ST, 1),                                                  /* M[1] = A */
+  BPF_STMT(BPF_LD  | BPF_H   | BPF_IND, SKF_NET_OFF + 2),               /* A = destination port */
+  BPF_STMT(BPF_LDX | BPF_MEM, 1),                                       /* X = M[1] */
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),                               /* A ^= X */
+  BPF_STMT(BPF_LDX | BPF_MEM, 0),                                       /* X = M[0] */
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),                               /* A ^= X */
+  BPF_STMT(BPF_ST, 0),                                                  /* M[0] = A */
+  BPF_STMT(BPF_JMP | BPF_JA, 36),                                       /* goto mix */
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IPV6, 0, 44),               /* IPv6? */
+  BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 8),               /* A = source address (first word) */
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),                                      /* X = A */
+  BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 12),              /* A = source address (second word) */
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),                               /* A ^= X */
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),                                      /* X = A */
+  BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 16),              /* A = source address (third word) */
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),                               /* A ^= X */
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),                                      /* X = A */
+  BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 20),              /* A = source address (fourth word) */
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),                               /* A ^= X */
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),                                      /* X = A */
+  BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 24),              /* A = destination address (first word) */
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),                               /* A ^= X */
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),                                      /* X = A */
+  BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 28),              /* A = destination address (second word) */
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),                               /* A ^= X */
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),                                      /* X = A */
+  BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 32),              /* A = destination address (third word) */
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),                               /* A ^= X */
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),                                      /* X = A */
+  BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 36),              /* A = destination address (fourth word) */
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),                               /* A ^= X */
+  BPF_STMT(BPF_ST, 0),                                                  /* M[0] = A */
+  BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, SKF_NET_OFF + 6),               /* A = next header */
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 2, 0),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 1, 0),
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_SCTP, 0, 8),
+  BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, SKF_NET_OFF + 40),              /* A = source port */
+  BPF_STMT(BPF_ST, 1),                                                  /* M[1] = A */
+  BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, SKF_NET_OFF + 42),              /* A = destination port */
+  BPF_STMT(BPF_LDX | BPF_MEM, 1),                                       /* X = M[1] */
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),                               /* A ^= X */
+  BPF_STMT(BPF_LDX | BPF_MEM, 0),                                       /* X = M[0] */
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),                               /* A ^= X */
+  BPF_STMT(BPF_ST, 0),                                                  /* M[0] = A */
+  BPF_STMT(BPF_LD  | BPF_MEM, 0),                                       /* A = M[0] */
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),                                      /* X = A */
+  BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),                               /* A ^= A >> 16 */
+  BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x45d9f3b),
+  BPF_STMT(BPF_MISC | BPF_TAX, 0),                                      /* X = A */
+  BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+  BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),                               /* A ^= A >> 16 */
+  BPF_STMT(BPF_RET | BPF_A, 0),                                         /* return A */
+  BPF_STMT(BPF_RET | BPF_K, 0),                                         /* not IP: first socket */
+};
+
+/*
+ * fanout_type_from_config(fanout) returns the PACKET_FANOUT_* type
+ * for the --fanout mode fanout, or PACKET_FANOUT_HASH if fanout is
+ * NULL
+ */
+static int fanout_type_from_config(const char *fanout) {
+  if (fanout == NULL || strcmp(fanout, "hash") == 0) {
+    return PACKET_FANOUT_HASH;
+  }
+  if (strcmp(fanout, "flow") == 0) {
+    return PACKET_FANOUT_CBPF;
+  }
+  if (strcmp(fanout, "cpu") == 0) {
+    return PACKET_FANOUT_CPU;
+  }
+  fprintf(stderr, "error: unknown fanout mode \"%s\"\n", fanout);
+  return -1;
+}
+
+/*
+ * parse_cpu_list(list, cpus, max_cpus) parses the comma-separated
+ * list of cpu numbers and ranges, such as "0-3,8", into the array
+ * cpus, and returns the number of cpus in it, or -1 if list is not
+ * valid
+ */
+static int parse_cpu_list(const char *list, int *cpus, int max_cpus) {
+  int num_cpus = 0;
+  const char *c = list;
+  while (*c != '\0') {
+    char *end;
+    long first = strtol(c, &end, 10);
+    if (end == c || first < 0 || first >= CPU_SETSIZE) {
+      return -1;
+    }
+    long last = first;
+    if (*end == '-') {
+      c = end + 1;
+      last = strtol(c, &end, 10);
+      if (end == c || last < first || last >= CPU_SETSIZE) {
+        return -1;
+      }
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      if (num_cpus == max_cpus) {
+        return -1;
+      }
+      cpus[num_cpus++] = cpu;
+    }
+    if (*end == ',') {
+      end++;
+    } else if (*end != '\0') {
+      return -1;
+    }
+    c = end;
+  }
+  return num_cpus;
+}
+
+/*
+ * set_cpu_affinity(cpu) pins the calling thread to cpu, if cpu is not
+ * negative; memory that the thread allocates and first touches while
+ * it is pinned comes from the NUMA node of that cpu, under the default
+ * memory policy
+ */
+static int set_cpu_affinity(int cpu) {
+  if (cpu < 0) {
+    return 0;
+  }
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(cpu, &cpu_set);
+  int err = sched_setaffinity(0, sizeof(cpu_set), &cpu_set);
+  if (err) {
+    fprintf(stderr, "%s: could not set affinity to cpu %d\n", strerror(errno), cpu);
+  }
+  return err;
+}
+
+/*
+ * restore_cpu_affinity(cpu_set) sets the affinity of the calling
+ * thread back to cpu_set, as saved before set_cpu_affinity() was
+ * called, so that an error return does not leave it pinned
+ */
+static void restore_cpu_affinity(const cpu_set_t *cpu_set) {
+  if (sched_setaffinity(0, sizeof(*cpu_set), cpu_set)) {
+    perror("could not restore cpu affinity");
+  }
+}
+
 /*
  * The function af_packet_rx_ring_fanout_capture() sets up an
  * AF_PACKET socket with a memory-mapped RX_RING and FANOUT, then
@@ -535,6 +718,22 @@ int create_dedicated_socket(struct thread_storage *thread_stor, int fanout_arg)
     return -1;
   }
 
+  /*
+   * with PACKET_FANOUT_CBPF, the program that selects the socket for
+   * each packet is shared by the group, and can only be set once this
+   * socket has joined it
+   */
+  if ((fanout_arg >> 16) == PACKET_FANOUT_CBPF) {
+    struct sock_fprog fanout_prog;
+    fanout_prog.len = sizeof(flow_fanout_filter) / sizeof(flow_fanout_filter[0]);
+    fanout_prog.filter = flow_fanout_filter;
+    err = setsockopt(sockfd, SOL_PACKET, PACKET_FANOUT_DATA, &fanout_prog, sizeof(fanout_prog));
+    if (err) {
+      perror("error: could not set fanout program");
+      return -1;
+    }
+  }
+
   return 0;
 }
 
@@ -780,10 +979,37 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
   struct ring_limits rl;
   ring_limits_init(&rl, cfg->buffer_fraction);
 
+  rl.af_fanout_type = fanout_type_from_config(cfg->fanout);
+  if (rl.af_fanout_type < 0) {
+    return status_err;
+  }
+
   int err;
   int num_threads = cfg->num_threads;
   int fanout_arg = ((getpid() & 0xffff) | (rl.af_fanout_type << 16));
 
+  /*
+   * if a cpu list was given, worker thread i is pinned to the ith cpu
+   * in it (modulo its length), and its ring buffer and packet
+   * processor are allocated while the main thread runs on that cpu,
+   * so that they are local to it; the original affinity of the main
+   * thread is restored afterwards
+   */
+  int cpu_list[CPU_SETSIZE];
+  int num_cpus = 0;
+  if (cfg->cpus) {
+    num_cpus = parse_cpu_list(cfg->cpus, cpu_list, CPU_SETSIZE);
+    if (num_cpus <= 0) {
+      fprintf(stderr, "error: invalid cpu list \"%s\"\n", cfg->cpus);
+      return status_err;
+    }
+  }
+  cpu_set_t original_cpu_set;
+  if (sched_getaffinity(0, sizeof(original_cpu_set), &original_cpu_set)) {
+    perror("could not get cpu affinity");
+    return status_err;
+  }
+
   /* We need all our threads to get a clean start at the same time or
    * else some threads will start working before other threads are ready
    * and this makes a mess of drop counters and gets in the way of
@@ -889,6 +1115,7 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
     tstor[thread].tnum = thread;
     tstor[thread].tid = 0;
     tstor[thread].sockfd = -1;
+    tstor[thread].cpu = num_cpus ? cpu_list[thread % num_cpus] : -1;
     tstor[thread].if_name = cfg->capture_interface;
     tstor[thread].statst = &statst;
     tstor[thread].t_start_p = &t_start_p;
@@ -902,6 +1129,9 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
 
     memcpy(&(tstor[thread].ring_params), &thread_ring_req, sizeof(thread_ring_req));
 
+    if (set_cpu_affinity(tstor[thread].cpu) != 0) {
+      exit(255);
+    }
     err = create_dedicated_socket(&(tstor[thread]), fanout_arg);
 
     if (err != 0) {
@@ -912,6 +1142,7 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
 
   /* drop privileges from root to normal user */
   if (drop_root_privileges(cfg->user, cfg->working_dir) != status_ok) {
+    restore_cpu_affinity(&original_cpu_set);
     return status_err;
   }
   if (cfg->user) {
@@ -925,12 +1156,21 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
    */
   for (int thread = 0; thread < num_threads; thread++) {
 
+      if (set_cpu_affinity(tstor[thread].cpu) != 0) {
+          restore_cpu_affinity(&original_cpu_set);
+          return status_err;
+      }
       tstor[thread].pkt_processor = pkt_proc_new_from_config(cfg, mc, thread, &out_ctx->qs.queue[thread]);
       if (tstor[thread].pkt_processor == NULL) {
           printf("error: could not initialize frame handler\n");
+          restore_cpu_affinity(&original_cpu_set);
           return status_err;
       }
   }
+  if (sched_setaffinity(0, sizeof(original_cpu_set), &original_cpu_set)) {
+    perror("could not restore cpu affinity");
+    return status_err;
+  }
 
   /* Start up the threads */
   pthread_t stats_thread;
@@ -947,6 +1187,18 @@ enum status bind_and_dispatch(struct mercury_config *cfg,
       exit(255);
     }
 
+    if (tstor[thread].cpu >= 0) {
+      cpu_set_t cpu_set;
+      CPU_ZERO(&cpu_set);
+      CPU_SET(tstor[thread].cpu, &cpu_set);
+      err = pthread_attr_setaffinity_np(&thread_attributes, sizeof(cpu_set), &cpu_set);
+      if (err) {
+        fprintf(stderr, "%s: error setting cpu affinity for thread %d\n", strerror(err), thread);
+        exit(255);
+      }
+      fprintf(stderr, "Pinning thread %d to cpu %d\n", thread, tstor[thread].cpu);
+    }
+
     err = pthread_create(&(tstor[thread].tid), &thread_attributes, packet_capture_thread_func, &(tstor[thread]));
     if (err) {
       fprintf(stderr, "%s: error creating af_packet capture thread %d\n", strerror(err), thread);
@@ -141,6 +141,18 @@ static enum status mercury_config_parse_line(struct mercury_config *cfg,
     } else if ((arg = command_get_argument("output-time=", line)) != NULL) {
         return argument_parse_as_uint64(arg, &cfg->out_rotation_duration);
 
+    } else if ((arg = command_get_argument("output-compression=", line)) != NULL) {
+        cfg->output_compression = strdup(arg);
+        return status_ok;
+
+    } else if ((arg = command_get_argument("fanout=", line)) != NULL) {
+        cfg->fanout = strdup(arg);
+        return status_ok;
+
+    } else if ((arg = command_get_argument("cpus=", line)) != NULL) {
+        cfg->cpus = strdup(arg);
+        return status_ok;
+
     } else if ((arg = command_get_argument("user=", line)) != NULL) {
         cfg->user = strdup(arg);
         return status_ok;
@@ -13,6 +13,7 @@
 #include "rotator.h"
 #include "output.h"
 #include "libmerc/libmerc.h"
+#include "signal_handling.h"
 
 class controller {
 public:
@@ -41,6 +42,8 @@ public:
         out_file->file_num = 0;
         out_file->mode = cfg.mode;
         out_file->rotate_time = cfg.out_rotation_duration;
+        out_file->compression = cfg.output_compression;
+        out_file->verbosity = cfg.verbosity;
 
         if (cfg.fingerprint_filename) {
             out_file->outfile_name = cfg.fingerprint_filename;
@@ -84,6 +87,16 @@ private:
         while (shutdown_requested.load() == false) {
             outfile_routine();
 
+            // reload the resource file after SIGHUP; the packet
+            // processing threads keep running while it is loaded
+            //
+            if (sig_reload_flag) {
+                sig_reload_flag = 0;
+                if (mercury_reload_resources(mc, nullptr) == false) {
+                    fprintf(stderr, "error: could not reload resource file\n");
+                }
+            }
+
             if (stats_dump) {
                 if (count == 0) {
                     count = num_secs_between_writes;
@@ -49,6 +49,7 @@ sources = ['mercury.pyx',
            '../libmerc/smb2.cc',
            '../libmerc/config_generator.cc',
            '../libmerc/bencode.cc',
+           '../libmerc/softmax.cc',
 ]
 
 additional_flags = os.getenv('ENV_CFLAGS').encode('latin1').decode('unicode_escape').replace("'","",2)
@@ -18,6 +18,12 @@
 // INTERCEPT_VERBOSE and INTERCEPT_MAX_PT_LEN to set the verbosity (to
 // 0 or 1) and maximum plaintext length that is captured for each
 // intercepted read/write call (to a positive integer).
+//
+// By default, intercepted calls do not write output themselves; each
+// thread appends its records to its own lock-free buffer, which a
+// background thread drains with large batched writes.  The variables
+// intercept_buffer_size, intercept_output_format, and intercept_stats
+// configure that buffering (see doc/intercept.md).
 
 // Implementation Notes
 //
@@ -70,8 +76,10 @@
 #include <dlfcn.h>
 #include <dirent.h>
 #include <syslog.h>
-#include <semaphore.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/file.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -115,16 +123,57 @@
 //
 int tty = 0;
 
-// read environment variables that configure intercept.so, and apply
-// configuration as needed
+// configuration of intercept.so, which is read from environment
+// variables by read_environment()
+//
+ssize_t max_pt_len = 0;
+
+long int verbose = 0;
+
+// buffer_size is the number of bytes in the ring buffer of each
+// thread; larger values than max_buffer_size are not accepted.  The
+// default is modest, because every thread that writes a record gets
+// a ring, and the output thread is woken to drain a ring as soon as
+// it is half full
 //
-const char *MAX_PT_LEN = getenv("intercept_max_pt_len");
+constexpr size_t default_buffer_size = 256*1024;
+
+constexpr size_t max_buffer_size = 64*1024*1024;
+
+size_t buffer_size = default_buffer_size;
 
-ssize_t max_pt_len = MAX_PT_LEN ? atol(MAX_PT_LEN) : 0;
+bool binary_format = false;
+
+long int stats = 0;
+
+// read_environment() reads the environment variables that configure
+// intercept.so; it is called by intercept_init(), because that
+// constructor can run before the dynamic initialization of the
+// variables in this file
+//
+void read_environment() {
+    const char *MAX_PT_LEN = getenv("intercept_max_pt_len");
+    max_pt_len = MAX_PT_LEN ? atol(MAX_PT_LEN) : 0;
+
+    const char *VERBOSE = getenv("intercept_verbose");
+    verbose = VERBOSE ? atol(VERBOSE) : 0;
+
+    const char *BUFFER_SIZE = getenv("intercept_buffer_size");
+    if (BUFFER_SIZE) {
+        buffer_size = strtoul(BUFFER_SIZE, nullptr, 10);
+        if (buffer_size > max_buffer_size) {
+            fprintf(stderr, YELLOW(tty, "warning: intercept_buffer_size %s exceeds the maximum of %zu; using %zu\n"),
+                    BUFFER_SIZE, max_buffer_size, default_buffer_size);
+            buffer_size = default_buffer_size;
+        }
+    }
 
-const char *VERBOSE = getenv("intercept_verbose");
+    const char *OUTPUT_FORMAT = getenv("intercept_output_format");
+    binary_format = OUTPUT_FORMAT && strcmp(OUTPUT_FORMAT, "binary") == 0;
 
-long int verbose = VERBOSE ? atol(VERBOSE) : 0;
+    const char *STATS = getenv("intercept_stats");
+    stats = STATS ? atol(STATS) : 0;
+}
 
 // Support functions for obtaining additional context from the
 // application or OS, and writing data output
@@ -293,6 +342,13 @@ void print_flow_key(int fd) {
 
 #include <unordered_set>
 #include <string>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <vector>
 
 #if 0
 struct http_request_x : public http_request {
@@ -373,6 +429,26 @@ public:
     virtual void write_buffer(struct buffer_stream &buf) = 0;
     virtual ~output() {};
 
+    // write_batch() writes length bytes of newline-terminated records;
+    // by default, each record is written with write_buffer()
+    //
+    virtual void write_batch(const char *data, size_t length) {
+        const char *end = data + length;
+        std::vector<char> line;
+        while (data < end) {
+            const char *eol = (const char *)memchr(data, '\n', end - data);
+            if (eol == nullptr) {
+                eol = end;
+            }
+            line.assign(data, eol);
+            line.resize(line.size() + 2);   // room for a terminator
+            struct buffer_stream buf(line.data(), line.size());
+            buf.doff = eol - data;
+            write_buffer(buf);
+            data = eol + 1;
+        }
+    }
+
     enum type { unknown=0, file, log, daemon };
 
     static enum output::type get_type(const char *type_string) {
@@ -395,26 +471,12 @@ public:
 
 
 class file_output : public output {
-    FILE *outfile = nullptr;
-    sem_t *outfile_sem = nullptr;
-    static constexpr size_t buffer_length = 20*1024;
+    int outfile = -1;
 
 public:
 
     file_output() {
 
-        //  use a named semaphore to ensure that writes to outfile are
-        //  not overlapping
-        //
-        //  On a modern Linux system, this semaphore is located at
-        //  /dev/shm/sem.intercept.  If there is a problem, you may
-        //  need to delete that file
-        //
-        if ((outfile_sem = sem_open ("/intercept", O_CREAT, 0666, 1)) == SEM_FAILED) {
-            perror ("intercept: sem_open()");
-            exit(EXIT_FAILURE);
-        }
-
         std::string outfile_name = "/usr/local/var/intercept/";  // default directory
         const char *ENV_INTERCEPT_DIR = getenv("intercept_dir");
         if (ENV_INTERCEPT_DIR) {
@@ -435,9 +497,14 @@ public:
             exit(EXIT_FAILURE);
         }
 
+        //  each record, or batch of records, is written with a single
+        //  write() to a file opened with O_APPEND, which the kernel
+        //  positions at the end of the file atomically, so writes from
+        //  different processes do not overlap, and need no lock
+        //
         outfile_name += "/intercept.json";
-        outfile = fopen(outfile_name.c_str(), "a+");
-        if (outfile ==nullptr) {
+        outfile = open(outfile_name.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+        if (outfile == -1) {
             fprintf(stderr, RED(tty, "%s: could not open file %s (%s)\n"), __func__, outfile_name.c_str(), strerror(errno));
             exit(EXIT_FAILURE);
         }
@@ -445,49 +512,29 @@ public:
     }
 
     ~file_output() {
-        if (outfile) {
-            fclose(outfile);
-        }
-        if (outfile_sem != SEM_FAILED) {
-            sem_close(outfile_sem);
+        if (outfile != -1) {
+            close(outfile);
         }
         // closelog();
     }
 
     void write_buffer(struct buffer_stream &buf) {
+        buf.write_char('\n');
+        write_batch(buf.dstr, buf.length());
+    }
 
-        // POSIX semaphores for file locking
-        //
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += 1;
-        if (sem_timedwait(outfile_sem, &ts) == -1) {   // use timedwait for resiliency
-            perror ("intercept: sem_wait()");
-
-            // failsafe: to recover from situations in which the
-            // semaphore is not being released for whatever reason,
-            // delete the semaphore and then create a new one
-            //
-            unlink("/dev/shm/sem.intercept");
-            if ((outfile_sem = sem_open ("/intercept", O_CREAT, 0666, 1)) == SEM_FAILED) {
-                perror ("intercept: sem_open()");
-                exit(EXIT_FAILURE);
+    void write_batch(const char *data, size_t length) {
+        while (length > 0) {
+            ssize_t bytes_written = write(outfile, data, length);
+            if (bytes_written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("intercept: write()");
+                return;
             }
-        }
-        // fprintf(stderr, GREEN(tty, "pid %d acquired semaphore\n"), pid);
-
-        fseek(outfile, 0, SEEK_END); // move to end of file
-        buf.write_line(outfile);
-        // add check to find write error
-        // if (buf.write_line(outfile) < 0) {
-        //     perror ("intercept: write()");
-        //     exit(EXIT_FAILURE);
-        // }
-
-        // fprintf(stderr, GREEN(tty, "pid %d releasing semaphore\n"), pid);
-        if (sem_post(outfile_sem) == -1) {
-            perror ("intercept: sem_post()");
-            exit(EXIT_FAILURE);
+            data += bytes_written;
+            length -= bytes_written;
         }
     }
 
@@ -544,6 +591,646 @@ struct daemon_output : public output {
     }
 };
 
+// class record_ring is a lock-free ring buffer of variable-length
+// records, with a single producer (the thread that owns the ring) and
+// a single consumer (the output thread of async_output).  Each record
+// is stored as a four-byte length followed by that many bytes, and
+// may wrap around the end of the buffer.  The producer never waits:
+// a record that does not fit into the free space is dropped, and
+// counted.  The statistics are written only by the producer.  The
+// buffer is not zeroed, so that its pages are only touched as records
+// are written to it.
+//
+class record_ring {
+    size_t capacity;
+    std::unique_ptr<uint8_t[]> buffer;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head{0};   // advanced by producer
+    alignas(64) std::atomic<size_t> tail{0};   // advanced by consumer
+
+public:
+
+    alignas(64) std::atomic<uint64_t> records{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> hooked_calls{0};
+    std::atomic<uint64_t> hook_ns{0};
+    std::atomic<uint64_t> hook_ns_max{0};
+
+    // orphaned is set when the thread that owns the ring exits, after
+    // which the ring can be freed once it is empty
+    //
+    std::atomic<bool> orphaned{false};
+
+    record_ring(size_t size) :
+        capacity{round_up_to_power_of_two(size)},
+        buffer{new uint8_t[capacity]},
+        mask{capacity - 1} { }
+
+    // push() appends a record consisting of a type byte, hdr_len
+    // bytes of hdr, and data_len bytes of data, and returns true, or
+    // returns false if it was dropped
+    //
+    bool push(uint8_t type, const void *hdr, size_t hdr_len, const void *data, size_t data_len) {
+        size_t body_len = sizeof(type) + hdr_len + data_len;
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_acquire);
+        if (sizeof(uint32_t) + body_len > capacity - (h - t)) {
+            count_drop();
+            return false;
+        }
+        uint32_t len = body_len;
+        copy_in(h, &len, sizeof(len));
+        h += sizeof(len);
+        copy_in(h, &type, sizeof(type));
+        h += sizeof(type);
+        copy_in(h, hdr, hdr_len);
+        h += hdr_len;
+        copy_in(h, data, data_len);
+        head.store(h + data_len, std::memory_order_release);
+        records.store(records.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // drain() passes each record in the ring, in order, to f(data,
+    // length), using scratch to hold it; it must only be called by
+    // the consumer
+    //
+    template <typename F>
+    void drain(std::vector<uint8_t> &scratch, F f) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h = head.load(std::memory_order_acquire);
+        while (t != h) {
+            uint32_t len;
+            copy_out(t, &len, sizeof(len));
+            scratch.resize(len);
+            copy_out(t + sizeof(len), scratch.data(), len);
+            t += sizeof(len) + len;
+            tail.store(t, std::memory_order_release);
+            f(scratch.data(), len);
+        }
+    }
+
+    // count_drop() counts a record that was not pushed; it must only
+    // be called by the producer
+    //
+    void count_drop() {
+        dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    bool empty() const {
+        return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire);
+    }
+
+    // above_high_water() returns true if more than half of the ring is
+    // in use; it must only be called by the producer
+    //
+    bool above_high_water() const {
+        return head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire) > capacity / 2;
+    }
+
+    // reset() discards all records; it is only safe to call when no
+    // other thread is using the ring, such as in the child after a
+    // fork()
+    //
+    void reset() {
+        tail.store(head.load());
+    }
+
+    void add_hook_time(uint64_t ns) {
+        hooked_calls.store(hooked_calls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        hook_ns.store(hook_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+        if (ns > hook_ns_max.load(std::memory_order_relaxed)) {
+            hook_ns_max.store(ns, std::memory_order_relaxed);
+        }
+    }
+
+private:
+
+    static size_t round_up_to_power_of_two(size_t size) {
+        size_t x = 4096;
+        while (x < size && x < max_buffer_size) {
+            x *= 2;
+        }
+        return x;
+    }
+
+    void copy_in(size_t position, const void *src, size_t len) {
+        if (len == 0) {
+            return;
+        }
+        size_t offset = position & mask;
+        size_t first = std::min(len, capacity - offset);
+        memcpy(&buffer[offset], src, first);
+        if (len > first) {
+            memcpy(&buffer[0], (const uint8_t *)src + first, len - first);
+        }
+    }
+
+    void copy_out(size_t position, void *dst, size_t len) const {
+        if (len == 0) {
+            return;
+        }
+        size_t offset = position & mask;
+        size_t first = std::min(len, capacity - offset);
+        memcpy(dst, &buffer[offset], first);
+        if (len > first) {
+            memcpy((uint8_t *)dst + first, &buffer[0], len - first);
+        }
+    }
+};
+
+// thread_ring holds the record_ring of the current thread, if it has
+// one, and marks it as orphaned when the thread exits
+//
+static thread_local struct thread_ring_holder {
+    record_ring *ring = nullptr;
+
+    // enroll() ensures that the destructor runs when the current
+    // thread exits, even if the thread never gets a ring
+    //
+    void enroll() { }
+
+    ~thread_ring_holder();
+} thread_ring;
+
+// class async_output takes output off of the intercepted calls: each
+// thread appends its records to its own record_ring, without locks or
+// system calls, and an output thread drains all of the rings, then
+// hands the records to another output object in large batches.  A
+// record is either a JSON object, or a binary capture that the output
+// thread converts into a JSON object with the formatter provided to
+// the constructor.  Intercepted calls only make a system call to wake
+// the output thread when it is not already awake.
+//
+class async_output : public output {
+public:
+
+    // a formatter writes the JSON object for the binary capture in
+    // data into buf, and returns true, or returns false if there is
+    // no output for it
+    //
+    using formatter = std::function<bool (const uint8_t *data, size_t length, struct buffer_stream &buf)>;
+
+private:
+
+    enum record_type : uint8_t { json_record = 'j', capture_record = 'c' };
+
+    static constexpr size_t max_batch_length = 1024*1024;
+    static constexpr size_t max_record_length = 20*1024;
+    static constexpr std::chrono::milliseconds batch_interval{10};
+
+    output *sink;
+    size_t ring_size;
+    formatter format_capture;
+    std::mutex thread_mutex;             // protects output_thread
+    std::mutex rings_mutex;              // protects rings
+    std::mutex drain_mutex;              // held by the output thread while draining
+    std::vector<record_ring *> rings;
+    int wake_fd = -1;
+    std::atomic<bool> wake_pending{false};
+    std::atomic<bool> flush_pending{false};
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> restart_needed{false};
+    std::atomic<bool> exiting{false};    // set once at exit; never cleared
+    std::thread *output_thread = nullptr;
+    std::string batch;
+    std::vector<uint8_t> scratch;
+    std::vector<char> record_buffer;
+
+    // statistics of rings that have been freed
+    //
+    uint64_t retired_records = 0, retired_dropped = 0, retired_calls = 0, retired_ns = 0, retired_ns_max = 0;
+
+    pthread_t main_thread;
+    static async_output *instance;   // for the fork and exit handlers
+
+public:
+
+    async_output(output *o, size_t size, formatter f) :
+        sink{o},
+        ring_size{size},
+        format_capture{f},
+        record_buffer(max_record_length) {
+
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake_fd == -1) {
+            perror("intercept: eventfd()");
+            exit(EXIT_FAILURE);
+        }
+        batch.reserve(max_batch_length + max_record_length);
+        main_thread = pthread_self();
+        thread_ring.enroll();   // see thread_exit()
+        instance = this;
+        static bool fork_handlers_registered = false;
+        if (!fork_handlers_registered) {
+            pthread_atfork(prepare_fork, parent_after_fork, child_after_fork);
+            fork_handlers_registered = true;
+        }
+        start_output_thread();
+    }
+
+    ~async_output() {
+        stop_output_thread();
+        drain();   // records written since the output thread stopped
+        if (stats) {
+            write_statistics();
+        }
+        instance = nullptr;
+        for (record_ring *ring : rings) {
+            delete ring;
+        }
+        close(wake_fd);
+        delete sink;
+    }
+
+    // write_buffer() queues the JSON object in buf for output
+    //
+    void write_buffer(struct buffer_stream &buf) {
+        push(json_record, nullptr, 0, buf.dstr, buf.length());
+    }
+
+    // write_capture() queues a binary capture, consisting of hdr_len
+    // bytes of hdr followed by data_len bytes of data, for formatting
+    // and output by the output thread
+    //
+    void write_capture(const void *hdr, size_t hdr_len, const void *data, size_t data_len) {
+        push(capture_record, hdr, hdr_len, data, data_len);
+    }
+
+    // thread_exit() is called when a thread exits.  When that thread
+    // is the main thread, the process is exiting, and the output thread
+    // is stopped after it writes all of the records; this must happen
+    // before the destructors of static objects run, because the output
+    // thread uses them.  Records that other threads write afterwards
+    // are dropped, and counted, rather than restarting the output
+    // thread while those destructors run.
+    //
+    static void thread_exit() {
+        async_output *o = instance;
+        if (o && pthread_equal(pthread_self(), o->main_thread)) {
+            o->exiting.store(true);
+            o->stop_output_thread();
+        }
+    }
+
+    // add_hook_time() adds the time spent in one hooked call to the
+    // statistics of the current thread
+    //
+    void add_hook_time(uint64_t ns) {
+        get_ring()->add_hook_time(ns);
+    }
+
+private:
+
+    // push() appends a record to the ring of the current thread; the
+    // first record after a drain wakes the output thread, which then
+    // waits for up to batch_interval for more records, unless a ring
+    // passes its high-water mark, in which case it is woken again so
+    // that it drains the rings before they fill up.  Once the process
+    // is exiting, records are dropped (see thread_exit())
+    //
+    void push(uint8_t type, const void *hdr, size_t hdr_len, const void *data, size_t data_len) {
+        if (exiting.load(std::memory_order_relaxed)) {
+            if (thread_ring.ring) {
+                thread_ring.ring->count_drop();
+            }
+            return;
+        }
+        if (restart_needed.load(std::memory_order_relaxed)) {
+            restart_output_thread();
+        }
+        record_ring *ring = get_ring();
+        if (!ring->push(type, hdr, hdr_len, data, data_len)) {
+            return;
+        }
+        if (!wake_pending.load(std::memory_order_relaxed) && !wake_pending.exchange(true)) {
+            eventfd_write(wake_fd, 1);
+        } else if (ring->above_high_water()
+                   && !flush_pending.load(std::memory_order_relaxed)
+                   && !flush_pending.exchange(true)) {
+            eventfd_write(wake_fd, 1);
+        }
+    }
+
+    record_ring *get_ring() {
+        if (thread_ring.ring == nullptr) {
+            record_ring *ring = new record_ring{ring_size};
+            std::lock_guard<std::mutex> lock{rings_mutex};
+            rings.push_back(ring);
+            thread_ring.ring = ring;
+        }
+        return thread_ring.ring;
+    }
+
+    void start_output_thread() {
+        output_thread = new std::thread{[this]() { run(); }};
+    }
+
+    void stop_output_thread() {
+        std::lock_guard<std::mutex> lock{thread_mutex};
+        if (output_thread) {
+            stopping.store(true);
+            eventfd_write(wake_fd, 1);
+            output_thread->join();
+            delete output_thread;
+            output_thread = nullptr;
+            stopping.store(false);
+            restart_needed.store(true);
+        }
+    }
+
+    void restart_output_thread() {
+        std::lock_guard<std::mutex> lock{thread_mutex};
+        if (restart_needed.load() && !exiting.load()) {
+            start_output_thread();
+            restart_needed.store(false);
+        }
+    }
+
+    // wait_for_wake(timeout) waits for up to timeout milliseconds, or
+    // indefinitely if timeout is negative, for a write to wake_fd
+    //
+    void wait_for_wake(int timeout) {
+        struct pollfd pfd{wake_fd, POLLIN, 0};
+        if (poll(&pfd, 1, timeout) > 0) {
+            eventfd_t count;
+            eventfd_read(wake_fd, &count);
+        }
+    }
+
+    // run() is the output thread: after it is woken, it waits for
+    // batch_interval, so that records accumulate, or until a ring
+    // passes its high-water mark, then drains them.  When it is
+    // stopped, it returns only after a drain that started after
+    // stopping was set, so that no records are left for ~async_output()
+    //
+    void run() {
+        while (true) {
+            wait_for_wake(-1);
+            if (!stopping.load() && !flush_pending.load()) {
+                wait_for_wake(batch_interval.count());
+            }
+            bool stop = stopping.load();
+            wake_pending.store(false);
+            flush_pending.store(false);
+            drain();
+            if (stop) {
+                return;
+            }
+        }
+    }
+
+    void drain() {
+        std::lock_guard<std::mutex> drain_lock{drain_mutex};
+        std::vector<record_ring *> snapshot;
+        {
+            std::lock_guard<std::mutex> lock{rings_mutex};
+            snapshot = rings;
+        }
+        for (record_ring *ring : snapshot) {
+            ring->drain(scratch, [this](const uint8_t *data, size_t length) { append(data, length); });
+        }
+        flush();
+
+        // free the rings of threads that have exited, once they are empty
+        //
+        std::lock_guard<std::mutex> lock{rings_mutex};
+        for (auto r = rings.begin(); r != rings.end(); ) {
+            record_ring *ring = *r;
+            if (ring->orphaned.load(std::memory_order_acquire) && ring->empty()) {
+                retired_records += ring->records.load();
+                retired_dropped += ring->dropped.load();
+                retired_calls += ring->hooked_calls.load();
+                retired_ns += ring->hook_ns.load();
+                retired_ns_max = std::max<uint64_t>(retired_ns_max, ring->hook_ns_max.load());
+                delete ring;
+                r = rings.erase(r);
+            } else {
+                ++r;
+            }
+        }
+    }
+
+    void append(const uint8_t *data, size_t length) {
+        if (length == 0) {
+            return;
+        }
+        if (data[0] == json_record) {
+            batch.append((const char *)data + 1, length - 1);
+        } else if (data[0] == capture_record) {
+            struct buffer_stream buf(record_buffer.data(), record_buffer.size());
+            if (!format_capture(data + 1, length - 1, buf)) {
+                return;
+            }
+            batch.append(buf.dstr, buf.length());
+        } else {
+            return;
+        }
+        batch.push_back('\n');
+        if (batch.length() >= max_batch_length) {
+            flush();
+        }
+    }
+
+    void flush() {
+        if (!batch.empty()) {
+            sink->write_batch(batch.data(), batch.length());
+            batch.clear();
+        }
+    }
+
+    // write_statistics() writes a record with the number of records
+    // and the latency added to hooked calls by this library, across
+    // all threads of this process
+    //
+    void write_statistics() {
+        uint64_t records = retired_records, dropped = retired_dropped, calls = retired_calls, ns = retired_ns, ns_max = retired_ns_max;
+        for (record_ring *ring : rings) {
+            records += ring->records.load();
+            dropped += ring->dropped.load();
+            calls += ring->hooked_calls.load();
+            ns += ring->hook_ns.load();
+            ns_max = std::max<uint64_t>(ns_max, ring->hook_ns_max.load());
+        }
+        char buffer[max_record_length];
+        struct buffer_stream buf(buffer, sizeof(buffer));
+        struct json_object record{&buf};
+        json_object stats_object{record, "intercept_stats"};
+        stats_object.print_key_uint("pid", getpid());
+        stats_object.print_key_uint("records", records);
+        stats_object.print_key_uint("dropped", dropped);
+        stats_object.print_key_uint("hooked_calls", calls);
+        stats_object.print_key_uint("hook_ns_mean", calls ? ns / calls : 0);
+        stats_object.print_key_uint("hook_ns_max", ns_max);
+        stats_object.close();
+        record.close();
+        sink->write_buffer(buf);
+    }
+
+    // fork handlers: the output thread is not duplicated by fork(), so
+    // the child discards the records that the parent had not yet
+    // written, and starts a new output thread when it first writes
+    //
+    static void prepare_fork() {
+        if (instance) {
+            instance->thread_mutex.lock();
+            instance->drain_mutex.lock();
+            instance->rings_mutex.lock();
+        }
+    }
+
+    static void parent_after_fork() {
+        if (instance) {
+            instance->rings_mutex.unlock();
+            instance->drain_mutex.unlock();
+            instance->thread_mutex.unlock();
+        }
+    }
+
+    static void child_after_fork() {
+        async_output *o = instance;
+        if (o == nullptr) {
+            return;
+        }
+        for (record_ring *ring : o->rings) {
+            ring->reset();
+            if (ring != thread_ring.ring) {
+                ring->orphaned.store(true);   // its thread does not exist in the child
+            }
+        }
+        close(o->wake_fd);
+        o->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        o->wake_pending.store(false);
+        o->flush_pending.store(false);
+        o->output_thread = nullptr;      // the parent's thread; it cannot be joined here
+        o->main_thread = pthread_self();
+        thread_ring.enroll();
+        o->restart_needed.store(true);
+        o->rings_mutex.unlock();
+        o->drain_mutex.unlock();
+        o->thread_mutex.unlock();
+    }
+
+};
+
+async_output *async_output::instance = nullptr;
+
+thread_ring_holder::~thread_ring_holder() {
+    if (ring) {
+        ring->orphaned.store(true, std::memory_order_release);
+        ring = nullptr;
+    }
+    async_output::thread_exit();
+}
+
+// class hook_timer measures the time from its construction to its
+// destruction, if intercept_stats is set, and adds it to the
+// statistics of async_output
+//
+class hook_timer {
+    async_output *out;
+    struct timespec start;
+
+public:
+
+    hook_timer(async_output *o) : out{stats ? o : nullptr} {
+        if (out) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+    }
+
+    ~hook_timer() {
+        if (out) {
+            struct timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            out->add_hook_time((end.tv_sec - start.tv_sec) * 1000000000 + end.tv_nsec - start.tv_nsec);
+        }
+    }
+};
+
+// write_ip_and_port() writes the address and port of the AF_INET or
+// AF_INET6 socket address sa, which is len bytes long, into record
+// with the keys ip_key and port_key
+//
+void write_ip_and_port(struct json_object &record, const char *ip_key, const char *port_key, const struct sockaddr *sa, socklen_t len) {
+    char addr[INET6_ADDRSTRLEN];
+    uint16_t port;
+    if (sa->sa_family == AF_INET && len >= sizeof(sockaddr_in)) {
+        const sockaddr_in *sin = (const sockaddr_in *)sa;
+        inet_ntop(AF_INET, &sin->sin_addr, addr, sizeof(addr));
+        port = ntohs(sin->sin_port);
+    } else if (sa->sa_family == AF_INET6 && len >= sizeof(sockaddr_in6)) {
+        const sockaddr_in6 *sin6 = (const sockaddr_in6 *)sa;
+        inet_ntop(AF_INET6, &sin6->sin6_addr, addr, sizeof(addr));
+        port = ntohs(sin6->sin6_port);
+    } else {
+        return;
+    }
+    record.print_key_string(ip_key, addr);
+    record.print_key_uint(port_key, port);
+}
+
+// struct flow_info holds the local and peer addresses of a socket,
+// which are read once for each intercepted message, and then used for
+// both protocol identification and output
+//
+struct flow_info {
+    sockaddr_in6 local;    // large enough for AF_INET or AF_INET6
+    sockaddr_in6 peer;
+    bool valid = false;
+
+    flow_info() : local{}, peer{} { }
+
+    flow_info(int fd) : local{}, peer{} {
+        if (!fd_is_socket(fd)) {
+            return;
+        }
+        socklen_t len = sizeof(local);
+        if (getsockname(fd, (struct sockaddr *)&local, &len) != 0
+            || (local.sin6_family != AF_INET && local.sin6_family != AF_INET6)) {
+            return;
+        }
+        len = sizeof(peer);
+        if (getpeername(fd, (struct sockaddr *)&peer, &len) != 0) {
+            peer = {};                            // not connected; report
+            peer.sin6_family = local.sin6_family; // an unspecified address
+        }
+        valid = true;
+    }
+
+    // ports() returns the source and destination ports, which are
+    // used for protocol identification, or {0, 0} if there are none
+    //
+    std::pair<uint16_t, uint16_t> ports() const {
+        if (!valid) {
+            return {0, 0};
+        }
+        return { ntohs(local.sin6_port), ntohs(peer.sin6_port) };  // same offset as sin_port
+    }
+
+    void write_json(struct json_object &record) const {
+        if (valid) {
+            write_ip_and_port(record, "src_ip", "src_port", (const struct sockaddr *)&local, sizeof(local));
+            write_ip_and_port(record, "dst_ip", "dst_port", (const struct sockaddr *)&peer, sizeof(peer));
+        }
+    }
+};
+
+// struct capture is the binary framing of a message that is used with
+// intercept_output_format=binary: it holds everything that is needed
+// to write the JSON record for the message, which is done later by
+// the output thread, and it is followed by (a prefix of) the message
+//
+struct capture {
+    struct timespec ts;
+    int fd;
+    bool tcp_first;
+    socklen_t address_len;
+    sockaddr_in6 address;     // address passed to sendto() or recvfrom()
+    flow_info flow;
+    char func[24];
+};
+
 // class intercept controls the behavior of this library; you can
 // define totally new behavior by defining a class that inherits from
 // this one and overrides one or more member functions
@@ -552,6 +1239,9 @@ struct daemon_output : public output {
 class intercept {
     int pid, ppid;
     output *out;
+    async_output *async_out = nullptr;   // set if output is buffered
+    bool capture_binary = false;
+    size_t max_capture_length = 16*1024;
     static constexpr size_t buffer_length = 20*1024;
     int out_fd = -1;
     const char *INTERCEPT_DIR = nullptr;   // TODO: merge with ENV_INTERCEPT_DIR
@@ -624,6 +1314,21 @@ public:
             out_fd = ((daemon_output*)out)->get_fd();
         }
 
+        // unless intercept_buffer_size is zero, records are written by
+        // an output thread, and with intercept_output_format=binary,
+        // they are also formatted by that thread
+        //
+        if (buffer_size > 0) {
+            async_out = new async_output{out, buffer_size, [this](const uint8_t *data, size_t length, struct buffer_stream &buf) {
+                return write_capture_record(buf, data, length);
+            }};
+            out = async_out;
+            capture_binary = binary_format;
+            if (max_pt_len > 0) {
+                max_capture_length = max_pt_len;
+            }
+        }
+
         // set cmd and pcmd
         //
         cmd_len = get_cmd(pid, cmd, sizeof(cmd));
@@ -678,205 +1383,142 @@ public:
         }
     }
 
-    // intercept_write_flow_key() reads network socket info from the file
-    // descriptor fd, then writes addresses and ports into json_object
+    // write_address() prints the address associated with a call for e.g. the sockaddr in sendto
     //
-    void intercept_write_flow_key(struct json_object &record, int fd) {
-
-        if (!fd_is_socket(fd)) {
+    void write_address(struct json_object &record, const struct sockaddr* address, socklen_t len) {
+        if (!address or !len) {
             return;
         }
-
-        // TODO: investigate performance, and determine if caching is
-        // needed
-
-        struct sockaddr_in address;
-        bzero(&address, sizeof(address));
-        socklen_t address_len = sizeof(address);
-        int retval = getsockname(fd, (struct sockaddr *) &address, &address_len);
-        if (retval == 0) {
-            if (address.sin_family == AF_INET || address.sin_family == AF_INET6) {
-
-                // report source address and source port
-                //
-                char addr[INET6_ADDRSTRLEN];
-                inet_ntop(address.sin_family, &address.sin_addr, addr, sizeof(addr));
-                uint16_t port = ntohs(address.sin_port);
-                record.print_key_string("src_ip", addr);
-                record.print_key_uint("src_port", port);
-
-                // report destination address and destination port
-                //
-                getpeername(fd, (struct sockaddr *) &address, &address_len);
-                inet_ntop(address.sin_family, &address.sin_addr, addr, sizeof(addr));
-                port = ntohs(address.sin_port);
-                record.print_key_string("dst_ip", addr);
-                record.print_key_uint("dst_port", port);
-
-            }
-        }
+        write_ip_and_port(record, "sock_ip", "sock_port", address, len);
     }
 
-    // get_ports returns a pair of src port and dst port that can be used for protocol identification
+    // process_data_pkt_send_recv() processes a message passed to a
+    // call that is usually made on a TCP socket, by trying to parse
+    // it as TCP data first, and then as a UDP datagram
     //
-    std::pair<uint16_t,uint16_t> get_ports(int fd) {
-        
-        if (!fd_is_socket(fd)) {
-            return {0,0};
-        }
-
-        struct sockaddr_in address;
-        bzero(&address, sizeof(address));
-        socklen_t address_len = sizeof(address);
-        uint16_t src_port, dst_port;
-        int retval = getsockname(fd, (struct sockaddr *) &address, &address_len);
-        if (retval == 0) {
-            if (address.sin_family == AF_INET || address.sin_family == AF_INET6) {
-
-                // report source address and source port
-                //
-                char addr[INET6_ADDRSTRLEN];
-                inet_ntop(address.sin_family, &address.sin_addr, addr, sizeof(addr));
-                src_port = ntohs(address.sin_port);
-                getpeername(fd, (struct sockaddr *) &address, &address_len);
-                inet_ntop(address.sin_family, &address.sin_addr, addr, sizeof(addr));
-                dst_port = ntohs(address.sin_port);
-                return {src_port,dst_port};
+    void process_data_pkt_send_recv(int fd, const uint8_t *data, ssize_t length, const char* func = nullptr, const sockaddr *address = nullptr, socklen_t *address_len = nullptr) {
+        process_data(fd, data, length, true, func, address, address_len);
+    }
 
-            }
-        }
-        return {0,0};
+    // process_data_pkt_sendto_recvfrom() processes a message passed to
+    // a call that is usually made on a UDP socket, by trying to parse
+    // it as a UDP datagram first, and then as TCP data
+    //
+    void process_data_pkt_sendto_recvfrom(int fd, const uint8_t *data, ssize_t length, const char* func = nullptr, const struct sockaddr *address = nullptr, socklen_t *address_len = nullptr) {
+        process_data(fd, data, length, false, func, address, address_len);
     }
 
-    // write_address() prints the address associated with a call for e.g. the sockaddr in sendto
+    // process_data() either writes the JSON record for a message, or,
+    // with binary output, captures the message so that the output
+    // thread can do so; this function runs inside of the hooked call,
+    // so the time it takes is added to that call
     //
-    void write_address(struct json_object &record, const struct sockaddr* address, socklen_t len) {
-        if (!address or !len) {
+    void process_data(int fd, const uint8_t *data, ssize_t length, bool tcp_first, const char *func, const sockaddr *address, socklen_t *address_len) {
+        hook_timer timer{async_out};
+        if (data == nullptr || length <= 0) {
             return;
         }
+        flow_info flow{fd};
+        struct timespec ts;
+        timespec_get(&ts, TIME_UTC);
+        socklen_t addr_len = (address && address_len) ? *address_len : 0;
 
-        struct sockaddr_in* address_in = (sockaddr_in*)address;
-        if (address_in->sin_family == AF_INET || address_in->sin_family == AF_INET6) {
-
-            // report address and port
-            //
-            char addr[INET6_ADDRSTRLEN];
-                inet_ntop(address_in->sin_family, &(address_in->sin_addr), addr, sizeof(addr));
-                uint16_t port = ntohs(address_in->sin_port);
-                record.print_key_string("sock_ip", addr);
-                record.print_key_uint("sock_port", port);
+        if (capture_binary) {
+            if (!may_be_recognized(flow, data, length)) {
+                return;
             }
-    }
-
-    void process_data_pkt_send_recv(int fd, const uint8_t *data, ssize_t length, const char* func = nullptr, const sockaddr *address = nullptr, socklen_t *address_len = nullptr)
-    {
-        // as send/recv can be used for TCP and UDP
-        // try parsing data as tcp stream first
-        // if no protocol matches, try UDP dgram
-        //
-
-        // create dummy tcp pkt with correct ports
-        datum tcp_pkt_data{data, data+length};
-        datum udp_pkt_data{data, data+length};
-        std::pair<uint16_t, uint16_t> ports = get_ports(fd);
-        datum dummy_pkt{};
-        tcp_packet tcp_pkt{dummy_pkt};
-        struct tcp_header hdr;
-        hdr.src_port = ports.first;
-        hdr.dst_port = ports.second;
-        tcp_pkt.header = &hdr;
-        protocol tcp_proto;
-        pkt_proc_ctx->set_tcp_protocol(tcp_proto, tcp_pkt_data, true, &tcp_pkt);
-        bool is_tcp = (std::holds_alternative<std::monostate>(tcp_proto) == false) && (std::holds_alternative<unknown_initial_packet>(tcp_proto) == false);
-        bool is_udp = false;
-        protocol udp_proto;
-
-        if (!is_tcp) {
-            // try checking udp protocols
-            enum udp_msg_type msg_type = (udp_msg_type)(pkt_proc_ctx->selector.get_udp_msg_type(udp_pkt_data));
-            udp::ports udp_ports;
-            udp_ports.src = ports.first;
-            udp_ports.dst = ports.second;
-            if (msg_type == udp_msg_type_unknown)
-            { // TODO: wrap this up in a traffic_selector member function
-                msg_type = (udp_msg_type)(pkt_proc_ctx->selector.get_udp_msg_type_from_ports(udp_ports));
+            struct capture c{};
+            c.ts = ts;
+            c.fd = fd;
+            c.tcp_first = tcp_first;
+            c.address_len = std::min<socklen_t>(addr_len, sizeof(c.address));
+            if (c.address_len) {
+                memcpy(&c.address, address, c.address_len);
+            }
+            c.flow = flow;
+            if (func) {
+                strncpy(c.func, func, sizeof(c.func) - 1);
             }
-            struct key k;
-            k.src_port = udp_ports.src;
-            k.dst_port = udp_ports.dst;
-            k.protocol = 17;
-            pkt_proc_ctx->set_udp_protocol(udp_proto, udp_pkt_data, msg_type, true, k);
-            is_udp = (msg_type != udp_msg_type_unknown) && (std::holds_alternative<std::monostate>(udp_proto) == false) && (std::holds_alternative<unknown_udp_initial_packet>(udp_proto) == false);
-        }
-        if (!is_tcp && !is_udp) {
+            async_out->write_capture(&c, sizeof(c), data, std::min<size_t>(length, max_capture_length));
             return;
         }
 
         char buffer[buffer_length];
         struct buffer_stream buf(buffer, sizeof(buffer));
-        struct json_object record{&buf};
-
-        // write pid into record
-        write_process_info(record, output_level);
-        record.print_key_uint("fd", fd);
-        intercept_write_flow_key(record, fd);
-
-        if (!std::visit(is_not_empty{}, (is_tcp ? tcp_proto : udp_proto))) {
-            return;
+        if (write_data_record(buf, flow, fd, data, length, tcp_first, ts, func, address, addr_len)) {
+            out->write_buffer(buf);
         }
+    }
 
-        pkt_proc_ctx->analysis.fp.init();
-        std::visit(compute_fingerprint{pkt_proc_ctx->analysis.fp, pkt_proc_ctx->global_vars.tls_fingerprint_format}, (is_tcp ? tcp_proto : udp_proto));
-
-        if (pkt_proc_ctx->analysis.fp.get_type() != fingerprint_type_unknown)
-        {
-            pkt_proc_ctx->analysis.fp.write(record);
+    // write_capture_record() writes the JSON record for the binary
+    // capture in data into buf, and returns true, or returns false if
+    // there is no record for it
+    //
+    bool write_capture_record(struct buffer_stream &buf, const uint8_t *data, size_t length) {
+        struct capture c;
+        if (length < sizeof(c)) {
+            return false;
         }
-        std::visit(write_metadata{record, pkt_proc_ctx->global_vars.metadata_output, pkt_proc_ctx->global_vars.certs_json_output, pkt_proc_ctx->global_vars.dns_json_output}, (is_tcp ? tcp_proto : udp_proto));
-
-        struct timespec ts;
-        timespec_get(&ts, TIME_UTC);
-        record.print_key_timestamp("event_start", &ts);
+        memcpy(&c, data, sizeof(c));
+        return write_data_record(buf, c.flow, c.fd, data + sizeof(c), length - sizeof(c), c.tcp_first, c.ts,
+                                 c.func[0] ? c.func : nullptr, (const struct sockaddr *)&c.address, c.address_len);
+    }
 
-        if (address and address_len and *address_len) {
-            // sendto was called, dump address as well
-            write_address(record, address, *address_len);
+    // may_be_recognized() returns false if the protocol selectors do
+    // not identify a message as either TCP data or a UDP datagram; it
+    // uses no state other than the (constant) selectors, so that it can
+    // be called by any thread
+    //
+    bool may_be_recognized(const flow_info &flow, const uint8_t *data, ssize_t length) const {
+        const auto &selector = pkt_proc_ctx->selector;
+        std::pair<uint16_t, uint16_t> ports = flow.ports();
+        datum tcp_data{data, data+length};
+        if (selector.get_tcp_msg_type(tcp_data) != tcp_msg_type_unknown) {
+            return true;
         }
-
-        if (func) {
-            record.print_key_string("func",func);
+        datum dummy_pkt{};
+        tcp_packet tcp_pkt{dummy_pkt};
+        struct tcp_header hdr;
+        hdr.src_port = ports.first;
+        hdr.dst_port = ports.second;
+        tcp_pkt.header = &hdr;
+        if (selector.get_tcp_msg_type_from_ports(&tcp_pkt) != tcp_msg_type_unknown) {
+            return true;
         }
-
-        record.close();
-
-        if (buf.trunc) {
-            if (verbose) {
-                fprintf(stderr, RED(tty, "error: output buffer overrun\n"));
-            }
-            return;
+        datum udp_data{data, data+length};
+        if (selector.get_udp_msg_type(udp_data) != udp_msg_type_unknown) {
+            return true;
         }
+        return selector.get_udp_msg_type_from_ports(udp::ports{ports.first, ports.second}) != udp_msg_type_unknown;
+    }
 
-        out->write_buffer(buf);
+    // identify_tcp() sets x to the parsed message, if the data is the
+    // start of a TCP stream in a known protocol, and returns true;
+    // otherwise it returns false
+    //
+    bool identify_tcp(protocol &x, const uint8_t *data, ssize_t length, std::pair<uint16_t, uint16_t> ports) {
+        datum tcp_pkt_data{data, data+length};
+        datum dummy_pkt{};
+        tcp_packet tcp_pkt{dummy_pkt};
+        struct tcp_header hdr;
+        hdr.src_port = ports.first;
+        hdr.dst_port = ports.second;
+        tcp_pkt.header = &hdr;
+        pkt_proc_ctx->set_tcp_protocol(x, tcp_pkt_data, true, &tcp_pkt);
+        return (std::holds_alternative<std::monostate>(x) == false) && (std::holds_alternative<unknown_initial_packet>(x) == false);
     }
 
-    void process_data_pkt_sendto_recvfrom(int fd, const uint8_t *data, ssize_t length, const char* func = nullptr, const struct sockaddr *address = nullptr, socklen_t *address_len = nullptr)
-    {
-        // as send/recv can be used for TCP and UDP
-        // try parsing data as udp dgram first
-        // if no protocol matches, try TCP
-        //
-        std::pair<uint16_t, uint16_t> ports = get_ports(fd);
-        bool is_udp = false;
-        protocol udp_proto;
-        protocol tcp_proto;
-        bool is_tcp = false;
+    // identify_udp() sets x to the parsed message, if the data is a UDP
+    // datagram in a known protocol, and returns true; otherwise it
+    // returns false
+    //
+    bool identify_udp(protocol &x, const uint8_t *data, ssize_t length, std::pair<uint16_t, uint16_t> ports) {
         datum udp_pkt_data{data, data+length};
-        datum tcp_pkt_data{data, data+length};
         enum udp_msg_type msg_type = (udp_msg_type)(pkt_proc_ctx->selector.get_udp_msg_type(udp_pkt_data));
         udp::ports udp_ports;
         udp_ports.src = ports.first;
         udp_ports.dst = ports.second;
-        if (msg_type == udp_msg_type_unknown) { 
+        if (msg_type == udp_msg_type_unknown) {
             // TODO: wrap this up in a traffic_selector member function
             msg_type = (udp_msg_type)(pkt_proc_ctx->selector.get_udp_msg_type_from_ports(udp_ports));
         }
@@ -884,51 +1526,62 @@ public:
         k.src_port = udp_ports.src;
         k.dst_port = udp_ports.dst;
         k.protocol = 17;
-        pkt_proc_ctx->set_udp_protocol(udp_proto, udp_pkt_data, msg_type, true, k);
-        is_udp = (msg_type != udp_msg_type_unknown) && (std::holds_alternative<std::monostate>(udp_proto) == false) && (std::holds_alternative<unknown_udp_initial_packet>(udp_proto) == false);
+        pkt_proc_ctx->set_udp_protocol(x, udp_pkt_data, msg_type, true, k);
+        return (msg_type != udp_msg_type_unknown) && (std::holds_alternative<std::monostate>(x) == false) && (std::holds_alternative<unknown_udp_initial_packet>(x) == false);
+    }
 
-        if (!is_udp) {
-            datum dummy_pkt{};
-            tcp_packet tcp_pkt{dummy_pkt};
-            struct tcp_header hdr;
-            hdr.src_port = ports.first;
-            hdr.dst_port = ports.second;
-            tcp_pkt.header = &hdr;
-            pkt_proc_ctx->set_tcp_protocol(tcp_proto, tcp_pkt_data, true, &tcp_pkt);
-            is_tcp = (std::holds_alternative<std::monostate>(tcp_proto) == false) && (std::holds_alternative<unknown_initial_packet>(tcp_proto) == false);
+    // write_data_record() writes the JSON record for a message sent or
+    // received on the socket fd into buf, and returns true, or returns
+    // false if the message is not recognized; as send/recv and
+    // sendto/recvfrom can be used for TCP and UDP, the message is parsed
+    // as TCP data first if tcp_first is true, and as a UDP datagram
+    // first otherwise
+    //
+    bool write_data_record(struct buffer_stream &buf,
+                           const flow_info &flow,
+                           int fd,
+                           const uint8_t *data,
+                           ssize_t length,
+                           bool tcp_first,
+                           struct timespec ts,
+                           const char *func,
+                           const struct sockaddr *address,
+                           socklen_t address_len) {
+
+        std::pair<uint16_t, uint16_t> ports = flow.ports();
+        protocol x;
+        bool found = tcp_first ? identify_tcp(x, data, length, ports) : identify_udp(x, data, length, ports);
+        if (!found) {
+            x.emplace<std::monostate>();
+            found = tcp_first ? identify_udp(x, data, length, ports) : identify_tcp(x, data, length, ports);
         }
-
-        if (!is_tcp && !is_udp) {
-            return;
+        if (!found) {
+            return false;
         }
 
-        char buffer[buffer_length];
-        struct buffer_stream buf(buffer, sizeof(buffer));
         struct json_object record{&buf};
 
         // write pid into record
         write_process_info(record, output_level);
         record.print_key_uint("fd", fd);
-        intercept_write_flow_key(record, fd);
+        flow.write_json(record);
 
-        if (!std::visit(is_not_empty{}, (is_tcp ? tcp_proto : udp_proto))) {
-            return;
+        if (!std::visit(is_not_empty{}, x)) {
+            return false;
         }
 
         pkt_proc_ctx->analysis.fp.init();
-        std::visit(compute_fingerprint{pkt_proc_ctx->analysis.fp, pkt_proc_ctx->global_vars.tls_fingerprint_format}, (is_tcp ? tcp_proto : udp_proto));
+        std::visit(compute_fingerprint{pkt_proc_ctx->analysis.fp, pkt_proc_ctx->global_vars.tls_fingerprint_format}, x);
         if (pkt_proc_ctx->analysis.fp.get_type() != fingerprint_type_unknown) {
             pkt_proc_ctx->analysis.fp.write(record);
         }
-        std::visit(write_metadata{record, pkt_proc_ctx->global_vars.metadata_output, pkt_proc_ctx->global_vars.certs_json_output, pkt_proc_ctx->global_vars.dns_json_output}, (is_tcp ? tcp_proto : udp_proto));
+        std::visit(write_metadata{record, pkt_proc_ctx->global_vars.metadata_output, pkt_proc_ctx->global_vars.certs_json_output, pkt_proc_ctx->global_vars.dns_json_output}, x);
 
-        struct timespec ts;
-        timespec_get(&ts, TIME_UTC);
         record.print_key_timestamp("event_start", &ts);
 
-        if (address and address_len and *address_len) {
+        if (address and address_len) {
             // sendto/recvfrom was called, dump address as well
-            write_address(record, address, *address_len);
+            write_address(record, address, address_len);
         }
 
         if (func) {
@@ -941,11 +1594,9 @@ public:
             if (verbose) {
                 fprintf(stderr, RED(tty, "error: output buffer overrun\n"));
             }
-            return;
+            return false;
         }
-
-        out->write_buffer(buf);
-
+        return true;
     }
 
 #if 0
@@ -975,7 +1626,7 @@ public:
             // write pid into record
             write_process_info(record, output_level);
             record.print_key_uint("fd", fd);
-            intercept_write_flow_key(record, fd);
+            flow_info{fd}.write_json(record);
 
             http_req.write_json(record, true);
 
@@ -1003,7 +1654,7 @@ public:
                 // write pid into record
                 write_process_info(record, output_level);
                 record.print_key_uint("fd", fd);
-                intercept_write_flow_key(record, fd);
+                flow_info{fd}.write_json(record);
 
                 record.print_key_hex("tcp_data", tcp_data);
 
@@ -1056,7 +1707,7 @@ public:
                 // write pid into record
                 write_process_info(record, output_level);
                 record.print_key_uint("fd", fd);
-                intercept_write_flow_key(record, fd);
+                flow_info{fd}.write_json(record);
 
                 hello.write_json(record);
                 record.close();
@@ -1176,7 +1827,7 @@ void intercept::process_http_request(int fd, const uint8_t *data, ssize_t length
         // write pid into record
         write_process_info(record, output_level);
         record.print_key_uint("fd", fd);
-        intercept_write_flow_key(record, fd);
+        flow_info{fd}.write_json(record);
 
         // write fingerprint into record
         struct fingerprint fp;
@@ -1217,7 +1868,7 @@ void intercept::process_tls_client_hello(int fd, const uint8_t *data, ssize_t le
             // write pid into record
             write_process_info(record, output_level);
             record.print_key_uint("fd", fd);
-            intercept_write_flow_key(record, fd);
+            flow_info{fd}.write_json(record);
 
             // write fingerprint into record
             fp.write(record);
@@ -1244,6 +1895,8 @@ void __attribute__ ((constructor)) intercept_init(void) {
     //
     tty = isatty(fileno(stderr));
 
+    read_environment();
+
     if (verbose) { fprintf(stderr, GREEN(tty, "%s\n"), __func__); }
 
     // allocate global intercept object
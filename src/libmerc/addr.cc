@@ -9,10 +9,12 @@
 
 #include <string.h>
 #include <locale.h>
+#include <arpa/inet.h>
 #include <string>
 #include "addr.h"
 #include "archive.h"
 #include "datum.h"  // for ntoh()
+#include "utils.h"  // for sprintf_ipv6_addr()
 
 #include "lctrie/lctrie.h"
 #include "lctrie/lctrie_bgp.h"
@@ -37,13 +39,30 @@ bool char_string_to_ipv4_addr(const char *s, uint32_t &addr) {
 }
 
 subnet_data::~subnet_data() {
-    if (ipv4_subnet_trie.root) {
+    free_tries();
+}
+
+// free_trie(trie) frees the nodes and bases of trie, but not its
+// subnet array, and zeroizes it
+//
+template <typename T>
+static void free_trie(lct<T> &trie) {
+    if (trie.root) {
         //
         // TBD: this free ought to be in lct_tree()
         //
-        free(ipv4_subnet_trie.root);
+        free(trie.root);
     }
-    lct_free(&ipv4_subnet_trie);
+    lct_free(&trie);
+    memset(&trie, 0, sizeof(trie));
+}
+
+void subnet_data::free_tries() {
+    if (image_backed) {
+        return;
+    }
+    free_trie(ipv4_subnet_trie);
+    free_trie(ipv6_subnet_trie);
     if (ipv4_subnet_array) {
         free(ipv4_subnet_array);
     }
@@ -52,26 +71,76 @@ subnet_data::~subnet_data() {
     }
 }
 
-uint32_t subnet_data::get_asn_info(const char* dst_ip) const {
+bool destination_address::parse(const char *s) {
     uint32_t ipv4_addr;
-
-    if (!char_string_to_ipv4_addr(dst_ip, ipv4_addr)) {
-        return 0;
+    if (char_string_to_ipv4_addr(s, ipv4_addr)) {
+        ip_vers = 4;
+        ipv4 = ntoh(ipv4_addr);
+        return true;
     }
+    if (inet_pton(AF_INET6, s, ipv6.data()) == 1) {
+        ip_vers = 6;
+        return true;
+    }
+    ip_vers = 0;
+    return false;
+}
 
-    lct_subnet_t *subnet = lct_find(&ipv4_subnet_trie, ntoh(ipv4_addr));
-    if (subnet == NULL) {
-        return 0;
+void destination_address::sprint(char *addr_str) const {
+    if (ip_vers == 4) {
+        snprintf(addr_str,
+                 sizeof("255.255.255.255"),
+                 "%u.%u.%u.%u",
+                 ipv4 >> 24 & 0xff,
+                 ipv4 >> 16 & 0xff,
+                 ipv4 >>  8 & 0xff,
+                 ipv4       & 0xff);
+    } else if (ip_vers == 6) {
+        sprintf_ipv6_addr(addr_str, ipv6.data());
+    } else {
+        addr_str[0] = '\0';
     }
-    if (subnet->info.type == IP_SUBNET_BGP) {
+}
+
+template <typename T>
+static inline uint32_t subnet_asn(const lct_subnet<T> *subnet) {
+    if (subnet != nullptr && subnet->info.type == IP_SUBNET_BGP) {
         return subnet->info.bgp.asn;
     }
+    return 0;
+}
+
+uint32_t subnet_data::get_asn_info(const destination_address &dst_addr) const {
 
+    if (dst_addr.ip_vers == 4 && ipv4_subnet_trie.root != nullptr) {
+        return subnet_asn(lct_find(&ipv4_subnet_trie, dst_addr.ipv4));
+    }
+    if (dst_addr.ip_vers == 6 && ipv6_subnet_trie.root != nullptr) {
+        ipv6_addr_t addr;
+        memcpy(&addr, dst_addr.ipv6.data(), sizeof(addr));
+        return subnet_asn(lct_find(&ipv6_subnet_trie, ntoh(addr)));
+    }
     return 0;
 }
 
 int subnet_data::process_line(std::string &line_str) {
 
+    // IPv6 subnets are stored separately from the IPv4 ones
+    if (line_str.find(':') != std::string::npos) {
+        lct_subnet_v6_t subnet{};
+        if (lct_subnet_set_from_string(&subnet, line_str.c_str()) != 0) {
+            printf_err(log_err, "could not parse subnet string '%s'\n", line_str.c_str());
+            return -1;  // failure
+        }
+        ipv6_subnets.push_back(subnet);
+        return 0;
+    }
+
+    if (num >= BGP_MAX_ENTRIES) {
+        printf_err(log_err, "too many subnets (more than %d)\n", BGP_MAX_ENTRIES);
+        return -1;  // failure
+    }
+
     // set the prefix[num] to the subnet and ASN found in line
     if (lct_subnet_set_from_string(&prefix[num], line_str.c_str()) != 0) {
         printf_err(log_err, "could not parse subnet string '%s'\n", line_str.c_str());
@@ -81,48 +150,85 @@ int subnet_data::process_line(std::string &line_str) {
     return 0;       // success
 }
 
-void subnet_data::process_final() {
+// build_subnet_trie(trie, subnets, num) masks, sorts, and
+// de-duplicates the array of num subnets, sets up their prefix
+// indexes, and builds the level compressed trie over them; it returns
+// the number of subnets that remain in the array, or -1 on failure
+//
+template <typename T>
+static int build_subnet_trie(lct<T> &trie, lct_subnet<T> *subnets, int num) {
 
     // validate subnet prefixes against their netmasks
     // and sort the resulting array
-    subnet_mask(prefix, num);
-    qsort(prefix, num, sizeof(lct_subnet<ipv4_addr_t>), subnet_cmp<ipv4_addr_t>);
+    subnet_mask(subnets, num);
+    qsort(subnets, num, sizeof(lct_subnet<T>), subnet_cmp<T>);
 
-    // de-duplicate subnets and shrink the buffer down to its
-    // actual size and split into prefixes and bases
-    num -= subnet_dedup(prefix, num);
-    lct_subnet_t *tmp = (lct_subnet_t *)realloc(prefix, num * sizeof(lct_subnet_t));
-    if (tmp != NULL) {
-        prefix = tmp;
-    } else {
-        return;  // TODO: leak check
-    }
-
-    // allocate a buffer for the IP stats
-    lct_ip_stats_t *stats = (lct_ip_stats_t *) calloc(num, sizeof(lct_ip_stats_t));
-    if (!stats) {
-        return;  // TODO: leak check
-    }
+    // de-duplicate subnets
+    num -= subnet_dedup(subnets, num);
 
     // count which subnets are prefixes of other subnets
-    subnet_prefix(prefix, stats, num);
-    free(stats);
+    std::vector<lct_ip_stats<T>> stats(num);
+    subnet_prefix(subnets, stats.data(), num);
 
-    // we're storing twice as many subnets as necessary for easy
-    // iteration over the entire sorted subnet list.
     for (int i = 0; i < num; i++) {
         // quick error check on the optimized prefix indexes
         uint32_t prfx;
-        prfx = prefix[i].prefix;
-        if (prfx != IP_PREFIX_NIL && prefix[prfx].type == IP_PREFIX_FULL) {
+        prfx = subnets[i].prefix;
+        if (prfx != IP_PREFIX_NIL && subnets[prfx].type == IP_PREFIX_FULL) {
             /* error: optimized subnet index points to a full prefix */
-            return;  // TODO: leak check
+            return -1;
         }
     }
 
-    // actually build the trie and get the trie node count for statistics printing
-    memset(&ipv4_subnet_trie, 0, sizeof(lct<ipv4_addr_t>));
-    lct_build(&ipv4_subnet_trie, prefix, num);
+    // actually build the trie
+    memset(&trie, 0, sizeof(lct<T>));
+    if (lct_build(&trie, subnets, num) != 0) {
+        return -1;
+    }
+    return num;
+}
+
+void subnet_data::process_final() {
+
+    // build the IPv6 trie, if there are any IPv6 subnets; the trie
+    // points into the subnet vector, which is only shrunk (and thus
+    // not moved) after the build
+    //
+    if (!ipv6_subnets.empty()) {
+        int num_v6 = build_subnet_trie(ipv6_subnet_trie, ipv6_subnets.data(), ipv6_subnets.size());
+        if (num_v6 < 0) {
+            printf_err(log_err, "could not build IPv6 subnet trie\n");
+            free_trie(ipv6_subnet_trie);
+            std::vector<lct_subnet_v6_t>{}.swap(ipv6_subnets);   // release the subnet array
+        } else {
+            ipv6_subnets.resize(num_v6);
+        }
+    }
+
+    num = build_subnet_trie(ipv4_subnet_trie, prefix, num);
+    if (num < 0) {
+        printf_err(log_err, "could not build IPv4 subnet trie\n");
+        free_trie(ipv4_subnet_trie);
+        free(prefix);
+        prefix = nullptr;
+        num = 0;
+        return;
+    }
+
+    // shrink the buffer down to its actual size; realloc() moves the
+    // array, so the trie is pointed at the new location
+    //
+    lct_subnet_t *tmp = (lct_subnet_t *)realloc(prefix, num * sizeof(lct_subnet_t));
+    if (tmp == NULL) {
+        printf_err(log_err, "could not shrink IPv4 subnet array\n");
+        free_trie(ipv4_subnet_trie);
+        free(prefix);
+        prefix = nullptr;
+        num = 0;
+        return;
+    }
+    prefix = tmp;
+    ipv4_subnet_trie.nets = prefix;
 
     // set subnet array to actual value; after this, the subnet_data
     // object is ready for use
@@ -131,3 +237,71 @@ void subnet_data::process_final() {
     prefix = nullptr;           // to avoid free(prefix)
 }
 
+template <typename T>
+static void write_trie(image_writer &w, const lct<T> &trie, size_t num_subnets) {
+    w.write(trie.shortest);
+    w.write_array(trie.nets, num_subnets);
+    w.write_array(trie.bases, trie.bcount);
+    w.write_array(trie.root, trie.ncount);
+}
+
+// read_trie(r, trie) reads a trie written by write_trie(), and checks
+// that lct_find() stays within its arrays: each branch node points to
+// children that follow it in the node array, each leaf to a base, each
+// base to a subnet, and each subnet to a shorter prefix that precedes
+// it, as lct_build() lays them out; it throws an exception otherwise
+//
+template <typename T>
+static size_t read_trie(image_reader &r, lct<T> &trie) {
+    size_t num_subnets;
+    size_t n;
+    trie.shortest = r.read<uint8_t>();
+    trie.nets = r.read_array<lct_subnet<T>>(num_subnets);
+    trie.bases = r.read_array<uint32_t>(n);
+    trie.bcount = n;
+    trie.root = r.read_array<lct_node_t>(n);
+    trie.ncount = n;
+
+    const size_t bits_in_T = sizeof(T) * 8;
+    bool valid = num_subnets <= UINT32_MAX && trie.bcount <= UINT32_MAX && trie.ncount <= UINT32_MAX;
+    for (size_t i = 0; valid && i < num_subnets; i++) {
+        uint32_t prfx = trie.nets[i].prefix;
+        valid = trie.nets[i].len <= bits_in_T && (prfx == IP_PREFIX_NIL || prfx < i);
+    }
+    for (size_t i = 0; valid && i < trie.bcount; i++) {
+        valid = trie.bases[i] < num_subnets;
+    }
+    for (size_t i = 0; valid && i < trie.ncount; i++) {
+        const lct_node_t &node = trie.root[i];
+        if (node.branch == 0) {
+            valid = node.index < trie.bcount;
+        } else {
+            valid = node.branch < 32 && node.index > i
+                && node.index <= trie.ncount && ((size_t)1 << node.branch) <= trie.ncount - node.index;
+        }
+    }
+    if (!valid) {
+        throw std::runtime_error("error: invalid subnet trie in resource image");
+    }
+
+    if (n == 0) {
+        trie.root = nullptr;
+    }
+    return num_subnets;
+}
+
+void subnet_data::write(image_writer &w) const {
+    write_trie(w, ipv4_subnet_trie, num);
+    write_trie(w, ipv6_subnet_trie, ipv6_subnets.size());
+}
+
+void subnet_data::read(image_reader &r) {
+    free_tries();
+    ipv4_subnet_array = nullptr;
+    prefix = nullptr;
+    ipv6_subnets.clear();
+    image_backed = true;
+
+    num = read_trie(r, ipv4_subnet_trie);
+    read_trie(r, ipv6_subnet_trie);
+}
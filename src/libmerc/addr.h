@@ -12,11 +12,48 @@
 #define ADDR_H
 
 #include <string>
+#include <string.h>
 #include <stdexcept>
+#include <array>
+#include <vector>
 #include "archive.h"
+#include "resource_image.h"
 
 #include "lctrie/lctrie.h"
 
+// struct destination_address holds the destination IP address of a
+// flow in binary form, so that the analysis path can look it up in
+// the subnet trie and the classifier's feature tables without
+// formatting and re-parsing it as text.  An IPv4 address is held as
+// an integer in host byte order, as in the subnet trie and the
+// watchlist, and an IPv6 address as an array of bytes in network
+// byte order.
+//
+struct destination_address {
+    uint8_t ip_vers = 0;             // 4, 6, or 0 if there is no address
+    uint32_t ipv4 = 0;
+    std::array<uint8_t, 16> ipv6{};
+
+    destination_address() = default;
+
+    explicit destination_address(uint32_t ipv4_host_order) : ip_vers{4}, ipv4{ipv4_host_order} { }
+
+    explicit destination_address(const std::array<uint8_t, 16> &ipv6_addr) : ip_vers{6}, ipv6{ipv6_addr} { }
+
+    // parse(s) sets this object to the IPv4 (dotted quad) or IPv6
+    // address in the null-terminated string s, and returns true on
+    // success; otherwise, it sets ip_vers to zero and returns false
+    //
+    bool parse(const char *s);
+
+    // sprint(addr_str) writes the textual representation of this
+    // address into addr_str, which must have room for
+    // MAX_DST_ADDR_LEN characters, or an empty string if there is no
+    // address
+    //
+    void sprint(char *addr_str) const;
+};
+
 // BGP_MAX_ENTRIES is the max number of subnets
 //
 #define BGP_MAX_ENTRIES  4000000
@@ -30,10 +67,22 @@ class subnet_data {
     lct<ipv4_addr_t> ipv4_subnet_trie;
     lct_subnet_t *ipv4_subnet_array;
 
+    // the ipv6_subnet_trie and ipv6_subnets variables hold the trie
+    // and subnet information for IPv6 BGP Autonomous System Numbers;
+    // the trie is empty (its root is nullptr) if there are no IPv6
+    // subnets
+    //
+    lct<ipv6_addr_t> ipv6_subnet_trie;
+    std::vector<lct_subnet_v6_t> ipv6_subnets;
+
     // data used during construction
     lct_subnet<ipv4_addr_t> *prefix;
     int num = 0;
 
+    bool image_backed = false;   // tries point into a resource image
+
+    void free_tries();
+
 public:
 
     subnet_data() {
@@ -44,6 +93,7 @@ public:
         ipv4_subnet_trie.shortest = 0;
         ipv4_subnet_trie.nets = 0;
         ipv4_subnet_array = nullptr;
+        memset(&ipv6_subnet_trie, 0, sizeof(ipv6_subnet_trie));
         prefix = (lct_subnet_t *)calloc(sizeof(lct_subnet_t), BGP_MAX_ENTRIES);
         if (prefix == nullptr) {
             throw std::runtime_error("error: could not initialize subnet_data");
@@ -63,9 +113,18 @@ public:
 
     ~subnet_data();
 
-    uint32_t get_asn_info(const char* dst_ip) const;
+    uint32_t get_asn_info(const destination_address &dst_addr) const;
 
     int process_line(std::string &line);
+
+    // write(w) writes the tries to a resource image, after
+    // process_final() has been called, and read(r) replaces the
+    // contents of this object with tries read from a resource image,
+    // which point into that image
+    //
+    void write(image_writer &w) const;
+
+    void read(image_reader &r);
 };
 
 #endif // ADDR_H
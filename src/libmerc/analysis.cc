@@ -43,6 +43,13 @@ classifier *analysis_init_from_archive(int, //verbosity
         archive_name = DEFAULT_RESOURCE_FILE;
     }
 
+    // a precompiled resource image (see resource_compiler) is mapped
+    // into memory, rather than parsed
+    //
+    if (resource_image_header::is_image(archive_name)) {
+        return new classifier(archive_name, fp_proc_threshold, proc_dst_threshold, report_os);
+    }
+
     encrypted_compressed_archive archive{archive_name, enc_key}; // TODO: key type
     return new classifier(archive, fp_proc_threshold, proc_dst_threshold, report_os);
 }
@@ -128,22 +135,22 @@ uint16_t flow_key_get_dst_port(const struct key &key) {
     return ntoh(key.dst_port);
 }
 
+destination_address flow_key_get_dst_addr(const struct key &key) {
+    if (key.ip_vers == 4) {
+        return destination_address{ntoh(key.addr.ipv4.dst)};
+    } else if (key.ip_vers == 6) {
+        std::array<uint8_t, 16> a;
+        memcpy(a.data(), &key.addr.ipv6.dst, a.size());
+        return destination_address{a};
+    }
+    return destination_address{};
+}
+
 
 std::string get_port_app(uint16_t dst_port) {
-    std::unordered_map<uint16_t, std::string> port_mapping = {{443, "https"},  {448,"database"}, {465,"email"},
-                                                              {563,"nntp"},    {585,"email"},    {614,"shell"},
-                                                              {636,"ldap"},    {989,"ftp"},      {990,"ftp"},
-                                                              {991,"nas"},     {992,"telnet"},   {993,"email"},
-                                                              {994,"irc"},     {995,"email"},    {1443,"alt-https"},
-                                                              {2376,"docker"}, {8001,"tor"},     {8443,"alt-https"},
-                                                              {9000,"tor"},    {9001,"tor"},     {9002,"tor"},
-                                                              {9101,"tor"}};
-
-    auto it = port_mapping.find(dst_port);
-    if (it != port_mapping.end()) {
-        return it->second;
+    if (const port_application *p = find_port_application(dst_port)) {
+        return p->name;
     }
-
     return "unknown";
 }
 
@@ -17,6 +17,7 @@
 #include "result.h"
 #include "dict.h"
 
+#include <atomic>
 #include <mutex>
 #include <shared_mutex>
 #include <map>
@@ -26,12 +27,19 @@
 #include <string>
 #include <vector>
 #include <list>
+#include <array>
+#include <memory>
 #include <zlib.h>
 #include "rapidjson/document.h"
 #include "rapidjson/stringbuffer.h"
 #include "util_obj.h"
 #include "archive.h"
 #include "watchlist.hpp"
+#include "feature_table.h"
+#include "softmax.h"
+#include "resource_image.h"
+#include "analysis_cache.h"
+#include "clock_set.h"
 
 // TBD - move flow_key_sprintf_src_addr() to the right file
 //
@@ -173,15 +181,16 @@ class naive_bayes {
     ptr_dict &os_dict;
     floating_point_type base_prior = 0;
 
-    std::vector<floating_point_type> process_prob;
+    image_array<floating_point_type> process_prob;
     std::vector<bool>        malware;
     std::vector<attribute_result::bitset> attr;
-    std::unordered_map<uint32_t, std::vector<class update>> as_number_updates;
-    std::unordered_map<uint16_t, std::vector<class update>> port_updates;
-    std::unordered_map<std::string, std::vector<class update>> hostname_domain_updates;
-    std::unordered_map<std::string, std::vector<class update>> ip_ip_updates;
-    std::unordered_map<std::string, std::vector<class update>> hostname_sni_updates;
-    std::unordered_map<std::string, std::vector<class update>> user_agent_updates;
+    feature_table<uint32_t, class update> as_number_updates;
+    feature_table<uint16_t, class update> port_updates;
+    feature_table<std::string, class update> hostname_domain_updates;
+    feature_table<uint32_t, class update> ipv4_updates;
+    feature_table<std::array<uint8_t, 16>, class update> ipv6_updates;
+    feature_table<std::string, class update> hostname_sni_updates;
+    feature_table<std::string, class update> user_agent_updates;
 
     floating_point_type as_weight;
     floating_point_type domain_weight;
@@ -216,8 +225,20 @@ public:
 
         // initialize data structures
         //
+        std::vector<floating_point_type> process_prob;
         process_prob.reserve(processes.size());
 
+        // the updates are gathered into unordered_maps, which are
+        // then compiled into the feature_tables used by classify()
+        //
+        std::unordered_map<uint32_t, std::vector<class update>> as_number_updates;
+        std::unordered_map<uint16_t, std::vector<class update>> port_updates;
+        std::unordered_map<std::string, std::vector<class update>> hostname_domain_updates;
+        std::unordered_map<uint32_t, std::vector<class update>> ipv4_updates;
+        std::unordered_map<std::array<uint8_t, 16>, std::vector<class update>> ipv6_updates;
+        std::unordered_map<std::string, std::vector<class update>> hostname_sni_updates;
+        std::unordered_map<std::string, std::vector<class update>> user_agent_updates;
+
         base_prior = log(0.1 / total_count);
         size_t index = 0;
         for (const auto &p : processes) {
@@ -257,12 +278,18 @@ public:
                 }
             }
             for (const auto &ip_and_count : p.ip_ip) {
-                const auto x = ip_ip_updates.find(ip_and_count.first);
+                // destination addresses are keyed in binary form, so
+                // that they can be looked up without formatting them
+                //
+                destination_address addr;
+                if (!addr.parse(ip_and_count.first.c_str())) {
+                    continue;  // unparseable addresses can never match
+                }
                 class update u{ index, (log((floating_point_type)ip_and_count.second / total_count) - base_prior) * ip_weight };
-                if (x != ip_ip_updates.end()) {
-                    x->second.push_back(u);
+                if (addr.ip_vers == 4) {
+                    ipv4_updates[addr.ipv4].push_back(u);
                 } else {
-                    ip_ip_updates[ip_and_count.first] = { u };
+                    ipv6_updates[addr.ipv6].push_back(u);
                 }
             }
             for (const auto &sni_and_count : p.hostname_sni) {
@@ -292,58 +319,86 @@ public:
         //
         assert(process_prob.size() == processes.size());
 
+        this->process_prob = image_array{std::move(process_prob)};
+        this->as_number_updates = feature_table{as_number_updates};
+        this->port_updates = feature_table{port_updates};
+        this->hostname_domain_updates = feature_table{hostname_domain_updates};
+        this->ipv4_updates = feature_table{ipv4_updates};
+        this->ipv6_updates = feature_table{ipv6_updates};
+        this->hostname_sni_updates = feature_table{hostname_sni_updates};
+        this->user_agent_updates = feature_table{user_agent_updates};
     }
 
-    std::vector<floating_point_type> classify(uint32_t asn_int,
-                                              uint16_t port_app,
-                                              const std::string &domain,
-                                              const std::string &server_name_str,
-                                              const std::string &dst_ip_str,
-                                              const char *user_agent) const {
-
-        std::vector<floating_point_type> process_score = process_prob;  // working copy of probability vector
+    // naive_bayes(r, os_dictionary) reads a classifier from a
+    // resource image (see write())
+    //
+    naive_bayes(image_reader &r, ptr_dict &os_dictionary) :
+        total_count{r.read<uint64_t>()},
+        os_dict{os_dictionary},
+        base_prior{r.read<floating_point_type>()},
+        process_prob{r},
+        as_number_updates{r},
+        port_updates{r},
+        hostname_domain_updates{r},
+        ipv4_updates{r},
+        ipv6_updates{r},
+        hostname_sni_updates{r},
+        user_agent_updates{r},
+        as_weight{r.read<floating_point_type>()},
+        domain_weight{r.read<floating_point_type>()},
+        port_weight{r.read<floating_point_type>()},
+        ip_weight{r.read<floating_point_type>()},
+        sni_weight{r.read<floating_point_type>()},
+        ua_weight{r.read<floating_point_type>()}
+    { }
+
+    void write(image_writer &w) const {
+        w.write(total_count);
+        w.write(base_prior);
+        process_prob.write(w);
+        as_number_updates.write(w);
+        port_updates.write(w);
+        hostname_domain_updates.write(w);
+        ipv4_updates.write(w);
+        ipv6_updates.write(w);
+        hostname_sni_updates.write(w);
+        user_agent_updates.write(w);
+        w.write(as_weight);
+        w.write(domain_weight);
+        w.write(port_weight);
+        w.write(ip_weight);
+        w.write(sni_weight);
+        w.write(ua_weight);
+    }
 
-        auto asn_update = as_number_updates.find(asn_int);
-        if (asn_update != as_number_updates.end()) {
-            for (const auto &x : asn_update->second) {
-                process_score[x.index] += x.value;
-            }
-        }
-        auto port_update = port_updates.find(port_app);
-        if (port_update != port_updates.end()) {
-            for (const auto &x : port_update->second) {
-                process_score[x.index] += x.value;
-            }
-        }
-        auto hostname_domain_update = hostname_domain_updates.find(domain);
-        if (hostname_domain_update != hostname_domain_updates.end()) {
-            for (const auto &x : hostname_domain_update->second) {
-                process_score[x.index] += x.value;
-            }
-        }
-        auto ip_ip_update = ip_ip_updates.find(dst_ip_str);
-        if (ip_ip_update != ip_ip_updates.end()) {
-            for (const auto &x : ip_ip_update->second) {
-                process_score[x.index] += x.value;
-            }
-        }
-        auto hostname_sni_update = hostname_sni_updates.find(server_name_str);
-        if (hostname_sni_update != hostname_sni_updates.end()) {
-            for (const auto &x : hostname_sni_update->second) {
-                process_score[x.index] += x.value;
-            }
-        }
+    // classify(process_score, ...) sets process_score to the score
+    // of each process, given the features of a session; the vector is
+    // resized as needed, so that a caller that reuses it does not
+    // allocate memory
+    //
+    void classify(std::vector<floating_point_type> &process_score,
+                  uint32_t asn_int,
+                  uint16_t port_app,
+                  std::string_view domain,
+                  std::string_view server_name,
+                  const destination_address &dst_addr,
+                  const char *user_agent) const {
+
+        process_score.assign(process_prob.begin(), process_prob.end());
+        auto apply = [&process_score](const class update &x) { process_score[x.index] += x.value; };
+
+        as_number_updates.for_each_match(asn_int, apply);
+        port_updates.for_each_match(port_app, apply);
+        hostname_domain_updates.for_each_match(domain, apply);
+        if (dst_addr.ip_vers == 4) {
+            ipv4_updates.for_each_match(dst_addr.ipv4, apply);
+        } else if (dst_addr.ip_vers == 6) {
+            ipv6_updates.for_each_match(dst_addr.ipv6, apply);
+        }
+        hostname_sni_updates.for_each_match(server_name, apply);
         if (user_agent != nullptr) {
-            std::string user_agent_str(user_agent);
-            auto user_agent_update = user_agent_updates.find(user_agent_str);
-            if (user_agent_update != user_agent_updates.end()) {
-                for (const auto &x : user_agent_update->second) {
-                    process_score[x.index] += x.value;
-                }
-            }
+            user_agent_updates.for_each_match(user_agent, apply);
         }
-
-        return process_score;
     }
 
     bool is_recomputation_required(floating_point_type new_as_weight, floating_point_type new_domain_weight,
@@ -386,41 +441,13 @@ public:
          * Update value is originally calculated as
          * update.value  = log((floating_point_type)as_and_count.second / total_count) - base_prior ) * as_weight
          */
-        for (auto &v : as_number_updates) {
-            for (auto &update : v.second) {
-                update.value = update.value * new_as_weight/as_weight;
-            }
-        }
-
-        for (auto &v: hostname_domain_updates) {
-            for (auto &update : v.second) {
-                update.value = update.value * new_domain_weight/domain_weight;
-            }
-        }
-
-        for (auto &v: port_updates) {
-            for (auto &update : v.second) {
-                update.value = update.value * new_port_weight/port_weight;
-            }
-        }
-
-        for (auto &v: ip_ip_updates) {
-            for (auto &update : v.second) {
-                update.value = update.value * new_ip_weight/ip_weight;
-            }
-        }
-
-        for (auto &v: hostname_sni_updates) {
-            for (auto &update : v.second) {
-                update.value = update.value * new_sni_weight/sni_weight;
-            }
-        }
- 
-        for (auto &v: user_agent_updates) {
-            for (auto &update : v.second) {
-                update.value = update.value * new_ua_weight/ua_weight;
-            }
-        }
+        as_number_updates.for_each_value([=](class update &u) { u.value = u.value * new_as_weight/as_weight; });
+        hostname_domain_updates.for_each_value([=](class update &u) { u.value = u.value * new_domain_weight/domain_weight; });
+        port_updates.for_each_value([=](class update &u) { u.value = u.value * new_port_weight/port_weight; });
+        ipv4_updates.for_each_value([=](class update &u) { u.value = u.value * new_ip_weight/ip_weight; });
+        ipv6_updates.for_each_value([=](class update &u) { u.value = u.value * new_ip_weight/ip_weight; });
+        hostname_sni_updates.for_each_value([=](class update &u) { u.value = u.value * new_sni_weight/sni_weight; });
+        user_agent_updates.for_each_value([=](class update &u) { u.value = u.value * new_ua_weight/ua_weight; });
 
         as_weight = new_as_weight;
         domain_weight = new_domain_weight;
@@ -429,15 +456,146 @@ public:
         sni_weight = new_sni_weight;
         ua_weight = new_ua_weight;
     }
+
+    // copy_weights(other) recomputes the probabilities of this
+    // classifier with the weights of other
+    //
+    void copy_weights(const naive_bayes &other) {
+        recompute_probabilities(other.as_weight, other.domain_weight, other.port_weight,
+                                other.ip_weight, other.sni_weight, other.ua_weight);
+    }
 };
 
+// struct port_application associates a destination port with an
+// application name, and with the port that the classifier uses to
+// represent that application (for instance, every email port is
+// represented by 465)
+//
+struct port_application {
+    uint16_t port;
+    uint16_t app_port;
+    const char *name;
+};
+
+// port_applications[] must be sorted by port.  It is indexed by the
+// constexpr dense array port_application_index[], so that a lookup
+// by port is a single array access; the tables and their lookup
+// functions are constexpr, so lookups allocate no memory and can be
+// evaluated at compile time, as the static_asserts below do.
+//
+inline constexpr port_application port_applications[] = {
+    {  443,  443, "https"     },
+    {  448,  448, "database"  },
+    {  465,  465, "email"     },
+    {  563,  563, "nntp"      },
+    {  585,  465, "email"     },
+    {  614,  614, "shell"     },
+    {  636,  636, "ldap"      },
+    {  989,  989, "ftp"       },
+    {  990,  989, "ftp"       },
+    {  991,  991, "nas"       },
+    {  992,  992, "telnet"    },
+    {  993,  465, "email"     },
+    {  994,  994, "irc"       },
+    {  995,  465, "email"     },
+    { 1443, 1443, "alt-https" },
+    { 2376, 2376, "docker"    },
+    { 8001, 8001, "tor"       },
+    { 8443, 1443, "alt-https" },
+    { 9000, 8001, "tor"       },
+    { 9001, 8001, "tor"       },
+    { 9002, 8001, "tor"       },
+    { 9101, 8001, "tor"       },
+};
+
+constexpr size_t num_port_applications = sizeof(port_applications) / sizeof(port_applications[0]);
+
+constexpr size_t port_application_index_length = port_applications[num_port_applications - 1].port + 1;
+
+constexpr uint8_t no_port_application = 0xff;
+
+static_assert(num_port_applications < no_port_application);
+
+// port_application_index[port] is the index of port in
+// port_applications[], or no_port_application if there is none
+//
+inline constexpr std::array<uint8_t, port_application_index_length> port_application_index = [] {
+    std::array<uint8_t, port_application_index_length> index{};
+    for (auto &i : index) {
+        i = no_port_application;
+    }
+    for (size_t i = 0; i < num_port_applications; i++) {
+        index[port_applications[i].port] = i;
+    }
+    return index;
+}();
+
+// find_port_application(port) returns the entry in
+// port_applications[] for port, or nullptr if there is none
+//
+constexpr const port_application *find_port_application(uint16_t port) {
+    if (port < port_application_index_length && port_application_index[port] != no_port_application) {
+        return &port_applications[port_application_index[port]];
+    }
+    return nullptr;
+}
+
+// app_name_to_port(name) returns the port that represents the
+// application name, or 0 (unknown) if there is none
+//
+constexpr uint16_t app_name_to_port(std::string_view name) {
+    for (const auto &p : port_applications) {
+        if (name == p.name) {
+            return p.app_port;
+        }
+    }
+    return 0;  // unknown
+}
+
+constexpr bool port_applications_are_sorted() {
+    for (size_t i = 1; i < num_port_applications; i++) {
+        if (port_applications[i-1].port >= port_applications[i].port) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(port_applications_are_sorted(), "port_applications[] must be sorted by port");
+static_assert(find_port_application(443)->app_port == 443);
+static_assert(find_port_application(993)->app_port == 465);
+static_assert(find_port_application(9101)->app_port == 8001);
+static_assert(find_port_application(80) == nullptr);
+static_assert(find_port_application(65535) == nullptr);
+static_assert(app_name_to_port("alt-https") == 1443);
+static_assert(app_name_to_port("unknown") == 0);
+
 class fingerprint_data {
 
-    std::vector<bool> malware;
-    std::vector<attribute_result::bitset> attr;
-    std::vector<std::string> process_name;
+    image_array<uint8_t> malware;
+    image_array<attribute_result::bitset> attr;
+    string_table process_name;
     std::vector<std::vector<struct os_information>> process_os_info_vector;
 
+    // os_names holds the names of the operating systems in
+    // process_os_info_vector, when this object has been read from a
+    // resource image
+    //
+    string_table os_names;
+
+    // attr_columns holds the attribute tags and malware flags of the
+    // processes as a column-major bit matrix, for softmax_reduce():
+    // column j < MAX_TAGS holds tag j, and column malware_column
+    // holds the malware flags; active_columns lists the columns that
+    // have at least one bit set
+    //
+    static constexpr size_t malware_column = attribute_result::MAX_TAGS;
+    static constexpr size_t num_columns = attribute_result::MAX_TAGS + 1;
+    static_assert(num_columns <= softmax_max_columns, "too many attribute tags for softmax_reduce()");
+    size_t words_per_column = 0;
+    image_array<uint64_t> attr_columns;
+    image_array<uint8_t> active_columns;
+
     naive_bayes classifier;
 
     bool malware_db = false;
@@ -467,6 +625,9 @@ public:
 
         // initialize data structures
         //
+        std::vector<std::string> process_name;
+        std::vector<uint8_t> malware;
+        std::vector<attribute_result::bitset> attr;
         process_name.reserve(processes.size());
         malware.reserve(processes.size());
         attr.reserve(processes.size());
@@ -499,6 +660,111 @@ public:
         assert(malware.size() == processes.size());
         assert(process_os_info_vector.size() == processes.size());
 
+        words_per_column = (processes.size() + 63) / 64;
+        std::vector<uint64_t> attr_columns(num_columns * words_per_column, 0);
+        std::vector<uint8_t> active_columns;
+        for (size_t i = 0; i < processes.size(); i++) {
+            for (size_t j = 0; j < attribute_result::MAX_TAGS; j++) {
+                if (attr[i][j]) {
+                    attr_columns[j * words_per_column + i / 64] |= (uint64_t)1 << (i % 64);
+                }
+            }
+            if (malware[i]) {
+                attr_columns[malware_column * words_per_column + i / 64] |= (uint64_t)1 << (i % 64);
+            }
+        }
+        for (size_t j = 0; j < num_columns; j++) {
+            for (size_t w = 0; w < words_per_column; w++) {
+                if (attr_columns[j * words_per_column + w] != 0) {
+                    active_columns.push_back(j);
+                    break;
+                }
+            }
+        }
+
+        this->process_name = string_table{process_name};
+        this->malware = image_array{std::move(malware)};
+        this->attr = image_array{std::move(attr)};
+        this->attr_columns = image_array{std::move(attr_columns)};
+        this->active_columns = image_array{std::move(active_columns)};
+    }
+
+    // fingerprint_data(r, ...) reads the data for a fingerprint from
+    // a resource image (see write()); only the operating system
+    // information, if there is any, is copied out of the image, into
+    // the os_information structures that are returned by analysis
+    //
+    fingerprint_data(image_reader &r,
+                     ptr_dict &os_dictionary,
+                     const subnet_data *subnets,
+                     const common_data *c) :
+        malware{r},
+        attr{r},
+        process_name{r},
+        os_names{r},
+        words_per_column{r.read<uint64_t>()},
+        attr_columns{r},
+        active_columns{r},
+        classifier{r, os_dictionary},
+        malware_db{r.read<uint8_t>() != 0},
+        subnet_data_ptr{subnets},
+        common{c},
+        total_count{r.read<uint64_t>()}
+    {
+        if (malware.size() != process_name.size() || attr.size() != process_name.size()
+            || attr_columns.size() != num_columns * words_per_column) {
+            throw std::runtime_error("error: inconsistent fingerprint data in resource image");
+        }
+        if (os_names.size() > 0) {
+            image_array<uint32_t> os_begin{r};
+            image_array<uint64_t> os_prevalence{r};
+            if (os_begin.size() != process_name.size() + 1 || os_prevalence.size() != os_names.size()) {
+                throw std::runtime_error("error: inconsistent fingerprint data in resource image");
+            }
+            process_os_info_vector.resize(process_name.size());
+            for (size_t i = 0; i < process_name.size(); i++) {
+                if (os_begin[i + 1] > os_names.size()) {
+                    throw std::runtime_error("error: inconsistent fingerprint data in resource image");
+                }
+                for (size_t j = os_begin[i]; j < os_begin[i + 1]; j++) {
+                    process_os_info_vector[i].push_back({ (char *)os_names[j], os_prevalence[j] });
+                }
+            }
+        }
+    }
+
+    void write(image_writer &w) const {
+        malware.write(w);
+        attr.write(w);
+        process_name.write(w);
+
+        // the operating system information is flattened into a table
+        // of names, a parallel array of prevalences, and the index of
+        // the first entry for each process
+        //
+        std::vector<std::string> names;
+        std::vector<uint32_t> os_begin;
+        std::vector<uint64_t> os_prevalence;
+        for (const auto &os_info : process_os_info_vector) {
+            os_begin.push_back(names.size());
+            for (const auto &os : os_info) {
+                names.push_back(os.os_name);
+                os_prevalence.push_back(os.os_prevalence);
+            }
+        }
+        os_begin.push_back(names.size());
+        string_table{names}.write(w);
+
+        w.write((uint64_t)words_per_column);
+        attr_columns.write(w);
+        active_columns.write(w);
+        classifier.write(w);
+        w.write((uint8_t)malware_db);
+        w.write(total_count);
+        if (!names.empty()) {
+            w.write_array(os_begin.data(), os_begin.size());
+            w.write_array(os_prevalence.data(), os_prevalence.size());
+        }
     }
 
     ~fingerprint_data() {
@@ -540,12 +806,12 @@ public:
     }
 #endif
 
-    // get_tld_domain_name() returns the string containing the top two
-    // domains of the input string; that is, given "s3.amazonaws.com",
-    // it returns "amazonaws.com".  If there is only one name, it is
-    // returned.
+    // get_tld_domain_name() returns a view of the string containing
+    // the top two domains of the input string; that is, given
+    // "s3.amazonaws.com", it returns "amazonaws.com".  If there is
+    // only one name, it is returned.
     //
-    std::string get_tld_domain_name(const char* server_name) {
+    static std::string_view get_tld_domain_name(const char* server_name) {
 
         const char *separator = NULL;
         const char *previous_separator = NULL;
@@ -561,21 +827,22 @@ public:
         }
         if (previous_separator) {
             previous_separator++;  // increment past '.'
-            return previous_separator;
+            return std::string_view{previous_separator, (size_t)(c - previous_separator)};
         }
-        return server_name;
+        return std::string_view{server_name, (size_t)(c - server_name)};
     }
 
-    struct analysis_result perform_analysis(const char *server_name, const char *dst_ip, uint16_t dst_port,
+    struct analysis_result perform_analysis(const char *server_name, const destination_address &dst_addr, uint16_t dst_port,
                                             const char *user_agent, enum fingerprint_status status) {
 
-        uint32_t asn_int = subnet_data_ptr->get_asn_info(dst_ip);
+        uint32_t asn_int = subnet_data_ptr->get_asn_info(dst_addr);
         uint16_t port_app = remap_port(dst_port);
-        std::string domain = get_tld_domain_name(server_name);
-        std::string server_name_str(server_name);
-        std::string dst_ip_str(dst_ip);
 
-        std::vector<floating_point_type> process_score = classifier.classify(asn_int, port_app, domain, server_name_str, dst_ip_str, user_agent);
+        // the score vector is reused across calls in each thread, to
+        // avoid allocating memory for each analysis
+        //
+        static thread_local std::vector<floating_point_type> process_score;
+        classifier.classify(process_score, asn_int, port_app, get_tld_domain_name(server_name), server_name, dst_addr, user_agent);
 
         floating_point_type max_score = std::numeric_limits<floating_point_type>::lowest();
         floating_point_type sec_score = std::numeric_limits<floating_point_type>::lowest();
@@ -593,28 +860,34 @@ public:
             }
         }
 
-        floating_point_type score_sum = 0.0;
-        floating_point_type malware_prob = 0.0;
+        // exponentiate the scores relative to the maximum (in place),
+        // and sum them over all processes, malware processes, and the
+        // processes with each attribute tag
+        //
+        static thread_local std::vector<float> relative_score;
+        relative_score.resize(softmax_padded_length(process_score.size()));
+        for (uint64_t i=0; i < process_score.size(); i++) {
+            relative_score[i] = (float)(process_score[i] - max_score);
+        }
+        std::fill(relative_score.begin() + process_score.size(), relative_score.end(), softmax_min_arg);
+
+        double sum;
+        double column_sum[softmax_max_columns];
+        softmax_reduce(relative_score.data(), process_score.size(), attr_columns.data(), words_per_column,
+                       active_columns.data(), active_columns.size(), sum, column_sum);
+
+        floating_point_type score_sum = sum;
+        floating_point_type malware_prob = column_sum[malware_column];
 
         std::array<floating_point_type, attribute_result::MAX_TAGS> attr_prob;
-        attr_prob.fill(0.0);
-        for (uint64_t i=0; i < process_score.size(); i++) {
-            process_score[i] = expf((float)(process_score[i] - max_score));
-            score_sum += process_score[i];
-            if (malware[i]) {
-                malware_prob += process_score[i];
-            }
-            for (int j = 0; j < attribute_result::MAX_TAGS; j++) {
-                if (attr[i][j]) {
-                    attr_prob[j] += process_score[i];
-                }
-            }
+        for (int j = 0; j < attribute_result::MAX_TAGS; j++) {
+            attr_prob[j] = column_sum[j];
         }
 
-        max_score = process_score[index_max];
-        sec_score = process_score[index_sec];
+        max_score = relative_score[index_max];
+        sec_score = relative_score[index_sec];
 
-        if (malware_db && process_name[index_max] == "generic dmz process" && malware[index_sec] == false) {
+        if (malware_db && strcmp(process_name[index_max], "generic dmz process") == 0 && malware[index_sec] == false) {
             // the most probable process is unlabeled, so choose the
             // next most probable one if it isn't malware, and adjust
             // the normalization sum as appropriate
@@ -636,7 +909,9 @@ public:
         // check encrypted dns watchlist
         //
         attribute_result::bitset attr_tags = attr[index_max];
-        if (common->doh_watchlist.contains(server_name) || common->doh_watchlist.contains_addr(dst_ip)) {
+        bool doh_addr = (dst_addr.ip_vers == 4 && common->doh_watchlist.contains(dst_addr.ipv4))
+            || (dst_addr.ip_vers == 6 && common->doh_watchlist.contains(dst_addr.ipv6));
+        if (common->doh_watchlist.contains(server_name) || doh_addr) {
             attr_tags[common->doh_idx] = true;
             attr_prob[common->doh_idx] = 1.0;
         }
@@ -652,10 +927,10 @@ public:
             os_info_size = process_os_info_vector[index_max].size();
         }
         if (malware_db) {
-            return analysis_result(status, process_name[index_max].c_str(), max_score, os_info_data, os_info_size,
+            return analysis_result(status, process_name[index_max], max_score, os_info_data, os_info_size,
                                    malware[index_max], malware_prob, attr_res);
         }
-        return analysis_result(status, process_name[index_max].c_str(), max_score, os_info_data, os_info_size, attr_res);
+        return analysis_result(status, process_name[index_max], max_score, os_info_data, os_info_size, attr_res);
     }
 
     void recompute_probabilities(floating_point_type new_as_weight, floating_point_type new_domain_weight,
@@ -664,36 +939,13 @@ public:
         classifier.recompute_probabilities(new_as_weight, new_domain_weight, new_port_weight, new_ip_weight, new_sni_weight, new_ua_weight);
     }
 
-    static uint16_t remap_port(uint16_t dst_port) {
-        std::unordered_map<uint16_t, uint16_t> port_remapping =
-            {
-             { 443, 443 },   // https
-             { 448, 448 },   // database
-             { 465, 465 },   // email
-             { 563, 563 },   // nntp
-             { 585, 465 },   // email
-             { 614, 614 },   // shell
-             { 636, 636 },   // ldap
-             { 989, 989 },   // ftp
-             { 990, 989 },   // ftp
-             { 991, 991 },   // nas
-             { 992, 992 },   // telnet
-             { 993, 465 },   // email
-             { 994, 994 },   // irc
-             { 995, 465 },   // email
-             { 1443, 1443 }, // alt-https
-             { 2376, 2376 }, // docker
-             { 8001, 8001 }, // tor
-             { 8443, 1443 }, // alt-https
-             { 9000, 8001 }, // tor
-             { 9001, 8001 }, // tor
-             { 9002, 8001 }, // tor
-             { 9101, 8001 }, // tor
-            };
-
-        const auto port_it = port_remapping.find(dst_port);
-        if (port_it != port_remapping.end()) {
-            return port_it->second;
+    void copy_weights(const fingerprint_data &other) {
+        classifier.copy_weights(other.classifier);
+    }
+
+    static constexpr uint16_t remap_port(uint16_t dst_port) {
+        if (const port_application *p = find_port_application(dst_port)) {
+            return p->app_port;
         }
         return 0;  // unknown
     }
@@ -705,69 +957,93 @@ public:
 // fprintf(stderr, "Type of member %s is %s\n", "str_repr", kTypeNames[fp["str_repr"].GetType()]);
 
 
+// class fingerprint_prevalence tracks which fingerprints are
+// prevalent: those in the known set, which is read from the resource
+// file, and those that have been seen recently by any packet
+// processing thread, which are held as digests in an adaptive
+// clock_set that all of those threads update without locking
+//
 class fingerprint_prevalence {
 public:
-    fingerprint_prevalence(uint32_t max_cache_size) : mutex_{}, list_{}, set_{}, known_set_{}, max_cache_size_{max_cache_size} {}
+    fingerprint_prevalence(uint32_t max_cache_size) : adaptive_set_{max_cache_size}, initial_set_{}, known_set_{} {}
 
-    // first check if known fingerprints contains fingerprint, then check adaptive set
-    bool contains(std::string fp_str) const {
-        if (known_set_.find(fp_str) != known_set_.end()) {
+    // first check if known fingerprints contains fingerprint, then
+    // check adaptive set, which is keyed on the digest of each
+    // fingerprint (its feature_hash())
+    //
+    bool contains(std::string_view fp_str, uint64_t digest) const {
+        if (known_set_.contains(fp_str, digest)) {
             return true;
         }
+        return adaptive_set_.contains(digest);
+    }
 
-        std::shared_lock lock(mutex_);
-        if (set_.find(fp_str) != set_.end()) {
-            return true;
-        }
-        return false;
+    bool contains(std::string_view fp_str) const {
+        return contains(fp_str, feature_hash(fp_str));
     }
 
     // seed known set of fingerprints
     void initial_add(const std::string &fp_str) {
-        known_set_.insert(fp_str);
+        initial_set_.insert(fp_str);
     }
 
-    // update fingerprint LRU cache if needed
-    void update(const std::string &fp_str) {
-        if (known_set_.find(fp_str) != known_set_.end()) {
-            return ;
-        }
+    // compile the seeded fingerprints into the known set, which is
+    // a compact table that can be written to a resource image
+    void finalize_known_set() {
+        known_set_ = feature_table<std::string, uint8_t>{initial_set_, 1};
+        initial_set_ = {};
+    }
 
-        std::unique_lock lock(mutex_, std::try_to_lock);
+    void read_known_set(image_reader &r) {
+        known_set_ = feature_table<std::string, uint8_t>{r};
+    }
 
-        if (!lock.owns_lock()) {
-            return;  // Some other thread wins the lock. So bailing out
-        }
+    void write_known_set(image_writer &w) const {
+        known_set_.write(w);
+    }
 
-        if (set_.find(fp_str) == set_.end()) {
-            if (list_.size() == max_cache_size_) {
-                set_.erase(list_.back());
-                list_.pop_back();
-            }
-        } else {
-            list_.erase(set_[fp_str]);
+    // update fingerprint LRU cache if needed
+    void update(std::string_view fp_str, uint64_t digest) {
+        if (known_set_.contains(fp_str, digest)) {
+            return ;
         }
+        adaptive_set_.update(digest);
+    }
 
-        list_.push_front(fp_str);
-        set_[fp_str] = list_.begin();
+    void update(std::string_view fp_str) {
+        update(fp_str, feature_hash(fp_str));
+    }
+
+    // copy_cache(other) adds the fingerprints in the adaptive cache of
+    // other to this object's cache; packet processing threads may
+    // keep updating either cache while it runs
+    //
+    void copy_cache(const fingerprint_prevalence &other) {
+        adaptive_set_.copy(other.adaptive_set_);
     }
 
     void print(FILE *f) {
-        for (auto &entry : known_set_) {
-            fprintf(f, "%s\n", entry.c_str());
-        }
+        known_set_.for_each_key([f](std::string_view entry) {
+            fprintf(f, "%.*s\n", (int)entry.length(), entry.data());
+        });
     }
 
 private:
-    mutable std::shared_mutex mutex_;
-    std::list<std::string> list_;
-    std::unordered_map<std::string, std::list<std::string>::iterator> set_;
-    std::unordered_set<std::string> known_set_;
-    uint32_t max_cache_size_;
+    clock_set adaptive_set_;
+    std::unordered_set<std::string> initial_set_;
+    feature_table<std::string, uint8_t> known_set_;
 };
 
 
 class classifier {
+
+    // image holds the resource image that this classifier was loaded
+    // from, if any; it is declared first, so that it is unmapped only
+    // after all of the data structures that point into it have been
+    // destroyed
+    //
+    std::unique_ptr<resource_image> image;
+
     bool MALWARE_DB = false;
     bool EXTENDED_FP_METADATA = false;
 
@@ -775,21 +1051,118 @@ class classifier {
 
     subnet_data subnets;     // holds ASN/subnet information
 
-    std::unordered_map<std::string, class fingerprint_data> fpdb;
+    // fpdb holds the fingerprint_data for each fingerprint in the
+    // resource file; while the file is being loaded, fpdb_names maps
+    // each fingerprint string to its index in fpdb
+    //
+    std::vector<class fingerprint_data> fpdb;
+    std::unordered_map<std::string, uint32_t> fpdb_names;
     fingerprint_prevalence fp_prevalence{100000};
 
+    // the thresholds and OS reporting option that this classifier was
+    // built with, which are recorded in resource images
+    //
+    float fp_proc_threshold_ = 0.0;
+    float proc_dst_threshold_ = 0.0;
+    bool report_os_ = false;
+
     std::string resource_version;  // as reported by VERSION file in resource archive
 
     std::vector<fingerprint_type> fp_types;
     size_t tls_fingerprint_format = 0;
     bool first_line = true;
 
+    // id distinguishes this classifier from any other that has been
+    // constructed in this process, including one that replaced it
+    // after a reload, so that an analysis_cache can tell when the
+    // results that it holds are stale; it is changed whenever the
+    // weights are changed by perform_analysis_with_weights(), since
+    // that makes any cached results stale as well
+    //
+    std::atomic<uint64_t> id{next_id()};
+
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> count{0};
+        return ++count;
+    }
+
     // the common object holds data that is common across all
     // fingerprint-specific classifiers, and is used by those
     // classifiers
     //
     common_data common;
 
+    // fpdb_index maps each fingerprint string to the index of its
+    // fingerprint_data in fpdb, and randomized_fpdb_index maps the
+    // prefix of each randomized fingerprint entry (such as "tls/1/"
+    // for the entry "tls/1/randomized") to the index of its
+    // fingerprint_data; they are built after fpdb is loaded, and are
+    // used for lookups, so that a C string can be looked up without
+    // allocating memory
+    //
+    feature_table<std::string, uint32_t> fpdb_index;
+    feature_table<std::string, uint32_t> randomized_fpdb_index;
+
+    void build_fpdb_index() {
+        static constexpr std::string_view randomized{"randomized"};
+        std::unordered_map<std::string, std::vector<uint32_t>> fp_map;
+        std::unordered_map<std::string, std::vector<uint32_t>> randomized_map;
+        for (const auto &fpdb_entry : fpdb_names) {
+            const std::string &fp_str = fpdb_entry.first;
+            fp_map[fp_str] = { fpdb_entry.second };
+            if (fp_str.length() >= randomized.length()
+                && fp_str.compare(fp_str.length() - randomized.length(), randomized.length(), randomized) == 0) {
+                randomized_map[fp_str.substr(0, fp_str.length() - randomized.length())] = { fpdb_entry.second };
+            }
+        }
+        fpdb_index = feature_table{fp_map};
+        randomized_fpdb_index = feature_table{randomized_map};
+        fpdb_names = {};
+    }
+
+    // lookup_fingerprint(fp_str, digest, prefix_length, status)
+    // returns the fingerprint_data that should be used to analyze the
+    // fingerprint fp_str, whose feature_hash() is digest, and sets
+    // status accordingly, or returns nullptr if there is none.  An
+    // unknown fingerprint is added to fp_prevalence; if it was not
+    // already prevalent, it is analyzed with the randomized entry for
+    // its protocol and format, if there is one, which is found from
+    // the characters of fp_str before its first '(', which is known
+    // not to be in its first prefix_length characters.
+    //
+    class fingerprint_data *lookup_fingerprint(std::string_view fp_str,
+                                               uint64_t digest,
+                                               size_t prefix_length,
+                                               enum fingerprint_status &status) {
+        if (const uint32_t *idx = fpdb_index.find(fp_str, digest)) {
+            status = fingerprint_status_labeled;
+            return &fpdb[*idx];
+        }
+        if (fp_prevalence.contains(fp_str, digest)) {
+            fp_prevalence.update(fp_str, digest);
+            status = fingerprint_status_unlabled;
+            return nullptr;
+        }
+        fp_prevalence.update(fp_str, digest);
+
+        /*
+         * Resource file has info about randomized fingerprints in the format
+         * protocol/format/randomized
+         * Eg: tls/1/randomized
+         */
+        status = fingerprint_status_randomized;
+        size_t prefix_end = fp_str.find('(', prefix_length);
+        if (const uint32_t *idx = randomized_fpdb_index.find(fp_str.substr(0, prefix_end))) {
+            return &fpdb[*idx];
+        }
+        return nullptr;  // TODO: does this actually happen?
+    }
+
+    class fingerprint_data *lookup_fingerprint(const char *fp_str, enum fingerprint_status &status) {
+        std::string_view s{fp_str};
+        return lookup_fingerprint(s, feature_hash(s), 0, status);
+    }
+
 public:
 
     static fingerprint_type get_fingerprint_type(const std::string &s) {
@@ -1033,15 +1406,7 @@ public:
                     //fprintf(stderr, "\tclasses_port_applications\n");
                     for (auto &y : x["classes_port_applications"].GetObject()) {
                         if (y.value.IsUint64() && ((float)y.value.GetUint64()/count > proc_dst_threshold)) {
-                            uint16_t tmp_port = 0;
-                            auto port_it = string_to_port.find(y.name.GetString());
-                            if (port_it == string_to_port.end()) {
-                                tmp_port = 0; // set port to unknown
-                                //throw std::runtime_error("error: unexpected string in classes_port_applications");
-                                //fprintf(stderr, "error: unexpected string \"%s\" in classes_port_applications\n", y.name.GetString());
-                            } else {
-                                tmp_port = port_it->second;
-                            }
+                            uint16_t tmp_port = app_name_to_port(y.name.GetString());  // unexpected strings map to 0 (unknown)
                             portname_applications[tmp_port] = y.value.GetUint64();
                         }
                     }
@@ -1100,18 +1465,26 @@ public:
             class fingerprint_data fp_data(total_count, process_vector, os_dictionary, &subnets, &common, MALWARE_DB);
             // fp_data.print(stderr);
 
-            if (fpdb.find(fp_string) != fpdb.end()) {
+            if (fpdb_names.find(fp_string) != fpdb_names.end()) {
                 printf_err(log_warning, "fingerprint database has duplicate entry for fingerprint %s\n", fp_string.c_str());
+                return;
             }
-            // fpdb[fp_string] = fp_data;
-            fpdb.emplace(fp_string, fp_data); // TODO: ???
+            fpdb_names.emplace(fp_string, fpdb.size());
+            fpdb.push_back(std::move(fp_data));
         }
     }
 
     classifier(class encrypted_compressed_archive &archive,
                float fp_proc_threshold,
                float proc_dst_threshold,
-               bool report_os) : os_dictionary{}, subnets{}, fpdb{}, resource_version{} {
+               bool report_os) :
+        os_dictionary{},
+        subnets{},
+        fpdb{},
+        fp_proc_threshold_{fp_proc_threshold},
+        proc_dst_threshold_{proc_dst_threshold},
+        report_os_{report_os},
+        resource_version{} {
 
         // reserve attribute for encrypted_dns watchlist
         //
@@ -1173,6 +1546,108 @@ public:
         }
 
         subnets.process_final();
+        build_fpdb_index();
+        fp_prevalence.finalize_known_set();
+    }
+
+    // classifier(image_file, ...) loads a classifier from a resource
+    // image written by write_image(), without parsing; the thresholds
+    // and report_os must be the same as those that the image was
+    // written with
+    //
+    classifier(const char *image_file,
+               float fp_proc_threshold,
+               float proc_dst_threshold,
+               bool report_os) :
+        image{std::make_unique<resource_image>(image_file)},
+        fp_proc_threshold_{fp_proc_threshold},
+        proc_dst_threshold_{proc_dst_threshold},
+        report_os_{report_os} {
+
+        image->check_header(sizeof(floating_point_type), sizeof(attribute_result::bitset), mercury_get_version_number());
+        image_reader r = image->reader();
+
+        float image_fp_proc_threshold = r.read<float>();
+        float image_proc_dst_threshold = r.read<float>();
+        bool image_report_os = r.read<uint8_t>() != 0;
+        if (image_fp_proc_threshold != fp_proc_threshold
+            || image_proc_dst_threshold != proc_dst_threshold
+            || image_report_os != report_os) {
+            printf_err(log_err,
+                       "resource image was compiled with fp_proc_threshold=%g, proc_dst_threshold=%g, report_os=%u\n",
+                       image_fp_proc_threshold, image_proc_dst_threshold, image_report_os);
+            throw std::runtime_error("error: resource image does not match the classifier configuration");
+        }
+
+        resource_version = r.read_string();
+        tls_fingerprint_format = r.read<uint64_t>();
+        MALWARE_DB = r.read<uint8_t>() != 0;
+        EXTENDED_FP_METADATA = r.read<uint8_t>() != 0;
+        size_t num_types;
+        const uint32_t *types = r.read_array<uint32_t>(num_types);
+        for (size_t i = 0; i < num_types; i++) {
+            fp_types.push_back((fingerprint_type)types[i]);
+        }
+
+        string_table attr_names{r};
+        for (size_t i = 0; i < attr_names.size(); i++) {
+            common.attr_name.get_index(attr_names[i]);
+        }
+        common.attr_name.stop_accepting_new_names();
+        common.doh_idx = r.read<int64_t>();
+        common.doh_watchlist = watchlist{r};
+
+        subnets.read(r);
+        fp_prevalence.read_known_set(r);
+
+        uint64_t num_fingerprints = r.read<uint64_t>();
+        fpdb.reserve(num_fingerprints);
+        for (uint64_t i = 0; i < num_fingerprints; i++) {
+            fpdb.emplace_back(r, os_dictionary, &subnets, &common);
+        }
+        fpdb_index = feature_table<std::string, uint32_t>{r};
+        randomized_fpdb_index = feature_table<std::string, uint32_t>{r};
+        auto check_index = [this](uint32_t &idx) {
+            if (idx >= fpdb.size()) {
+                throw std::runtime_error("error: invalid fingerprint index in resource image");
+            }
+        };
+        fpdb_index.for_each_value(check_index);
+        randomized_fpdb_index.for_each_value(check_index);
+    }
+
+    // write_image(f) writes this classifier to the file f as a
+    // resource image, which can be loaded much faster than the
+    // resource archive that it was built from
+    //
+    void write_image(FILE *f) const {
+        image_writer w{f};
+        resource_image::write_header(w, sizeof(floating_point_type), sizeof(attribute_result::bitset), mercury_get_version_number());
+
+        w.write(fp_proc_threshold_);
+        w.write(proc_dst_threshold_);
+        w.write((uint8_t)report_os_);
+
+        w.write_string(resource_version);
+        w.write((uint64_t)tls_fingerprint_format);
+        w.write((uint8_t)MALWARE_DB);
+        w.write((uint8_t)EXTENDED_FP_METADATA);
+        std::vector<uint32_t> types{fp_types.begin(), fp_types.end()};
+        w.write_array(types.data(), types.size());
+
+        string_table{common.attr_name.value()}.write(w);
+        w.write((int64_t)common.doh_idx);
+        common.doh_watchlist.write(w);
+
+        subnets.write(w);
+        fp_prevalence.write_known_set(w);
+
+        w.write((uint64_t)fpdb.size());
+        for (const auto &fp_data : fpdb) {
+            fp_data.write(w);
+        }
+        fpdb_index.write(w);
+        randomized_fpdb_index.write(w);
     }
 
 #if 0
@@ -1186,78 +1661,48 @@ public:
     }
 #endif
 
-    std::unordered_map<std::string, uint16_t> string_to_port =
-        {
-         { "unknown",      0 },
-         { "https",      443 },
-         { "database",   448 },
-         { "email",      465 },
-         { "nntp",       563 },
-         { "shell",      614 },
-         { "ldap",       636 },
-         { "ftp",        989 },
-         { "nas",        991 },
-         { "telnet",     992 },
-         { "irc",        994 },
-         { "alt-https", 1443 },
-         { "docker",    2376 },
-         { "tor",       8001 },
-        };
-    std::string port_to_app(uint16_t dst_port) {
-        std::unordered_map<uint16_t, std::string> port_app = {
-             {443, "https"},  {448,"database"}, {465,"email"},
-             {563,"nntp"},    {585,"email"},    {614,"shell"},
-             {636,"ldap"},    {989,"ftp"},      {990,"ftp"},
-             {991,"nas"},     {992,"telnet"},   {993,"email"},
-             {994,"irc"},     {995,"email"},    {1443,"alt-https"},
-             {2376,"docker"}, {8001,"tor"},     {8443,"alt-https"},
-             {9000,"tor"},    {9001,"tor"},     {9002,"tor"},
-             {9101,"tor"}
-        };
-        auto it = port_app.find(dst_port);
-        if (it != port_app.end()) {
-            return it->second;
+    static constexpr const char *port_to_app(uint16_t dst_port) {
+        if (const port_application *p = find_port_application(dst_port)) {
+            return p->name;
         }
         return "unknown";
-
     }
 
-    struct analysis_result perform_analysis(const char *fp_str, const char *server_name, const char *dst_ip,
+    struct analysis_result perform_analysis(const char *fp_str, const char *server_name, const destination_address &dst_addr,
                                             uint16_t dst_port, const char *user_agent) {
 
         // fp_stats.observe(fp_str, server_name, dst_ip, dst_port); // TBD - decide where this call should go
 
-        const auto fpdb_entry = fpdb.find(fp_str);
-        if (fpdb_entry == fpdb.end()) {
-            if (fp_prevalence.contains(fp_str)) {
-                fp_prevalence.update(fp_str);
-                return analysis_result(fingerprint_status_unlabled);
-            } else {
-                fp_prevalence.update(fp_str);
-                /*
-                 * Resource file has info about randomized fingerprints in the format
-                 * protocol/format/randomized
-                 * Eg: tls/1/randomized
-                 */
-                std::string randomized_str;
-                const char *c = &fp_str[0];
-                while (*c != '\0' && *c != '(') {
-                    randomized_str.append(c, 1);
-                    c++;
-                }
-                randomized_str.append("randomized");
- 
-                const auto fpdb_entry_randomized = fpdb.find(randomized_str);
-                if (fpdb_entry_randomized == fpdb.end()) {
-                    return analysis_result(fingerprint_status_randomized);  // TODO: does this actually happen?
-                }
-                class fingerprint_data &fp_data = fpdb_entry_randomized->second;
-                return fp_data.perform_analysis(server_name, dst_ip, dst_port, user_agent, fingerprint_status_randomized);
-            }
+        enum fingerprint_status status;
+        class fingerprint_data *fp_data = lookup_fingerprint(fp_str, status);
+        if (fp_data == nullptr) {
+            return analysis_result(status);
         }
-        class fingerprint_data &fp_data = fpdb_entry->second;
+        return fp_data->perform_analysis(server_name, dst_addr, dst_port, user_agent, status);
+    }
 
-        return fp_data.perform_analysis(server_name, dst_ip, dst_port, user_agent, fingerprint_status_labeled);
+    // this version of perform_analysis() accepts a fingerprint, whose
+    // digest is used to look it up
+    //
+    struct analysis_result perform_analysis(const fingerprint &fp, const char *server_name, const destination_address &dst_addr,
+                                            uint16_t dst_port, const char *user_agent) {
+        enum fingerprint_status status;
+        class fingerprint_data *fp_data = lookup_fingerprint(fp.string_view(), fp.digest(), fp.prefix().length(), status);
+        if (fp_data == nullptr) {
+            return analysis_result(status);
+        }
+        return fp_data->perform_analysis(server_name, dst_addr, dst_port, user_agent, status);
+    }
+
+    // this version of perform_analysis() accepts the destination
+    // address as a string, for callers outside of the packet
+    // processing path
+    //
+    struct analysis_result perform_analysis(const char *fp_str, const char *server_name, const char *dst_ip,
+                                            uint16_t dst_port, const char *user_agent) {
+        destination_address dst_addr;
+        dst_addr.parse(dst_ip);
+        return perform_analysis(fp_str, server_name, dst_addr, dst_port, user_agent);
     }
 
     /*
@@ -1276,44 +1721,27 @@ public:
 
         // fp_stats.observe(fp_str, server_name, dst_ip, dst_port); // TBD - decide where this call should go
 
-        const auto fpdb_entry = fpdb.find(fp_str);
-        if (fpdb_entry == fpdb.end()) {
-            if (fp_prevalence.contains(fp_str)) {
-                fp_prevalence.update(fp_str);
-                return analysis_result(fingerprint_status_unlabled);
-            } else {
-                fp_prevalence.update(fp_str);
-                /*
-                 * Resource file has info about randomized fingerprints in the format
-                 * protocol/format/randomized
-                 * Eg: tls/1/randomized
-                 */
-                std::string randomized_str;
-                const char *c = &fp_str[0];
-                while (*c != '\0' && *c != '(') {
-                    randomized_str.append(c, 1);
-                    c++;
-                }
-                randomized_str.append("randomized");
-
-                const auto fpdb_entry_randomized = fpdb.find(randomized_str);
-                if (fpdb_entry_randomized == fpdb.end()) {
-                    return analysis_result(fingerprint_status_randomized);  // TODO: does this actually happen?
-                }
-                class fingerprint_data &fp_data = fpdb_entry_randomized->second;
-                fp_data.recompute_probabilities(new_as_weight, new_domain_weight, new_port_weight, new_ip_weight, new_sni_weight, new_ua_weight);
-                return fp_data.perform_analysis(server_name, dst_ip, dst_port, user_agent, fingerprint_status_randomized);
-            }
+        enum fingerprint_status status;
+        class fingerprint_data *fp_data = lookup_fingerprint(fp_str, status);
+        if (fp_data == nullptr) {
+            return analysis_result(status);
         }
-        class fingerprint_data &fp_data = fpdb_entry->second;
-
-        fp_data.recompute_probabilities(new_as_weight, new_domain_weight, new_port_weight, new_ip_weight, new_sni_weight, new_ua_weight);
-        return fp_data.perform_analysis(server_name, dst_ip, dst_port, user_agent, fingerprint_status_labeled);
+        fp_data->recompute_probabilities(new_as_weight, new_domain_weight, new_port_weight, new_ip_weight, new_sni_weight, new_ua_weight);
+        id.store(next_id(), std::memory_order_relaxed);   // invalidate any analysis_cache
+        destination_address dst_addr;
+        dst_addr.parse(dst_ip);
+        return fp_data->perform_analysis(server_name, dst_addr, dst_port, user_agent, status);
     }
 
+    // analyze_fingerprint_and_destination_context(fp, dc, result,
+    // cache) sets result to the analysis of the fingerprint fp and
+    // destination context dc; if cache is not nullptr, the result is
+    // taken from it when possible, and otherwise stored in it
+    //
     bool analyze_fingerprint_and_destination_context(const fingerprint &fp,
                                                      const destination_context &dc,
-                                                     analysis_result &result
+                                                     analysis_result &result,
+                                                     analysis_cache *cache=nullptr
                                                      ) {
 
         if (fp.is_null()) {
@@ -1323,13 +1751,42 @@ public:
             result = analysis_result(fingerprint_status_unanalyzed);
             return true;  // not configured to analyze fingerprints of this type
         }
-        result = this->perform_analysis(fp.string(), dc.sn_str, dc.dst_ip_str, dc.dst_port, dc.ua_str);
+        if (cache == nullptr) {
+            result = this->perform_analysis(fp, dc.sn_str, dc.dst_addr, dc.dst_port, dc.ua_str);
+            return true;
+        }
+        uint64_t hash;
+        if (const analysis_result *cached = cache->find(id.load(std::memory_order_relaxed), fp.string_view(), fp.digest(), dc, hash)) {
+            result = *cached;
+            return true;
+        }
+        result = this->perform_analysis(fp, dc.sn_str, dc.dst_addr, dc.dst_port, dc.ua_str);
+        if (result.status == fingerprint_status_labeled) {
+            cache->insert(hash, fp.string_view(), dc, result);
+        }
         return true;
     }
 
     const char *get_resource_version() {
         return resource_version.c_str();
     }
+
+    // carry_over(old) applies the state that has accumulated in the
+    // classifier old, which this one is replacing, to this classifier:
+    // the weights of each fingerprint that is in both of them, as set
+    // by perform_analysis_with_weights(), and the fingerprints in the
+    // adaptive prevalence cache
+    //
+    void carry_over(const classifier &old) {
+        fpdb_index.for_each_key([this, &old](std::string_view fp_str) {
+            const uint32_t *old_idx = old.fpdb_index.find(fp_str);
+            const uint32_t *idx = fpdb_index.find(fp_str);
+            if (old_idx && idx) {
+                fpdb[*idx].copy_weights(old.fpdb[*old_idx]);
+            }
+        });
+        fp_prevalence.copy_cache(old.fp_prevalence);
+    }
 };
 
 
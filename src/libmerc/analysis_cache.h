@@ -0,0 +1,202 @@
+/*
+ * analysis_cache.h
+ *
+ * per-thread cache of the results of fingerprint and destination
+ * analysis
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef ANALYSIS_CACHE_H
+#define ANALYSIS_CACHE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <atomic>
+#include "result.h"
+#include "feature_table.h"
+
+// class analysis_cache holds the results of recent analyses, keyed on
+// everything that the naive bayes classifier uses to compute them:
+// the fingerprint string, server name, destination address and port,
+// and user agent.  Clients often connect to the same destination with
+// the same fingerprint many times, and each such connection can then
+// reuse the stored analysis_result instead of scoring every process
+// again.  Each packet processor has its own cache, so no locking is
+// needed.
+//
+// The cache is a set-associative table: each key hashes to a set of
+// ways entries, and the full key of each entry is compared, so that a
+// hash collision never returns the wrong result.  Each entry counts
+// its hits; when a set is full, the entry with the fewest hits is
+// replaced, and the counts of the others are halved, so that entries
+// that were popular once but are no longer used eventually make way.
+// A new entry is thus the first to go, which keeps a stream of
+// one-off destinations from evicting the entries that get most of
+// the hits.
+//
+// An analysis_result points into the classifier that produced it (for
+// instance, at its OS information), so the cache records the id of
+// that classifier, and is emptied whenever it is used with another
+// one, as after the resources are reloaded.  Only the results for
+// labeled fingerprints are stored, since the status of any other
+// fingerprint depends on how often it has been seen before.
+//
+// The hit, miss, and eviction counters are only written by the
+// thread that owns the cache, but may be read from any thread.
+//
+class analysis_cache {
+
+    static constexpr size_t ways = 4;
+
+    struct entry {
+        uint64_t hash = 0;
+        uint32_t hits = 0;
+        bool valid = false;
+        uint16_t dst_port = 0;
+        destination_address dst_addr;
+        std::string fp_str;
+        std::string server_name;
+        std::string user_agent;
+        analysis_result result;
+
+        bool matches(uint64_t h,
+                     std::string_view fp,
+                     const destination_context &dc) const {
+            return valid
+                && hash == h
+                && dst_port == dc.dst_port
+                && dst_addr.ip_vers == dc.dst_addr.ip_vers
+                && (dst_addr.ip_vers != 4 || dst_addr.ipv4 == dc.dst_addr.ipv4)
+                && (dst_addr.ip_vers != 6 || dst_addr.ipv6 == dc.dst_addr.ipv6)
+                && fp_str == fp
+                && server_name == dc.sn_str
+                && user_agent == dc.ua_str;
+        }
+    };
+
+    std::vector<entry> entries;
+    size_t set_mask = 0;
+    uint64_t classifier_id = 0;
+    std::atomic<size_t> num_hits{0};
+    std::atomic<size_t> num_misses{0};
+    std::atomic<size_t> num_evictions{0};
+
+    // increment(counter) adds one to a counter; since only the
+    // owning thread writes the counters, no atomic read-modify-write
+    // is needed
+    //
+    static void increment(std::atomic<size_t> &counter) {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    static uint64_t key_hash(uint64_t fp_digest, const destination_context &dc) {
+        uint64_t h = fp_digest;
+        h = feature_hash(h ^ feature_hash(std::string_view{dc.sn_str}));
+        h = feature_hash(h ^ feature_hash(std::string_view{dc.ua_str}));
+        if (dc.dst_addr.ip_vers == 6) {
+            h = feature_hash(h ^ feature_hash(dc.dst_addr.ipv6));
+        } else {
+            h = feature_hash(h ^ dc.dst_addr.ipv4);
+        }
+        return feature_hash(h ^ ((uint64_t)dc.dst_addr.ip_vers << 16 | dc.dst_port));
+    }
+
+    entry *set_for(uint64_t h) {
+        return &entries[(h & set_mask) * ways];
+    }
+
+public:
+
+    // analysis_cache(capacity) constructs a cache that holds at least
+    // capacity results, rounded up to a power of two
+    //
+    explicit analysis_cache(size_t capacity) {
+        size_t num_sets = 1;
+        while (num_sets * ways < capacity) {
+            num_sets *= 2;
+        }
+        entries.resize(num_sets * ways);
+        set_mask = num_sets - 1;
+    }
+
+    // find(id, fp, fp_digest, dc, hash) returns a pointer to the
+    // stored result for the fingerprint string fp, whose digest is
+    // fp_digest, and destination context dc, as computed by the
+    // classifier with the id id, or nullptr if there is none; in the
+    // latter case, hash is set so that it can be passed to insert()
+    //
+    const analysis_result *find(uint64_t id,
+                                std::string_view fp,
+                                uint64_t fp_digest,
+                                const destination_context &dc,
+                                uint64_t &hash) {
+        if (id != classifier_id) {
+            clear();
+            classifier_id = id;
+        }
+        hash = key_hash(fp_digest, dc);
+        entry *set = set_for(hash);
+        for (size_t i = 0; i < ways; i++) {
+            if (set[i].matches(hash, fp, dc)) {
+                if (set[i].hits < UINT32_MAX) {
+                    set[i].hits++;
+                }
+                increment(num_hits);
+                return &set[i].result;
+            }
+        }
+        increment(num_misses);
+        return nullptr;
+    }
+
+    // insert(hash, fp, dc, result) stores result, for the key that
+    // was just passed to find() along with hash
+    //
+    void insert(uint64_t hash, std::string_view fp, const destination_context &dc, const analysis_result &result) {
+        entry *set = set_for(hash);
+        entry *victim = &set[0];
+        for (size_t i = 0; i < ways; i++) {
+            if (!set[i].valid) {
+                victim = &set[i];
+                break;
+            }
+            if (set[i].hits < victim->hits) {
+                victim = &set[i];
+            }
+        }
+        if (victim->valid) {
+            for (size_t i = 0; i < ways; i++) {
+                set[i].hits /= 2;
+            }
+            increment(num_evictions);
+        }
+        victim->hash = hash;
+        victim->hits = 0;
+        victim->valid = true;
+        victim->dst_port = dc.dst_port;
+        victim->dst_addr = dc.dst_addr;
+        victim->fp_str.assign(fp);
+        victim->server_name.assign(dc.sn_str);
+        victim->user_agent.assign(dc.ua_str);
+        victim->result = result;
+    }
+
+    void clear() {
+        for (auto &e : entries) {
+            e.valid = false;
+        }
+    }
+
+    uint64_t hits() const { return num_hits.load(std::memory_order_relaxed); }
+
+    uint64_t misses() const { return num_misses.load(std::memory_order_relaxed); }
+
+    uint64_t evictions() const { return num_evictions.load(std::memory_order_relaxed); }
+};
+
+#endif // ANALYSIS_CACHE_H
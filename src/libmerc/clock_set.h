@@ -0,0 +1,156 @@
+/*
+ * clock_set.h
+ *
+ * a concurrent, approximately least-recently-used set of 64-bit
+ * digests
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef CLOCK_SET_H
+#define CLOCK_SET_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <memory>
+
+// class clock_set holds a bounded set of 64-bit digests (such as
+// fingerprint digests, see fingerprint.h), which many threads can
+// look up and add to at the same time without taking any lock.  When
+// it is full, adding a digest evicts one that has not been used
+// recently, as in a least-recently-used cache.
+//
+// The set is divided into many small sets of ways entries, each of
+// which fills one cache line, and each digest belongs to the small
+// set selected by its low bits, so that threads that work with
+// different digests rarely touch the same cache line.  Within a small
+// set, the CLOCK algorithm approximates LRU: each entry has a
+// referenced flag, which is set when its digest is seen again, and a
+// new digest replaces the first entry, starting at the hand of the
+// clock, whose flag is clear, clearing the flags that it passes over.
+// A digest is thus evicted only after all of the others in its small
+// set have been inserted or seen since it was last seen, and a new
+// digest is evicted before one that has been seen more than once.
+//
+// All operations are lock free, and use relaxed atomics, since the
+// set is a heuristic: when two threads update the same small set at
+// once, a digest may be added twice, or an update may be lost, but
+// contains() only ever returns true for a digest that was added.
+// Zero marks an empty entry, so the low bit of each digest is set
+// before it is stored, and two digests that differ only in that bit
+// are treated as the same.
+//
+class clock_set {
+
+    static constexpr size_t ways = 7;
+
+    struct alignas(64) small_set {
+        std::atomic<uint64_t> tag[ways];
+        std::atomic<uint8_t> referenced[ways];
+        std::atomic<uint8_t> hand;
+    };
+
+    static_assert(sizeof(small_set) == 64, "each small set should fill one cache line");
+
+    std::unique_ptr<small_set[]> sets;
+    size_t mask;
+
+    static uint64_t tag_of(uint64_t digest) { return digest | 1; }
+
+    small_set &set_for(uint64_t t) const { return sets[(t >> 1) & mask]; }
+
+    // find(s, t) returns the way of the small set s that holds the
+    // tag t, or ways if there is none
+    //
+    static size_t find(const small_set &s, uint64_t t) {
+        for (size_t i = 0; i < ways; i++) {
+            if (s.tag[i].load(std::memory_order_relaxed) == t) {
+                return i;
+            }
+        }
+        return ways;
+    }
+
+    void insert_tag(uint64_t t) {
+        small_set &s = set_for(t);
+        size_t i = find(s, t);
+        if (i != ways) {
+            if (s.referenced[i].load(std::memory_order_relaxed) == 0) {
+                s.referenced[i].store(1, std::memory_order_relaxed);
+            }
+            return;
+        }
+        uint8_t h = s.hand.load(std::memory_order_relaxed);
+        for (size_t n = 0; n < ways && s.referenced[h].load(std::memory_order_relaxed); n++) {
+            s.referenced[h].store(0, std::memory_order_relaxed);
+            h = (h + 1) % ways;
+        }
+        s.tag[h].store(t, std::memory_order_relaxed);
+        s.referenced[h].store(0, std::memory_order_relaxed);
+        s.hand.store((h + 1) % ways, std::memory_order_relaxed);
+    }
+
+public:
+
+    // clock_set(capacity) constructs an empty set that holds at
+    // least capacity digests
+    //
+    explicit clock_set(size_t capacity) {
+        size_t num_sets = 1;
+        while (num_sets * ways < capacity) {
+            num_sets *= 2;
+        }
+        sets.reset(new small_set[num_sets]);
+        mask = num_sets - 1;
+        for (size_t j = 0; j < num_sets; j++) {
+            for (size_t i = 0; i < ways; i++) {
+                sets[j].tag[i].store(0, std::memory_order_relaxed);
+                sets[j].referenced[i].store(0, std::memory_order_relaxed);
+            }
+            sets[j].hand.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    clock_set(const clock_set &) = delete;
+    clock_set &operator=(const clock_set &) = delete;
+
+    bool contains(uint64_t digest) const {
+        uint64_t t = tag_of(digest);
+        return find(set_for(t), t) != ways;
+    }
+
+    // update(digest) marks digest as recently used, adding it to the
+    // set if it is not already there
+    //
+    void update(uint64_t digest) {
+        insert_tag(tag_of(digest));
+    }
+
+    // copy(other) adds the digests in other to this set
+    //
+    void copy(const clock_set &other) {
+        for (size_t j = 0; j <= other.mask; j++) {
+            for (size_t i = 0; i < ways; i++) {
+                if (uint64_t t = other.sets[j].tag[i].load(std::memory_order_relaxed)) {
+                    insert_tag(t);
+                }
+            }
+        }
+    }
+
+    size_t capacity() const { return (mask + 1) * ways; }
+
+    size_t size() const {
+        size_t count = 0;
+        for (size_t j = 0; j <= mask; j++) {
+            for (size_t i = 0; i < ways; i++) {
+                count += sets[j].tag[i].load(std::memory_order_relaxed) != 0;
+            }
+        }
+        return count;
+    }
+};
+
+#endif // CLOCK_SET_H
@@ -17,14 +17,35 @@
 #include <openssl/hmac.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
+#include <string.h>
+#include <stdexcept>
 
 #define pt_buf_len 2048
 
+// class crypto_engine holds the cipher contexts used to decrypt
+// packets.  Each context is initialized with its cipher only once, and
+// afterwards is only given a new key, which avoids looking up the
+// cipher implementation again; each also remembers the AES-128 key
+// that it was last given, and when the same key is used again, only
+// its IV or state is reset, so that the key schedule (and, for GCM,
+// the GHASH key) is not recomputed, as for the retransmitted Initial
+// packets of a QUIC connection.
+//
 class crypto_engine {
 
     EVP_CIPHER_CTX *gcm_ctx = nullptr;
     EVP_CIPHER_CTX *ecb_ctx = nullptr;
 
+    static constexpr size_t aes_128_key_len = 16;
+
+    uint8_t gcm_key[aes_128_key_len];
+    bool gcm_cipher_set = false;
+    bool gcm_key_set = false;
+
+    uint8_t ecb_key[aes_128_key_len];
+    bool ecb_cipher_set = false;
+    bool ecb_key_set = false;
+
     static constexpr size_t max_label_len = 2048;
 
 public:
@@ -47,7 +68,11 @@ public:
         }
     }
 
-    void ecb_encrypt(unsigned char *key,
+    // ecb_encrypt(key, ciphertext, plaintext, plaintext_len) encrypts
+    // plaintext with AES-128 in ECB mode, without padding, so
+    // plaintext_len must be a multiple of the block size
+    //
+    void ecb_encrypt(const unsigned char *key,
                     uint8_t *ciphertext,
                     const unsigned char *plaintext,
                     const int plaintext_len)
@@ -55,9 +80,24 @@ public:
         int len;
         int ciphertext_len;
 
-        if(!EVP_EncryptInit_ex(ecb_ctx, EVP_aes_128_ecb(), NULL, key, NULL)) {
+        if (!ecb_cipher_set) {
+            if(!EVP_EncryptInit_ex(ecb_ctx, EVP_aes_128_ecb(), NULL, NULL, NULL)) {
+                throw std::runtime_error("could not initialize EVP_CIPHER_CTX");
+            }
+            EVP_CIPHER_CTX_set_padding(ecb_ctx, 0);
+            ecb_cipher_set = true;
+        }
+        if (ecb_key_set && memcmp(key, ecb_key, sizeof(ecb_key)) == 0) {
+            key = NULL;   // reuse the key schedule
+        }
+        ecb_key_set = false;
+        if (!EVP_EncryptInit_ex(ecb_ctx, NULL, NULL, key, NULL)) {
             throw std::runtime_error("could not initialize EVP_CIPHER_CTX");
         }
+        if (key != NULL) {
+            memcpy(ecb_key, key, sizeof(ecb_key));
+        }
+        ecb_key_set = true;
 
         if (!EVP_EncryptUpdate(ecb_ctx, ciphertext, &len, plaintext, plaintext_len)) {
             return;
@@ -81,8 +121,8 @@ public:
                     unsigned int ad_len,
                     const unsigned char *ciphertext,
                     int ciphertext_len,
-                    unsigned char *key,
-                    unsigned char *iv,
+                    const unsigned char *key,
+                    const unsigned char *iv,
                     unsigned char *plaintext)
     {
         int len;
@@ -100,14 +140,26 @@ public:
         }
         const uint8_t *tag = ciphertext + ciphertext_len;
 
-        // initialize cipher & context with key and iv
+        // initialize cipher & context with key and iv, or just with
+        // iv if the key is the one that the context already holds
         //
-        if(!EVP_DecryptInit_ex(gcm_ctx, EVP_aes_128_gcm(), NULL, NULL, NULL)) {
-            throw std::runtime_error("could not initialize EVP_CIPHER_CTX");
+        if (!gcm_cipher_set) {
+            if(!EVP_DecryptInit_ex(gcm_ctx, EVP_aes_128_gcm(), NULL, NULL, NULL)) {
+                throw std::runtime_error("could not initialize EVP_CIPHER_CTX");
+            }
+            gcm_cipher_set = true;
+        }
+        if (gcm_key_set && memcmp(key, gcm_key, sizeof(gcm_key)) == 0) {
+            key = NULL;   // reuse the key schedule and GHASH key
         }
+        gcm_key_set = false;
         if(!EVP_DecryptInit_ex(gcm_ctx, NULL, NULL, key, iv)) {
             return -1;
         }
+        if (key != NULL) {
+            memcpy(gcm_key, key, sizeof(gcm_key));
+        }
+        gcm_key_set = true;
 
         // set the associated data
         //
@@ -15,6 +15,10 @@
 #include <unordered_map>
 #include <vector>
 #include <algorithm>
+#include <mutex>
+#include <deque>
+#include <string>
+#include <string_view>
 
 #include "bytestring.h"
 
@@ -114,6 +118,111 @@ public:
 
 };
 
+// class producer_dict is a dictionary coder that is updated by a
+// single (producer) thread, and whose inverse map can be read from
+// other threads.  The producer looks up strings that are already in
+// the dictionary without locking; insertions, clear(), and
+// get_inverse_map() take a mutex.  Because the strings are held in
+// the nodes of an unordered_map, or in a deque, the pointers in the
+// inverse map remain valid until clear() is called.
+//
+// A string whose hash has already been computed, such as the digest
+// of a fingerprint, can be looked up by that hash, so that it is not
+// hashed again; its entry is then found in hashed, and its string is
+// compared to that in the entry, in case of a collision, in which
+// case it falls back to the string dictionary.
+//
+// Each entry also holds the std::hash of its string, which is the
+// same in the dictionaries of every producer, so that identical
+// strings can be recognized across producers and epochs without
+// comparing them.
+//
+class producer_dict {
+    std::unordered_map<std::string, uint32_t> d;
+    std::unordered_map<uint64_t, uint32_t> hashed;
+    std::deque<std::string> hashed_strings;
+    std::vector<const std::string *> inverse;
+    std::vector<uint64_t> string_hashes;
+    mutable std::mutex m;
+
+public:
+
+    producer_dict() : d{}, hashed{}, hashed_strings{}, inverse{}, string_hashes{}, m{} { }
+
+    // get(value) returns the index of value, adding it to the
+    // dictionary if needed; it MUST only be called from the producer
+    // thread
+    //
+    uint32_t get(const std::string &value) {
+        auto x = d.find(value);
+        if (x != d.end()) {
+            return x->second;
+        }
+        std::lock_guard lock{m};
+        auto entry = d.emplace(value, inverse.size()).first;
+        inverse.push_back(&entry->first);
+        string_hashes.push_back(std::hash<std::string>{}(value));
+        return entry->second;
+    }
+
+    // get(value, hash) returns the index of value, whose hash is hash,
+    // adding it to the dictionary if needed; it MUST only be called
+    // from the producer thread
+    //
+    uint32_t get(std::string_view value, uint64_t hash) {
+        auto x = hashed.find(hash);
+        if (x != hashed.end()) {
+            if (*inverse[x->second] == value) {
+                return x->second;
+            }
+            return get(std::string{value});  // hash collision
+        }
+        std::lock_guard lock{m};
+        hashed_strings.emplace_back(value);
+        uint32_t index = inverse.size();
+        inverse.push_back(&hashed_strings.back());
+        string_hashes.push_back(std::hash<std::string_view>{}(value));
+        hashed.emplace(hash, index);
+        return index;
+    }
+
+    // string_hash(index) returns the std::hash of the string with
+    // index index, or zero if there is no such string; it MUST only
+    // be called from the producer thread
+    //
+    uint64_t string_hash(uint32_t index) const {
+        if (index < string_hashes.size()) {
+            return string_hashes[index];
+        }
+        return 0;
+    }
+
+    // clear() removes all entries; it MUST only be called from the
+    // producer thread, and only when no reader holds an inverse map
+    //
+    void clear() {
+        std::lock_guard lock{m};
+        d.clear();
+        hashed.clear();
+        hashed_strings.clear();
+        inverse.clear();
+        string_hashes.clear();
+    }
+
+    // get_inverse_map() returns a vector that maps each index to a
+    // pointer to its string
+    //
+    std::vector<const std::string *> get_inverse_map() const {
+        std::lock_guard lock{m};
+        return inverse;
+    }
+
+    size_t size() const {
+        std::lock_guard lock{m};
+        return inverse.size();
+    }
+};
+
 struct dictionary {
     std::unordered_map<std::basic_string<uint8_t>, uint32_t> dict;
     unsigned int count;
@@ -0,0 +1,356 @@
+/*
+ * feature_table.h
+ *
+ * compact, read-only hash tables used by the naive bayes classifier
+ * to map feature values to probability updates
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef FEATURE_TABLE_H
+#define FEATURE_TABLE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <array>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "resource_image.h"
+
+// feature_hash(x) returns a 64-bit hash of the feature value x; for
+// integers, the bits are mixed so that consecutive values (such as
+// port numbers or AS numbers) do not collide in the low-order bits
+//
+static inline uint64_t feature_hash(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// the string hash is defined here, rather than by std::hash, so that
+// the tables written to a resource image do not depend on the
+// standard library that wrote them
+//
+static inline uint64_t feature_hash(std::string_view s) {
+    uint64_t h = s.length();
+    size_t i = 0;
+    for ( ; i + sizeof(uint64_t) <= s.length(); i += sizeof(uint64_t)) {
+        uint64_t x;
+        memcpy(&x, s.data() + i, sizeof(x));
+        h = (h ^ x) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 32;
+    }
+    if (i < s.length()) {
+        uint64_t x = 0;
+        memcpy(&x, s.data() + i, s.length() - i);
+        h = (h ^ x) * 0x9e3779b97f4a7c15ULL;
+    }
+    return feature_hash(h);
+}
+
+template <size_t N>
+static inline uint64_t feature_hash(const std::array<uint8_t, N> &a) {
+    return feature_hash(std::string_view{(const char *)a.data(), N});
+}
+
+// class feature_table<K, V> maps feature values of type K (an
+// unsigned integer type, a byte array such as an IPv6 address, or
+// std::string) to lists of elements of type V.  It is built once
+// from a std::unordered_map<K, std::vector<V>>, and is then only
+// read, so it is laid out for lookups:
+//
+//    - the table is a power-of-two array of slots, at most half
+//      full, that is searched with linear probing; each slot holds
+//      the hash of its key, so that a miss rarely compares keys;
+//
+//    - the values for all of the keys are held in a single array,
+//      and each slot holds the range of that array that belongs to
+//      its key;
+//
+//    - string keys are held in a single character array, and each
+//      slot holds the offset and length of its key in that array, so
+//      that a table can be looked up with a std::string_view (or a
+//      NULL-terminated string) without constructing a std::string,
+//      and can be copied without invalidating the slots.
+//
+// The values are writable through for_each_value(), so that they can
+// be rescaled after construction.  Since the slots, values, and keys
+// are flat arrays, a table can be written to a resource image, and
+// read back from one without rebuilding it.
+//
+template <typename K, typename V>
+class feature_table {
+    static_assert(std::is_trivially_copyable_v<K> || std::is_same_v<K, std::string>,
+                  "feature_table keys must be unsigned integers, byte arrays, or strings");
+
+    static constexpr bool string_key = std::is_same_v<K, std::string>;
+
+    using lookup_type = std::conditional_t<string_key, std::string_view, K>;
+
+    using key_type = std::conditional_t<string_key, uint32_t, K>;
+
+    struct slot {
+        uint64_t hash;
+        key_type key;     // key, or offset of string key in keys
+        uint32_t length;  // length of string key
+        uint32_t begin;   // index of first value
+        uint32_t end;     // index past last value, or zero if slot is empty
+    };
+
+    image_array<slot> slots;
+    image_array<V> values;
+    image_array<char> keys;
+    size_t mask = 0;
+
+    bool key_matches(const slot &s, lookup_type k) const {
+        if constexpr (string_key) {
+            return s.length == k.length() && memcmp(keys.data() + s.key, k.data(), k.length()) == 0;
+        } else {
+            return s.key == k;
+        }
+    }
+
+    const slot *find_slot(lookup_type k) const {
+        return find_slot(k, feature_hash(k));
+    }
+
+    const slot *find_slot(lookup_type k, uint64_t h) const {
+        for (size_t i = h & mask; slots[i].end != 0; i = (i + 1) & mask) {
+            if (slots[i].hash == h && key_matches(slots[i], k)) {
+                return &slots[i];
+            }
+        }
+        return nullptr;
+    }
+
+    // class builder gathers the keys and values of a table, which is
+    // then laid out by the constructors below
+    //
+    class builder {
+        std::vector<slot> slots;
+        std::vector<V> values;
+        std::vector<char> keys;
+        size_t mask;
+
+        friend class feature_table;
+
+    public:
+
+        builder(size_t num_keys, size_t num_values, size_t key_length) {
+            size_t num_slots = 2;
+            while (num_slots < 2 * num_keys) {
+                num_slots <<= 1;
+            }
+            slots.assign(num_slots, slot{0, key_type{}, 0, 0, 0});
+            mask = num_slots - 1;
+            values.reserve(num_values);
+            keys.reserve(key_length);
+        }
+
+        template <typename I>
+        void add(const K &k, I first, I last) {
+            if (first == last) {
+                return;
+            }
+            slot s;
+            if constexpr (string_key) {
+                s.hash = feature_hash(std::string_view{k});
+                s.key = keys.size();
+                s.length = k.length();
+                keys.insert(keys.end(), k.begin(), k.end());
+            } else {
+                s.hash = feature_hash(k);
+                s.key = k;
+                s.length = 0;
+            }
+            s.begin = values.size();
+            values.insert(values.end(), first, last);
+            s.end = values.size();
+
+            size_t i = s.hash & mask;
+            while (slots[i].end != 0) {
+                i = (i + 1) & mask;
+            }
+            slots[i] = s;
+        }
+    };
+
+    explicit feature_table(builder &&b) :
+        slots{std::move(b.slots)},
+        values{std::move(b.values)},
+        keys{std::move(b.keys)},
+        mask{b.mask} { }
+
+public:
+
+    feature_table() : slots{std::vector<slot>(1, slot{0, key_type{}, 0, 0, 0})} { }
+
+    template <typename H>
+    explicit feature_table(const std::unordered_map<K, std::vector<V>, H> &map) :
+        feature_table{[&map]() {
+            size_t num_values = 0;
+            size_t key_length = 0;
+            for (const auto &x : map) {
+                num_values += x.second.size();
+                if constexpr (string_key) {
+                    key_length += x.first.length();
+                }
+            }
+            builder b{map.size(), num_values, key_length};
+            for (const auto &x : map) {
+                b.add(x.first, x.second.begin(), x.second.end());
+            }
+            return b;
+        }()} { }
+
+    // feature_table(set, v) constructs a table in which each key in
+    // set has the single value v, which can be used as a compact set
+    // through contains()
+    //
+    template <typename H>
+    feature_table(const std::unordered_set<K, H> &set, const V &v) :
+        feature_table{[&set, &v]() {
+            size_t key_length = 0;
+            if constexpr (string_key) {
+                for (const auto &k : set) {
+                    key_length += k.length();
+                }
+            }
+            builder b{set.size(), set.size(), key_length};
+            for (const auto &k : set) {
+                b.add(k, &v, &v + 1);
+            }
+            return b;
+        }()} { }
+
+    // feature_table(r) reads a table from a resource image
+    //
+    explicit feature_table(image_reader &r) :
+        slots{r},
+        values{r},
+        keys{r},
+        mask{slots.size() - 1}
+    {
+        // the slots are checked, so that a lookup stays within the
+        // values and keys arrays, and the probe loop in find_slot()
+        // reaches an empty slot; the values and keys themselves are
+        // not touched
+        //
+        if (slots.empty() || (slots.size() & mask) != 0) {
+            throw std::runtime_error("error: invalid table in resource image");
+        }
+        bool has_empty_slot = false;
+        for (const slot &s : slots) {
+            if (s.end == 0) {
+                has_empty_slot = true;
+                continue;
+            }
+            bool valid = s.begin < s.end && s.end <= values.size();
+            if constexpr (string_key) {
+                valid = valid && s.key <= keys.size() && s.length <= keys.size() - s.key;
+            }
+            if (!valid) {
+                throw std::runtime_error("error: invalid table in resource image");
+            }
+        }
+        if (!has_empty_slot) {
+            throw std::runtime_error("error: invalid table in resource image");
+        }
+    }
+
+    void write(image_writer &w) const {
+        slots.write(w);
+        values.write(w);
+        keys.write(w);
+    }
+
+    // for_each_match(k, f) applies the function f to each value for
+    // the key k, in the order in which they appeared in the vector
+    // from which the table was built; it does nothing if k is not in
+    // the table
+    //
+    template <typename F>
+    void for_each_match(lookup_type k, F f) const {
+        if (const slot *s = find_slot(k)) {
+            for (uint32_t j = s->begin; j < s->end; j++) {
+                f(values[j]);
+            }
+        }
+    }
+
+    // find(k) returns a pointer to the first value for the key k, or
+    // nullptr if k is not in the table
+    //
+    const V *find(lookup_type k) const {
+        if (const slot *s = find_slot(k)) {
+            return &values[s->begin];
+        }
+        return nullptr;
+    }
+
+    // find(k, h) is the same as find(k), for a key k whose
+    // feature_hash() h has already been computed, as for the digest
+    // of a fingerprint
+    //
+    const V *find(lookup_type k, uint64_t h) const {
+        if (const slot *s = find_slot(k, h)) {
+            return &values[s->begin];
+        }
+        return nullptr;
+    }
+
+    // contains(k) returns true if the key k is in the table, and
+    // false otherwise
+    //
+    bool contains(lookup_type k) const {
+        return find_slot(k) != nullptr;
+    }
+
+    bool contains(lookup_type k, uint64_t h) const {
+        return find_slot(k, h) != nullptr;
+    }
+
+    // for_each_key(f) applies the function f to each key in the
+    // table, as a lookup_type
+    //
+    template <typename F>
+    void for_each_key(F f) const {
+        for (const auto &s : slots) {
+            if (s.end != 0) {
+                if constexpr (string_key) {
+                    f(std::string_view{keys.data() + s.key, s.length});
+                } else {
+                    f(s.key);
+                }
+            }
+        }
+    }
+
+    // for_each_value(f) applies the function f to a reference to each
+    // value in the table
+    //
+    template <typename F>
+    void for_each_value(F f) {
+        for (auto &v : values) {
+            f(v);
+        }
+    }
+
+    size_t size() const {
+        size_t count = 0;
+        for (const auto &s : slots) {
+            count += (s.end != 0);
+        }
+        return count;
+    }
+};
+
+#endif // FEATURE_TABLE_H
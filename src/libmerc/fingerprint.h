@@ -6,30 +6,67 @@
 
 #include <cctype>
 #include <cassert>
+#include <string.h>
+#include <string_view>
 #include <vector>
 #include "json_object.h"
-
+#include "feature_table.h"
+
+// class fingerprint holds the canonical (textual) form of a
+// fingerprint, along with its length and a 64-bit digest of it, which
+// are computed once, when the fingerprint is completed.  The digest
+// is feature_hash() of the string, which is the hash used by the
+// tables that hold fingerprints (such as the fingerprint database of
+// the classifier), so a fingerprint can be looked up in those tables
+// with digest() instead of hashing its string again.  Like the
+// tables in a resource image, the digest is the same on all machines
+// with the same byte order.
+//
 class fingerprint {
     enum fingerprint_type type;
     static const size_t MAX_FP_STR_LEN = 4096;
     char fp_str[MAX_FP_STR_LEN];
     struct buffer_stream fp_buf;
+    size_t fp_length;
+    size_t fp_prefix_length;
+    uint64_t fp_digest;
 
 public:
 
     fingerprint() : type{fingerprint_type_unknown},
-                    fp_buf{fp_str, MAX_FP_STR_LEN} {}
+                    fp_buf{fp_str, MAX_FP_STR_LEN},
+                    fp_length{0},
+                    fp_prefix_length{0},
+                    fp_digest{0} { fp_str[0] = '\0'; }
 
     void init() {
         type = fingerprint_type_unknown;
         fp_str[0] = '\0';
         fp_buf = buffer_stream{fp_str, MAX_FP_STR_LEN};
+        fp_length = 0;
+        fp_prefix_length = 0;
+        fp_digest = 0;
     }
 
     const char *string() const {
         return fp_str;
     }
 
+    // the following functions may only be called after final()
+
+    std::string_view string_view() const {
+        return { fp_str, fp_length };
+    }
+
+    uint64_t digest() const { return fp_digest; }
+
+    // prefix() returns the part of the fingerprint that identifies
+    // its type and format, such as "tls/1/"
+    //
+    std::string_view prefix() const {
+        return { fp_str, fp_prefix_length };
+    }
+
     // to create a fingerprint, call these member functions in this
     // order:
     //
@@ -46,6 +83,7 @@ public:
             fp_buf.write_uint8(format_version);
             fp_buf.write_char('/');
         }
+        fp_prefix_length = fp_buf.length();
     }
 
     template <typename T>
@@ -125,6 +163,8 @@ public:
 
     void final() {
         fp_buf.write_char('\0'); // null-terminate
+        fp_length = fp_buf.trunc ? strnlen(fp_str, MAX_FP_STR_LEN) : fp_buf.length() - 1;
+        fp_digest = feature_hash(string_view());
         assert(fingerprint_is_well_formed());
     }
 
@@ -0,0 +1,456 @@
+/*
+ * flow_map.h
+ *
+ * an open-addressing hash table for per-flow state, in which entries
+ * are expired through a hierarchical timer wheel
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef FLOW_MAP_H
+#define FLOW_MAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <array>
+#include <functional>
+#include <vector>
+
+// class flow_map<K, V, H> maps keys of type K (such as struct key) to
+// values of type V.  It is designed for tables with many short-lived
+// entries that are looked up once or twice per packet:
+//
+//    - the table is an array of cache-line sized buckets, each of
+//      which holds an 8-bit tag and an entry index for up to
+//      slots_per_bucket entries, so that a lookup usually touches one
+//      bucket and one entry;
+//
+//    - collisions are resolved by probing the following buckets;
+//      each bucket counts the entries that have probed past it, so
+//      that no tombstones are needed, and a lookup can stop at the
+//      first bucket that has not overflowed;
+//
+//    - entries (key, precomputed hash, and value) are held in a
+//      separate array and recycled through a free list, so that
+//      inserting an entry does not allocate memory, once the table
+//      has grown to its working size;
+//
+//    - each entry has a deadline (in seconds), and is erased when
+//      advance() moves the current time past that deadline; the
+//      deadlines are held in a hierarchical timer wheel, so that the
+//      cost of expiring an entry is constant;
+//
+//    - the number of entries is limited to the capacity passed to
+//      the constructor; when the table is full, inserting a new
+//      entry evicts the entry with the earliest deadline.
+//
+// Entries are identified by handles, which remain valid until the
+// entry is erased.  The value of an erased entry is reset to V{}, so
+// that any resources that it holds are released.
+//
+template <typename K, typename V, typename H = std::hash<K>>
+class flow_map {
+public:
+
+    using handle = uint32_t;
+    static constexpr handle nil = UINT32_MAX;
+
+private:
+
+    struct entry {
+        K key;
+        uint64_t hash;
+        uint32_t deadline;
+        handle next;         // timer wheel list, or free list
+        handle prev;         // timer wheel list
+        uint16_t slot;       // timer wheel slot
+        bool in_use;
+        V value;
+    };
+
+    static constexpr size_t slots_per_bucket = 12;
+
+    struct alignas(64) bucket {
+        uint8_t tag[slots_per_bucket];     // zero if slot is empty
+        uint16_t overflow;                 // entries that probed past this bucket
+        handle index[slots_per_bucket];
+    };
+    static_assert(sizeof(bucket) == 64, "flow_map bucket is not a cache line");
+
+    // each level of the timer wheel has wheel_size slots; a slot in
+    // level l covers wheel_size^l seconds
+    //
+    static constexpr unsigned int wheel_bits = 6;
+    static constexpr uint32_t wheel_size = 1 << wheel_bits;
+    static constexpr uint32_t wheel_mask = wheel_size - 1;
+    static constexpr unsigned int wheel_levels = 4;
+    static constexpr uint32_t wheel_span = 1 << (wheel_bits * wheel_levels);
+
+    std::vector<bucket> buckets;
+    size_t bucket_mask;
+    std::vector<entry> entries;
+    handle free_list;
+    size_t num_entries;
+    size_t max_entries;
+
+    std::array<handle, wheel_size * wheel_levels> wheel;
+    uint32_t now;
+    bool started;
+
+    uint64_t insertion_count;
+    uint64_t expiration_count;
+    uint64_t eviction_count;
+
+    static uint64_t mix(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static uint8_t tag_of(uint64_t h) { return (h >> 56) | 0x80; }
+
+    // the table is grown when it is more than 7/8 full
+    //
+    size_t max_load() const { return (buckets.size() * slots_per_bucket * 7) / 8; }
+
+    static size_t num_buckets_for(size_t n) {
+        size_t b = 16;
+        while (b * slots_per_bucket * 7 / 8 < n) {
+            b *= 2;
+        }
+        return b;
+    }
+
+    void place(handle i, uint64_t h) {
+        const uint8_t tag = tag_of(h);
+        size_t b = h & bucket_mask;
+        while (true) {
+            bucket &bkt = buckets[b];
+            for (size_t s = 0; s < slots_per_bucket; s++) {
+                if (bkt.tag[s] == 0) {
+                    bkt.tag[s] = tag;
+                    bkt.index[s] = i;
+                    return;
+                }
+            }
+            bkt.overflow++;
+            b = (b + 1) & bucket_mask;
+        }
+    }
+
+    void unplace(handle i, uint64_t h) {
+        size_t b = h & bucket_mask;
+        while (true) {
+            bucket &bkt = buckets[b];
+            for (size_t s = 0; s < slots_per_bucket; s++) {
+                if (bkt.tag[s] != 0 && bkt.index[s] == i) {
+                    bkt.tag[s] = 0;
+                    return;
+                }
+            }
+            bkt.overflow--;
+            b = (b + 1) & bucket_mask;
+        }
+    }
+
+    void rehash(size_t num_buckets) {
+        buckets.assign(num_buckets, bucket{});
+        bucket_mask = num_buckets - 1;
+        for (handle i = 0; i < entries.size(); i++) {
+            if (entries[i].in_use) {
+                place(i, entries[i].hash);
+            }
+        }
+    }
+
+    handle allocate_entry() {
+        if (free_list != nil) {
+            handle i = free_list;
+            free_list = entries[i].next;
+            return i;
+        }
+        entries.emplace_back();
+        return entries.size() - 1;
+    }
+
+    // timer wheel functions
+    //
+    void link(handle i, uint32_t slot) {
+        entry &e = entries[i];
+        e.slot = slot;
+        e.prev = nil;
+        e.next = wheel[slot];
+        if (e.next != nil) {
+            entries[e.next].prev = i;
+        }
+        wheel[slot] = i;
+    }
+
+    void unlink(handle i) {
+        entry &e = entries[i];
+        if (e.prev != nil) {
+            entries[e.prev].next = e.next;
+        } else {
+            wheel[e.slot] = e.next;
+        }
+        if (e.next != nil) {
+            entries[e.next].prev = e.prev;
+        }
+    }
+
+    static bool is_due(uint32_t deadline, uint32_t t) { return (int32_t)(deadline - t) <= 0; }
+
+    // schedule(i) puts entry i into the lowest level of the wheel
+    // whose span covers its deadline; an entry that is already due
+    // is put into the slot for the next tick
+    //
+    void schedule(handle i) {
+        uint32_t when = entries[i].deadline;
+        if (is_due(when, now)) {
+            when = now + 1;
+        }
+        uint32_t delta = when - now;
+        unsigned int level = 0;
+        while (level < wheel_levels - 1 && delta >= (1u << (wheel_bits * (level + 1)))) {
+            level++;
+        }
+        link(i, level * wheel_size + ((when >> (wheel_bits * level)) & wheel_mask));
+    }
+
+    // process_slot() expires each entry in a slot whose deadline has
+    // passed, and reschedules the others into a lower level
+    //
+    template <typename F>
+    void process_slot(uint32_t slot, F &on_expire) {
+        handle i = wheel[slot];
+        wheel[slot] = nil;
+        while (i != nil) {
+            handle next = entries[i].next;
+            if (is_due(entries[i].deadline, now)) {
+                on_expire(entries[i].key, entries[i].value);
+                remove(i);
+                ++expiration_count;
+            } else {
+                schedule(i);
+            }
+            i = next;
+        }
+    }
+
+    // remove(i) erases entry i from the table, but not from the
+    // timer wheel
+    //
+    void remove(handle i) {
+        entry &e = entries[i];
+        unplace(i, e.hash);
+        e.value = V{};
+        e.in_use = false;
+        e.next = free_list;
+        free_list = i;
+        --num_entries;
+    }
+
+    // soonest() returns the entry in the wheel with the earliest
+    // deadline, or an entry close to it
+    //
+    handle soonest() const {
+        for (unsigned int level = 0; level < wheel_levels; level++) {
+            uint32_t current = (now >> (wheel_bits * level)) & wheel_mask;
+            for (uint32_t j = 1; j <= wheel_size; j++) {
+                handle i = wheel[level * wheel_size + ((current + j) & wheel_mask)];
+                if (i != nil) {
+                    return i;
+                }
+            }
+        }
+        return nil;
+    }
+
+public:
+
+    // construct a flow_map that holds at most capacity entries, with
+    // room for initial_size entries before it needs to be grown
+    //
+    explicit flow_map(size_t capacity, size_t initial_size=0) :
+        buckets{},
+        bucket_mask{0},
+        entries{},
+        free_list{nil},
+        num_entries{0},
+        max_entries{capacity ? capacity : 1},
+        now{0},
+        started{false},
+        insertion_count{0},
+        expiration_count{0},
+        eviction_count{0}
+    {
+        wheel.fill(nil);
+        if (initial_size > max_entries) {
+            initial_size = max_entries;
+        }
+        rehash(num_buckets_for(initial_size));
+        entries.reserve(initial_size);
+    }
+
+    flow_map(const flow_map &) = delete;
+    flow_map &operator=(const flow_map &) = delete;
+
+    handle find(const K &k) const {
+        const uint64_t h = mix(H{}(k));
+        const uint8_t tag = tag_of(h);
+        size_t b = h & bucket_mask;
+        for (size_t probes = 0; probes <= bucket_mask; probes++) {
+            const bucket &bkt = buckets[b];
+            for (size_t s = 0; s < slots_per_bucket; s++) {
+                if (bkt.tag[s] == tag) {
+                    const entry &e = entries[bkt.index[s]];
+                    if (e.hash == h && e.key == k) {
+                        return bkt.index[s];
+                    }
+                }
+            }
+            if (bkt.overflow == 0) {
+                break;
+            }
+            b = (b + 1) & bucket_mask;
+        }
+        return nil;
+    }
+
+    // emplace(k, deadline, args...) inserts an entry for k, which
+    // MUST NOT already be in the table, with the value V(args...),
+    // and returns its handle
+    //
+    template <typename... Args>
+    handle emplace(const K &k, uint32_t deadline, Args&&... args) {
+        if (num_entries >= max_entries) {
+            handle victim = soonest();
+            if (victim != nil) {
+                erase(victim);
+                ++eviction_count;
+            }
+        }
+        if (num_entries + 1 > max_load()) {
+            rehash(buckets.size() * 2);
+        }
+        handle i = allocate_entry();
+        entry &e = entries[i];
+        e.key = k;
+        e.hash = mix(H{}(k));
+        e.deadline = deadline;
+        e.in_use = true;
+        e.value = V(std::forward<Args>(args)...);
+        place(i, e.hash);
+        schedule(i);
+        ++num_entries;
+        ++insertion_count;
+        return i;
+    }
+
+    void erase(handle i) {
+        unlink(i);
+        remove(i);
+    }
+
+    V &value(handle i) { return entries[i].value; }
+
+    const V &value(handle i) const { return entries[i].value; }
+
+    const K &key(handle i) const { return entries[i].key; }
+
+    uint32_t deadline(handle i) const { return entries[i].deadline; }
+
+    void set_deadline(handle i, uint32_t deadline) {
+        if (entries[i].deadline != deadline) {
+            unlink(i);
+            entries[i].deadline = deadline;
+            schedule(i);
+        }
+    }
+
+    // advance(t, on_expire) sets the current time to t, and erases
+    // all of the entries whose deadlines are at or before t, after
+    // calling on_expire(key, value) for each of them.  Time does not
+    // run backwards; an earlier t is ignored.
+    //
+    template <typename F>
+    void advance(uint32_t t, F on_expire) {
+        if (!started) {
+            now = t;
+            started = true;
+            return;
+        }
+        if (is_due(t, now)) {
+            return;
+        }
+        if (t - now >= wheel_span || t - now > num_entries + wheel.size()) {
+            // it is cheaper to visit every entry than every tick, so
+            // move every entry into a single list, then expire or
+            // reschedule each of them
+            //
+            handle all = nil;
+            for (handle &head : wheel) {
+                while (head != nil) {
+                    handle i = head;
+                    head = entries[i].next;
+                    entries[i].next = all;
+                    all = i;
+                }
+            }
+            now = t;
+            for (handle i = all; i != nil; ) {
+                handle next = entries[i].next;
+                if (is_due(entries[i].deadline, now)) {
+                    on_expire(entries[i].key, entries[i].value);
+                    remove(i);
+                    ++expiration_count;
+                } else {
+                    schedule(i);
+                }
+                i = next;
+            }
+            return;
+        }
+        while (now != t) {
+            ++now;
+            for (unsigned int level = wheel_levels - 1; level > 0; level--) {
+                if ((now & ((1u << (wheel_bits * level)) - 1)) == 0) {
+                    process_slot(level * wheel_size + ((now >> (wheel_bits * level)) & wheel_mask), on_expire);
+                }
+            }
+            process_slot(now & wheel_mask, on_expire);
+        }
+    }
+
+    void advance(uint32_t t) {
+        advance(t, [](const K &, V &) { });
+    }
+
+    void clear() {
+        for (handle i = 0; i < entries.size(); i++) {
+            if (entries[i].in_use) {
+                remove(i);
+            }
+        }
+        wheel.fill(nil);
+    }
+
+    size_t size() const { return num_entries; }
+
+    size_t capacity() const { return max_entries; }
+
+    // occupancy and eviction counters: the number of entries that
+    // have been inserted, that have been erased because their
+    // deadlines passed, and that have been evicted to make room for
+    // new entries
+    //
+    uint64_t insertions() const { return insertion_count; }
+
+    uint64_t expirations() const { return expiration_count; }
+
+    uint64_t evictions() const { return eviction_count; }
+};
+
+#endif // FLOW_MAP_H
@@ -6,6 +6,7 @@
 #include <map>  
 #include <string>
 #include <algorithm>
+#include <cstdlib>
 
 // the preprocessor directive STATIC_CFG_SELECT can be used as a
 // compile-time option to select the default protocols that mercury
@@ -40,6 +41,14 @@ public:
     std::string temp_proto_str;
     bool tcp_reassembly = false;          /* reassemble tcp segments      */
     size_t tls_fingerprint_format = 0;    // default fingerprint format
+    size_t stats_queue_depth = 256;       /* events per stats message_queue */
+    size_t stats_dump_threads = 1;        /* threads used to format stats   */
+    size_t flow_table_capacity = 0;       /* max flows per table (0=default)*/
+    size_t reassembly_buffer_size = 8192; /* max bytes reassembled per flow */
+    size_t reassembly_max_segments = 20;  /* max segments per flow          */
+    size_t reassembly_max_flows = 10000;  /* max flows in reassembly        */
+    size_t quic_reassembly_max_flows = 1024; /* max QUIC connections in reassembly */
+    size_t analysis_cache_size = 4096;    /* max cached analysis results    */
 
     void set_tls_fingerprint_format(size_t format) { tls_fingerprint_format = format; }
 
@@ -136,6 +145,65 @@ public:
         return true;
     }
 
+    // set_size_option() sets value to the positive integer in the
+    // string s, if it is no greater than max_value; otherwise, it
+    // reports an error and leaves value unchanged
+    //
+    static bool set_size_option(const std::string &s, const char *name, size_t max_value, size_t &value) {
+        char *end = nullptr;
+        unsigned long x = strtoul(s.c_str(), &end, 10);
+        if (s.empty() || *end != '\0' || x == 0 || x > max_value) {
+            printf_err(log_warning, "invalid %s: %s; using default instead\n", name, s.c_str());
+            return false;
+        }
+        value = x;
+        return true;
+    }
+
+    bool set_stats_queue_depth(const std::string &s) {
+        return set_size_option(s, "stats-queue-depth", 1 << 20, stats_queue_depth);
+    }
+
+    bool set_stats_dump_threads(const std::string &s) {
+        return set_size_option(s, "stats-dump-threads", 64, stats_dump_threads);
+    }
+
+    bool set_flow_table_capacity(const std::string &s) {
+        return set_size_option(s, "flow-table-capacity", UINT32_MAX - 1, flow_table_capacity);
+    }
+
+    bool set_reassembly_buffer_size(const std::string &s) {
+        return set_size_option(s, "tcp-reassembly-buffer-size", 1 << 24, reassembly_buffer_size);
+    }
+
+    bool set_reassembly_max_segments(const std::string &s) {
+        return set_size_option(s, "tcp-reassembly-max-segments", 1 << 16, reassembly_max_segments);
+    }
+
+    bool set_reassembly_max_flows(const std::string &s) {
+        return set_size_option(s, "tcp-reassembly-max-flows", UINT32_MAX - 1, reassembly_max_flows);
+    }
+
+    // a quic-reassembly-max-flows of zero turns QUIC reassembly off
+    //
+    bool set_quic_reassembly_max_flows(const std::string &s) {
+        if (s == "0") {
+            quic_reassembly_max_flows = 0;
+            return true;
+        }
+        return set_size_option(s, "quic-reassembly-max-flows", UINT32_MAX - 1, quic_reassembly_max_flows);
+    }
+
+    // an analysis-cache-size of zero turns the analysis cache off
+    //
+    bool set_analysis_cache_size(const std::string &s) {
+        if (s == "0") {
+            analysis_cache_size = 0;
+            return true;
+        }
+        return set_size_option(s, "analysis-cache-size", 1 << 24, analysis_cache_size);
+    }
+
     bool set_fingerprint_format(const std::string &s) {
         if (s == "tls") {
             tls_fingerprint_format = 0;
@@ -155,7 +223,15 @@ static void setup_extended_fields(global_config* lc, const std::string& config)
         {"select", "-s", "--select", SETTER_FUNCTION(&lc){ lc->set_protocols(s); }},
         {"resources", "", "", SETTER_FUNCTION(&lc){ lc->set_resource_file(s); }},
         {"format", "", "", SETTER_FUNCTION(&lc){ lc->set_fingerprint_format(s); }},
-        {"tcp-reassembly", "", "", SETTER_FUNCTION(&lc){ lc->tcp_reassembly = true; }}
+        {"tcp-reassembly", "", "", SETTER_FUNCTION(&lc){ lc->tcp_reassembly = true; }},
+        {"stats-queue-depth", "", "", SETTER_FUNCTION(&lc){ lc->set_stats_queue_depth(s); }},
+        {"stats-dump-threads", "", "", SETTER_FUNCTION(&lc){ lc->set_stats_dump_threads(s); }},
+        {"flow-table-capacity", "", "", SETTER_FUNCTION(&lc){ lc->set_flow_table_capacity(s); }},
+        {"tcp-reassembly-buffer-size", "", "", SETTER_FUNCTION(&lc){ lc->set_reassembly_buffer_size(s); }},
+        {"tcp-reassembly-max-segments", "", "", SETTER_FUNCTION(&lc){ lc->set_reassembly_max_segments(s); }},
+        {"tcp-reassembly-max-flows", "", "", SETTER_FUNCTION(&lc){ lc->set_reassembly_max_flows(s); }},
+        {"quic-reassembly-max-flows", "", "", SETTER_FUNCTION(&lc){ lc->set_quic_reassembly_max_flows(s); }},
+        {"analysis-cache-size", "", "", SETTER_FUNCTION(&lc){ lc->set_analysis_cache_size(s); }}
     };
 
     parse_additional_options(options, config, *lc);
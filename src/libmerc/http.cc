@@ -493,5 +493,5 @@ bool http_request::do_analysis(const struct key &k_, struct analysis_context &an
 
     analysis_.destination.init(host_data, user_agent_data, {nullptr, nullptr}, k_);
 
-    return c_->analyze_fingerprint_and_destination_context(analysis_.fp, analysis_.destination, analysis_.result);
+    return c_->analyze_fingerprint_and_destination_context(analysis_.fp, analysis_.destination, analysis_.result, analysis_.cache);
 }
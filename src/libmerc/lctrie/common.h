@@ -57,7 +57,8 @@ T REMOVE(unsigned int p, T str) {
 // address addr into the buffer at dst, if that buffer is large
 // enough; size indicates the number of available bytes in that buffer
 //
-//    af should be LCTRIE_AF_INET or LCTRIE_AF_INET6
+//    af should be LCTRIE_AF_INET or LCTRIE_AF_INET6; IPv6 addresses
+//    are written without zero compression
 //
 // return: null on failure; dst on success
 //
@@ -66,13 +67,24 @@ T REMOVE(unsigned int p, T str) {
                         char *dst,
                         size_t size) {
 
+    uint8_t *a = (uint8_t *)addr;
+    if (af == LCTRIE_AF_INET6) {
+        if (size < LCTRIE_INET6_ADDRSTRLEN) {
+            return nullptr; // error; we need at least INET6_ADDRSTRLEN=46 bytes
+        }
+        if (snprintf(dst, size, "%x:%x:%x:%x:%x:%x:%x:%x",
+                     a[0] << 8 | a[1], a[2] << 8 | a[3], a[4] << 8 | a[5], a[6] << 8 | a[7],
+                     a[8] << 8 | a[9], a[10] << 8 | a[11], a[12] << 8 | a[13], a[14] << 8 | a[15]) > 0) {
+            return dst;
+        }
+        return nullptr;
+    }
     if (af != LCTRIE_AF_INET) {
-        return nullptr; // we only support IPv4 for now
+        return nullptr; // unsupported address family
     }
     if (size < 16) {
         return nullptr; // error; we need at least INET_ADDRSTRLEN=16 bytes
     }
-    uint8_t *a = (uint8_t *)addr;
     if (snprintf(dst, size, "%u.%u.%u.%u", a[0], a[1], a[2], a[3]) > 0) {
         return dst;
     }
@@ -97,5 +109,11 @@ inline __uint128_t ntoh(__uint128_t addr) {
     return output;
 }
 
+// __uint128_t hton() is suitable for IPv6 addresses
+//
+inline __uint128_t hton(__uint128_t addr) {
+    return ntoh(addr);
+}
+
 
 #endif // COMMON_H
@@ -91,12 +91,10 @@ uint8_t compute_skip(lct<T> *trie, uint32_t prefix, uint32_t first,
   T low, high;
   uint32_t i;
 
-  // there is no skip factor on the root node
-  if ((prefix == 0) && (first == 0)) {
-    return 0;
-  }
-
-  // Compute the new prefix
+  // Compute the new prefix; on the root node, this skips the bits
+  // shared by all of the subnets, such as the leading 001 of the
+  // global unicast IPv6 addresses (for IPv4, the special subnets
+  // span the whole address space, so there is nothing to skip)
   low = REMOVE(prefix, trie->nets[trie->bases[first]].addr);
   high = REMOVE(prefix, trie->nets[trie->bases[first + num - 1]].addr);
   i = prefix;
@@ -113,6 +111,7 @@ static
 uint8_t compute_branch(lct<T> *trie, uint32_t prefix, uint32_t first,
                        uint32_t num, uint32_t newprefix) {
   size_t i, pat, bits, count, patfound;
+  constexpr unsigned int bits_in_T = sizeof(T) * 8;
 
   // branch factor results in 1 << branch trie subnodes
 
@@ -134,7 +133,7 @@ uint8_t compute_branch(lct<T> *trie, uint32_t prefix, uint32_t first,
   do {
     bits++;
     if (num < ((FILLFACT * ((unsigned int)1<<bits)) / 100) ||
-        newprefix + bits > sizeof(uint32_t))
+        newprefix + bits > bits_in_T)
       break;
     i = first;
     pat = 0;
@@ -85,6 +85,7 @@ lct_subnet_set_from_string(lct_subnet<__uint128_t> *subnet, const char *subnet_s
   //
   // 2001::  32      6939_1101
   // 2001:250:208::  48      24349
+  // 2001:200::/32   2500
 
   int advance = 0;
 
@@ -151,10 +152,21 @@ lct_subnet_set_from_string(lct_subnet<__uint128_t> *subnet, const char *subnet_s
       //fprintf(stderr, "-----------------------------\n");
   }
   addr = ntoh(addr);
+
+  // the prefix length follows the address after a slash (as in
+  // pyasn.db) or whitespace
+  //
+  if (start[0] == '/') {
+      start++;
+  }
   num_items_parsed = sscanf(start, "\t%hhu%n", &mask_length, &advance);
   if (num_items_parsed != 1) {
       return -1;
   }
+  if ((mask_length == 0) || (mask_length > sizeof(__uint128_t) * 8)) {
+      fprintf(stderr, "ERROR: %u is not a valid prefix length\n", mask_length);
+      return -1;
+  }
   start += advance;
   num_items_parsed = sscanf(start, "\t%u", &asn);
   if (num_items_parsed != 1) {
@@ -106,10 +106,13 @@ using lct_subnet_t = lct_subnet<uint32_t>;
 using lct_subnet_v6_t = lct_subnet<__uint128_t>;
 
 
-typedef struct lct_ip_stats {
-  uint32_t size;  // size of the subnet
-  uint32_t used;  // size of the subprefixed address space
-} lct_ip_stats_t;
+template <typename T>
+struct lct_ip_stats {
+  T size;  // size of the subnet
+  T used;  // size of the subprefixed address space
+};
+
+using lct_ip_stats_t = lct_ip_stats<uint32_t>;
 
 
 template <typename T> struct address_family;
@@ -451,7 +454,7 @@ size_t subnet_dedup(lct_subnet<T> *subnets, size_t size) {
           // slide the rest of the array over the second value.  if we're at the
           // end of the array, just let it drop off.
           if ((j + 1) < size)
-              memmove(&subnets[j], &subnets[j + 1], (size - (j + 1)) * sizeof(lct_subnet_t));
+              memmove(&subnets[j], &subnets[j + 1], (size - (j + 1)) * sizeof(lct_subnet<T>));
           --size;
           ++ndup;
       }
@@ -481,8 +484,9 @@ int subnet_isprefix(lct_subnet<T> *s, lct_subnet<T> *t) {
 // and returns the number found
 //
 template <typename T>
-size_t subnet_prefix(lct_subnet<T> *p, lct_ip_stats_t *stats, size_t size) {
+size_t subnet_prefix(lct_subnet<T> *p, lct_ip_stats<T> *stats, size_t size) {
   size_t npre = 0;
+  constexpr unsigned int bits_in_T = sizeof(T) * 8;
 
   //int address_family = get_address_family<T>();
 
@@ -562,7 +566,7 @@ size_t subnet_prefix(lct_subnet<T> *p, lct_ip_stats_t *stats, size_t size) {
     else {
       p[i].type = IP_BASE;
     }
-    stats[i].size = 1 << (32 - p[i].len);
+    stats[i].size = p[i].len ? (T)1 << (bits_in_T - p[i].len) : ~(T)0;
     stats[i].used = 0;
   }
 
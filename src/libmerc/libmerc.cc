@@ -58,8 +58,8 @@ uint32_t mercury_get_version_number() {
 }
 
 const char *mercury_get_resource_version(struct mercury *mc) {
-    if (mc && mc->c) {
-        return mc->c->get_resource_version();
+    if (mc && mc->c.get_current()) {
+        return mc->c.get_current()->get_resource_version();
     }
     return nullptr;
 }
@@ -99,6 +99,20 @@ mercury_context mercury_init(const struct libmerc_config *vars, int verbosity) {
     return nullptr; // failure
 }
 
+bool mercury_reload_resources(mercury_context mc, const char *resource_file) {
+    if (mc == nullptr) {
+        return false;
+    }
+    try {
+        mc->reload_classifier(resource_file);
+        return true;
+    }
+    catch (std::exception &e) {
+        printf_err(log_err, "%s\n", e.what());
+    }
+    return false;
+}
+
 int mercury_finalize(mercury_context mc) {
     if (mc) {
         delete mc;
@@ -134,6 +148,7 @@ const struct analysis_context *mercury_packet_processor_ip_get_analysis_context(
     try {
         if (processor->analyze_ip_packet(packet, length, ts, processor->reassembler_ptr)) {
             if (processor->analysis.result.is_valid()) {
+                processor->analysis.destination.set_dst_ip_str();
                 return &processor->analysis;
             }
         }
@@ -149,6 +164,7 @@ const struct analysis_context *mercury_packet_processor_get_analysis_context(mer
     try {
         if (processor->analyze_eth_packet(packet, length, ts, processor->reassembler_ptr)) {
             if (processor->analysis.result.is_valid()) {
+                processor->analysis.destination.set_dst_ip_str();
                 return &processor->analysis;
             }
         }
@@ -165,6 +181,7 @@ const struct analysis_context *mercury_packet_processor_get_analysis_context_lin
     {
         if (processor->analyze_packet(packet, length, ts, processor->reassembler_ptr, linktype)) {
             if (processor->analysis.result.is_valid()) {
+                processor->analysis.destination.set_dst_ip_str();
                 return &processor->analysis;
             }
         }
@@ -207,6 +224,13 @@ const char *analysis_context_get_fingerprint_string(const struct analysis_contex
     return NULL;
 }
 
+uint64_t analysis_context_get_fingerprint_digest(const struct analysis_context *ac) {
+    if (ac) {
+        return ac->fp.digest();
+    }
+    return 0;
+}
+
 const char *analysis_context_get_server_name(const struct analysis_context *ac) {
     if (ac) {
         return ac->get_server_name();
@@ -453,3 +477,24 @@ size_t get_stats_aggregator_num_entries(mercury_context mc)
 
     return mc->aggregator->get_num_entries();
 }
+
+size_t get_stats_aggregator_num_dropped_events(mercury_context mc)
+{
+    if (mc == NULL || mc->aggregator == nullptr) {
+       return 0;
+    }
+
+    return mc->aggregator->get_num_dropped_events();
+}
+
+bool mercury_packet_processor_get_analysis_cache_stats(mercury_packet_processor processor,
+                                                       uint64_t *hits,
+                                                       uint64_t *misses)
+{
+    if (processor == NULL || hits == NULL || misses == NULL) {
+        return false;
+    }
+    *hits = processor->cache.hits();
+    *misses = processor->cache.misses();
+    return true;
+}
@@ -757,4 +757,98 @@ extern "C" LIBMERC_DLL_EXPORTED
 #endif
 const struct attribute_context *mercury_packet_processor_get_attributes(mercury_packet_processor processor);
 
+//
+// start of libmerc version 7 API
+//
+
+/**
+ * get_stats_aggregator_num_dropped_events() returns the number of
+ * events that were discarded, since mercury_init(), because the
+ * event queue of a packet processor was full when the event was
+ * observed.  Each packet processor has its own queue, whose depth
+ * can be set with the "stats-queue-depth" configuration option.
+ *
+ * @param mercury_context is the context associated
+ *
+ * @return number of dropped stats events.  Will return 0 if libmerc
+ * is not configured to report stats.
+ */
+#ifdef __cplusplus
+extern "C" LIBMERC_DLL_EXPORTED
+#endif
+size_t get_stats_aggregator_num_dropped_events(mercury_context mc);
+
+//
+// start of libmerc version 8 API
+//
+
+/**
+ * @brief reloads the resource file used for analysis
+ *
+ * Loads a new classifier from resource_file, or from the resource
+ * file in the configuration passed to mercury_init() if resource_file
+ * is NULL, and then publishes it to the packet processors associated
+ * with the context, without stopping them.  The resource file is
+ * loaded in the calling thread, which should not be a packet
+ * processing thread; each packet processor continues to use the old
+ * classifier until it analyzes its next packet, and the old
+ * classifier is freed, outside of the packet processing threads, once
+ * none of them can use it.  Fingerprint weights and the adaptive
+ * fingerprint prevalence cache carry over to the new classifier.  The
+ * encryption key and analysis thresholds in the configuration are
+ * used, and the new resource file must use the same TLS fingerprint
+ * format as the current one.
+ *
+ * @warning a string returned by mercury_get_resource_version() refers
+ * to the old classifier, and must not be used after a reload.
+ *
+ * @return true on success; false on failure, in which case the
+ * current classifier remains in use
+ */
+#ifdef __cplusplus
+extern "C" LIBMERC_DLL_EXPORTED
+#endif
+bool mercury_reload_resources(mercury_context mc, const char *resource_file);
+
+/**
+ * mercury_packet_processor_get_analysis_cache_stats() reports the
+ * number of analyses that were answered from the analysis cache of a
+ * packet processor (hits), and the number that had to be computed
+ * (misses), since the processor was constructed.  Each packet
+ * processor caches the results for labeled fingerprints, keyed on
+ * the fingerprint and destination; its capacity can be set with the
+ * "analysis-cache-size" configuration option.
+ *
+ * @param processor (input) is a packet processor context
+ *
+ * @param hits (output) is set to the number of cache hits
+ *
+ * @param misses (output) is set to the number of cache misses
+ *
+ * @return true if the counters were written, and false otherwise
+ */
+#ifdef __cplusplus
+extern "C" LIBMERC_DLL_EXPORTED
+#endif
+bool mercury_packet_processor_get_analysis_cache_stats(mercury_packet_processor processor,
+                                                       uint64_t *hits,
+                                                       uint64_t *misses);
+
+/**
+ * analysis_context_get_fingerprint_digest() returns a 64-bit digest
+ * of the fingerprint string associated with an analysis_context, which
+ * is computed along with that string.  Equal fingerprint strings have
+ * equal digests, on all machines with the same byte order, so the
+ * digest can be used as a compact identifier of a fingerprint, for
+ * instance as the key of a table, without hashing its string.
+ *
+ * @param ac (input) is an analysis_context pointer.
+ *
+ * @return the digest of the fingerprint, or zero if ac is NULL.
+ */
+#ifdef __cplusplus
+extern "C" LIBMERC_DLL_EXPORTED
+#endif
+uint64_t analysis_context_get_fingerprint_digest(const struct analysis_context *ac);
+
 #endif /* LIBMERC_H */
@@ -52,6 +52,13 @@ public:
 
     constexpr size_t length() const { return N; }
 
+    // mask_at(i) and value_at(i) return the ith byte of the mask and
+    // of the value, respectively
+    //
+    constexpr uint8_t mask_at(size_t i) const { return mask[i]; }
+
+    constexpr uint8_t value_at(size_t i) const { return value[i]; }
+
     static unsigned int u32_compare_masked_data_to_value(const void *data_in,
                                                          const void *mask_in,
                                                          const void *value_in) {
@@ -110,57 +110,66 @@ class event_string
 {
     const struct key &k;
     const struct analysis_context &analysis;
-    std::string dest_context;
-    event_msg event;
 
 public:
     event_string(const struct key &k, const struct analysis_context &analysis) :
         k{k}, analysis{analysis} {  }
 
-    event_msg construct_event_string() {
-        char src_ip_str[MAX_ADDR_STR_LEN];
-        k.sprint_src_addr(src_ip_str);
+    // write_event(event, producer) sets the fields of event, using
+    // the identifiers that producer assigns to the event strings
+    //
+    void write_event(event_record &event, event_producer &producer) const {
+        event.src.ip_vers = k.ip_vers;
+        if (k.ip_vers == 6) {
+            memcpy(event.src.addr, &k.addr.ipv6.src, sizeof(event.src.addr));
+        } else {
+            event.src.addr[0] = k.addr.ipv4.src;
+            event.src.addr[1] = event.src.addr[2] = event.src.addr[3] = 0;
+        }
+
+        char dst_ip_str[MAX_DST_ADDR_LEN];
+        flow_key_sprintf_dst_addr(k, dst_ip_str);
         char dst_port_str[MAX_PORT_STR_LEN];
         k.sprint_dst_port(dst_port_str);
 
-        dest_context.append("(");
-        dest_context.append(analysis.destination.sn_str).append(")(");
-        dest_context.append(analysis.destination.dst_ip_str).append(")(");
-        dest_context.append(dst_port_str).append(")");
-
-        event = std::make_tuple(src_ip_str, analysis.fp.string(), analysis.destination.ua_str, dest_context);
-        return event;
+        event.fp = producer.get_fingerprint_id(analysis.fp.string_view(), analysis.fp.digest());
+        event.ua = producer.get_user_agent_id(analysis.destination.ua_str);
+        event.dst = producer.get_destination_id(analysis.destination.sn_str,
+                                                dst_ip_str,
+                                                dst_port_str);
     }
 };
 
 struct do_observation {
     const struct key &k_;
     struct analysis_context &analysis_;
-    class message_queue *mq_;
+    event_producer *mq_;
 
     do_observation(const struct key &k,
                    struct analysis_context &analysis,
-                   class message_queue *mq) :
+                   event_producer *mq) :
         k_{k},
         analysis_{analysis},
         mq_{mq}
     {}
 
-    void operator()(tls_client_hello &) {
+    void push_event() {
         event_string ev_str{k_, analysis_};
-        mq_->push(ev_str.construct_event_string());
+        mq_->push_event([&ev_str](event_record &ev, event_producer &p) { ev_str.write_event(ev, p); });
+    }
+
+    void operator()(tls_client_hello &) {
+        push_event();
     }
 
     void operator()(quic_init &) {
         // create event and send it to the data/stats aggregator
-        event_string ev_str{k_, analysis_};
-        mq_->push(ev_str.construct_event_string());
+        push_event();
     }
 
     void operator()(http_request &) {
         // create event and send it to the data/stats aggregator
-        event_string ev_str{k_, analysis_};
-        mq_->push(ev_str.construct_event_string());
+        push_event();
         analysis_.reset_user_agent();
     }
 
@@ -286,13 +295,16 @@ void stateful_pkt_proc::set_tcp_protocol(protocol &x,
 // of std::monostate indicates that the protocol matcher did not
 // recognize, or could not parse, the packet.  The class
 // unknown_udp_initial_packet represents the UDP data field of an
-// unrecognized packet that is the first data packet in a flow.
+// unrecognized packet that is the first data packet in a flow.  If
+// ts is null, as it is for callers without packet timestamps, QUIC
+// client hellos are not reassembled.
 //
 void stateful_pkt_proc::set_udp_protocol(protocol &x,
                       struct datum &pkt,
                       enum udp_msg_type msg_type,
                       bool is_new,
-                      const struct key& k) {
+                      const struct key& k,
+                      struct timespec *ts) {
 
     // note: std::get<T>() throws exceptions; it might be better to
     // use get_if<T>(), which does not
@@ -321,7 +333,11 @@ void stateful_pkt_proc::set_udp_protocol(protocol &x,
         x.emplace<dhcp_discover>(pkt);
         break;
     case udp_msg_type_quic:
-        x.emplace<quic_init>(pkt, quic_crypto);
+        if (ts != nullptr) {
+            x.emplace<quic_init>(pkt, quic_crypto, quic_reassembler_ptr, ts->tv_sec);
+        } else {
+            x.emplace<quic_init>(pkt, quic_crypto);   // no timestamp, so no reassembly
+        }
         break;
     case udp_msg_type_dtls_client_hello:
         {
@@ -623,7 +639,7 @@ size_t stateful_pkt_proc::ip_write_json(void *buffer,
         if (global_vars.output_udp_initial_data && pkt.is_not_empty()) {
             is_new = ip_flow_table.flow_is_new(k, ts->tv_sec);
         }
-        set_udp_protocol(x, pkt, msg_type, is_new, k);
+        set_udp_protocol(x, pkt, msg_type, is_new, k, ts);
     }
 
     // process transport/application protocol
@@ -632,7 +648,7 @@ size_t stateful_pkt_proc::ip_write_json(void *buffer,
         std::visit(compute_fingerprint{analysis.fp, global_vars.tls_fingerprint_format}, x);
         bool output_analysis = false;
         if (global_vars.do_analysis && analysis.fp.get_type() != fingerprint_type_unknown) {
-            output_analysis = std::visit(do_analysis{k, analysis, c}, x);
+            output_analysis = std::visit(do_analysis{k, analysis, c.get()}, x);
 
             // note: we only perform observations when analysis is
             // configured, because we rely on do_analysis to set the
@@ -667,7 +683,7 @@ size_t stateful_pkt_proc::ip_write_json(void *buffer,
         else if (reassembler && reassembler->curr_reassembly_state != reassembly_status::reassembly_none) {
             reassembler->write_flags(record, "reassembly_properties");
             if (reassembler->curr_reassembly_consumed == true) {
-                reassembler->remove_segment(reassembler->reap_it);
+                reassembler->remove_segment(reassembler->curr_seg);
                 reassembler->curr_reassembly_consumed = false;
             }
         }
@@ -799,6 +815,7 @@ bool stateful_pkt_proc::analyze_ip_packet(const uint8_t *packet,
     struct key k;
     ip ip_pkt{pkt, k};
     protocol x;
+    analysis.flow_state_pkts_needed = false;
     uint8_t transport_proto = ip_pkt.transport_protocol();
     if (transport_proto == ip::protocol::tcp) {
         tcp_packet tcp_pkt{pkt, &ip_pkt};
@@ -844,7 +861,10 @@ bool stateful_pkt_proc::analyze_ip_packet(const uint8_t *packet,
         */
         }
 
-        set_udp_protocol(x, pkt, msg_type, false, k);
+        set_udp_protocol(x, pkt, msg_type, false, k, ts);
+        if (const quic_init *quic = std::get_if<quic_init>(&x)) {
+            analysis.flow_state_pkts_needed = quic->reassembly_pending();
+        }
     }
 
     // process protocol data element
@@ -856,7 +876,7 @@ bool stateful_pkt_proc::analyze_ip_packet(const uint8_t *packet,
             // re-initialize the structure that holds analysis results
             //
             analysis.result.reinit();
-            bool output_analysis = std::visit(do_analysis{k, analysis, c}, x);
+            bool output_analysis = std::visit(do_analysis{k, analysis, c.get()}, x);
 
             // note: we only perform observations when analysis is
             // configured, because we rely on do_analysis to set the
@@ -868,7 +888,7 @@ bool stateful_pkt_proc::analyze_ip_packet(const uint8_t *packet,
 
             if (reassembler) {
                 if (reassembler->curr_reassembly_consumed == true) {
-                    reassembler->remove_segment(reassembler->reap_it);
+                    reassembler->remove_segment(reassembler->curr_seg);
                     reassembler->curr_reassembly_consumed = false;
                     analysis.flow_state_pkts_needed = false;
                 }
@@ -880,7 +900,7 @@ bool stateful_pkt_proc::analyze_ip_packet(const uint8_t *packet,
 
     if (reassembler) {
         if (reassembler->curr_reassembly_consumed == true) {
-            reassembler->remove_segment(reassembler->reap_it);
+            reassembler->remove_segment(reassembler->curr_seg);
             reassembler->curr_reassembly_consumed = false;
             analysis.flow_state_pkts_needed = false;
         }
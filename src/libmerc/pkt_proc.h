@@ -24,6 +24,7 @@
 #include "perfect_hash.h"
 #include "crypto_assess.h"
 #include "pkt_proc_util.h"
+#include "rcu.h"
 
 /**
  * enum linktype is a 16-bit enumeration that identifies a protocol
@@ -44,34 +45,88 @@ enum linktype : uint16_t {
  * struct mercury holds state that is used by one or more
  * mercury_packet_processor
  *
+ * The classifier is published to the packet processors through an
+ * rcu_publisher, so that reload_classifier() can replace it while
+ * they are running.
  */
 struct mercury {
     struct global_config global_vars;
     std::unique_ptr<data_aggregator> aggregator{nullptr};
-    classifier *c;
+    rcu_publisher<classifier> c;
     class traffic_selector selector;
-
-    mercury(const struct libmerc_config *vars, int verbosity) : global_vars{*vars}, aggregator{ global_vars.do_stats? (std::make_unique<data_aggregator>(global_vars.max_stats_entries)) : nullptr}, c{nullptr}, selector{global_vars.protocols} {
+    std::vector<uint8_t> enc_key;      // key for resource archive, if any
+    enum enc_key_type key_type;
+    int verbosity;
+    std::mutex reload_mutex;
+
+    mercury(const struct libmerc_config *vars, int verbosity) :
+        global_vars{*vars},
+        aggregator{ global_vars.do_stats? (std::make_unique<data_aggregator>(global_vars.max_stats_entries, global_vars.stats_queue_depth, global_vars.stats_dump_threads)) : nullptr},
+        c{},
+        selector{global_vars.protocols},
+        enc_key{},
+        key_type{vars->key_type},
+        verbosity{verbosity} {
+
+        if (vars->enc_key != nullptr) {
+            enc_key.assign(vars->enc_key, vars->enc_key + (vars->key_type == enc_key_type_aes_256 ? 32 : 16));
+        }
         if (global_vars.do_analysis) {
-            c = analysis_init_from_archive(verbosity, global_vars.get_resource_file(),
-                                           vars->enc_key, vars->key_type,
-                                           global_vars.fp_proc_threshold,
-                                           global_vars.proc_dst_threshold,
-                                           global_vars.report_os);
-            if (c == nullptr) {
+            classifier *tmp = analysis_init_from_archive(verbosity, global_vars.get_resource_file(),
+                                                         vars->enc_key, vars->key_type,
+                                                         global_vars.fp_proc_threshold,
+                                                         global_vars.proc_dst_threshold,
+                                                         global_vars.report_os);
+            if (tmp == nullptr) {
                 throw std::runtime_error("error: analysis_init_from_archive() failed"); // failure
             }
+            c.publish(tmp);
 
             // set fingerprint formats to match those in the resource file
             //
-            size_t resources_tls_format = c->get_tls_fingerprint_format();
+            size_t resources_tls_format = tmp->get_tls_fingerprint_format();
             global_vars.set_tls_fingerprint_format(resources_tls_format);
             printf_err(log_info, "setting tls fingerprint format to match resource file (format: %zu)\n", resources_tls_format);
         }
     }
 
-    ~mercury() {
-        analysis_finalize(c);
+    // reload_classifier(resource_file) loads a new classifier from
+    // resource_file, or from the resource file in the configuration if
+    // that is nullptr, in the calling thread, and then publishes it to
+    // the packet processors, which continue to use the old classifier
+    // until they pick up the new one; the fingerprint weights and the
+    // fingerprint prevalence cache of the old classifier are carried
+    // over to the new one.  If the new classifier cannot be loaded, or
+    // if it uses a different TLS fingerprint format, then the old one
+    // remains in use, and an exception is thrown.
+    //
+    void reload_classifier(const char *resource_file) {
+        if (!global_vars.do_analysis) {
+            throw std::runtime_error("error: cannot reload resources when analysis is not configured");
+        }
+        std::unique_lock<std::mutex> lock{reload_mutex};
+        if (resource_file == nullptr) {
+            resource_file = global_vars.get_resource_file();
+        }
+        std::unique_ptr<classifier> tmp{analysis_init_from_archive(verbosity, resource_file,
+                                                                   enc_key.empty() ? nullptr : enc_key.data(),
+                                                                   key_type,
+                                                                   global_vars.fp_proc_threshold,
+                                                                   global_vars.proc_dst_threshold,
+                                                                   global_vars.report_os)};
+        if (tmp == nullptr) {
+            throw std::runtime_error("error: analysis_init_from_archive() failed");
+        }
+        if (tmp->get_tls_fingerprint_format() != global_vars.tls_fingerprint_format) {
+            throw std::runtime_error("error: reloaded resource file uses a different tls fingerprint format");
+        }
+
+        // the current classifier cannot be retired while
+        // reload_mutex is held, so it is safe to read from it here
+        //
+        tmp->carry_over(*c.get_current());
+        c.publish(tmp.release());
+        printf_err(log_info, "reloaded resource file %s\n", resource_file);
     }
 };
 
@@ -82,29 +137,38 @@ struct stateful_pkt_proc {
     struct tcp_reassembler *reassembler_ptr;
     struct tcp_initial_message_filter tcp_init_msg_filter;
     struct analysis_context analysis;
-    class message_queue *mq;
+    analysis_cache cache;
+    event_producer *mq;
     mercury_context m;
-    classifier *c;        // TODO: change to reference
+    rcu_reader<classifier> c;
     data_aggregator *ag;
     global_config global_vars;
     class traffic_selector &selector;
     quic_crypto_engine quic_crypto;
+    quic_reassembler quic_reassembly;
+    quic_reassembler *quic_reassembler_ptr;
     crypto_policy::assessor *crypto_policy = nullptr;
 
     explicit stateful_pkt_proc(mercury_context mc, size_t prealloc_size=0) :
-        ip_flow_table{prealloc_size},
-        tcp_flow_table{prealloc_size},
-        reassembler{prealloc_size},
+        ip_flow_table{prealloc_size, mc->global_vars.flow_table_capacity},
+        tcp_flow_table{prealloc_size, mc->global_vars.flow_table_capacity},
+        reassembler{prealloc_size,
+                    mc->global_vars.reassembly_max_flows,
+                    mc->global_vars.reassembly_buffer_size,
+                    mc->global_vars.reassembly_max_segments},
         reassembler_ptr{&reassembler},
         tcp_init_msg_filter{},
         analysis{},
+        cache{mc->global_vars.do_analysis ? mc->global_vars.analysis_cache_size : 0},
         mq{nullptr},
         m{mc},
-        c{nullptr},
+        c{mc->c},
         ag{nullptr},
         global_vars{mc->global_vars},
         selector{mc->selector},
-        quic_crypto{}
+        quic_crypto{},
+        quic_reassembly{mc->global_vars.quic_reassembly_max_flows},
+        quic_reassembler_ptr{&quic_reassembly}
     {
 
         constexpr bool DO_CRYPTO_ASSESSMENT = false;
@@ -115,11 +179,13 @@ struct stateful_pkt_proc {
 
         // set config and classifier to (refer to) context m
         //
-        if (m->c == nullptr && m->global_vars.do_analysis) {
+        if (m->c.get_current() == nullptr && m->global_vars.do_analysis) {
             throw std::runtime_error("error: classifier pointer is null");
         }
-        this->c = m->c;
         this->global_vars = m->global_vars;
+        if (global_vars.analysis_cache_size) {
+            analysis.cache = &cache;
+        }
 
         //fprintf(stderr, "note: setting classifier to %p, setting global_vars to %p\n", (void *)m->c, (void *)&m->global_vars));
         // }
@@ -135,6 +201,9 @@ struct stateful_pkt_proc {
         if (!global_vars.tcp_reassembly) {
             reassembler_ptr = nullptr;
         }
+        if (global_vars.quic_reassembly_max_flows == 0) {
+            quic_reassembler_ptr = nullptr;
+        }
 
 //#ifndef USE_TCP_REASSEMBLY
 // #pragma message "omitting tcp reassembly; 'make clean' and recompile with OPTFLAGS=-DUSE_TCP_REASSEMBLY to use that option"
@@ -154,6 +223,7 @@ struct stateful_pkt_proc {
     //
     void finalize() {
         reassembler.count_all();
+        quic_reassembly.clear();
         tcp_flow_table.count_all();
     }
 
@@ -244,7 +314,8 @@ struct stateful_pkt_proc {
                           struct datum &pkt,
                           enum udp_msg_type msg_type,
                           bool is_new,
-                          const struct key& k);
+                          const struct key& k,
+                          struct timespec *ts=nullptr);
 
     bool dump_pkt ();
 };
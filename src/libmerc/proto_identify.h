@@ -95,11 +95,51 @@ struct matcher_type_and_offset {
 };
 
 
+// class protocol_identifier<N> identifies the protocol of a TCP or UDP
+// payload by matching its first N bytes (or the N bytes at an offset)
+// against the masks and values of the protocols that were added to
+// it, and returning the type of the first matcher that matches, in
+// the order in which they were added.
+//
+// compile() builds a jump table that is used in place of a scan over
+// all of the matchers: one byte position is chosen as the key, and
+// for each of the 256 values of that byte, the table holds the
+// matchers that can match a payload with that value at that position,
+// in their original order, so that only those are tried.  The key
+// position is chosen to minimize the size of the table, and thus the
+// mean number of matchers tried for random data; with all protocols
+// selected, about three of the thirteen TCP matchers are tried for
+// each payload.  The results are the same as those of the ordered
+// scan, which is used until compile() has been called.  Matchers with
+// offsets are rare, and are tried in order after the table.
+//
 template <size_t N>
 class protocol_identifier {
     std::vector<matcher_and_type<N>> matchers;
     std::vector<matcher_type_and_offset<N>> matchers_and_offset;
 
+    bool compiled = false;
+    size_t key_offset = 0;                     // position of the byte used as the key
+    std::array<uint32_t, 257> bucket_start{};  // candidates for key b are table[bucket_start[b]] to table[bucket_start[b+1]-1]
+    std::vector<matcher_and_type<N>> table;
+
+    // candidates_at(m, i) returns the number of values of the byte at
+    // position i that can match the matcher m
+    //
+    static size_t candidates_at(const mask_and_value<N> &m, size_t i) {
+        if ((m.value_at(i) & ~m.mask_at(i)) != 0) {
+            return 0;   // m can never match
+        }
+        return (size_t)256 >> __builtin_popcount(m.mask_at(i));
+    }
+
+    bool matches(const matcher_and_type<N> &p, datum &pkt) const {
+        if (N == 4) {
+            return p.mv.matches(pkt.data, pkt.length()) && pkt_len_match(pkt, p.type);
+        }
+        return p.mv.matches(pkt.data, pkt.length());
+    }
+
 public:
 
     protocol_identifier() : matchers{}, matchers_and_offset{} {  }
@@ -107,6 +147,7 @@ public:
     void add_protocol(const mask_and_value<N> &mv, size_t type) {
         struct matcher_and_type<N> new_proto{mv, type};
         matchers.push_back(new_proto);
+        compiled = false;
     }
 
     void add_protocol(const mask_value_and_offset<N> &mv, size_t type) {
@@ -114,9 +155,32 @@ public:
         matchers_and_offset.push_back(new_proto);
     }
 
+    // compile() builds the jump table; it should be called after the
+    // last call to add_protocol()
+    //
     void compile() {
-        // this function is a placeholder for now, but in the future,
-        // it may compile a jump table, reorder matchers, etc.
+        size_t min_size = SIZE_MAX;
+        for (size_t i = 0; i < N; i++) {
+            size_t size = 0;
+            for (const auto &p : matchers) {
+                size += candidates_at(p.mv, i);
+            }
+            if (size < min_size) {
+                min_size = size;
+                key_offset = i;
+            }
+        }
+        table.clear();
+        for (size_t b = 0; b < 256; b++) {
+            bucket_start[b] = table.size();
+            for (const auto &p : matchers) {
+                if ((b & p.mv.mask_at(key_offset)) == p.mv.value_at(key_offset)) {
+                    table.push_back(p);
+                }
+            }
+        }
+        bucket_start[256] = table.size();
+        compiled = true;
     }
 
     bool pkt_len_match(datum &pkt, const size_t type) const {
@@ -151,17 +215,24 @@ public:
         if (pkt.length() < 4) {
             return 0;   // type unknown;
         }
-        for (matcher_and_type p : matchers) {
-            if (N == 4) {
-                if (p.mv.matches(pkt.data, pkt.length()) && pkt_len_match(pkt, p.type)) {
+        if (compiled) {
+            if (pkt.length() >= (ssize_t)N) {  // otherwise, no matcher can match
+                uint8_t key = pkt.data[key_offset];
+                for (size_t i = bucket_start[key]; i < bucket_start[key + 1]; i++) {
+                    if (matches(table[i], pkt)) {
+                        return table[i].type;
+                    }
+                }
+            }
+        } else {
+            for (const matcher_and_type<N> &p : matchers) {
+                if (matches(p, pkt)) {
                     return p.type;
                 }
-            } else if (p.mv.matches(pkt.data, pkt.length())) {
-                return p.type;
             }
         }
 
-        for (matcher_type_and_offset p : matchers_and_offset) {
+        for (const matcher_type_and_offset<N> &p : matchers_and_offset) {
             if (N == 4) {
                 if (p.mv.matches_at_offset(pkt.data, pkt.length()) && pkt_len_match(pkt, p.type)) {
                     return p.type;
@@ -406,6 +477,7 @@ public:
             udp.add_protocol(quic_initial_packet::matcher, udp_msg_type_quic);
         }
         // tell protocol_identification objects to compile lookup tables
+        tcp4.compile();
         tcp.compile();
         udp.compile();
         udp16.compile();
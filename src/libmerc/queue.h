@@ -1,90 +1,175 @@
 /*
  * queue.h
  *
- * a threadsafe queue for fixed-length messages, based on a ring
- * buffer
+ * a wait-free single-producer, single-consumer queue for
+ * fixed-length event records, based on a ring buffer
  */
 
 #ifndef QUEUE_H
 #define QUEUE_H
 
-#include <string.h>
-#include <mutex>
-#include <tuple>
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <vector>
 
-typedef std::tuple<std::string, std::string, std::string, std::string> event_msg;
 #define EVENT_BUF_SIZE 256
 
-class message_queue {
-    std::mutex m;
-    size_t first;
-    size_t last;
-    long unsigned int err_count;
-    event_msg msg_buf[EVENT_BUF_SIZE];
+// struct event_src_addr holds the source address of an event, in
+// binary form; an IPv4 address is held in addr[0], with the other
+// words zeroized
+//
+struct event_src_addr {
+    uint32_t addr[4];
+    uint8_t ip_vers;
+
+    bool operator==(const event_src_addr &rhs) const {
+        return ip_vers == rhs.ip_vers
+            && addr[0] == rhs.addr[0]
+            && addr[1] == rhs.addr[1]
+            && addr[2] == rhs.addr[2]
+            && addr[3] == rhs.addr[3];
+    }
+};
 
-public:
-    message_queue() : m{}, first{0}, last{0}, err_count{0} { }
+// struct event_record is the compact, fixed-width representation of
+// a (source, fingerprint, user agent, destination) event that is
+// passed from a packet processor to the data_aggregator.  The
+// fingerprint, user agent, and destination are represented by
+// integer identifiers into the dictionaries of the producer that
+// created the record, for the dictionary epoch in the record; digest
+// is a hash of their strings, which is the same for identical events
+// from any producer or epoch.
+//
+struct event_record {
+    uint64_t digest;
+    struct event_src_addr src;
+    uint32_t epoch;
+    uint32_t fp;
+    uint32_t ua;
+    uint32_t dst;
+};
 
-    ~message_queue() {
-        // TBD: connect error_count to verbosity > 0
-        // fprintf(stderr, "note: message_queue::error_count: %lu\n", err_count);
+// class message_queue is a ring buffer that passes event_records
+// from exactly one producer thread (a stateful_pkt_proc) to exactly
+// one consumer thread (the data_aggregator).  Neither push() nor
+// pop() takes a lock or waits; push() fails and increments a drop
+// counter if the ring is full.
+//
+class message_queue {
+    static constexpr size_t cache_line_size = 64;
+
+    // head is written only by the consumer, and tail is written only
+    // by the producer; they are kept on separate cache lines, along
+    // with each side's cached copy of the other's index, to avoid
+    // false sharing
+    //
+    alignas(cache_line_size) std::atomic<size_t> head;
+    size_t cached_tail;
+    alignas(cache_line_size) std::atomic<size_t> tail;
+    size_t cached_head;
+    std::atomic<uint64_t> drop_count;
+    std::atomic<uint64_t> push_count;
+
+    alignas(cache_line_size) size_t mask;
+    std::vector<event_record> msg_buf;
+
+    static size_t round_up_to_power_of_two(size_t n) {
+        size_t x = 2;
+        while (x < n && x < max_depth) {
+            x <<= 1;
+        }
+        return x;
     }
 
-    void fprint(FILE *f) {
-        fprintf(f, "STATE: first: %zu\tlast: %zu\n", first, last);
+public:
+
+    // max_depth is the largest number of messages that a message_queue
+    // can hold
+    //
+    static constexpr size_t max_depth = 1 << 20;
+
+    // construct a message_queue that holds (at least) depth messages;
+    // the depth is rounded up to a power of two, and limited to
+    // max_depth
+    //
+    explicit message_queue(size_t depth=EVENT_BUF_SIZE) :
+        head{0},
+        cached_tail{0},
+        tail{0},
+        cached_head{0},
+        drop_count{0},
+        push_count{0},
+        mask{round_up_to_power_of_two(depth) - 1},
+        msg_buf(mask + 1)
+    { }
+
+    message_queue(const message_queue &) = delete;
+    message_queue &operator=(const message_queue &) = delete;
+
+    void fprint(FILE *f) const {
+        fprintf(f, "STATE: head: %zu\ttail: %zu\tdepth: %zu\tpushed: %lu\tdropped: %lu\n",
+                head.load(), tail.load(), capacity(), push_count.load(), drop_count.load());
     }
 
-    bool push(const event_msg& ev_str) {
-        std::unique_lock<std::mutex> m_lock(m);
-        if (is_full()) {
-            err_count++;
-            //fprintf(stderr, "%s: queue %p is full\n", __func__, (void *)this);
-            return false; // error: no room in queue
+    // push(ev) copies ev into the next free slot and publishes it to
+    // the consumer; it returns true on success, and false (after
+    // counting a drop) if the queue is full.
+    //
+    // This function MUST only be called from the producer thread.
+    //
+    bool push(const event_record &ev) {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if (t - cached_head > mask) {
+            cached_head = head.load(std::memory_order_acquire);
+            if (t - cached_head > mask) {
+                drop_count.store(drop_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return false; // error: no room in queue
+            }
         }
-        //fprintf(stderr, "src_ip = %s, fp = %s, user-agent= %s, dest_info= %s\n", std::get<0>(ev_str).c_str(), std::get<1>(ev_str).c_str(), std::get<2>(ev_str).c_str(), std::get<3>(ev_str).c_str());
-        msg_buf[last] = ev_str;
-        increment(last);
+        msg_buf[t & mask] = ev;
+        tail.store(t + 1, std::memory_order_release);
+        push_count.store(push_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
         return true;
     }
 
-    bool pop(event_msg &entry) {
-        std::unique_lock<std::mutex> m_lock(m);
-        //fprintf(stderr, "%s: queue size: %zd\n", __func__, size());
-        if (is_empty()) {
-            return false;
+    // pop(entry) copies the oldest message in the queue into entry
+    // and returns true, or returns false if the queue is empty.
+    //
+    // This function MUST only be called from the consumer thread.
+    //
+    bool pop(event_record &entry) {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (h == cached_tail) {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (h == cached_tail) {
+                return false;
+            }
         }
-        entry = msg_buf[first];
-        increment(first);
+        entry = msg_buf[h & mask];
+        head.store(h + 1, std::memory_order_release);
         return true;
     }
 
-    void increment(size_t &idx) {
-        idx = next_index(idx);
+    bool is_empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
     }
 
-    size_t next_index(size_t idx) const {
-        size_t tmp = idx + 1;
-        if (tmp == EVENT_BUF_SIZE) {
-            return 0;
-        }
-        return tmp;
+    size_t size() const {
+        const size_t h = head.load(std::memory_order_acquire);
+        return tail.load(std::memory_order_acquire) - h;
     }
 
-    bool is_full() const {
-        //fprintf(stdout, "%s: next_index: %zu\n", __func__, next_index(last));
-        return (next_index(last) == first);
-    }
+    size_t capacity() const { return mask + 1; }
 
-    bool is_empty() const {
-        return (first == last);
-    }
+    // drops() returns the number of messages that could not be
+    // pushed because the queue was full, and pushes() returns the
+    // number that were pushed successfully; both can be read from
+    // any thread
+    //
+    uint64_t drops() const { return drop_count.load(std::memory_order_relaxed); }
 
-    ssize_t size() {
-        if (last >= first) {
-            return last - first;
-        }
-        return EVENT_BUF_SIZE - (first - last);
-    }
+    uint64_t pushes() const { return push_count.load(std::memory_order_relaxed); }
 };
 
 
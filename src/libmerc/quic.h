@@ -13,10 +13,13 @@
 #ifndef QUIC_H
 #define QUIC_H
 
+#include <algorithm>
+#include <array>
 #include <string>
 #include <tuple>
 #include <unordered_map>
 #include <variant>
+#include <vector>
 #include <openssl/aes.h>
 #include <openssl/hmac.h>
 #include <openssl/evp.h>
@@ -26,6 +29,7 @@
 #include "util_obj.h"
 #include "match.h"
 #include "crypto_engine.h"
+#include "tcp.h"
 
 #define type_quic_user_agent 0x3129
 /*
@@ -791,6 +795,12 @@ private:
 
     std::unordered_map<uint32_t, const std::tuple<salt_enum, init_pkt_mask_enum, hkdf_label_enum> > quic_initial_params;
 
+    // distinct_params holds each distinct combination of salt, initial
+    // packet mask, and HKDF labels in quic_initial_params, newest salt
+    // first; these are the parameters tried for an unknown version
+    //
+    std::vector<std::tuple<salt_enum, init_pkt_mask_enum, hkdf_label_enum>> distinct_params;
+
 public:
 
     static constexpr size_t MAX_QUIC_VERSIONS{30};  // limit memory usage
@@ -823,6 +833,15 @@ public:
             {1889161412, {salt_enum::D1_D7_V2, init_pkt_mask_enum::V2, hkdf_label_enum::V2}},        // draft1_draft7-v2
             {1798521807, {salt_enum::V2, init_pkt_mask_enum::V2, hkdf_label_enum::V2}},              // version-2
         };
+
+        for (const auto &p : quic_initial_params) {
+            if (std::find(distinct_params.begin(), distinct_params.end(), p.second) == distinct_params.end()) {
+                distinct_params.push_back(p.second);
+            }
+        }
+        std::sort(distinct_params.begin(), distinct_params.end(), [](const auto &a, const auto &b) {
+            return std::get<0>(a) > std::get<0>(b);
+        });
     }
 
     void add_param_mapping(uint32_t version, const std::tuple<quic_parameters::salt_enum, quic_parameters::init_pkt_mask_enum, quic_parameters::hkdf_label_enum> param) {
@@ -855,26 +874,58 @@ public:
 
     const std::unordered_map<uint32_t, const std::tuple<salt_enum, init_pkt_mask_enum, hkdf_label_enum> > &get_params_map() {return quic_initial_params;}
 
+    const std::vector<std::tuple<salt_enum, init_pkt_mask_enum, hkdf_label_enum>> &get_distinct_params() const { return distinct_params; }
+
     static quic_parameters &create() {
         static quic_parameters quic_params;
         return quic_params;
     }
 };
 
+// class quic_crypto_engine decrypts QUIC Initial packets.  The keys
+// of an Initial packet are derived from its destination connection ID
+// (DCID) and the salt and HKDF labels of its version, with
+// HKDF-Extract and four HKDF-Expand steps (RFC 9001, Section 5.2),
+// which cost far more than the decryption itself.  A client uses the
+// same DCID for all of the Initial packets that it sends until it
+// hears from the server, so the derived keys are kept in a small
+// direct-mapped cache keyed on the salt, labels, and DCID, from which
+// retransmitted and coalesced Initials are decrypted.
+//
+// When the version of a packet is not known, each distinct salt is
+// tried in turn.  Before the AEAD tag is checked over the whole
+// payload with a salt, header protection is removed and the first
+// byte of the payload is decrypted, using a single block of the GCM
+// keystream; unless that byte is the type of a frame that is allowed
+// in an Initial packet, the salt is skipped.
+//
 class quic_crypto_engine {
 
+    static constexpr size_t max_dcid_len = 20;     // RFC 9000, Section 17.2
+    static constexpr size_t key_cache_size = 256;    // must be a power of two
+
+    // struct initial_keys holds the keys derived for a DCID with a
+    // salt and a set of labels
+    //
+    struct initial_keys {
+        const quic_parameters::salt *salt = nullptr;   // nullptr marks an empty entry
+        const quic_parameters::kdf_label *labels = nullptr;
+        uint8_t dcid_len = 0;
+        uint8_t dcid[max_dcid_len];
+        uint8_t key[16];
+        uint8_t iv[12];
+        uint8_t hp[16];
+    };
+
     crypto_engine core_crypto;
 
     size_t salt_length = 20;
 
-    uint8_t quic_key[EVP_MAX_MD_SIZE] = {0};
-    unsigned int quic_key_len = 0;
+    std::array<initial_keys, key_cache_size> key_cache;
+    initial_keys uncached_keys;   // keys for a DCID too long to cache
 
-    uint8_t quic_iv[EVP_MAX_MD_SIZE] = {0};
-    unsigned int quic_iv_len = 0;
-
-    uint8_t quic_hp[EVP_MAX_MD_SIZE] = {0};
-    unsigned int quic_hp_len = 0;
+    const uint8_t *quic_key = nullptr;
+    uint8_t quic_iv[sizeof(initial_keys::iv)] = {0};   // nonce for the current packet
 
     uint8_t pn_length = 0;
 
@@ -907,50 +958,32 @@ public:
                 }
             }
 
-            const uint8_t *client_in_label = (quic_params.get_kdf(std::get<2>(*params))->get_client_label());
-            const uint8_t *quic_key_label  = (quic_params.get_kdf(std::get<2>(*params))->get_key_label());
-            const uint8_t *quic_iv_label   = (quic_params.get_kdf(std::get<2>(*params))->get_iv_label());
-            const uint8_t *quic_hp_label   = (quic_params.get_kdf(std::get<2>(*params))->get_hp_label());
-            const unsigned int client_in_label_size = (quic_params.get_kdf(std::get<2>(*params))->get_client_label_size());
-            const unsigned int quic_key_label_size  = (quic_params.get_kdf(std::get<2>(*params))->get_key_label_size());
-            const unsigned int quic_iv_label_size   = (quic_params.get_kdf(std::get<2>(*params))->get_iv_label_size());
-            const unsigned int quic_hp_label_size   = (quic_params.get_kdf(std::get<2>(*params))->get_hp_label_size());
-
             if (initial_salt) {
                 salt_str = initial_salt->get_name();
-                if (process_initial_packet(aad, quic_pkt, initial_salt->data(), client_in_label, quic_key_label, quic_iv_label, quic_hp_label,
-                                            client_in_label_size, quic_key_label_size, quic_iv_label_size, quic_hp_label_size) == false) {
+                const initial_keys &keys = get_initial_keys(initial_salt, quic_params.get_kdf(std::get<2>(*params)), quic_pkt.dcid);
+                if (process_initial_packet(aad, quic_pkt, keys) == false) {
                     return {nullptr, nullptr};
                 }
                 decrypt__(aad.buffer, aad.readable_length(),
                       quic_pkt.payload.data, quic_pkt.payload.length());
                 return {plaintext, plaintext+plaintext_len};
             }
-            return {nullptr, nullptr}; 
+            return {nullptr, nullptr};
         }
         else {
             // try every salt to decrypt, most likely a version negotiation pkt
-            for (auto params : quic_params.get_params_map()) {
-                const std::tuple<quic_parameters::salt_enum, quic_parameters::init_pkt_mask_enum, quic_parameters::hkdf_label_enum> param = params.second; 
+            for (const auto &param : quic_params.get_distinct_params()) {
                 const quic_parameters::salt *initial_salt = quic_params.get_initial_salt(std::get<0>(param));
-                const uint8_t *client_in_label = (quic_params.get_kdf(std::get<2>(param))->get_client_label());
-                const uint8_t *quic_key_label  = (quic_params.get_kdf(std::get<2>(param))->get_key_label());
-                const uint8_t *quic_iv_label   = (quic_params.get_kdf(std::get<2>(param))->get_iv_label());
-                const uint8_t *quic_hp_label   = (quic_params.get_kdf(std::get<2>(param))->get_hp_label());
-                const unsigned int client_in_label_size = (quic_params.get_kdf(std::get<2>(param))->get_client_label_size());
-                const unsigned int quic_key_label_size  = (quic_params.get_kdf(std::get<2>(param))->get_key_label_size());
-                const unsigned int quic_iv_label_size   = (quic_params.get_kdf(std::get<2>(param))->get_iv_label_size());
-                const unsigned int quic_hp_label_size   = (quic_params.get_kdf(std::get<2>(param))->get_hp_label_size());
-                if (process_initial_packet(aad, quic_pkt, initial_salt->data(), client_in_label, quic_key_label, quic_iv_label, quic_hp_label,
-                                        client_in_label_size, quic_key_label_size, quic_iv_label_size, quic_hp_label_size) == false) {
+                const initial_keys &keys = get_initial_keys(initial_salt, quic_params.get_kdf(std::get<2>(param)), quic_pkt.dcid);
+                if (process_initial_packet(aad, quic_pkt, keys) == false || first_frame_type_is_valid(quic_pkt) == false) {
                     reset_buffers();
+                    aad.reset();
                     continue;
                 }
                 decrypt__(aad.buffer, aad.readable_length(),
                   quic_pkt.payload.data, quic_pkt.payload.length());
 
                 if (plaintext_len) {
-                    //salt_str = quic_params.salts[i].get_name();
                     salt_str = initial_salt->get_name();
                     quic_params.add_param_mapping(version, param);
                     return {plaintext, plaintext+plaintext_len};
@@ -968,32 +1001,56 @@ public:
 
 private:
 
-    //bool process_initial_packet(data_buffer<1024> &aad, const quic_initial_packet &quic_pkt, const uint8_t* salt) {
-    bool process_initial_packet(data_buffer<1024> &aad, const quic_initial_packet &quic_pkt, const uint8_t* salt,
-                            const uint8_t *client_in_label, const uint8_t *quic_key_label, const uint8_t *quic_iv_label, const uint8_t *quic_hp_label,
-                            const unsigned int client_in_label_size, const unsigned int quic_key_label_size, const unsigned int quic_iv_label_size, const unsigned int quic_hp_label_size) {
-        if (!quic_pkt.is_not_empty()) {
-            return false;
+    // get_initial_keys(salt, labels, dcid) returns the keys for the
+    // connection ID dcid with salt and labels, from the cache if
+    // possible
+    //
+    const initial_keys &get_initial_keys(const quic_parameters::salt *salt, const quic_parameters::kdf_label *labels, const datum &dcid) {
+        size_t dcid_len = dcid.length();
+        if (dcid_len > max_dcid_len) {
+            derive_initial_keys(uncached_keys, salt, labels, dcid);
+            return uncached_keys;
+        }
+        uint32_t h = 2166136261u ^ (uint32_t)(uintptr_t)salt;    // FNV-1a
+        for (size_t i = 0; i < dcid_len; i++) {
+            h = (h ^ dcid.data[i]) * 16777619u;
+        }
+        initial_keys &k = key_cache[(h ^ (h >> 16)) & (key_cache_size - 1)];
+        if (k.salt == salt && k.labels == labels && k.dcid_len == dcid_len && memcmp(k.dcid, dcid.data, dcid_len) == 0) {
+            return k;
         }
-        const uint8_t *dcid = quic_pkt.dcid.data;
-        size_t dcid_len = quic_pkt.dcid.length();
+        derive_initial_keys(k, salt, labels, dcid);
+        k.salt = salt;
+        k.labels = labels;
+        k.dcid_len = dcid_len;
+        memcpy(k.dcid, dcid.data, dcid_len);
+        return k;
+    }
 
+    void derive_initial_keys(initial_keys &k, const quic_parameters::salt *salt, const quic_parameters::kdf_label *labels, const datum &dcid) {
         uint8_t initial_secret[EVP_MAX_MD_SIZE];
         unsigned int initial_secret_len = 0;
-        HMAC(EVP_sha256(), salt, salt_length, dcid, dcid_len, initial_secret, &initial_secret_len);
+        HMAC(EVP_sha256(), salt->data(), salt_length, dcid.data, dcid.length(), initial_secret, &initial_secret_len);
 
         uint8_t c_initial_secret[EVP_MAX_MD_SIZE] = {0};
         unsigned int c_initial_secret_len = 0;
-        core_crypto.kdf_tls13(initial_secret, initial_secret_len, client_in_label, client_in_label_size-1, 32, c_initial_secret, &c_initial_secret_len);
-        core_crypto.kdf_tls13(c_initial_secret, c_initial_secret_len, quic_key_label, quic_key_label_size-1, 16, quic_key, &quic_key_len);
-        core_crypto.kdf_tls13(c_initial_secret, c_initial_secret_len, quic_iv_label, quic_iv_label_size-1, 12, quic_iv, &quic_iv_len);
-        core_crypto.kdf_tls13(c_initial_secret, c_initial_secret_len, quic_hp_label, quic_hp_label_size-1, 16, quic_hp, &quic_hp_len);
+        unsigned int len = 0;
+        core_crypto.kdf_tls13(initial_secret, initial_secret_len, labels->get_client_label(), labels->get_client_label_size()-1, 32, c_initial_secret, &c_initial_secret_len);
+        core_crypto.kdf_tls13(c_initial_secret, c_initial_secret_len, labels->get_key_label(), labels->get_key_label_size()-1, sizeof(k.key), k.key, &len);
+        core_crypto.kdf_tls13(c_initial_secret, c_initial_secret_len, labels->get_iv_label(), labels->get_iv_label_size()-1, sizeof(k.iv), k.iv, &len);
+        core_crypto.kdf_tls13(c_initial_secret, c_initial_secret_len, labels->get_hp_label(), labels->get_hp_label_size()-1, sizeof(k.hp), k.hp, &len);
+    }
+
+    bool process_initial_packet(data_buffer<1024> &aad, const quic_initial_packet &quic_pkt, const initial_keys &keys) {
+        if (!quic_pkt.is_not_empty()) {
+            return false;
+        }
 
         // remove header protection (RFC9001, Section 5.4.1)
         //
         static constexpr size_t sample_offset = 4;
         uint8_t mask[32] = {0};
-        core_crypto.ecb_encrypt(quic_hp,mask,quic_pkt.payload.data + sample_offset,16);
+        core_crypto.ecb_encrypt(keys.hp,mask,quic_pkt.payload.data + sample_offset,16);
 
         uint8_t unmasked_conn_info;
         unmasked_conn_info = quic_pkt.connection_info ^ (mask[0] & 0x0f);
@@ -1041,17 +1098,48 @@ private:
 
         // construct AEAD iv
         //
+        constexpr uint8_t quic_iv_len = sizeof(quic_iv);
+        memcpy(quic_iv, keys.iv, quic_iv_len);
         for (uint8_t i = quic_iv_len-pn_length; i < quic_iv_len; i++) {
             quic_iv[i] ^= (mask[(i-(quic_iv_len-pn_length))+1] ^ *(quic_pkt.payload.data + (i-(quic_iv_len-pn_length))));
         }
+        quic_key = keys.key;
 
         return true;
     }
 
+    // first_frame_type_is_valid(quic_pkt) decrypts the first byte of
+    // the payload of quic_pkt, after process_initial_packet() has
+    // succeeded, and returns true if it is the type of a frame that
+    // can appear in an Initial packet (RFC 9000, Section 17.2.2):
+    // PADDING, PING, ACK, CRYPTO, or CONNECTION_CLOSE.  With a 96-bit
+    // nonce, GCM encrypts the first block of plaintext with the counter
+    // block nonce || 2 (NIST SP 800-38D, Section 7.2).
+    //
+    bool first_frame_type_is_valid(const quic_initial_packet &quic_pkt) {
+        if (quic_pkt.payload.length() <= pn_length) {
+            return false;
+        }
+        uint8_t counter_block[16] = {0};
+        memcpy(counter_block, quic_iv, sizeof(quic_iv));
+        counter_block[15] = 2;
+        uint8_t keystream[16];
+        core_crypto.ecb_encrypt(quic_key, keystream, counter_block, sizeof(counter_block));
+        switch (keystream[0] ^ quic_pkt.payload.data[pn_length]) {
+        case 0x00:  // PADDING
+        case 0x01:  // PING
+        case 0x02:  // ACK
+        case 0x03:  // ACK with ECN counts
+        case 0x06:  // CRYPTO
+        case 0x1c:  // CONNECTION_CLOSE
+            return true;
+        default:
+            return false;
+        }
+    }
+
     void reset_buffers() {
-        quic_key_len = 0;
-        quic_iv_len = 0;
-        quic_hp_len = 0;
+        quic_key = nullptr;
         pn_length = 0;
     }
 
@@ -1256,10 +1344,72 @@ public:
 
 };
 
+// struct crypto_ranges holds the byte ranges of a CRYPTO stream that
+// have been received, as at most max_ranges disjoint ranges in
+// increasing order; ranges that overlap or touch are merged
+//
+struct crypto_ranges {
+    static constexpr size_t max_ranges = 16;
+
+    seg_range range[max_ranges];
+    size_t count = 0;
+    bool overflow = false;     // a range was dropped for lack of room
+
+    void add(uint32_t first, uint32_t second) {
+        if (first >= second) {
+            return;
+        }
+        size_t i = 0;
+        while (i < count && range[i].second < first) {
+            i++;
+        }
+        size_t j = i;
+        while (j < count && range[j].first <= second) {
+            first = std::min(first, range[j].first);
+            second = std::max(second, range[j].second);
+            j++;
+        }
+        if (i == j) {
+            if (count == max_ranges) {
+                overflow = true;
+                return;
+            }
+            memmove(range + i + 1, range + i, (count - i) * sizeof(seg_range));
+            count++;
+        } else if (j > i + 1) {
+            memmove(range + i + 1, range + j, (count - j) * sizeof(seg_range));
+            count -= j - i - 1;
+        }
+        range[i].first = first;
+        range[i].second = second;
+    }
+
+    // contiguous_length() returns the number of bytes at the start of
+    // the stream that have all been received
+    //
+    uint32_t contiguous_length() const {
+        return (count > 0 && range[0].first == 0) ? range[0].second : 0;
+    }
+
+    void reset() { count = 0; overflow = false; }
+};
+
+// handshake_length(data, length) returns the length of the TLS
+// handshake message at the start of the length bytes at data,
+// including its header, or zero if the header is not all there
+//
+inline uint32_t handshake_length(const uint8_t *data, uint32_t length) {
+    if (length < 4) {
+        return 0;
+    }
+    return 4 + (data[1] << 16 | data[2] << 8 | data[3]);
+}
+
 struct cryptographic_buffer
 {
     uint64_t buf_len = 0;
     unsigned char buffer[pt_buf_len] = {}; // pt_buf_len - decryption buffer trim size for gcm_decrypt
+    crypto_ranges ranges;
 
     void extend(crypto& d)
     {
@@ -1268,8 +1418,8 @@ struct cryptographic_buffer
             if (d.offset() + d.length() > buf_len) {
                 buf_len = d.offset() + d.length();
             }
+            ranges.add(d.offset(), d.offset() + d.length());
         }
-        // TODO: track segments to verify that all are present
     }
 
     bool is_valid()
@@ -1277,7 +1427,170 @@ struct cryptographic_buffer
         return buf_len > 0;
     }
 
-    void reset() {buf_len = 0;}
+    // is_complete() returns true if the buffer holds a whole handshake
+    // message, starting at offset zero, with no gaps
+    //
+    bool is_complete() const {
+        uint32_t length = ranges.contiguous_length();
+        uint32_t needed = handshake_length(buffer, length);
+        return needed != 0 && needed <= length;
+    }
+
+    void reset() {buf_len = 0; ranges.reset();}
+};
+
+// class quic_reassembler gathers the CRYPTO frames of a QUIC
+// connection across the Initial packets that carry them, so that a
+// TLS client hello that does not fit into a single datagram, as with
+// post-quantum key shares, can be fingerprinted.  Connections are
+// keyed on the destination connection ID that the client chose for
+// its first Initial packets, which is the same in each of them.
+//
+// State is kept only for a connection whose client hello is not
+// complete in the first Initial packet that is seen, and the memory
+// that it uses is bounded:
+//
+//    - the table holds at most max_flows connections, and when it is
+//      full, a new connection evicts the one whose deadline is
+//      earliest;
+//
+//    - each connection expires timeout seconds after its first packet;
+//
+//    - at most max_crypto_len bytes of the CRYPTO stream are held per
+//      connection, in buffers from a reassembly_pool that grow with
+//      the data received, and the received ranges are held in a
+//      fixed-size crypto_ranges.
+//
+// When the client hello is complete, its connection is kept until
+// the next call to check_packet(), so that the reassembled data
+// remains valid while the packet that completed it is processed.
+//
+// The reassembler is not thread safe; each packet processor has its
+// own.
+//
+class quic_reassembler {
+public:
+
+    static constexpr size_t max_dcid_len = 20;           // RFC 9000, Section 17.2
+    static constexpr uint32_t max_crypto_len = 8192;     // maximum bytes of CRYPTO stream per connection
+    static constexpr unsigned int timeout = 10;          // seconds before connection timeout
+    static const size_t default_max_flows = 1024;
+
+private:
+
+    struct dcid_key {
+        uint8_t length = 0;
+        uint8_t bytes[max_dcid_len] = {};
+
+        bool operator==(const dcid_key &rhs) const {
+            return length == rhs.length && memcmp(bytes, rhs.bytes, length) == 0;
+        }
+    };
+
+    struct dcid_hash {
+        size_t operator()(const dcid_key &k) const {
+            uint64_t h = 14695981039346656037ULL ^ k.length;    // FNV-1a
+            for (size_t i = 0; i < k.length; i++) {
+                h = (h ^ k.bytes[i]) * 1099511628211ULL;
+            }
+            return h;
+        }
+    };
+
+    struct crypto_stream {
+        crypto_ranges ranges;
+        pooled_array<uint8_t> data;
+
+        bool add(crypto &c, reassembly_pool &pool) {
+            uint64_t end = c.offset() + c.length();
+            if (end > max_crypto_len || !data.reserve(pool, end)) {
+                return false;
+            }
+            memcpy(data.data() + c.offset(), c.data().data, c.length());
+            ranges.add(c.offset(), end);
+            return !ranges.overflow;
+        }
+    };
+
+    using stream_table = flow_map<dcid_key, crypto_stream, dcid_hash>;
+
+    reassembly_pool pool;    // must outlive table
+    stream_table table;
+    stream_table::handle completed;
+
+    void erase_completed() {
+        if (completed != stream_table::nil) {
+            table.erase(completed);
+            completed = stream_table::nil;
+        }
+    }
+
+public:
+
+    explicit quic_reassembler(size_t max_flows=default_max_flows) :
+        pool{max_crypto_len, crypto_ranges::max_ranges},
+        table{max_flows},
+        completed{stream_table::nil} { }
+
+    // check_packet(dcid, sec, plaintext, state) adds the CRYPTO frames
+    // in plaintext, the decrypted payload of an Initial packet with
+    // the destination connection ID dcid, to the stream for that
+    // connection, and returns the client hello handshake message if
+    // it is now complete, or a null datum otherwise.  The state is
+    // set to reassembly_done or reassembly_in_progress, or to
+    // truncated if the stream cannot be held, or is not a client
+    // hello.
+    //
+    datum check_packet(const datum &dcid, unsigned int sec, datum plaintext, reassembly_status &state) {
+        erase_completed();
+        table.advance(sec);
+
+        state = truncated;
+        dcid_key k;
+        if (dcid.length() > (ssize_t)max_dcid_len) {
+            return datum{};
+        }
+        k.length = dcid.length();
+        memcpy(k.bytes, dcid.data, k.length);
+
+        stream_table::handle h = table.find(k);
+        if (h == stream_table::nil) {
+            h = table.emplace(k, sec + timeout + 1);
+        }
+        crypto_stream &stream = table.value(h);
+        while (plaintext.is_not_empty()) {
+            quic_frame frame{plaintext};
+            if (!frame.is_valid()) {
+                break;
+            }
+            crypto *c = frame.get_if<crypto>();
+            if (c && c->is_valid() && !stream.add(*c, pool)) {
+                table.erase(h);
+                return datum{};
+            }
+        }
+
+        uint32_t length = stream.ranges.contiguous_length();
+        if (length > 0 && stream.data[0] != (uint8_t)handshake_type::client_hello) {
+            table.erase(h);
+            return datum{};
+        }
+        uint32_t needed = handshake_length(stream.data.data(), length);
+        if (needed == 0 || needed > length) {
+            state = reassembly_in_progress;
+            return datum{};
+        }
+        state = reassembly_done;
+        completed = h;
+        return datum{stream.data.data(), stream.data.data() + needed};
+    }
+
+    void clear() {
+        table.clear();
+        completed = stream_table::nil;
+    }
+
+    size_t size() const { return table.size(); }
 };
 
 struct quic_hdr_fp {
@@ -1416,7 +1729,7 @@ public:
 
         analysis_.destination.init(sn, user_agent, alpn, k_);
 
-        return c_->analyze_fingerprint_and_destination_context(analysis_.fp, analysis_.destination, analysis_.result);
+        return c_->analyze_fingerprint_and_destination_context(analysis_.fp, analysis_.destination, analysis_.result, analysis_.cache);
     }
 };
 
@@ -1431,10 +1744,25 @@ class quic_init {
     quic_frame cc;
     quic_init_decry decry_pkt;
     bool pre_decrypted;
+    reassembly_status reassembly_state;
 
 public:
 
-    quic_init(struct datum &d, quic_crypto_engine &quic_crypto_) : initial_packet{d}, quic_crypto{quic_crypto_}, crypto_buffer{}, hello{}, plaintext{}, decry_pkt{initial_packet,crypto_buffer}, pre_decrypted{false} {
+    // quic_init(d, quic_crypto, reassembler, sec) parses and decrypts
+    // the Initial packet d; if its client hello is not complete, and
+    // reassembler is not null, the CRYPTO frames are added to those
+    // of the earlier Initial packets of the same connection, and sec
+    // is the time of the packet
+    //
+    quic_init(struct datum &d, quic_crypto_engine &quic_crypto_, quic_reassembler *reassembler=nullptr, unsigned int sec=0) :
+        initial_packet{d},
+        quic_crypto{quic_crypto_},
+        crypto_buffer{},
+        hello{},
+        plaintext{},
+        decry_pkt{initial_packet,crypto_buffer},
+        pre_decrypted{false},
+        reassembly_state{reassembly_none} {
 
         // check reserved bits, if 0, try for decrypted quic packet
         //
@@ -1471,6 +1799,15 @@ public:
         }
         if(crypto_buffer.is_valid()){
             struct datum d{crypto_buffer.buffer, crypto_buffer.buffer + crypto_buffer.buf_len};
+            if (!crypto_buffer.is_complete()) {
+                reassembly_state = truncated;
+                if (reassembler) {
+                    datum reassembled = reassembler->check_packet(initial_packet.dcid, sec, plaintext, reassembly_state);
+                    if (reassembled.is_not_empty()) {
+                        d = reassembled;
+                    }
+                }
+            }
             tls_handshake tls{d};
             hello.parse(tls.body);
             hello.is_quic_hello = true;
@@ -1496,6 +1833,20 @@ public:
         return hello;
     }
 
+    // reassembly_pending() returns true if the client hello is
+    // not complete, and is being reassembled from the CRYPTO frames of
+    // this and later Initial packets
+    //
+    bool reassembly_pending() const { return reassembly_state == reassembly_in_progress; }
+
+    // hello_is_complete() returns false if the client hello is still
+    // being reassembled, or is truncated; as with TCP reassembly, no
+    // fingerprint or analysis is reported for an incomplete hello
+    //
+    bool hello_is_complete() const {
+        return reassembly_state == reassembly_none || reassembly_state == reassembly_done;
+    }
+
     void write_json(struct json_object &record, bool metadata_output=false) {
         if(pre_decrypted) {
             decry_pkt.write_json(record,metadata_output);
@@ -1522,6 +1873,18 @@ public:
         // }
         // frame_dump.close();
         quic_record.close();
+
+        // write indication of truncation or reassembly
+        //
+        if (reassembly_state == reassembly_done) {
+            struct json_object flags{record, "reassembly_properties"};
+            flags.print_key_bool("reassembled", true);
+            flags.close();
+        } else if (reassembly_state != reassembly_none) {
+            struct json_object flags{record, "reassembly_properties"};
+            flags.print_key_bool("truncated", true);
+            flags.close();
+        }
     }
 
     void compute_fingerprint(class fingerprint &fp) const {
@@ -1535,7 +1898,7 @@ public:
             return;
         }
 
-        if (hello.is_not_empty()) {
+        if (hello.is_not_empty() && hello_is_complete()) {
             fp.set_type(fingerprint_type_quic);
             quic_hdr_fp hdr_fp(initial_packet.version);
             fp.add(hdr_fp);
@@ -1548,7 +1911,10 @@ public:
         if(pre_decrypted) {
             return decry_pkt.do_analysis(k_, analysis_, c_);
         }
-        
+        if (!hello_is_complete()) {
+            return false;
+        }
+
         struct datum sn{NULL, NULL};
         struct datum user_agent {NULL, NULL};
         datum alpn;
@@ -1557,7 +1923,7 @@ public:
 
         analysis_.destination.init(sn, user_agent, alpn, k_);
 
-        return c_->analyze_fingerprint_and_destination_context(analysis_.fp, analysis_.destination, analysis_.result);
+        return c_->analyze_fingerprint_and_destination_context(analysis_.fp, analysis_.destination, analysis_.result, analysis_.cache);
     }
 };
 
@@ -0,0 +1,194 @@
+// rcu.h
+//
+// read-copy-update publication of a shared object, such as the
+// classifier, to the packet processing threads
+//
+// Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+// https://github.com/cisco/mercury/blob/master/LICENSE
+
+#ifndef RCU_H
+#define RCU_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// class rcu_publisher<T> holds the current version of an object of
+// type T that is read by many threads, and lets another thread replace
+// it with a new version without stopping or slowing down the readers.
+//
+// Each reading thread uses its own rcu_reader, which caches a pointer
+// to the current version.  Whenever a new version is published, the
+// epoch of the publisher is incremented; each call to
+// rcu_reader::get() compares the epoch to the one that the reader last
+// saw, which costs a single load from a cache line that is almost
+// never written, and only when they differ does the reader pick up the
+// new version and record the new epoch.  Because a reader only uses
+// the pointer that it returned from its latest get(), a version that
+// has been replaced is no longer referenced by a reader once that
+// reader has recorded an epoch that is later than the one in which
+// the version was retired; the version is then deleted, outside of
+// the reading threads, by the publishing thread or by a reclamation
+// thread that the publisher starts when some readers have yet to catch
+// up.  A reader that does not call get() keeps the version that it
+// last saw alive, until it does call get() or it is destroyed.
+//
+// All readers must be destroyed before their publisher.
+//
+template <typename T> class rcu_reader;
+
+template <typename T>
+class rcu_publisher {
+    std::atomic<T *> current;
+    std::atomic<uint64_t> epoch{1};
+
+    std::mutex m;                                     // guards readers and retired
+    std::vector<rcu_reader<T> *> readers;
+    std::vector<std::pair<T *, uint64_t>> retired;    // retired versions and the epochs that they were retired in
+
+    std::thread reclaimer;
+    std::condition_variable stop_reclaimer;
+    bool stopping = false;
+    bool reclaimer_running = false;
+
+    static constexpr std::chrono::milliseconds reclaim_interval{100};
+
+    friend class rcu_reader<T>;
+
+    // reclaim() deletes each retired version that no reader can
+    // reference, and returns true if none remain; the mutex m must be
+    // held by the caller
+    //
+    bool reclaim() {
+        uint64_t oldest = UINT64_MAX;
+        for (const rcu_reader<T> *r : readers) {
+            oldest = std::min(oldest, r->observed.load(std::memory_order_acquire));
+        }
+        auto unreferenced = [oldest](const std::pair<T *, uint64_t> &x) {
+            if (oldest >= x.second) {
+                delete x.first;
+                return true;
+            }
+            return false;
+        };
+        retired.erase(std::remove_if(retired.begin(), retired.end(), unreferenced), retired.end());
+        return retired.empty();
+    }
+
+    void run_reclaimer() {
+        std::unique_lock<std::mutex> lock{m};
+        while (!stopping && !reclaim()) {
+            stop_reclaimer.wait_for(lock, reclaim_interval);
+        }
+        reclaimer_running = false;
+    }
+
+public:
+
+    explicit rcu_publisher(T *initial=nullptr) : current{initial} { }
+
+    ~rcu_publisher() {
+        {
+            std::unique_lock<std::mutex> lock{m};
+            stopping = true;
+        }
+        stop_reclaimer.notify_all();
+        if (reclaimer.joinable()) {
+            reclaimer.join();
+        }
+        for (auto &x : retired) {
+            delete x.first;
+        }
+        delete current.load();
+    }
+
+    rcu_publisher(const rcu_publisher &) = delete;
+    rcu_publisher &operator=(const rcu_publisher &) = delete;
+
+    // get_current() returns the current version; it must not be used
+    // by a thread that might run concurrently with publish(), since
+    // that version could be deleted while it is in use
+    //
+    T *get_current() const { return current.load(std::memory_order_acquire); }
+
+    // publish(x) makes x the current version, and retires the version
+    // that it replaces, which is deleted as soon as no reader can
+    // reference it; this object takes ownership of x
+    //
+    void publish(T *x) {
+        std::unique_lock<std::mutex> lock{m};
+        T *old = current.exchange(x, std::memory_order_acq_rel);
+        uint64_t new_epoch = epoch.fetch_add(1, std::memory_order_acq_rel) + 1;
+        if (old != nullptr) {
+            retired.push_back({ old, new_epoch });
+        }
+        if (reclaim() || reclaimer_running) {
+            return;
+        }
+        if (reclaimer.joinable()) {
+            reclaimer.join();    // the previous reclamation thread has finished
+        }
+        reclaimer_running = true;
+        reclaimer = std::thread{[this]() { run_reclaimer(); }};
+    }
+
+    // num_retired() returns the number of retired versions that have
+    // not yet been deleted
+    //
+    size_t num_retired() {
+        std::unique_lock<std::mutex> lock{m};
+        return retired.size();
+    }
+};
+
+// class rcu_reader<T> gives a single thread access to the current
+// version of the object held by an rcu_publisher<T> (see above)
+//
+template <typename T>
+class rcu_reader {
+    rcu_publisher<T> &publisher;
+    T *cached;
+    uint64_t cached_epoch;
+    alignas(64) std::atomic<uint64_t> observed;     // read by the publisher
+
+    friend class rcu_publisher<T>;
+
+public:
+
+    explicit rcu_reader(rcu_publisher<T> &p) : publisher{p} {
+        std::unique_lock<std::mutex> lock{publisher.m};
+        cached_epoch = publisher.epoch.load(std::memory_order_acquire);
+        cached = publisher.current.load(std::memory_order_acquire);
+        observed.store(cached_epoch, std::memory_order_release);
+        publisher.readers.push_back(this);
+    }
+
+    ~rcu_reader() {
+        std::unique_lock<std::mutex> lock{publisher.m};
+        publisher.readers.erase(std::find(publisher.readers.begin(), publisher.readers.end(), this));
+    }
+
+    rcu_reader(const rcu_reader &) = delete;
+    rcu_reader &operator=(const rcu_reader &) = delete;
+
+    // get() returns the current version, which remains valid until
+    // the next call to get() by this reader, or until it is destroyed
+    //
+    T *get() {
+        uint64_t e = publisher.epoch.load(std::memory_order_acquire);
+        if (e != cached_epoch) {
+            cached = publisher.current.load(std::memory_order_acquire);
+            cached_epoch = e;
+            observed.store(e, std::memory_order_release);
+        }
+        return cached;
+    }
+};
+
+#endif // RCU_H
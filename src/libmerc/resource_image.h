@@ -0,0 +1,352 @@
+/*
+ * resource_image.h
+ *
+ * precompiled binary images of the classifier built from a resource
+ * archive
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef RESOURCE_IMAGE_H
+#define RESOURCE_IMAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// A resource image holds the data structures of a classifier, as
+// they are laid out in memory, so that a classifier can be loaded
+// from an image without parsing, by mapping the image into memory and
+// pointing its arrays at the mapped data (see image_array).  The
+// image is mapped privately, so that the pages of an image file are
+// shared between all of the processes that load it, until (and
+// unless) a process writes to one of them, as when the weights of a
+// classifier are changed.
+//
+// An image consists of a resource_image_header followed by a sequence
+// of scalars and arrays, which are written by an image_writer and
+// read back, in the same order, by an image_reader.  Each array is
+// preceded by its number of elements, and both are aligned to
+// image_alignment bytes.  An image can only be used on a machine
+// with the same byte order and type sizes as the machine that wrote
+// it, and by the same version of libmerc; the header records what is
+// needed to check that.  The indexes and offsets held in an image are
+// checked as it is read, so that a corrupt image is rejected rather
+// than followed out of bounds.
+//
+static constexpr size_t image_alignment = 16;
+
+struct resource_image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t floating_point_size;
+    uint32_t attribute_bitset_size;
+    uint32_t library_version;       // mercury_get_version_number()
+
+    static constexpr char image_magic[8] = { 'm', 'e', 'r', 'c', 'i', 'm', 'g', '\n' };
+
+    // version is incremented whenever the layout of an image changes
+    //
+    static constexpr uint32_t image_version = 2;
+
+    static constexpr uint32_t native_byte_order = 0x01020304;
+
+    static bool is_image(const char *filename) {
+        char buf[sizeof(image_magic)];
+        FILE *f = fopen(filename, "r");
+        if (f == nullptr) {
+            return false;
+        }
+        bool match = fread(buf, sizeof(buf), 1, f) == 1 && memcmp(buf, image_magic, sizeof(buf)) == 0;
+        fclose(f);
+        return match;
+    }
+};
+
+// class image_writer writes scalars and arrays to a resource image
+// file
+//
+class image_writer {
+    FILE *file;
+    size_t offset = 0;
+
+    void write_bytes(const void *data, size_t length) {
+        if (length > 0 && fwrite(data, length, 1, file) != 1) {
+            throw std::runtime_error("error: could not write resource image");
+        }
+        offset += length;
+    }
+
+    void align() {
+        static const uint8_t zeros[image_alignment] = { 0, };
+        if (offset % image_alignment) {
+            write_bytes(zeros, image_alignment - offset % image_alignment);
+        }
+    }
+
+public:
+
+    explicit image_writer(FILE *f) : file{f} { }
+
+    template <typename T>
+    void write(const T &x) {
+        static_assert(std::is_trivially_copyable_v<T>, "only trivially copyable types can be written to an image");
+        align();
+        write_bytes(&x, sizeof(x));
+    }
+
+    template <typename T>
+    void write_array(const T *data, size_t count) {
+        static_assert(std::is_trivially_copyable_v<T>, "only trivially copyable types can be written to an image");
+        write((uint64_t)count);
+        align();
+        write_bytes(data, count * sizeof(T));
+    }
+
+    void write_string(std::string_view s) {
+        write_array(s.data(), s.length());
+    }
+};
+
+// class image_reader reads scalars and arrays from a resource image
+// in memory; arrays are not copied, and instead, a pointer to their
+// first element in the image is returned
+//
+class image_reader {
+    uint8_t *data;
+    size_t length;
+    size_t offset = 0;
+
+    uint8_t *read_bytes(size_t n) {
+        offset = (offset + image_alignment - 1) & ~(image_alignment - 1);
+        if (n > length || offset > length - n) {
+            throw std::runtime_error("error: resource image is truncated");
+        }
+        uint8_t *p = data + offset;
+        offset += n;
+        return p;
+    }
+
+public:
+
+    image_reader(uint8_t *image, size_t image_length) : data{image}, length{image_length} { }
+
+    template <typename T>
+    T read() {
+        static_assert(std::is_trivially_copyable_v<T>, "only trivially copyable types can be read from an image");
+        T x;
+        memcpy(&x, read_bytes(sizeof(T)), sizeof(T));
+        return x;
+    }
+
+    template <typename T>
+    T *read_array(size_t &count) {
+        static_assert(std::is_trivially_copyable_v<T>, "only trivially copyable types can be read from an image");
+        uint64_t n = read<uint64_t>();
+        if (n > length / (sizeof(T) ? sizeof(T) : 1)) {
+            throw std::runtime_error("error: resource image is truncated");
+        }
+        count = n;
+        return (T *)read_bytes(n * sizeof(T));
+    }
+
+    std::string_view read_string() {
+        size_t n;
+        const char *s = read_array<char>(n);
+        return { s, n };
+    }
+};
+
+// class image_array<T> is an array of elements of type T, which is
+// either held in a std::vector that it owns, when it has been built
+// from a resource archive, or in a resource image, when it has been
+// read from one; either way, it is accessed through a pointer to its
+// first element, and can be written to an image.
+//
+template <typename T>
+class image_array {
+    static_assert(std::is_trivially_copyable_v<T>, "image_array elements must be trivially copyable");
+    static_assert(!std::is_same_v<T, bool>, "use uint8_t instead of bool in an image_array");
+
+    std::vector<T> owned;
+    T *ptr = nullptr;
+    size_t count = 0;
+
+public:
+
+    image_array() = default;
+
+    explicit image_array(std::vector<T> &&v) : owned{std::move(v)}, ptr{owned.data()}, count{owned.size()} { }
+
+    explicit image_array(image_reader &r) { ptr = r.read_array<T>(count); }
+
+    image_array(const image_array &rhs) : owned{rhs.owned}, ptr{owned.empty() ? rhs.ptr : owned.data()}, count{rhs.count} { }
+
+    image_array(image_array &&rhs) noexcept : owned{std::move(rhs.owned)}, ptr{rhs.ptr}, count{rhs.count} { }
+
+    image_array &operator=(const image_array &rhs) {
+        if (this != &rhs) {
+            owned = rhs.owned;
+            ptr = owned.empty() ? rhs.ptr : owned.data();
+            count = rhs.count;
+        }
+        return *this;
+    }
+
+    image_array &operator=(image_array &&rhs) noexcept {
+        owned = std::move(rhs.owned);
+        ptr = rhs.ptr;
+        count = rhs.count;
+        return *this;
+    }
+
+    T *data() { return ptr; }
+    const T *data() const { return ptr; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    T &operator[](size_t i) { return ptr[i]; }
+    const T &operator[](size_t i) const { return ptr[i]; }
+
+    T *begin() { return ptr; }
+    T *end() { return ptr + count; }
+    const T *begin() const { return ptr; }
+    const T *end() const { return ptr + count; }
+
+    void write(image_writer &w) const { w.write_array(ptr, count); }
+};
+
+// class string_table holds a sequence of strings in a single
+// image_array of characters, each of which is null-terminated, so
+// that it can be used as a C string
+//
+class string_table {
+    image_array<uint32_t> offsets;
+    image_array<char> chars;
+
+public:
+
+    string_table() = default;
+
+    explicit string_table(const std::vector<std::string> &strings) {
+        std::vector<uint32_t> o;
+        std::vector<char> c;
+        o.reserve(strings.size());
+        for (const auto &s : strings) {
+            o.push_back(c.size());
+            c.insert(c.end(), s.begin(), s.end());
+            c.push_back('\0');
+        }
+        offsets = image_array<uint32_t>{std::move(o)};
+        chars = image_array<char>{std::move(c)};
+    }
+
+    explicit string_table(image_reader &r) : offsets{r}, chars{r} {
+        if (!offsets.empty() && (chars.empty() || chars[chars.size() - 1] != '\0')) {
+            throw std::runtime_error("error: invalid string table in resource image");
+        }
+        for (uint32_t o : offsets) {
+            if (o >= chars.size()) {
+                throw std::runtime_error("error: invalid string table in resource image");
+            }
+        }
+    }
+
+    const char *operator[](size_t i) const { return chars.data() + offsets[i]; }
+
+    size_t size() const { return offsets.size(); }
+
+    void write(image_writer &w) const {
+        offsets.write(w);
+        chars.write(w);
+    }
+};
+
+// class resource_image maps a resource image file into memory, and
+// checks that its header is compatible with this process
+//
+class resource_image {
+    uint8_t *addr = nullptr;
+    size_t length = 0;
+
+public:
+
+    explicit resource_image(const char *filename) {
+        int fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error(std::string{"error: could not open resource image "} + filename);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(resource_image_header)) {
+            close(fd);
+            throw std::runtime_error(std::string{"error: could not read resource image "} + filename);
+        }
+        length = st.st_size;
+        void *a = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (a == MAP_FAILED) {
+            throw std::runtime_error(std::string{"error: could not map resource image "} + filename);
+        }
+        addr = (uint8_t *)a;
+    }
+
+    ~resource_image() {
+        if (addr) {
+            munmap(addr, length);
+        }
+    }
+
+    resource_image(const resource_image &) = delete;
+    resource_image &operator=(const resource_image &) = delete;
+
+    // check_header(floating_point_size, attribute_bitset_size,
+    // library_version) throws an exception if the image was written
+    // by an incompatible program
+    //
+    void check_header(size_t floating_point_size, size_t attribute_bitset_size, uint32_t library_version) const {
+        resource_image_header h;
+        memcpy(&h, addr, sizeof(h));
+        if (memcmp(h.magic, resource_image_header::image_magic, sizeof(h.magic)) != 0) {
+            throw std::runtime_error("error: file is not a resource image");
+        }
+        if (h.version != resource_image_header::image_version
+            || h.byte_order != resource_image_header::native_byte_order
+            || h.floating_point_size != floating_point_size
+            || h.attribute_bitset_size != attribute_bitset_size
+            || h.library_version != library_version) {
+            throw std::runtime_error("error: resource image was compiled by an incompatible version of mercury, or on another platform");
+        }
+    }
+
+    // reader() returns an image_reader positioned after the header
+    //
+    image_reader reader() const {
+        image_reader r{addr, length};
+        r.read<resource_image_header>();
+        return r;
+    }
+
+    static void write_header(image_writer &w, size_t floating_point_size, size_t attribute_bitset_size, uint32_t library_version) {
+        resource_image_header h;
+        memcpy(h.magic, resource_image_header::image_magic, sizeof(h.magic));
+        h.version = resource_image_header::image_version;
+        h.byte_order = resource_image_header::native_byte_order;
+        h.floating_point_size = floating_point_size;
+        h.attribute_bitset_size = attribute_bitset_size;
+        h.library_version = library_version;
+        w.write(h);
+    }
+};
+
+#endif // RESOURCE_IMAGE_H
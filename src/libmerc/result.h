@@ -17,6 +17,8 @@
 
 uint16_t flow_key_get_dst_port(const struct key &key);
 
+destination_address flow_key_get_dst_addr(const struct key &key);
+
 void flow_key_sprintf_dst_addr(const struct key &key,
                                char *dst_addr_str);
 
@@ -273,6 +275,12 @@ public:
 #define MAX_ALPN 16
 #define MAX_ALPN_STR_LEN 128
 
+// struct destination_context holds the destination address, port,
+// server name, user agent, and ALPN of a flow, for use in analysis.
+// The address is held in binary form in dst_addr; its textual form
+// dst_ip_str is only written by set_dst_ip_str(), when the context
+// is returned to a caller outside of the analysis path.
+//
 struct destination_context {
     char dst_ip_str[MAX_DST_ADDR_LEN];
     char sn_str[MAX_SNI_LEN];
@@ -280,13 +288,15 @@ struct destination_context {
     uint8_t alpn_array[MAX_ALPN_STR_LEN];
     size_t alpn_length;
     uint16_t dst_port;
+    destination_address dst_addr;
 
-    destination_context() : dst_port{0} {}
+    destination_context() : dst_port{0} { dst_ip_str[0] = '\0'; }
 
     void init(struct datum domain, struct datum user_agent, datum alpn, const struct key &key) {
         user_agent.strncpy(ua_str, MAX_USER_AGENT_LEN);
         domain.strncpy(sn_str, MAX_SNI_LEN);
-        flow_key_sprintf_dst_addr(key, dst_ip_str);
+        dst_addr = flow_key_get_dst_addr(key);
+        dst_ip_str[0] = '\0';
         dst_port = flow_key_get_dst_port(key);
 
         alpn.write_to_buffer(alpn_array, sizeof(alpn_array));
@@ -294,16 +304,23 @@ struct destination_context {
 
     }
 
+    void set_dst_ip_str() {
+        dst_addr.sprint(dst_ip_str);
+    }
+
 
 };
 
+class analysis_cache;
+
 struct analysis_context {
     fingerprint fp;
     struct destination_context destination;
     struct analysis_result result;
     bool flow_state_pkts_needed;
+    analysis_cache *cache;     // results of recent analyses, or nullptr
 
-    analysis_context() : fp{}, destination{}, result{}, flow_state_pkts_needed{false} {}
+    analysis_context() : fp{}, destination{}, result{}, flow_state_pkts_needed{false}, cache{nullptr} {}
     // could add structs needed for 'scratchwork'
 
     const char *get_server_name() const {
@@ -0,0 +1,368 @@
+/*
+ * softmax.cc
+ *
+ * vectorized exponentiation and reduction of classifier scores
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include "softmax.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SOFTMAX_X86
+
+// the AVX-512 intrinsics use _mm512_undefined_pd() and similar
+// functions as pass-through operands, which some versions of gcc
+// wrongly report as uninitialized
+//
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+// exp(x) is computed as 2^(k/8) * exp(r), where k is the integer
+// nearest to 8x / ln(2), and r = x - k * ln(2)/8, which is at most
+// ln(2)/16 in magnitude.  2^(k/8) is the product of 2^floor(k/8),
+// which is computed by setting the exponent bits of a double, and
+// 2^((k mod 8)/8), which is looked up in a table.  ln(2)/8 is split
+// into a high part with trailing zero bits, so that k * ln2_hi is
+// exact, and a low part.  exp(r) is computed with a degree seven
+// Taylor polynomial, whose relative error on that interval is below
+// 2^-51.  Adding the magic number 1.5 * 2^52 rounds 8x / ln(2) to an
+// integer, which is then held in the low bits of the sum.  The
+// arguments are clamped to softmax_min_arg, so that every
+// intermediate value is a normal number.
+//
+// Each implementation performs the same double precision operations
+// in the same order, without fused multiply-adds, so that they
+// return identical results.
+//
+static constexpr double log2e_8 = 8 * 1.4426950408889634;
+static constexpr double ln2_hi_8 = 6.93147180369123816490e-01 / 8;
+static constexpr double ln2_lo_8 = 1.90821492927058770002e-10 / 8;
+static constexpr double magic = 6755399441055744.0;
+static constexpr double c2 = 1.0 / 2;
+static constexpr double c3 = 1.0 / 6;
+static constexpr double c4 = 1.0 / 24;
+static constexpr double c5 = 1.0 / 120;
+static constexpr double c6 = 1.0 / 720;
+static constexpr double c7 = 1.0 / 5040;
+
+alignas(64) static constexpr double exp2_eighths[8] = {
+    0x1.0000000000000p+0,
+    0x1.172b83c7d517bp+0,
+    0x1.306fe0a31b715p+0,
+    0x1.4bfdad5362a27p+0,
+    0x1.6a09e667f3bcdp+0,
+    0x1.8ace5422aa0dbp+0,
+    0x1.ae89f995ad3adp+0,
+    0x1.d5818dcfba487p+0
+};
+
+static inline int64_t double_bits(double d) {
+    int64_t i;
+    memcpy(&i, &d, sizeof(i));
+    return i;
+}
+
+static inline double bits_double(int64_t i) {
+    double d;
+    memcpy(&d, &i, sizeof(d));
+    return d;
+}
+
+static inline float exp_scalar(float x) {
+    double xd = x < softmax_min_arg ? softmax_min_arg : x;
+    double t = xd * log2e_8 + magic;
+    double k = t - magic;
+    double r = (xd - k * ln2_hi_8) - k * ln2_lo_8;
+    double p = ((((((c7 * r + c6) * r + c5) * r + c4) * r + c3) * r + c2) * r + 1.0) * r + 1.0;
+    int64_t ki = double_bits(t) - double_bits(magic);
+    double scale = bits_double(((uint64_t)(ki & ~7) << 49) + ((uint64_t)1023 << 52));
+    return (float)((p * exp2_eighths[ki & 7]) * scale);
+}
+
+// horizontal_sum(lane) adds the eight lane sums in a fixed order
+//
+static inline double horizontal_sum(const double *lane) {
+    return ((lane[0] + lane[1]) + (lane[2] + lane[3])) + ((lane[4] + lane[5]) + (lane[6] + lane[7]));
+}
+
+// Each implementation makes two passes: the first one replaces each
+// x[i] with exp(x[i]), and adds it to lane i mod 8 of the total, and
+// the second one adds the exponentials to the lanes of each active
+// column in turn.  A lane to which no exponential is added is
+// unchanged, since adding zero to a non-negative sum does not change
+// it.
+//
+static void softmax_reduce_scalar(float *x,
+                                  size_t n,
+                                  const uint64_t *columns,
+                                  size_t words_per_column,
+                                  const uint8_t *active,
+                                  size_t num_active,
+                                  double &sum,
+                                  double *column_sum) {
+
+    // the exponentials of the padding round to zero, and need not be
+    // added to the lanes
+    //
+    double lane[softmax_block_length] = { 0.0 };
+    for (size_t i = 0; i < n; i++) {
+        x[i] = exp_scalar(x[i]);
+        lane[i % softmax_block_length] += x[i];
+    }
+    for (size_t i = n; i < softmax_padded_length(n); i++) {
+        x[i] = 0.0f;
+    }
+    sum = horizontal_sum(lane);
+
+    for (size_t c = 0; c < softmax_max_columns; c++) {
+        column_sum[c] = 0.0;
+    }
+    for (size_t a = 0; a < num_active; a++) {
+        const uint64_t *column = columns + active[a] * words_per_column;
+        for (double &l : lane) {
+            l = 0.0;
+        }
+        for (size_t w = 0; w < words_per_column; w++) {
+            for (uint64_t bits = column[w]; bits != 0; bits &= bits - 1) {
+                size_t i = w * 64 + __builtin_ctzll(bits);
+                lane[i % softmax_block_length] += x[i];
+            }
+        }
+        column_sum[active[a]] = horizontal_sum(lane);
+    }
+}
+
+#ifdef SOFTMAX_X86
+
+__attribute__((target("avx2")))
+static inline __m256d exp_avx2(__m256d x) {
+    x = _mm256_max_pd(x, _mm256_set1_pd(softmax_min_arg));
+    __m256d t = _mm256_add_pd(_mm256_mul_pd(x, _mm256_set1_pd(log2e_8)), _mm256_set1_pd(magic));
+    __m256d k = _mm256_sub_pd(t, _mm256_set1_pd(magic));
+    __m256d r = _mm256_sub_pd(_mm256_sub_pd(x, _mm256_mul_pd(k, _mm256_set1_pd(ln2_hi_8))),
+                              _mm256_mul_pd(k, _mm256_set1_pd(ln2_lo_8)));
+    __m256d p = _mm256_set1_pd(c7);
+    p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(c6));
+    p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(c5));
+    p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(c4));
+    p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(c3));
+    p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(c2));
+    p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(1.0));
+    p = _mm256_add_pd(_mm256_mul_pd(p, r), _mm256_set1_pd(1.0));
+    __m256i ki = _mm256_sub_epi64(_mm256_castpd_si256(t), _mm256_set1_epi64x(double_bits(magic)));
+    __m256d table = _mm256_i64gather_pd(exp2_eighths, _mm256_and_si256(ki, _mm256_set1_epi64x(7)), 8);
+    __m256i scale = _mm256_add_epi64(_mm256_slli_epi64(_mm256_andnot_si256(_mm256_set1_epi64x(7), ki), 49),
+                                     _mm256_set1_epi64x((int64_t)1023 << 52));
+    return _mm256_mul_pd(_mm256_mul_pd(p, table), _mm256_castsi256_pd(scale));
+}
+
+// lane_mask_avx2[b] has all of the bits of lane i set if bit i of b
+// is set, and none of them set otherwise
+//
+#define M(b) (((b) & 1) ? -1LL : 0LL)
+alignas(32) static const int64_t lane_mask_avx2[16][4] = {
+    { M(0), M(0), M(0), M(0) }, { M(1), M(0), M(0), M(0) }, { M(0), M(1), M(0), M(0) }, { M(1), M(1), M(0), M(0) },
+    { M(0), M(0), M(1), M(0) }, { M(1), M(0), M(1), M(0) }, { M(0), M(1), M(1), M(0) }, { M(1), M(1), M(1), M(0) },
+    { M(0), M(0), M(0), M(1) }, { M(1), M(0), M(0), M(1) }, { M(0), M(1), M(0), M(1) }, { M(1), M(1), M(0), M(1) },
+    { M(0), M(0), M(1), M(1) }, { M(1), M(0), M(1), M(1) }, { M(0), M(1), M(1), M(1) }, { M(1), M(1), M(1), M(1) },
+};
+#undef M
+
+__attribute__((target("avx2")))
+static void softmax_reduce_avx2(float *x,
+                                size_t n,
+                                const uint64_t *columns,
+                                size_t words_per_column,
+                                const uint8_t *active,
+                                size_t num_active,
+                                double &sum,
+                                double *column_sum) {
+
+    // each block of eight lanes is held in two vectors, lo and hi,
+    // of four lanes each
+    //
+    const size_t num_blocks = softmax_padded_length(n) / softmax_block_length;
+    __m256d lo = _mm256_setzero_pd();
+    __m256d hi = _mm256_setzero_pd();
+    for (size_t block = 0; block < num_blocks; block++) {
+        float *xb = x + block * softmax_block_length;
+        __m256d e_lo = exp_avx2(_mm256_cvtps_pd(_mm_loadu_ps(xb)));
+        __m256d e_hi = exp_avx2(_mm256_cvtps_pd(_mm_loadu_ps(xb + 4)));
+        __m128 f_lo = _mm256_cvtpd_ps(e_lo);       // round to single precision
+        __m128 f_hi = _mm256_cvtpd_ps(e_hi);
+        _mm_storeu_ps(xb, f_lo);
+        _mm_storeu_ps(xb + 4, f_hi);
+        lo = _mm256_add_pd(lo, _mm256_cvtps_pd(f_lo));
+        hi = _mm256_add_pd(hi, _mm256_cvtps_pd(f_hi));
+    }
+    double lane[softmax_block_length];
+    _mm256_storeu_pd(lane, lo);
+    _mm256_storeu_pd(lane + 4, hi);
+    sum = horizontal_sum(lane);
+
+    for (size_t c = 0; c < softmax_max_columns; c++) {
+        column_sum[c] = 0.0;
+    }
+    for (size_t a = 0; a < num_active; a++) {
+        const uint8_t *mask = (const uint8_t *)(columns + active[a] * words_per_column);
+        lo = _mm256_setzero_pd();
+        hi = _mm256_setzero_pd();
+        for (size_t block = 0; block < num_blocks; block++) {
+            if (mask[block] == 0) {
+                continue;
+            }
+            float *xb = x + block * softmax_block_length;
+            __m256d m_lo = _mm256_load_pd((const double *)lane_mask_avx2[mask[block] & 0x0f]);
+            __m256d m_hi = _mm256_load_pd((const double *)lane_mask_avx2[mask[block] >> 4]);
+            lo = _mm256_add_pd(lo, _mm256_and_pd(_mm256_cvtps_pd(_mm_loadu_ps(xb)), m_lo));
+            hi = _mm256_add_pd(hi, _mm256_and_pd(_mm256_cvtps_pd(_mm_loadu_ps(xb + 4)), m_hi));
+        }
+        _mm256_storeu_pd(lane, lo);
+        _mm256_storeu_pd(lane + 4, hi);
+        column_sum[active[a]] = horizontal_sum(lane);
+    }
+}
+
+__attribute__((target("avx512f")))
+static inline __m512d exp_avx512(__m512d x) {
+    x = _mm512_max_pd(x, _mm512_set1_pd(softmax_min_arg));
+    __m512d t = _mm512_add_pd(_mm512_mul_pd(x, _mm512_set1_pd(log2e_8)), _mm512_set1_pd(magic));
+    __m512d k = _mm512_sub_pd(t, _mm512_set1_pd(magic));
+    __m512d r = _mm512_sub_pd(_mm512_sub_pd(x, _mm512_mul_pd(k, _mm512_set1_pd(ln2_hi_8))),
+                              _mm512_mul_pd(k, _mm512_set1_pd(ln2_lo_8)));
+    __m512d p = _mm512_set1_pd(c7);
+    p = _mm512_add_pd(_mm512_mul_pd(p, r), _mm512_set1_pd(c6));
+    p = _mm512_add_pd(_mm512_mul_pd(p, r), _mm512_set1_pd(c5));
+    p = _mm512_add_pd(_mm512_mul_pd(p, r), _mm512_set1_pd(c4));
+    p = _mm512_add_pd(_mm512_mul_pd(p, r), _mm512_set1_pd(c3));
+    p = _mm512_add_pd(_mm512_mul_pd(p, r), _mm512_set1_pd(c2));
+    p = _mm512_add_pd(_mm512_mul_pd(p, r), _mm512_set1_pd(1.0));
+    p = _mm512_add_pd(_mm512_mul_pd(p, r), _mm512_set1_pd(1.0));
+    __m512i ki = _mm512_sub_epi64(_mm512_castpd_si512(t), _mm512_set1_epi64(double_bits(magic)));
+    __m512d table = _mm512_permutexvar_pd(ki, _mm512_load_pd(exp2_eighths));  // uses the low three bits of ki
+    __m512i scale = _mm512_add_epi64(_mm512_slli_epi64(_mm512_andnot_si512(_mm512_set1_epi64(7), ki), 49),
+                                     _mm512_set1_epi64((int64_t)1023 << 52));
+    return _mm512_mul_pd(_mm512_mul_pd(p, table), _mm512_castsi512_pd(scale));
+}
+
+__attribute__((target("avx512f")))
+static void softmax_reduce_avx512(float *x,
+                                  size_t n,
+                                  const uint64_t *columns,
+                                  size_t words_per_column,
+                                  const uint8_t *active,
+                                  size_t num_active,
+                                  double &sum,
+                                  double *column_sum) {
+
+    const size_t num_blocks = softmax_padded_length(n) / softmax_block_length;
+    __m512d total = _mm512_setzero_pd();
+    for (size_t block = 0; block < num_blocks; block++) {
+        float *xb = x + block * softmax_block_length;
+        __m256 f = _mm512_cvtpd_ps(exp_avx512(_mm512_cvtps_pd(_mm256_loadu_ps(xb))));  // round to single precision
+        _mm256_storeu_ps(xb, f);
+        total = _mm512_add_pd(total, _mm512_cvtps_pd(f));
+    }
+    double lane[softmax_block_length];
+    _mm512_storeu_pd(lane, total);
+    sum = horizontal_sum(lane);
+
+    for (size_t c = 0; c < softmax_max_columns; c++) {
+        column_sum[c] = 0.0;
+    }
+    for (size_t a = 0; a < num_active; a++) {
+        const uint8_t *mask = (const uint8_t *)(columns + active[a] * words_per_column);
+        total = _mm512_setzero_pd();
+        for (size_t block = 0; block < num_blocks; block++) {
+            __m512d e = _mm512_cvtps_pd(_mm256_loadu_ps(x + block * softmax_block_length));
+            total = _mm512_mask_add_pd(total, mask[block], total, e);
+        }
+        _mm512_storeu_pd(lane, total);
+        column_sum[active[a]] = horizontal_sum(lane);
+    }
+}
+
+#endif // SOFTMAX_X86
+
+bool softmax_isa_supported(softmax_isa isa) {
+    switch (isa) {
+    case softmax_isa::scalar:
+        return true;
+#ifdef SOFTMAX_X86
+    case softmax_isa::avx2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    case softmax_isa::avx512:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx512f");
+#endif
+    default:
+        return false;
+    }
+}
+
+const char *softmax_isa_name(softmax_isa isa) {
+    switch (isa) {
+    case softmax_isa::scalar:
+        return "scalar";
+    case softmax_isa::avx2:
+        return "avx2";
+    case softmax_isa::avx512:
+        return "avx512";
+    }
+    return "unknown";
+}
+
+void softmax_reduce(softmax_isa isa,
+                    float *x,
+                    size_t n,
+                    const uint64_t *columns,
+                    size_t words_per_column,
+                    const uint8_t *active,
+                    size_t num_active,
+                    double &sum,
+                    double *column_sum) {
+    switch (isa) {
+#ifdef SOFTMAX_X86
+    case softmax_isa::avx512:
+        softmax_reduce_avx512(x, n, columns, words_per_column, active, num_active, sum, column_sum);
+        return;
+    case softmax_isa::avx2:
+        softmax_reduce_avx2(x, n, columns, words_per_column, active, num_active, sum, column_sum);
+        return;
+#endif
+    default:
+        softmax_reduce_scalar(x, n, columns, words_per_column, active, num_active, sum, column_sum);
+        return;
+    }
+}
+
+// best_isa() returns the fastest implementation that the CPU supports
+//
+static softmax_isa best_isa() {
+    if (softmax_isa_supported(softmax_isa::avx512)) {
+        return softmax_isa::avx512;
+    }
+    if (softmax_isa_supported(softmax_isa::avx2)) {
+        return softmax_isa::avx2;
+    }
+    return softmax_isa::scalar;
+}
+
+void softmax_reduce(float *x,
+                    size_t n,
+                    const uint64_t *columns,
+                    size_t words_per_column,
+                    const uint8_t *active,
+                    size_t num_active,
+                    double &sum,
+                    double *column_sum) {
+    // a single block is faster to compute without vector
+    // instructions, and the results are the same
+    //
+    static const softmax_isa isa = best_isa();
+    softmax_reduce(n > softmax_block_length ? isa : softmax_isa::scalar, x, n, columns, words_per_column, active, num_active, sum, column_sum);
+}
@@ -0,0 +1,90 @@
+/*
+ * softmax.h
+ *
+ * vectorized exponentiation and reduction of classifier scores
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc. All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef SOFTMAX_H
+#define SOFTMAX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// The softmax functions turn a vector of n log-scores x[i] (each of
+// which is at most zero, because the maximum score has already been
+// subtracted) into their exponentials exp(x[i]), the sum of those
+// exponentials, and their sums over subsets of the indices.  Each
+// subset is a column of a column-major bit matrix, with one 64-bit
+// word for every 64 indices, so that column c, word w, bit b
+// corresponds to index 64*w + b; the classifier uses one column for
+// each attribute tag, and one for malware.
+//
+// There are scalar, AVX2, and AVX-512 implementations, and
+// softmax_reduce() uses the best one that the CPU supports.  All of
+// them compute exp() in double precision with the same sequence of
+// operations, round it to single precision as expf() would, and
+// accumulate the values in eight interleaved double precision sums
+// that are added in the same order, so they all return identical
+// results.
+//
+
+// the vector x must be padded to softmax_padded_length(n) elements,
+// with the value softmax_min_arg, whose exponential rounds to zero
+//
+constexpr size_t softmax_block_length = 8;
+constexpr float softmax_min_arg = -200.0f;
+constexpr size_t softmax_max_columns = 16;
+
+inline size_t softmax_padded_length(size_t n) {
+    return (n + softmax_block_length - 1) & ~(softmax_block_length - 1);
+}
+
+enum class softmax_isa {
+    scalar,
+    avx2,
+    avx512
+};
+
+// softmax_isa_supported(isa) returns true if the CPU can run the
+// implementation for isa
+//
+bool softmax_isa_supported(softmax_isa isa);
+
+// softmax_isa_name(isa) returns a readable name for isa
+//
+const char *softmax_isa_name(softmax_isa isa);
+
+// softmax_reduce(x, n, columns, words_per_column, active,
+// num_active, sum, column_sum) replaces each x[i] with exp(x[i]),
+// sets sum to the sum of those exponentials, and sets column_sum[c]
+// to the sum of the exp(x[i]) for which bit i of column c is set,
+// for each c in the array active of length num_active; the other
+// elements of column_sum (up to softmax_max_columns) are set to zero
+//
+void softmax_reduce(float *x,
+                    size_t n,
+                    const uint64_t *columns,
+                    size_t words_per_column,
+                    const uint8_t *active,
+                    size_t num_active,
+                    double &sum,
+                    double *column_sum);
+
+// this version of softmax_reduce() uses the implementation for isa,
+// which must be supported
+//
+void softmax_reduce(softmax_isa isa,
+                    float *x,
+                    size_t n,
+                    const uint64_t *columns,
+                    size_t words_per_column,
+                    const uint8_t *active,
+                    size_t num_active,
+                    double &sum,
+                    double *column_sum);
+
+#endif // SOFTMAX_H
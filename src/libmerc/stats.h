@@ -12,261 +12,676 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <atomic>
 #include <zlib.h>
 #include <functional>
+#include <future>
+#include <exception>
+#include <inttypes.h>
+#include <array>
 
 #include "dict.h"
 #include "queue.h"
 
-// class event_processor_gz coverts a sequence of sorted event
-// strings into an alternative JSON representation
+// class event_processor coverts a sequence of sorted events into an
+// alternative JSON representation, which is appended to a
+// std::string so that it can be formed independently of the
+// (compressed) output file
 //
-class event_processor_gz {
-    std::vector<std::string> prev;
+class event_processor {
+    std::array<std::string, 3> prev;
     bool first_loop;
-    gzFile gzf;
-    std::array<std::string, 4> v;
+    std::string &out;
 
 public:
-    event_processor_gz(gzFile gzfile) : prev{"", "", "", ""}, first_loop{true}, gzf{gzfile} {}
+    event_processor(std::string &output) : prev{"", "", ""}, first_loop{true}, out{output} {}
 
     void process_init() {
         first_loop = true;
-        prev = { "", "", "", "" };
+        prev = { "", "", "" };
     }
 
-    void process_update(const event_msg &event, uint32_t count, const char *version,
-                    const char *git_commit_id, uint32_t git_count, const char *init_time) {
+    void process_update(const char *src,
+                        const std::string &fp,
+                        const std::string &ua,
+                        const std::string &dst,
+                        uint64_t count,
+                        const char *version,
+                        const char *git_commit_id,
+                        uint32_t git_count,
+                        const char *init_time) {
 
-        std::tie(v[0], v[1], v[2], v[3]) = event;
+        const std::string *v[3] = { nullptr, &fp, &ua };
+        const std::string src_str{src};
+        v[0] = &src_str;
 
         // find number of elements that match previous vector
         size_t num_matching = 0;
         for (num_matching=0; num_matching<3; num_matching++) {
-            if (prev[num_matching].compare(v[num_matching]) != 0) {
+            if (prev[num_matching].compare(*v[num_matching]) != 0) {
                 break;
             }
         }
         // set mismatched previous values
         for (size_t i=num_matching; i<3; i++) {
-            prev[i] = v[i];
+            prev[i] = *v[i];
         }
 
         //Format the optional parameter user-agent only if it is present
         //Extra 15 bytes is to account for additional data required for json
         char user_agent[MAX_USER_AGENT_LEN + 15]{"\0"};
-        if(v[2][0] != '\0') {
-            snprintf(user_agent, MAX_USER_AGENT_LEN - 1, "\"user_agent\":\"%s\", ", v[2].c_str());
+        if(ua[0] != '\0') {
+            snprintf(user_agent, MAX_USER_AGENT_LEN - 1, "\"user_agent\":\"%s\", ", ua.c_str());
         }
+        char count_str[24];
+        snprintf(count_str, sizeof(count_str), "%" PRIu64, count);
 
         // output unique elements
-        int gz_ret = 1;
         switch(num_matching) {
         case 0:
             if (!first_loop) {
-                gz_ret = gzprintf(gzf, "}]}]}]}\n");
+                out.append("}]}]}]}\n");
             }
-            if (gz_ret <= 0)
-                throw std::runtime_error("error in gzprintf");
-            gz_ret = gzprintf(gzf, "{\"src_ip\":\"%s\", \"libmerc_init_time\" : \"%s\",\"libmerc_version\": \"%s\","
-                                   " \"build_number\" : \"%u\", \"git_commit_id\": \"%s\", \"fingerprints\":"
-                                   "[{\"str_repr\":\"%s\", \"sessions\": [{%s\"dest_info\":[{\"dst\":\"%s\",\"count\":%u", 
-                v[0].c_str(), init_time, version, git_count, git_commit_id, v[1].c_str(), user_agent, v[3].c_str(), count);
+            out.append("{\"src_ip\":\"").append(src);
+            out.append("\", \"libmerc_init_time\" : \"").append(init_time);
+            out.append("\",\"libmerc_version\": \"").append(version);
+            out.append("\", \"build_number\" : \"").append(std::to_string(git_count));
+            out.append("\", \"git_commit_id\": \"").append(git_commit_id);
+            out.append("\", \"fingerprints\":[{\"str_repr\":\"").append(fp);
+            out.append("\", \"sessions\": [{").append(user_agent);
             break;
         case 1:
-            gz_ret = gzprintf(gzf, "}]}]},{\"str_repr\":\"%s\", \"sessions\": [{%s\"dest_info\":[{\"dst\":\"%s\",\"count\":%u", v[1].c_str(), user_agent, v[3].c_str(), count);
+            out.append("}]}]},{\"str_repr\":\"").append(fp);
+            out.append("\", \"sessions\": [{").append(user_agent);
             break;
         case 2:
-            gzprintf(gzf, "}]},{%s\"dest_info\":[{\"dst\":\"%s\",\"count\":%u", user_agent, v[3].c_str(), count);
+            out.append("}]},{").append(user_agent);
             break;
         case 3:
-            gz_ret = gzprintf(gzf, "},{\"dst\":\"%s\",\"count\":%u", v[3].c_str(), count);
-            break;
+            out.append("},{\"dst\":\"").append(dst).append("\",\"count\":").append(count_str);
+            first_loop = false;
+            return;
         default:
             ;
         }
+        out.append("\"dest_info\":[{\"dst\":\"").append(dst).append("\",\"count\":").append(count_str);
         first_loop = false;
-        if (gz_ret <= 0)
-            throw std::runtime_error("error in gzprintf");
     }
 
     void process_final() {
-        int gz_ret = gzprintf(gzf, "}]}]}]}\n");
-        if (gz_ret <= 0)
-            throw std::runtime_error("error in gzprintf");
+        if (!first_loop) {
+            out.append("}]}]}]}\n");
+        }
     }
 
 };
 
 #define ANON_SRC_IP
 
-// class event_encoder provides methods to compress/decompress event string.
-// Its member functions are not const because they may update the dict
-// member.
+// the fingerprint, user agent, and destination strings of an event
+// are interned into the dictionaries of the producer that observed
+// it.  Each producer has num_dict_epochs sets of dictionaries, and
+// uses the set for the data_aggregator's current epoch modulo
+// num_dict_epochs.  The epoch is incremented whenever a
+// stats_aggregator is swapped out for printing; the stats_aggregator
+// that is being printed holds events from the previous two epochs,
+// so a producer can safely clear the set of dictionaries for a new
+// epoch before using it.
+//
+static constexpr uint32_t num_dict_epochs = 3;
 
-class event_encoder {
-    dict fp_dict;
-    dict ua_dict;
+struct event_dicts {
+    producer_dict fp;
+    producer_dict ua;
+    producer_dict dst;
+};
 
-public:
+// class event_producer is the per-thread interface through which a
+// packet processor reports events to a data_aggregator.  It interns
+// event strings into its own dictionaries, so that no hashing of
+// those strings or memory allocation takes place on the consumer
+// thread, and it passes the events to the consumer as fixed-width
+// event_records through a wait-free message_queue.
+//
+class event_producer {
+    message_queue q;
+    std::array<event_dicts, num_dict_epochs> dicts;
+    const std::atomic<uint32_t> &aggregator_epoch;
+    uint32_t epoch;
+    std::string scratch;  // used as preallocated temporary variable
+    bool active;
+
+    friend class data_aggregator;
+
+    event_dicts &current_dicts() { return dicts[epoch % num_dict_epochs]; }
+
+    // reset() prepares a removed producer for reuse by a new thread;
+    // its queue must be empty, and none of its events may remain in
+    // a stats_aggregator.  The drop count is retained, since it is
+    // included in data_aggregator::get_num_dropped_events().
+    //
+    void reset() {
+        for (auto &d : dicts) {
+            d.fp.clear();
+            d.ua.clear();
+            d.dst.clear();
+        }
+        epoch = aggregator_epoch.load();
+        active = true;
+    }
 
-    event_encoder() : fp_dict{}, ua_dict{} {}
+public:
 
-    bool compute_inverse_map() {
-        return fp_dict.compute_inverse_map() && ua_dict.compute_inverse_map();
+    event_producer(const std::atomic<uint32_t> &ag_epoch, size_t queue_depth) :
+        q{queue_depth},
+        dicts{},
+        aggregator_epoch{ag_epoch},
+        epoch{ag_epoch.load()},
+        scratch{},
+        active{true}
+    { }
+
+    // push_event(write_event) updates the dictionary epoch if the
+    // data_aggregator has started a new one, then calls
+    // write_event(event_record &, event_producer &) to fill in an
+    // event_record, and pushes that record onto the queue.  It
+    // returns true on success, and false if the queue was full.
+    //
+    template <typename W>
+    bool push_event(W write_event) {
+        uint32_t ag_epoch = aggregator_epoch.load(std::memory_order_acquire);
+        if (ag_epoch != epoch) {
+            epoch = ag_epoch;
+            event_dicts &d = current_dicts();
+            d.fp.clear();
+            d.ua.clear();
+            d.dst.clear();
+        }
+        event_record ev{};
+        ev.epoch = epoch;
+        write_event(ev, *this);
+        const event_dicts &d = current_dicts();
+        uint64_t x = d.fp.string_hash(ev.fp) * 0x9e3779b97f4a7c15ULL;
+        x = (x ^ d.ua.string_hash(ev.ua)) * 0x9e3779b97f4a7c15ULL;
+        x = (x ^ d.dst.string_hash(ev.dst)) * 0x9e3779b97f4a7c15ULL;
+        ev.digest = x ^ (x >> 29);
+        return q.push(ev);
     }
 
-    void get_inverse(event_msg &event) {
-        const std::string &fngr = std::get<1>(event);
-        const std::string &ua   = std::get<2>(event);
+    // get_fingerprint_id(fp, digest) returns the identifier of the
+    // fingerprint string fp, whose digest (see fingerprint.h) is
+    // digest, without hashing fp
+    //
+    uint32_t get_fingerprint_id(std::string_view fp, uint64_t digest) {
+        return current_dicts().fp.get(fp, digest);
+    }
 
-        size_t compressed_fp_num = strtol(fngr.c_str(), NULL, 16);
-        size_t compressed_ua_num = strtol(ua.c_str(), NULL, 16);
+    uint32_t get_user_agent_id(const char *ua) {
+        scratch.assign(ua);
+        return current_dicts().ua.get(scratch);
+    }
 
-        std::get<1>(event) = fp_dict.get_inverse(compressed_fp_num);
-        std::get<2>(event) = ua_dict.get_inverse(compressed_ua_num);
+    // get_destination_id() returns the identifier of the destination
+    // context "(server_name)(dst_ip)(dst_port)"
+    //
+    uint32_t get_destination_id(const char *server_name, const char *dst_ip, const char *dst_port) {
+        scratch.assign("(");
+        scratch.append(server_name).append(")(");
+        scratch.append(dst_ip).append(")(");
+        scratch.append(dst_port).append(")");
+        return current_dicts().dst.get(scratch);
     }
 
-    void compress_event_string(event_msg& event, dict& addr_dict) {
+    // the functions below may be called from any thread
+    //
+    uint64_t drops() const { return q.drops(); }
 
-        const std::string &addr = std::get<0>(event);
-        const std::string &fngr = std::get<1>(event);
-        const std::string &ua   = std::get<2>(event);
+    // inverse_maps hold the inverse of the fingerprint, user agent,
+    // and destination dictionaries for a particular epoch
+    //
+    struct inverse_maps {
+        std::vector<const std::string *> fp;
+        std::vector<const std::string *> ua;
+        std::vector<const std::string *> dst;
+
+        static const std::string &lookup(const std::vector<const std::string *> &inverse, uint32_t index) {
+            static const std::string unknown{dict::unknown_fp_string};
+            if (index < inverse.size()) {
+                return *inverse[index];
+            }
+            return unknown;
+        }
+    };
 
-        // compress source address string, for anonymization (regardless of ANON_SRC_IP)
-        char src_addr_buf[9];
-        addr_dict.compress(addr, src_addr_buf);
+    inverse_maps get_inverse_maps(uint32_t dict_epoch) const {
+        const event_dicts &d = dicts[dict_epoch % num_dict_epochs];
+        return { d.fp.get_inverse_map(), d.ua.get_inverse_map(), d.dst.get_inverse_map() };
+    }
+};
 
-        // compress fingerprint string
-        char compressed_fp_buf[9];
-        fp_dict.compress(fngr, compressed_fp_buf);
+// class src_addr_dict maps each source address to a small integer,
+// for anonymization (regardless of ANON_SRC_IP)
+//
+class src_addr_dict {
+
+    struct hash_src_addr {
+        size_t operator()(const event_src_addr &a) const {
+            uint64_t x = ((uint64_t)a.addr[0] << 32 | a.addr[1]) ^ ((uint64_t)a.addr[2] << 32 | a.addr[3]);
+            x ^= a.ip_vers;
+            x *= 0x9e3779b97f4a7c15ULL;
+            return x ^ (x >> 32);
+        }
+    };
 
-        char compressed_ua_buf[9];
-        ua_dict.compress(ua, compressed_ua_buf);
+    std::unordered_map<event_src_addr, uint32_t, hash_src_addr> d;
+
+public:
 
-        std::get<0>(event) = src_addr_buf;
-        std::get<1>(event) = compressed_fp_buf;
-        std::get<2>(event) = compressed_ua_buf;
+    src_addr_dict() : d{} { }
 
+    uint32_t get(const event_src_addr &a) {
+        auto x = d.find(a);
+        if (x == d.end()) {
+            uint32_t index = d.size();
+            d.emplace(a, index);
+            return index;
+        }
+        return x->second;
     }
+};
 
+// struct event_key identifies an entry in a stats_aggregator's
+// event_table; the fingerprint, user agent, and destination are the
+// identifiers assigned by the producer during the dictionary epoch
+//
+struct event_key {
+    uint32_t producer;
+    uint32_t epoch;
+    uint32_t src;
+    uint32_t fp;
+    uint32_t ua;
+    uint32_t dst;
+
+    bool operator==(const event_key &rhs) const {
+        return producer == rhs.producer
+            && epoch == rhs.epoch
+            && src == rhs.src
+            && fp == rhs.fp
+            && ua == rhs.ua
+            && dst == rhs.dst;
+    }
 };
 
-struct hash_tuple {
-    template <class T1, class T2, class T3, class T4>
+struct hash_event_key {
+    size_t operator()(const event_key &k) const {
+        uint64_t x = ((uint64_t)k.producer << 32 | k.epoch);
+        x = (x ^ ((uint64_t)k.src << 32 | k.fp)) * 0x9e3779b97f4a7c15ULL;
+        x = (x ^ ((uint64_t)k.ua << 32 | k.dst)) * 0x9e3779b97f4a7c15ULL;
+        return x ^ (x >> 29);
+    }
+};
 
-    size_t operator()(const std::tuple<T1, T2, T3, T4>& x) const {
-        std::hash<std::string> hasher;
-        return hasher(std::get<0>(x))
-                ^ hasher(std::get<1>(x))
-                ^ hasher(std::get<2>(x))
-                ^ hasher(std::get<3>(x));
+// class dump_thread_pool holds the worker threads that sort and
+// format the shards of a stats_aggregator.  They are started once,
+// by the data_aggregator, and wait for work between stats dumps.
+//
+class dump_thread_pool {
+    std::vector<std::thread> threads;
+    std::mutex m;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    std::function<void()> work;
+    uint64_t generation;
+    size_t running;
+    bool stopping;
+
+    void worker() {
+        uint64_t last_generation = 0;
+        std::unique_lock lock{m};
+        while (true) {
+            work_ready.wait(lock, [&]() { return stopping || generation != last_generation; });
+            if (stopping) {
+                return;
+            }
+            last_generation = generation;
+            lock.unlock();
+            work();      // work is not changed until running is zero
+            lock.lock();
+            if (--running == 0) {
+                work_done.notify_all();
+            }
+        }
+    }
+
+public:
+
+    dump_thread_pool(size_t num_threads) : threads{}, work{}, generation{0}, running{0}, stopping{false} {
+        for (size_t t = 0; t < num_threads; t++) {
+            threads.emplace_back([this]() { worker(); });
+        }
+    }
+
+    ~dump_thread_pool() {
+        {
+            std::lock_guard lock{m};
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for (auto &t : threads) {
+            t.join();
+        }
+    }
+
+    // start(f) calls f on each thread of the pool; wait() MUST be
+    // called before start() is called again
+    //
+    void start(std::function<void()> f) {
+        std::lock_guard lock{m};
+        work = std::move(f);
+        running = threads.size();
+        ++generation;
+        work_ready.notify_all();
+    }
+
+    // wait() returns once every call to the function passed to
+    // start() has returned
+    //
+    void wait() {
+        std::unique_lock lock{m};
+        work_done.wait(lock, [this]() { return running == 0; });
+        work = nullptr;
     }
 };
 
 // class stats_aggregator manages all of the data needed to gather and
 // report aggregate statistics about (fingerprint and destination)
-// events
+// events.  The event table is split into num_stats_shards shards,
+// by the first hex digit of the anonymized source address, so that no
+// single hash table grows too large to rehash quickly, and so that
+// the shards can be sorted and formatted in parallel when the table
+// is printed, and written out in the order of the source address
+// strings.
+//
+// An event observed by several producers, or in both of the epochs
+// held by a stats_aggregator, has an entry for each, which are merged
+// when the table is printed.  The max_entries limit applies to the
+// distinct events, which are tracked by their digests, so that it
+// does not depend on the number of producers.
 //
+static constexpr size_t num_stats_shards = 16;
+
 class stats_aggregator {
-    std::unordered_map<event_msg, uint64_t, hash_tuple> event_table;
-    event_encoder encoder;
-    std::string observation;  // used as preallocated temporary variable
-    size_t num_entries;
+    std::array<std::unordered_map<event_key, uint64_t, hash_event_key>, num_stats_shards> shards;
+    std::unordered_set<uint64_t> dict_keys;  // (producer, epoch) pairs in shards
+    std::unordered_set<uint64_t> distinct;   // digests of the distinct events in shards
     size_t max_entries;
-    dict &addr_dict;
+    src_addr_dict &addr_dict;
+
+    // a merged_event is an event table entry whose identifiers have
+    // been replaced by the corresponding strings, so that entries
+    // from different producers and epochs can be merged
+    //
+    struct merged_event {
+        uint32_t src;
+        uint64_t src_order;
+        const std::string *fp;
+        const std::string *ua;
+        const std::string *dst;
+        uint64_t count;
+
+        bool operator<(const merged_event &rhs) const {
+            if (src_order != rhs.src_order) {
+                return src_order < rhs.src_order;
+            }
+            if (int cmp = fp->compare(*rhs.fp)) {
+                return cmp < 0;
+            }
+            if (int cmp = ua->compare(*rhs.ua)) {
+                return cmp < 0;
+            }
+            return dst->compare(*rhs.dst) < 0;
+        }
+
+        bool same_event(const merged_event &rhs) const {
+            return src == rhs.src && *fp == *rhs.fp && *ua == *rhs.ua && *dst == *rhs.dst;
+        }
+    };
+
+    typedef std::unordered_map<uint64_t, event_producer::inverse_maps> inverse_map_table;
+
+    // hex_order(src) returns a key that orders source addresses in the
+    // same way as their hexadecimal strings, as written by
+    // format_shard(): the digits, aligned to the left, followed by the
+    // number of digits, so that a prefix comes first
+    //
+    static uint64_t hex_order(uint32_t src) {
+        unsigned int digits = 1;
+        while (digits < 8 && (src >> (4 * digits)) != 0) {
+            ++digits;
+        }
+        uint32_t aligned = src << (4 * (8 - digits));
+        return (uint64_t)aligned << 4 | digits;
+    }
+
+    // shard_of(src) returns the shard that holds the events from the
+    // source address src, which is its first hex digit
+    //
+    static size_t shard_of(uint32_t src) {
+        return hex_order(src) >> 32;
+    }
+
+    static uint64_t dict_key(uint32_t producer, uint32_t epoch) {
+        return (uint64_t)producer << 32 | epoch;
+    }
+
+    // format_shard() writes the JSON representation of the events in
+    // shard i into a string, and then clears the shard; it may be
+    // called concurrently for different shards
+    //
+    std::string format_shard(size_t i,
+                             const inverse_map_table &inverse,
+                             const char *version,
+                             const char *git_commit_id,
+                             uint32_t git_count,
+                             const char *init_time,
+                             const std::atomic<bool> &interrupt) {
+
+        auto &event_table = shards[i];
+        std::vector<merged_event> v;
+        v.reserve(event_table.size());
+        for (const auto &entry : event_table) {
+            const event_key &k = entry.first;
+            const auto inv = inverse.find(dict_key(k.producer, k.epoch));
+            if (inv == inverse.end()) {
+                continue;  // error: unknown producer
+            }
+            const event_producer::inverse_maps &maps = inv->second;
+            v.push_back({
+                    k.src,
+                    hex_order(k.src),
+                    &maps.lookup(maps.fp, k.fp),
+                    &maps.lookup(maps.ua, k.ua),
+                    &maps.lookup(maps.dst, k.dst),
+                    entry.second
+                });
+        }
+        event_table.clear();
+        std::sort(v.begin(), v.end(), [&interrupt](auto &l, auto &r){
+            if (interrupt.load() == true) {
+                throw std::runtime_error("error: stats dump interrupted");
+            } else {
+                return l < r;
+            }
+        } );
+
+        std::string output;
+        event_processor ep(output);
+        ep.process_init();
+        for (auto it = v.begin(); it != v.end(); ) {
+            if (interrupt.load() == true) {
+                throw std::runtime_error("error: stats dump interrupted");
+            }
+
+            // sum the counts of identical events
+            //
+            uint64_t count = it->count;
+            auto next = it + 1;
+            while (next != v.end() && next->same_event(*it)) {
+                count += next->count;
+                ++next;
+            }
+
+            char src_ip[9];
+            snprintf(src_ip, sizeof(src_ip), "%x", it->src);
+            ep.process_update(src_ip, *it->fp, *it->ua, *it->dst, count, version, git_commit_id, git_count, init_time);
+            it = next;
+        }
+        ep.process_final();
+
+        return output;
+    }
 
 public:
 
-    stats_aggregator(dict& _addr_dict, size_t size_limit) : event_table{}, encoder{}, observation{}, num_entries{0}, max_entries{size_limit}, addr_dict{_addr_dict} { }
+    stats_aggregator(src_addr_dict& _addr_dict, size_t size_limit) : shards{}, dict_keys{}, distinct{}, max_entries{size_limit}, addr_dict{_addr_dict} { }
 
     ~stats_aggregator() {  }
 
-    void observe_event_string(event_msg &obs) {
+    void observe_event(const event_record &ev, uint32_t producer) {
 
-        encoder.compress_event_string(obs, addr_dict);
+        event_key k{producer, ev.epoch, addr_dict.get(ev.src), ev.fp, ev.ua, ev.dst};
+        auto &event_table = shards[shard_of(k.src)];
 
-        const auto entry = event_table.find(obs);
+        const auto entry = event_table.find(k);
         if (entry != event_table.end()) {
             entry->second = entry->second + 1;
         } else {
-            if (max_entries && num_entries >= max_entries) {
-                return;  // don't go over the max_entries limit
+            const uint64_t digest = (ev.digest ^ k.src) * 0x9e3779b97f4a7c15ULL;
+            if (distinct.find(digest) == distinct.end()) {
+                if (max_entries && distinct.size() >= max_entries) {
+                    return;  // don't go over the max_entries limit
+                }
+                distinct.insert(digest);
             }
-            event_table.emplace(obs, 1);  // TODO: check return value for allocation failure
-            ++num_entries;
+            event_table.emplace(k, 1);  // TODO: check return value for allocation failure
+            dict_keys.insert(dict_key(producer, ev.epoch));
         }
     }
 
-    bool is_empty() const { return event_table.size() == 0; }
+    bool is_empty() const { return distinct.empty(); }
 
+    // gzprint() writes out and then clears the event table; the
+    // vector producers must hold the event_producer for each producer
+    // index that appears in the table.  The shards are sorted and
+    // formatted by the threads of workers, while the calling thread
+    // compresses and writes them out, in order.
+    //
     void gzprint(gzFile f, const char *version, const char *git_commit_id,
                  uint32_t git_count,
                  const char *init_time,
-                 std::atomic<bool> &interrupt ) {
+                 const std::vector<event_producer *> &producers,
+                 std::atomic<bool> &interrupt,
+                 dump_thread_pool &workers) {
 
-        if (event_table.size() == 0) {
+        if (distinct.empty()) {
             return;  // nothing to report
         }
 
-        // note: this function is not const because of compute_inverse_map()
-
-        // compute decoding table for elements
-        if (encoder.compute_inverse_map() == false) {
-            return;  // error; unable to compute fingerprint decompression map
+        // obtain the inverse dictionary maps for each (producer,
+        // epoch) pair that appears in the table; they are shared by
+        // all of the worker threads
+        //
+        inverse_map_table inverse;
+        for (uint64_t k : dict_keys) {
+            uint32_t producer = k >> 32;
+            if (producer < producers.size()) {
+                inverse.emplace(k, producers[producer]->get_inverse_maps(k & 0xffffffff));
+            }
         }
+        dict_keys.clear();
+        distinct.clear();
+
+        std::array<std::promise<std::string>, num_stats_shards> output;
+        std::atomic<size_t> next_shard{0};
+        auto worker = [&]() {
+            for (size_t i = next_shard++; i < num_stats_shards; i = next_shard++) {
+                try {
+                    output[i].set_value(format_shard(i, inverse, version, git_commit_id, git_count, init_time, interrupt));
+                }
+                catch (...) {
+                    output[i].set_exception(std::current_exception());
+                }
+            }
+        };
+        workers.start(worker);
 
-        std::vector<std::pair<event_msg, uint64_t>> v(event_table.begin(), event_table.end());
-        event_table.clear();
-        num_entries = 0;
-        std::sort(v.begin(), v.end(), [&interrupt](auto &l, auto &r){
-            if (interrupt.load() == true) {
-                throw std::runtime_error("error: stats dump interrupted");
-            } else {
-                return l.first < r.first;
-            } 
-        } );
-
-        event_processor_gz ep(f);
-        ep.process_init();
-        for (auto &entry : v) {
-            if (interrupt.load() == true) {
-                ep.process_final();
-                throw std::runtime_error("error: stats dump interrupted");
+        // write out each shard as soon as it is ready; after an
+        // error, the remaining shards are discarded, but the workers
+        // must still finish
+        //
+        std::exception_ptr error;
+        for (auto &shard_output : output) {
+            try {
+                std::string s = shard_output.get_future().get();
+                if (!error && s.length() > 0 && gzwrite(f, s.data(), s.length()) <= 0) {
+                    throw std::runtime_error("error in gzwrite");
+                }
+            }
+            catch (...) {
+                if (!error) {
+                    error = std::current_exception();
+                }
             }
-            encoder.get_inverse(entry.first);
-            ep.process_update(entry.first, entry.second, version, git_commit_id, git_count, init_time);
         }
-        ep.process_final();
-
-        // if (fp_dict.unit_test(stderr)) {
-        //     fprintf(stderr, "passed fp_dict.unit_test()\n");
-        // }
-
-        return;
+        workers.wait();
+        if (error) {
+            std::rethrow_exception(error);
+        }
     }
 
+    // get_num_entries() returns the number of distinct events
+    //
     size_t get_num_entries() const
     {
-        return num_entries;
+        return distinct.size();
     }
 };
 
 #define MAX_VERSION_STRING 15
 
 class data_aggregator {
-    std::vector<class message_queue *> q;
+    std::vector<event_producer *> producers;   // indexed by producer id
+
+    // a removed producer is retired along with the number of
+    // gzprint() calls that had started when it was removed; its
+    // events are written out by the next gzprint(), after which it
+    // can be reused by add_producer()
+    //
+    struct retired_producer {
+        uint32_t index;
+        uint64_t prints_started;
+    };
+    std::vector<retired_producer> retired;
+    uint64_t prints_started;
+    uint64_t prints_completed;
     stats_aggregator ag1, ag2, *ag;
     std::atomic<bool> shutdown_requested;
-    dict addr_dict;
+    std::atomic<uint32_t> epoch;
+    src_addr_dict addr_dict;
     std::thread consumer_thread;
     std::mutex m;
     std::mutex output_mutex;
     char version[MAX_VERSION_STRING];
+    size_t queue_depth;
+    dump_thread_pool dump_threads;    // worker threads used by gzprint()
+    uint64_t stale_count;   // events discarded because their epoch had expired
 
     // stop_processing() MUST NOT be called until all writing to the
     // message_queues has stopped
@@ -280,22 +695,28 @@ class data_aggregator {
         }
     }
 
-    void empty_event_queue(message_queue *q) {
+    // empty_event_queue() MUST be called with the mutex m held
+    //
+    void empty_event_queue(uint32_t producer) {
         //fprintf(stderr, "note: emptying message queue in %p\n", (void *)this);
-        event_msg event;
-        while (q->pop(event)) {
+        const uint32_t current_epoch = epoch.load(std::memory_order_relaxed);
+        event_record event;
+        while (producers[producer]->q.pop(event)) {
             //fprintf(stderr, "note: got message\n");
-            ag->observe_event_string(event);
+            if (event.epoch + 1 < current_epoch) {
+                ++stale_count;   // the dictionaries for this epoch may have been cleared
+                continue;
+            }
+            ag->observe_event(event, producer);
         }
     }
 
     void process_event_queues() {
         std::lock_guard m_guard{m};
         //fprintf(stderr, "note: processing event queue of size %zd in %p\n", q.size(), (void *)this);
-        if (q.size()) {
-            for (auto & qr : q) {
-                //fprintf(stderr, "note: processing event queue %p in %p with size %zd\n", (void *)qr, (void *)this, qr->size());
-                empty_event_queue(qr);
+        for (uint32_t i = 0; i < producers.size(); i++) {
+            if (producers[i]->active) {
+                empty_event_queue(i);
             }
         }
     }
@@ -310,7 +731,19 @@ class data_aggregator {
 
 public:
 
-    data_aggregator(size_t size_limit=0) : q{}, ag1{addr_dict, size_limit}, ag2{addr_dict, size_limit}, ag{&ag1}, shutdown_requested{false} {
+    data_aggregator(size_t size_limit=0, size_t event_queue_depth=EVENT_BUF_SIZE, size_t num_dump_threads=1) :
+        producers{},
+        retired{},
+        prints_started{0},
+        prints_completed{0},
+        ag1{addr_dict, size_limit},
+        ag2{addr_dict, size_limit},
+        ag{&ag1},
+        shutdown_requested{false},
+        epoch{0},
+        queue_depth{event_queue_depth},
+        dump_threads{std::clamp(num_dump_threads, (size_t)1, num_stats_shards)},
+        stale_count{0} {
         mercury_get_version_string(version, MAX_VERSION_STRING);
         start_processing();
         //fprintf(stderr, "note: constructing data_aggregator %p\n", (void *)this);
@@ -320,35 +753,49 @@ public:
         //fprintf(stderr, "note: destructing data_aggregator %p\n", (void *)this);
         stop_processing();
 
-        // delete message_queues, if any
-        for (auto & x : q) {
-            //fprintf(stderr, "%s: deleting message_queue %p\n", __func__, (void *)x);
+        // delete event_producers, if any
+        for (auto & x : producers) {
+            //fprintf(stderr, "%s: deleting event_producer %p\n", __func__, (void *)x);
             delete x;
         }
     }
 
-    message_queue *add_producer() {
+    event_producer *add_producer() {
         std::lock_guard m_guard{m};
         //fprintf(stderr, "note: adding producer in %p\n", (void *)this);
-        q.push_back(new message_queue);
-        return q.back();
+        for (auto r = retired.begin(); r != retired.end(); r++) {
+            if (r->prints_started < prints_completed) {
+                event_producer *p = producers[r->index];
+                retired.erase(r);
+                p->reset();
+                return p;
+            }
+        }
+        producers.push_back(new event_producer{epoch, queue_depth});
+        return producers.back();
     }
 
-    void remove_producer(message_queue *p) {
+    // remove_producer(p) processes the remaining events from p and
+    // deactivates it; the producer's dictionaries are retained until
+    // its events have been written out by gzprint(), after which
+    // add_producer() can reuse it
+    //
+    void remove_producer(event_producer *p) {
         if (p == nullptr) {
             return;
         }
         std::lock_guard m_guard{m};
         //fprintf(stderr, "note: removing producer in %p\n", (void *)this);
-        empty_event_queue(p);
-        for (std::vector<message_queue *>::iterator it = q.begin(); it < q.end(); it++) {
-            if (*it == p) {
-                //fprintf(stderr, "%s: deleting and erasing message_queue p=%p in %p\n", __func__, (void *)p, (void *)this);
-                delete *it;
-                q.erase(it);
+        size_t num_active = 0;
+        for (uint32_t i = 0; i < producers.size(); i++) {
+            if (producers[i] == p && p->active) {
+                empty_event_queue(i);
+                p->active = false;
+                retired.push_back({i, prints_started});
             }
+            num_active += producers[i]->active;
         }
-        if (q.size() == 0) {
+        if (num_active == 0) {
             shutdown_requested.store(true);  // time to close up shop
         }
     }
@@ -370,9 +817,13 @@ public:
 
         // swap ag pointer, so that we can print out the previously
         // gathered data while new events are tracked in the other
-        // stats_aggregator
+        // stats_aggregator, and start a new dictionary epoch; the
+        // consumer thread is only blocked for the duration of the
+        // swap, and continues to process events while the previous
+        // stats_aggregator is printed
         //
         stats_aggregator *tmp;
+        std::vector<event_producer *> producers_snapshot;
         {
             std::lock_guard m_guard{m};
             tmp = ag;
@@ -381,20 +832,49 @@ public:
             } else {
                 ag = &ag1;
             }
+            epoch.store(epoch.load() + 1, std::memory_order_release);
+            producers_snapshot = producers;
+            ++prints_started;
         }
 
         try {
-            tmp->gzprint(f, version, git_commit_id, git_count, init_time, std::ref(shutdown_requested));
+            tmp->gzprint(f, version, git_commit_id, git_count, init_time, producers_snapshot, std::ref(shutdown_requested), dump_threads);
         }
         catch (std::exception &e) {
             printf_err(log_err, "%s\n", e.what());
         }
+
+        std::lock_guard m_guard{m};
+        ++prints_completed;
+    }
+
+    // get_num_producers() returns the number of event_producers that
+    // have been allocated, including those that have been removed
+    // and are awaiting reuse
+    //
+    size_t get_num_producers() {
+        std::lock_guard m_guard{m};
+        return producers.size();
     }
 
     size_t get_num_entries() const
     {
         return ag->get_num_entries();
     }
+
+    // get_num_dropped_events() returns the total number of events
+    // that producers could not push because their message_queue was
+    // full, or that were discarded because they arrived after their
+    // dictionary epoch had expired
+    //
+    uint64_t get_num_dropped_events() {
+        std::lock_guard m_guard{m};
+        uint64_t total = stale_count;
+        for (const auto & p : producers) {
+            total += p->drops();
+        }
+        return total;
+    }
 };
 
 #endif // STATS_H
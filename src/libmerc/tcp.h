@@ -11,7 +11,12 @@
 #include <stdint.h>
 #include <string.h>
 #include <unordered_map>
+#include <array>
+#include <memory>
+#include <type_traits>
+#include <vector>
 #include "datum.h"
+#include "flow_map.h"
 #include "json_object.h"
 #include "util_obj.h"
 
@@ -165,9 +170,12 @@ void fprintf_tcp_hdr_info(FILE *f, const struct key *k, const struct tcp_header
 #define DROP_PACKET     0
 
 struct tcp_initial_message_filter {
-    std::unordered_map<struct key, struct tcp_state> tcp_flow_table;
+    flow_map<struct key, struct tcp_state> tcp_flow_table;
 
-    tcp_initial_message_filter(void) : tcp_flow_table{} {}
+    static const unsigned int timeout = 60;       // seconds of inactivity before flow timeout
+    static const size_t default_capacity = 65536;
+
+    tcp_initial_message_filter(size_t capacity=default_capacity) : tcp_flow_table{capacity} {}
 
     // A TCP message is defined as the set of TCP/IP packets for which
     // the ACK flag is set, the Ack value is constant, and the Seq is
@@ -184,16 +192,17 @@ struct tcp_initial_message_filter {
     // p.ack = s.ack       talking           listening               *
     // p.ack < s.ack          *                  *                   *
 
-    size_t apply(struct key &k, const struct tcp_header *tcp, size_t length) {
+    size_t apply(struct key &k, const struct tcp_header *tcp, size_t length, unsigned int sec) {
 
         size_t retval = DROP_PACKET;
+        tcp_flow_table.advance(sec);
 
         k.src_port = tcp->src_port;
         k.dst_port = tcp->dst_port;
         size_t data_length = length - tcp_offrsv_get_header_length(tcp->offrsv);
 
         auto it = tcp_flow_table.find(k);
-        if (it == tcp_flow_table.end()) {
+        if (it == tcp_flow_table.nil) {
 
             uint32_t tmp_seq = tcp->seq;
             if (TCP_IS_SYN(tcp->flags)) {
@@ -206,14 +215,14 @@ struct tcp_initial_message_filter {
                                        tcp->ack, // .init_ack
                                        listening // .disposition
             };
-            tcp_flow_table[k] = state;
+            tcp_flow_table.emplace(k, sec + timeout, state);
             retval = ACCEPT_PACKET;
 
             fprintf_tcp_hdr_info(stderr, &k, tcp, &state, length, retval);
 
         } else {
 
-            struct tcp_state state = it->second;
+            struct tcp_state state = tcp_flow_table.value(it);
 
             // initialize acknowledgement number, if it has not yet been set
             if (state.ack == 0) {
@@ -243,7 +252,8 @@ struct tcp_initial_message_filter {
             if (ntoh(tcp->ack) > ntoh(state.ack)) {
                 state.ack = tcp->ack;
             }
-            tcp_flow_table[k] = state;
+            tcp_flow_table.value(it) = state;
+            tcp_flow_table.set_deadline(it, sec + timeout);
 
             fprintf_tcp_hdr_info(stderr, &k, tcp, &state, length, retval);
 
@@ -284,6 +294,173 @@ struct tcp_seg_context {
     tcp_seg_context(uint32_t len, uint32_t seq_no, uint32_t additional_bytes) : data_length{len}, seq{seq_no}, additional_bytes_needed{additional_bytes} {}
 };
 
+// class reassembly_pool provides the memory that holds the data and
+// the segment lists of tcp_segments.  Memory is handed out in
+// power-of-two size classes, from 64 bytes up, and is recycled
+// through a free list for each class; buffers of up to slab_size
+// bytes are carved out of slabs, so that small buffers do not each
+// require a separate allocation.  A tcp_segment starts with buffers
+// that are just large enough for the data that it has seen, and
+// grows them as needed, so the memory used by the reassembler scales
+// with the number of bytes that are actually buffered, up to the
+// limits held in the pool.
+//
+// The pool is not thread safe; each tcp_reassembler has its own.
+//
+class reassembly_pool {
+    static constexpr unsigned int min_class_bits = 6;    // 64 bytes
+    static constexpr unsigned int num_classes = 20;      // up to 32 megabytes
+    static constexpr size_t slab_size = 64 * 1024;
+
+    std::array<std::vector<uint8_t *>, num_classes> free_list;
+    std::vector<std::unique_ptr<uint8_t[]>> slabs;
+    size_t bytes_in_use;
+    size_t bytes_allocated;
+
+    static unsigned int size_class(size_t size) {
+        unsigned int c = 0;
+        while (c < num_classes && class_size(c) < size) {
+            c++;
+        }
+        return c;
+    }
+
+    static size_t class_size(unsigned int c) { return (size_t)1 << (c + min_class_bits); }
+
+public:
+
+    const uint32_t buffer_len;       // maximum bytes of reassembled data per flow
+    const uint32_t max_seg_count;    // maximum segments per flow
+
+    static const uint32_t default_buffer_len = 8192;
+    static const uint32_t default_max_seg_count = 20;
+
+    reassembly_pool(uint32_t max_buffer_len=default_buffer_len, uint32_t max_segments=default_max_seg_count) :
+        free_list{},
+        slabs{},
+        bytes_in_use{0},
+        bytes_allocated{0},
+        buffer_len{max_buffer_len},
+        max_seg_count{max_segments}
+    { }
+
+    reassembly_pool(const reassembly_pool &) = delete;
+    reassembly_pool &operator=(const reassembly_pool &) = delete;
+
+    // allocate(size) returns a buffer of at least size bytes, and
+    // sets size to the actual size of the buffer, or returns nullptr
+    // if size is too large
+    //
+    uint8_t *allocate(size_t &size) {
+        unsigned int c = size_class(size);
+        if (c >= num_classes) {
+            return nullptr;
+        }
+        size = class_size(c);
+        if (free_list[c].empty()) {
+            size_t count = size < slab_size ? slab_size / size : 1;
+            slabs.emplace_back(new uint8_t[count * size]);
+            bytes_allocated += count * size;
+            for (size_t i = 0; i < count; i++) {
+                free_list[c].push_back(slabs.back().get() + i * size);
+            }
+        }
+        uint8_t *buffer = free_list[c].back();
+        free_list[c].pop_back();
+        bytes_in_use += size;
+        return buffer;
+    }
+
+    // release(buffer, size) returns a buffer to the pool; size must
+    // be the size that was set by allocate()
+    //
+    void release(uint8_t *buffer, size_t size) {
+        free_list[size_class(size)].push_back(buffer);
+        bytes_in_use -= size;
+    }
+
+    size_t get_bytes_in_use() const { return bytes_in_use; }
+
+    size_t get_bytes_allocated() const { return bytes_allocated; }
+};
+
+// class pooled_array<T> is an array of trivially copyable elements
+// whose storage is obtained from a reassembly_pool, and returned to
+// it when the array is destructed
+//
+template <typename T>
+class pooled_array {
+    static_assert(std::is_trivially_copyable_v<T>, "pooled_array elements must be trivially copyable");
+
+    T *buffer;
+    size_t length;
+    reassembly_pool *pool;
+
+public:
+
+    pooled_array() : buffer{nullptr}, length{0}, pool{nullptr} { }
+
+    pooled_array(pooled_array &&rhs) noexcept : buffer{rhs.buffer}, length{rhs.length}, pool{rhs.pool} {
+        rhs.buffer = nullptr;
+        rhs.length = 0;
+    }
+
+    pooled_array &operator=(pooled_array &&rhs) noexcept {
+        if (this != &rhs) {
+            release();
+            buffer = rhs.buffer;
+            length = rhs.length;
+            pool = rhs.pool;
+            rhs.buffer = nullptr;
+            rhs.length = 0;
+        }
+        return *this;
+    }
+
+    ~pooled_array() { release(); }
+
+    // reserve(p, n) ensures that the array can hold n elements,
+    // preserving its contents, and returns true on success
+    //
+    bool reserve(reassembly_pool &p, size_t n) {
+        if (n <= length) {
+            return true;
+        }
+        size_t size = n * sizeof(T);
+        uint8_t *tmp = p.allocate(size);
+        if (tmp == nullptr) {
+            return false;
+        }
+        if (buffer != nullptr) {
+            memcpy(tmp, buffer, length * sizeof(T));
+            release();
+        }
+        buffer = reinterpret_cast<T *>(tmp);
+        length = size / sizeof(T);
+        pool = &p;
+        return true;
+    }
+
+    void release() {
+        if (buffer != nullptr) {
+            pool->release(reinterpret_cast<uint8_t *>(buffer), length * sizeof(T));
+            buffer = nullptr;
+            length = 0;
+        }
+    }
+
+    T *data() { return buffer; }
+
+    T &operator[](size_t i) { return buffer[i]; }
+
+    size_t capacity() const { return length; }
+};
+
+struct seg_range {
+    uint32_t first;
+    uint32_t second;
+};
+
 struct tcp_segment {
     uint32_t seq_init;
     uint32_t curr_seq;
@@ -301,17 +478,26 @@ struct tcp_segment {
 
     static const unsigned int timeout = 30;    // seconds before flow timeout
 
-    static const size_t buffer_len = 8192;
-    uint8_t data[buffer_len];
+    // the reassembled data and the list of segments are held in
+    // buffers from the pool, which also holds the maximum buffer
+    // length and segment count
+    //
+    reassembly_pool *pool;
+    pooled_array<uint8_t> data;
+    pooled_array<seg_range> seg;
+
+    static const uint32_t initial_seg_capacity = 8;
 
-    static const uint32_t max_seg_count = 20;
-    std::pair<uint32_t, uint32_t> seg[max_seg_count];
-    //std::vector< std::pair<uint32_t,uint32_t> > seg;
+    tcp_segment() : seq_init{0}, curr_seq{0}, index{0}, end_index{0}, seg_len{0}, max_index{0}, total_bytes_needed{0},
+                        current_bytes{0}, seg_count{0}, init_time{0}, done{false}, seg_overlap{false}, max_seg_exceed{false},
+                        pool{nullptr}, data{}, seg{} {}
 
-    tcp_segment() : seq_init{0}, curr_seq{0}, index{0}, end_index{0}, seg_len{0}, max_index{8192}, total_bytes_needed{8192},
-                        current_bytes{0}, seg_count{0}, init_time{0}, done{false}, seg_overlap{false}, max_seg_exceed{false} {}
+    tcp_segment(tcp_segment &&) = default;
+    tcp_segment &operator=(tcp_segment &&) = default;
 
-    bool init_from_pkt (unsigned int sec, struct tcp_seg_context &tcp_pkt, uint32_t syn_seq, datum &p) {
+    bool init_from_pkt (unsigned int sec, struct tcp_seg_context &tcp_pkt, uint32_t syn_seq, datum &p, reassembly_pool &segment_pool) {
+        pool = &segment_pool;
+        max_index = total_bytes_needed = pool->buffer_len;
         seq_init = syn_seq;
         init_time = sec;
         seg_len = tcp_pkt.data_length;
@@ -326,23 +512,29 @@ struct tcp_segment {
 
         index = curr_seq - seq_init;
         end_index = index + seg_len;
+        if (!seg.reserve(*pool, initial_seg_capacity)) {
+            return false;
+        }
         seg[0].first = index;
         seg[0].second = end_index;
-        if (max_index > buffer_len) {
+        if (max_index > pool->buffer_len) {
             return false;   // cannot accommodate reassembled data
         }
-        if (index >= buffer_len) {
+        if (index >= pool->buffer_len) {
             return true;    // ignore this seg
         }
 
         // TODO: check for datum len
-        uint32_t len = end_index > buffer_len ? (buffer_len-index):seg_len;
-        memcpy(data+index, p.data, len);
+        uint32_t len = end_index > pool->buffer_len ? (pool->buffer_len-index):seg_len;
+        if (!data.reserve(*pool, is_initial ? total_bytes_needed : index + len)) {
+            return false;
+        }
+        memcpy(data.data()+index, p.data, len);
         current_bytes += seg_len;
         return true;
     }
 
-    bool check_overlap (uint32_t start, uint32_t end, std::pair<uint32_t,uint32_t> *segment) {
+    bool check_overlap (uint32_t start, uint32_t end, const seg_range *segment) {
 
         // right overlap
         bool right = (start > segment->first && start < segment->second);
@@ -355,14 +547,16 @@ struct tcp_segment {
         uint32_t index = seg_count - 2;
 
         for (size_t i = 0; i <= index; i++) {
-            if (check_overlap(start, end, seg+i)) {
+            if (check_overlap(start, end, &seg[i])) {
                 return true;
             }
         }
 
-        seg[index + 1].first = start;
-        seg[index + 1].second = end;
-    
+        if (seg.reserve(*pool, index + 2)) {
+            seg[index + 1].first = start;
+            seg[index + 1].second = end;
+        }
+
         return false;
     }
 
@@ -380,7 +574,7 @@ struct tcp_segment {
         end_index = index + seg_len;
 
         seg_count++;
-        if (seg_count > max_seg_count) {
+        if (seg_count > pool->max_seg_count) {
             // force flush
             done = true;
             max_seg_exceed = true;
@@ -391,16 +585,19 @@ struct tcp_segment {
             seg_overlap = true;
         }
 
-        if (max_index > buffer_len) {
+        if (max_index > pool->buffer_len) {
             return nullptr;   // cannot accommodate reassembled data
         }
-        if (index >= buffer_len) {
+        if (index >= pool->buffer_len) {
             return this;    // ignore this seg
         }
 
         // TODO: check for datum len
-        uint32_t len = end_index > buffer_len ? (buffer_len-index):seg_len;
-        memcpy(data+index, p.data, len);
+        uint32_t len = end_index > pool->buffer_len ? (pool->buffer_len-index):seg_len;
+        if (!data.reserve(*pool, index + len)) {
+            return nullptr;
+        }
+        memcpy(data.data()+index, p.data, len);
         current_bytes += seg_len;
 
         if (current_bytes >= total_bytes_needed) {
@@ -411,7 +608,11 @@ struct tcp_segment {
     }
 
     struct datum get_reassembled_segment() {
-        struct datum reassembled_tcp_data{data, data + total_bytes_needed};
+        uint32_t length = total_bytes_needed < pool->buffer_len ? total_bytes_needed : pool->buffer_len;
+        if (!data.reserve(*pool, length)) {
+            return datum{};
+        }
+        struct datum reassembled_tcp_data{data.data(), data.data() + length};
         return reassembled_tcp_data;
     }
 
@@ -566,36 +767,41 @@ struct tcp_reassembler {
     bool curr_reassembly_consumed;
     enum reassembly_status curr_reassembly_state;
 
-    static const uint32_t max_map_entries = 10000;  // Hard limit to map entries
+    static const uint32_t max_map_entries = 10000;  // default limit to map entries
 
-    std::unordered_map<struct key, struct tcp_segment> segment_table;
-    std::unordered_map<struct key, struct tcp_segment>::iterator reap_it;
+    reassembly_pool pool;   // must outlive segment_table
 
-    tcp_reassembler(unsigned int size) : dump_pkt{false}, curr_reassembly_consumed{false}, curr_reassembly_state{reassembly_none}, segment_table{}, reap_it{segment_table.end()} {
-        segment_table.reserve(size);
-        reap_it = segment_table.end();
-    }
+    using segment_handle = flow_map<struct key, struct tcp_segment>::handle;
+    static constexpr segment_handle no_segment = flow_map<struct key, struct tcp_segment>::nil;
+
+    flow_map<struct key, struct tcp_segment> segment_table;
+    segment_handle curr_seg;   // segment involved in current pkt, if any
+
+    tcp_reassembler(unsigned int size,
+                    size_t max_entries=max_map_entries,
+                    uint32_t buffer_len=reassembly_pool::default_buffer_len,
+                    uint32_t max_seg_count=reassembly_pool::default_max_seg_count) :
+        dump_pkt{false},
+        curr_reassembly_consumed{false},
+        curr_reassembly_state{reassembly_none},
+        pool{buffer_len, max_seg_count},
+        segment_table{max_entries, size},
+        curr_seg{no_segment} { }
+
+    // segments are reaped as soon as they have expired; when the
+    // table is full, the oldest segment is evicted
+    //
+    static uint32_t deadline(unsigned int sec) { return sec + tcp_segment::timeout + 1; }
 
     bool init_segment(const struct key &k, unsigned int sec, struct tcp_seg_context &tcp_pkt, uint32_t syn_seq, datum &p) {
-        if (segment_table.size() >= max_map_entries) {
-            // aggressive : remove two entries
-            increment_reap_iterator();
-            if (reap_it != segment_table.end()) {
-                reap_it = segment_table.erase(reap_it);
-            }
-            increment_reap_iterator();
-            if (reap_it != segment_table.end()) {
-                reap_it = segment_table.erase(reap_it);
-            }
-        }
-        else {
-            reap(sec);  // passive: try cleaning expired entries
-        }
+        reap(sec);
 
         tcp_segment segment;
-        if (segment.init_from_pkt(sec, tcp_pkt, syn_seq, p)) {
-            reap_it = segment_table.emplace(k, segment).first; 
-            //++reap_it;
+        if (segment.init_from_pkt(sec, tcp_pkt, syn_seq, p, pool)) {
+            curr_seg = segment_table.find(k);
+            if (curr_seg == no_segment) {
+                curr_seg = segment_table.emplace(k, deadline(sec), std::move(segment));
+            }
             return true;
         }
         return false;
@@ -603,8 +809,8 @@ struct tcp_reassembler {
 
     bool is_init_seg (const struct key&k, uint32_t seq) {
         auto it = segment_table.find(k);
-        if (it != segment_table.end()) {
-            return (it->second.seq_init == seq);
+        if (it != no_segment) {
+            return (segment_table.value(it).seq_init == seq);
         }
         return false;
     }
@@ -613,40 +819,39 @@ struct tcp_reassembler {
 
         reap(sec);    // passive cleaning
         auto it = segment_table.find(k);
-        if (it != segment_table.end()) {
-            if (it->second.expired(sec)) {
+        if (it != no_segment) {
+            tcp_segment &segment = segment_table.value(it);
+            if (segment.expired(sec)) {
                 remove_segment(it);
                 return nullptr;
             }
             // Before adding more data, check if reassembly already done
-            if (it->second.done) {
+            if (segment.done) {
                 reassembly_consumed = true;
-                return &it->second;
+                return &segment;
             }
-            reap_it = it;
-            return it->second.check_packet(tcp_pkt, p);
+            curr_seg = it;
+            return segment.check_packet(tcp_pkt, p);
         }
         return nullptr;
     }
 
     void remove_segment(key &k) {
-        auto it = segment_table.find(k);
-        if (it != segment_table.end()) {
-            reap_it = segment_table.erase(it);
-        }
+        remove_segment(segment_table.find(k));
     }
 
-    void remove_segment(std::unordered_map<struct key, struct tcp_segment>::iterator it) {
-        if (it != segment_table.end()) {
-            reap_it = segment_table.erase(it);
+    void remove_segment(segment_handle it) {
+        if (it != no_segment) {
+            segment_table.erase(it);
+            if (it == curr_seg) {
+                curr_seg = no_segment;
+            }
         }
     }
 
     void count_all() {
-        auto it = segment_table.begin();
-        while (it != segment_table.end()) {
-            it = segment_table.erase(it);
-        }
+        segment_table.clear();
+        curr_seg = no_segment;
     }
 
     void write_flags(struct json_object &record, const char *key) {
@@ -658,17 +863,18 @@ struct tcp_reassembler {
             return;
         }
 
-        if (reap_it == segment_table.end()) {
+        if (curr_seg == no_segment) {
             return;
         }
-        if (reap_it->second.done) {
+        const tcp_segment &segment = segment_table.value(curr_seg);
+        if (segment.done) {
             struct json_object flags{record, key};
             flags.print_key_bool("reassembled", true);
-            if (reap_it->second.seg_overlap) {
-                flags.print_key_bool("segment_overlap", reap_it->second.seg_overlap);
+            if (segment.seg_overlap) {
+                flags.print_key_bool("segment_overlap", segment.seg_overlap);
             }
-            if (reap_it->second.max_seg_exceed) {
-                flags.print_key_bool("segment_count_exceed", reap_it->second.max_seg_exceed);
+            if (segment.max_seg_exceed) {
+                flags.print_key_bool("segment_count_exceed", segment.max_seg_exceed);
             }
             flags.close();
         }
@@ -677,72 +883,43 @@ struct tcp_reassembler {
             flags.print_key_bool("truncated", true);
             flags.close();
         }
-        reap_it = segment_table.end();
+        curr_seg = no_segment;
         return;
     }
 
+    // reap() erases the segments that have expired, which may
+    // include the current segment
+    //
     void reap(unsigned int sec) {
-
-        // check for expired flows
-        increment_reap_iterator();
-        if (reap_it != segment_table.end() && reap_it->second.expired(sec)) {
-            reap_it = segment_table.erase(reap_it);
-        }
-        increment_reap_iterator();
-        if (reap_it != segment_table.end() && reap_it->second.expired(sec)) {
-            reap_it = segment_table.erase(reap_it);
-        }
-    }
-
-    void increment_reap_iterator() {
-        if (reap_it != segment_table.end()) {
-            ++reap_it;
-        } else {
-            reap_it = segment_table.begin();
-        }
+        segment_table.advance(sec);
+        curr_seg = no_segment;
     }
 };
 
 struct flow_table {
-    std::unordered_map<struct key, unsigned int> table;
-    std::unordered_map<struct key, unsigned int>::iterator reap_it;
+    flow_map<struct key, unsigned int> table;     // time of most recent packet
 
-    flow_table(unsigned int size) : table{}, reap_it{table.end()} {
-        table.reserve(size);
-        reap_it = table.end();
-    }
+    static const unsigned int timeout = 60 * 60; // seconds before flow timeout
+    static const size_t default_capacity = 1 << 20;
+
+    flow_table(unsigned int size, size_t capacity=0) : table{capacity ? capacity : default_capacity, size} { }
 
     bool flow_is_new(const struct key &k, unsigned int sec) {
 
+        table.advance(sec);
         auto it = table.find(k);
-        if (it != table.end() && (sec - it->second < flow_table::timeout)) {
-            it->second = sec;
-            reap(sec);
-            //printf_err(log_debug, "FLOW OLD\n");
-            return false;
+        if (it != table.nil) {
+            bool is_new = !(sec - table.value(it) < flow_table::timeout);
+            table.value(it) = sec;
+            table.set_deadline(it, sec + timeout);
+            //printf_err(log_debug, is_new ? "FLOW NEW\n" : "FLOW OLD\n");
+            return is_new;
         }
-        auto tmp = table.insert({k, sec}).first;
-        update_reap_iterator(tmp);
+        table.emplace(k, sec + timeout, sec);
         //printf_err(log_debug, "FLOW NEW\n");
         return true;
     }
 
-    void reap(unsigned int sec) {
-
-        // check for expired flows
-        if (reap_it != table.end() && (sec - reap_it->second > flow_table::timeout)) {
-            reap_it = table.erase(reap_it);
-        }
-    }
-
-    void update_reap_iterator(std::unordered_map<struct key, unsigned int>::iterator x) {
-        if (x != table.end()) {
-            reap_it = x++;
-        }
-    }
-
-    static const unsigned int timeout = 60 * 60; // seconds before flow timeout
-
 };
 
 
@@ -753,14 +930,16 @@ struct flow_table {
 //
 // approach: create a tcp_context when a SYN packet is observed, and
 // when the first data packet is observed, delete the context;
-// randomly traverse the table of tcp_contexts and check for expired
-// elements.
+// expired contexts are reaped through the timer wheel of the
+// flow_map.
 
 
 struct tcp_context {
 public:
     tcp_context(unsigned int seconds, uint32_t sequence_number) : sec{seconds}, seq{sequence_number+1} {}
 
+    tcp_context() : sec{0}, seq{0} {}
+
     ~tcp_context() {}
 
     bool is_expired(unsigned int current_time) {
@@ -776,65 +955,56 @@ public:
         return seq;
     }
 
+    static const unsigned int timeout = 30; // seconds before flow timeout
+
 private:
     unsigned int sec;
     uint32_t seq;
-
-    static const unsigned int timeout = 30; // seconds before flow timeout
 };
 
 struct flow_table_tcp {
-    std::unordered_map<struct key, struct tcp_context> table;
-    std::unordered_map<struct key, struct tcp_context>::iterator reap_it;
+    flow_map<struct key, struct tcp_context> table;
     static constexpr uint32_t max_entries = 20000;
 
-    flow_table_tcp(unsigned int size) : table{}, reap_it{table.end()} {
-        table.reserve(size);
-        reap_it = table.end();
-    }
+    flow_table_tcp(unsigned int size, size_t capacity=0) : table{capacity ? capacity : max_entries, size} { }
+
+    // a context is reaped one second after it expires, so that a
+    // data packet that arrives just after the timeout is still
+    // treated as the first data packet in its flow; note that the
+    // context timeout, and not flow_table_tcp::timeout, determines
+    // how long the context is retained
+    //
+    static uint32_t deadline(unsigned int sec) { return sec + tcp_context::timeout + 1; }
 
     void syn_packet(const struct key &k, unsigned int sec, uint32_t seq) {
-        if (table.size() >= max_entries) {
-            // aggressive : try to remove two entries
-            increment_reap_iterator();
-            if (reap_it != table.end()) {
-                reap_it = table.erase(reap_it);
-            }
-            increment_reap_iterator();
-            if (reap_it != table.end()) {
-                reap_it = table.erase(reap_it);
-            }
-        }
-        else {
-            reap(sec);  // passive: try clean expired entries
-        }
+        table.advance(sec);
         auto it = table.find(k);
-        if (it == table.end()) {
-            table.insert({k, {sec, seq}});
+        if (it == table.nil) {
+            table.emplace(k, deadline(sec), sec, seq);
             // printf_err(log_debug, "tcp_flow_table size: %zu\n", table.size());
         }
     }
 
     void find_and_erase(const struct key &k) {
         auto it = table.find(k);
-        if (it != table.end()) {
-            reap_it = table.erase(it);
+        if (it != table.nil) {
+            table.erase(it);
         }
     }
 
     bool is_first_data_packet(const struct key &k, unsigned int sec, uint32_t seq) {
+        table.advance(sec);
         auto it = table.find(k);
-        if (it != table.end()) {
-            if (it->second.is_expired(sec)) {
-                reap_it = table.erase(it);
+        if (it != table.nil) {
+            if (table.value(it).is_expired(sec)) {
+                table.erase(it);
                 return true;
             }
-            if (it->second.seq_is_equal_to(seq)) {
-                reap_it = table.erase(it);
+            if (table.value(it).seq_is_equal_to(seq)) {
+                table.erase(it);
                 return true;
             }
         }
-        reap(sec);
         return false;
     }
 
@@ -842,55 +1012,32 @@ struct flow_table_tcp {
     //
     uint32_t check_flow(const struct key &k, unsigned int sec, uint32_t seq, bool &initial_seq, bool &expired) {
         uint32_t syn_seq;
+        table.advance(sec);
         auto it = table.find(k);
-        if (it != table.end()) {
-            if (it->second.is_expired(sec)) {
-                syn_seq = it->second.get_seq();
-                reap_it = table.erase(it);
+        if (it != table.nil) {
+            tcp_context &context = table.value(it);
+            if (context.is_expired(sec)) {
+                syn_seq = context.get_seq();
+                table.erase(it);
                 expired = true;
                 return syn_seq;
             }
-            if (it->second.seq_is_equal_to(seq)) {
-                reap_it = table.erase(it);
+            if (context.seq_is_equal_to(seq)) {
+                table.erase(it);
                 initial_seq = true;
                 return seq;
             }
-            else if (it->second.seq_is_greater(seq)) {
-                syn_seq = it->second.get_seq();
-                reap_it = table.erase(it);
-                return syn_seq;       
+            else if (context.seq_is_greater(seq)) {
+                syn_seq = context.get_seq();
+                table.erase(it);
+                return syn_seq;
             }
         }
-        reap(sec);
-        return 0;    
-    }
-
-    void reap(unsigned int sec) {
-
-        // check for expired flows
-        increment_reap_iterator();
-        if (reap_it != table.end() && reap_it->second.is_expired(sec)) {
-            reap_it = table.erase(reap_it);
-        }
-        increment_reap_iterator();
-        if (reap_it != table.end() && reap_it->second.is_expired(sec)) {
-            reap_it = table.erase(reap_it);
-        }
-    }
-
-    void increment_reap_iterator() {
-        if (reap_it != table.end()) {
-            ++reap_it;
-        } else {
-            reap_it = table.begin();
-        }
+        return 0;
     }
 
     void count_all() {
-        auto it = table.begin();
-        while (it != table.end()) {
-            it = table.erase(it);
-        }
+        table.clear();
     }
 
     static const unsigned int timeout = 1; // seconds before flow timeout
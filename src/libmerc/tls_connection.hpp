@@ -302,10 +302,36 @@ public:
                                             const std::string &http_host_field,
                                             const std::string &user_agent,
                                             bool doh) {
-        std::set<std::string> src_links;
-
         // send HTTP request
         //
+        std::string request = http_request_string(path, hostname, http_host_field, user_agent, doh);
+        if (tls_connection::write(request.data(), request.size()) < 0) {
+            if (verbosity >= verbosity_level::warnings) {
+                fprintf(stderr, "warning: could not send http request\n");
+            }
+            return {}; // return empty set
+        }
+        write_http_request_json(request);
+
+        // get HTTP response
+        //
+        char http_buffer[1024*256] = {};
+        int read_len = sizeof(http_buffer);
+        tls_connection::read(http_buffer, &read_len);
+
+        const unsigned char *tmp = (const unsigned char *)http_buffer;
+        return process_http_response(datum{tmp, tmp+read_len});
+    }
+
+    // http_request_string() returns the HTTP GET request that
+    // send_http_request() sends; it is also used by tls_scan_engine,
+    // which sends requests without a tls_connection
+    //
+    static std::string http_request_string(std::string path,
+                                           const std::string &hostname,
+                                           const std::string &http_host_field,
+                                           const std::string &user_agent,
+                                           bool doh) {
         if (doh) {
             path += doh_path(http_host_field);
         }
@@ -319,44 +345,42 @@ public:
             request += "Host: " + http_host_field + "\r\n";
         }
         request += "\r\n";
-        if (tls_connection::write(request.data(), request.size()) < 0) {
-            if (verbosity >= verbosity_level::warnings) {
-                fprintf(stderr, "warning: could not send http request\n");
-            }
-            return src_links; // return empty set
-        }
+        return request;
+    }
 
-        // parse HTTP request for JSON output
-        //
+    // write_http_request_json() parses an HTTP request and writes it
+    // to stdout as a JSON object
+    //
+    static void write_http_request_json(const std::string &request) {
         const uint8_t *http_req_buffer = (const uint8_t *)request.data();
         struct datum http_req_data{http_req_buffer, http_req_buffer + request.length()};
         http_request req{http_req_data};
 
-        // report http request
-        //
         char output_buffer[1024*16];
         struct buffer_stream output_buffer_stream{output_buffer, sizeof(output_buffer)};
         struct json_object http_record{&output_buffer_stream};
         req.write_json(http_record, true);
         http_record.close();
         output_buffer_stream.write_line(stdout);
+    }
 
-        // get HTTP response
-        //
-        char http_buffer[1024*256] = {};
-        int read_len = sizeof(http_buffer);
-        tls_connection::read(http_buffer, &read_len);
+    // process_http_response() parses an HTTP response, writes it to
+    // stdout as a JSON object, and returns the set of src= links in
+    // its body, including one for its redirect, if there is one
+    //
+    static std::set<std::string> process_http_response(datum http) {
+        std::set<std::string> src_links;
+        char output_buffer[1024*16];
+        struct buffer_stream output_buffer_stream{output_buffer, sizeof(output_buffer)};
 
         // parse and process http_response message
-        if (read_len > 0) {
+        if (http.is_not_empty()) {
 
             bool parse_response = true;
             std::string redirect;  // stores HTTP redirect, if there is one
 
             // parse http headers, and print as JSON
             //
-            const unsigned char *tmp = (const unsigned char *)http_buffer;
-            struct datum http{tmp, tmp+read_len};
             if (parse_response) {
                 http_response response{http};
 
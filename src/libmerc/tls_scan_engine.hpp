@@ -0,0 +1,708 @@
+// tls_scan_engine.hpp
+//
+// Copyright (c) 2023 Cisco Systems, Inc. License at
+// https://github.com/cisco/mercury/blob/master/LICENSE
+
+#ifndef TLS_SCAN_ENGINE_HPP
+#define TLS_SCAN_ENGINE_HPP
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tls_connection.hpp"
+
+// struct scan_target is a server to be scanned by tls_scan_engine: a
+// host name or IPv4 address, a TCP port, and the request (if any) to
+// be sent over TLS once the handshake completes.  If the request is
+// empty, the scan ends with the handshake.
+//
+struct scan_target {
+    std::string hostname;
+    uint16_t port = 443;
+    std::string request;
+};
+
+// enum class scan_status is the outcome of a scan; the phase in which
+// a scan failed can be read from its name
+//
+enum class scan_status {
+    ok                = 0,
+    resolve_failed    = 1,
+    connect_failed    = 2,
+    connect_timeout   = 3,
+    handshake_failed  = 4,
+    handshake_timeout = 5,
+    request_failed    = 6,
+    response_failed   = 7,
+    response_timeout  = 8,
+};
+
+static constexpr size_t num_scan_status = 9;
+
+static inline const char *scan_status_string(scan_status s) {
+    switch (s) {
+    case scan_status::ok:                return "ok";
+    case scan_status::resolve_failed:    return "resolve_failed";
+    case scan_status::connect_failed:    return "connect_failed";
+    case scan_status::connect_timeout:   return "connect_timeout";
+    case scan_status::handshake_failed:  return "handshake_failed";
+    case scan_status::handshake_timeout: return "handshake_timeout";
+    case scan_status::request_failed:    return "request_failed";
+    case scan_status::response_failed:   return "response_failed";
+    case scan_status::response_timeout:  return "response_timeout";
+    }
+    return "unknown";
+}
+
+// struct scan_result is passed to the result handler of
+// tls_scan_engine when a scan completes.  The tls pointer is null
+// unless the handshake completed, and it and the response are only
+// valid for the duration of the call.  Phase times are in
+// microseconds, and are zero for phases that were not completed;
+// total_us runs from the start of the TCP connection to the
+// completion of the scan.
+//
+struct scan_result {
+    const scan_target &target;
+    scan_status status;
+    sockaddr_in address;
+    SSL *tls;
+    datum response;
+    uint32_t connect_us;
+    uint32_t handshake_us;
+    uint32_t response_us;
+    uint32_t total_us;
+};
+
+// class scan_statistics accumulates the outcomes of the scans run by
+// a tls_scan_engine, and the latencies of the successful ones, and
+// reports the scan rate and the latency distribution
+//
+class scan_statistics {
+    std::array<size_t, num_scan_status> count{};
+    std::vector<uint32_t> latency_us;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+
+public:
+
+    void begin() {
+        start = end = std::chrono::steady_clock::now();
+    }
+
+    void add(scan_status s, uint32_t total_us) {
+        count[static_cast<size_t>(s)]++;
+        if (s == scan_status::ok) {
+            latency_us.push_back(total_us);
+        }
+        end = std::chrono::steady_clock::now();
+    }
+
+    size_t scans() const {
+        size_t total = 0;
+        for (const auto &c : count) {
+            total += c;
+        }
+        return total;
+    }
+
+    size_t scans_with_status(scan_status s) const { return count[static_cast<size_t>(s)]; }
+
+    double seconds() const {
+        return std::chrono::duration<double>(end - start).count();
+    }
+
+    double scans_per_second() const {
+        double s = seconds();
+        return s > 0.0 ? scans() / s : 0.0;
+    }
+
+    // latency_percentile(p) returns the latency in milliseconds that
+    // p percent of the successful scans did not exceed, or zero if
+    // there were none
+    //
+    double latency_percentile(double p) {
+        if (latency_us.empty()) {
+            return 0.0;
+        }
+        size_t rank = (size_t)(p / 100.0 * (latency_us.size() - 1) + 0.5);
+        std::nth_element(latency_us.begin(), latency_us.begin() + rank, latency_us.end());
+        return latency_us[rank] / 1000.0;
+    }
+
+    void fprint(FILE *f) {
+        fprintf(f, "scans: %zu\tsucceeded: %zu\tseconds: %.3f\tscans/s: %.1f\n",
+                scans(), scans_with_status(scan_status::ok), seconds(), scans_per_second());
+        fprintf(f, "latency (ms)\tp50: %.3f\tp90: %.3f\tp99: %.3f\tmax: %.3f\n",
+                latency_percentile(50), latency_percentile(90), latency_percentile(99), latency_percentile(100));
+        for (size_t i = 1; i < num_scan_status; i++) {
+            if (count[i] != 0) {
+                fprintf(f, "%s: %zu\n", scan_status_string(static_cast<scan_status>(i)), count[i]);
+            }
+        }
+    }
+};
+
+// class tls_scan_engine scans TLS servers concurrently from a single
+// thread, using non-blocking sockets and non-blocking OpenSSL
+// connections driven by an epoll event loop.  At most max_in_flight
+// scans are in progress at any time; a new one is started from the
+// target source whenever one completes, and each result is passed to
+// the result handler as soon as its scan completes.  The connect,
+// handshake, and response phases each have their own timeout.
+//
+// Host names are resolved by a small pool of threads, since
+// getaddrinfo() blocks; those lookups count against max_in_flight,
+// but are bounded only by the system resolver's own timeout.
+// Targets that are IPv4 addresses are not sent to the resolvers.
+//
+class tls_scan_engine {
+public:
+
+    struct config {
+        size_t max_in_flight = 1000;
+        unsigned int connect_timeout_ms = 5000;
+        unsigned int handshake_timeout_ms = 5000;
+        unsigned int response_timeout_ms = 10000;
+        unsigned int resolver_threads = 16;
+        size_t max_response_length = 256 * 1024;
+        bool omit_sni = false;
+        verbosity_level verbosity = verbosity_level::no_output;
+    };
+
+    // a target_source sets its argument to the next target and
+    // returns true, or returns false when there are no more targets
+    //
+    using target_source = std::function<bool (scan_target &)>;
+
+    using result_handler = std::function<void (const scan_result &)>;
+
+private:
+
+    using clock = std::chrono::steady_clock;
+
+    enum class phase { idle, resolving, connecting, handshaking, requesting, responding };
+
+    struct connection {
+        phase state = phase::idle;
+        uint32_t serial = 0;
+        int fd = -1;
+        uint32_t events = 0;
+        SSL *ssl = nullptr;
+        scan_target target;
+        sockaddr_in address{};
+        size_t request_offset = 0;
+        std::vector<uint8_t> response;
+        clock::time_point deadline;
+        clock::time_point start;
+        clock::time_point connected;
+        clock::time_point handshake_done;
+        clock::time_point request_sent;
+    };
+
+    struct timer {
+        clock::time_point deadline;
+        uint32_t slot;
+        uint32_t serial;
+
+        bool operator>(const timer &rhs) const { return deadline > rhs.deadline; }
+    };
+
+    struct lookup {
+        uint32_t slot;
+        uint32_t serial;
+        std::string hostname;
+        uint16_t port;
+        bool found = false;
+        sockaddr_in address{};
+    };
+
+    // the epoll data of a connection holds its slot and serial
+    // number, so that events for a slot that has since been reused
+    // can be recognized; the eventfd of the resolvers has a serial
+    // number of zero, which no connection has
+    //
+    static uint64_t epoll_tag(uint32_t slot, uint32_t serial) { return (uint64_t)serial << 32 | slot; }
+
+    config cfg;
+    SSL_CTX *ctx = nullptr;
+    int epoll_fd = -1;
+    int lookup_event_fd = -1;
+
+    std::vector<connection> slots;
+    std::vector<uint32_t> free_slots;
+    uint32_t next_serial = 1;
+    size_t in_flight = 0;
+    std::priority_queue<timer, std::vector<timer>, std::greater<timer>> timers;
+    std::array<uint8_t, 16 * 1024> read_buffer;
+
+    std::mutex lookup_mutex;
+    std::condition_variable lookup_cv;
+    std::deque<lookup> lookup_requests;
+    std::deque<lookup> lookup_results;
+    bool stopping = false;
+    std::vector<std::thread> resolvers;
+
+    scan_statistics stats;
+
+public:
+
+    tls_scan_engine(const config &c) : cfg{c} {
+        if (cfg.max_in_flight == 0 || cfg.max_in_flight > UINT32_MAX) {
+            throw std::runtime_error{"invalid maximum number of scans in flight"};
+        }
+        ctx = SSL_CTX_new(TLS_client_method());
+        if (ctx == nullptr) {
+            throw std::runtime_error{"could not create SSL_CTX"};
+        }
+
+        // don't perform certificate validation, so that we can obtain
+        // self-issued certificates
+        //
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        lookup_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_fd == -1 || lookup_event_fd == -1) {
+            cleanup();
+            throw std::runtime_error{"could not create epoll or event file descriptor"};
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = epoll_tag(0, 0);
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, lookup_event_fd, &ev) == -1) {
+            cleanup();
+            throw std::runtime_error{"could not add event file descriptor to epoll"};
+        }
+
+        slots.resize(cfg.max_in_flight);
+        free_slots.reserve(cfg.max_in_flight);
+        for (size_t i = cfg.max_in_flight; i > 0; i--) {
+            free_slots.push_back(i - 1);
+        }
+        for (unsigned int i = 0; i < std::max(cfg.resolver_threads, 1u); i++) {
+            resolvers.emplace_back([this]() { resolve(); });
+        }
+    }
+
+    ~tls_scan_engine() {
+        cleanup();
+    }
+
+    tls_scan_engine(const tls_scan_engine &) = delete;
+    tls_scan_engine &operator=(const tls_scan_engine &) = delete;
+
+    // run(next_target, handle_result) scans every target provided by
+    // next_target, and returns when all of those scans are complete
+    //
+    void run(const target_source &next_target, const result_handler &handle_result) {
+        stats.begin();
+        bool more_targets = true;
+        std::array<epoll_event, 256> events;
+        while (true) {
+
+            // keep the number of scans in flight at its maximum
+            //
+            while (more_targets && in_flight < cfg.max_in_flight) {
+                scan_target t;
+                if (!next_target(t)) {
+                    more_targets = false;
+                    break;
+                }
+                start(std::move(t), handle_result);
+            }
+            if (in_flight == 0) {
+                break;
+            }
+
+            int n = epoll_wait(epoll_fd, events.data(), events.size(), wait_time_ms());
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error{"epoll_wait() failed"};
+            }
+            for (int i = 0; i < n; i++) {
+                uint32_t slot = events[i].data.u64 & 0xffffffff;
+                uint32_t serial = events[i].data.u64 >> 32;
+                if (serial == 0) {
+                    process_lookups(handle_result);
+                } else if (slots[slot].serial == serial) {
+                    advance(slot, handle_result);
+                }
+            }
+            expire_timers(handle_result);
+        }
+    }
+
+    scan_statistics &get_statistics() { return stats; }
+
+private:
+
+    void cleanup() {
+        {
+            std::lock_guard<std::mutex> lock{lookup_mutex};
+            stopping = true;
+        }
+        lookup_cv.notify_all();
+        for (auto &t : resolvers) {
+            t.join();
+        }
+        resolvers.clear();
+        for (auto &c : slots) {
+            release(c);
+        }
+        if (lookup_event_fd != -1) {
+            close(lookup_event_fd);
+            lookup_event_fd = -1;
+        }
+        if (epoll_fd != -1) {
+            close(epoll_fd);
+            epoll_fd = -1;
+        }
+        if (ctx != nullptr) {
+            SSL_CTX_free(ctx);
+            ctx = nullptr;
+        }
+    }
+
+    // resolve() is run by each resolver thread
+    //
+    void resolve() {
+        while (true) {
+            lookup l;
+            {
+                std::unique_lock<std::mutex> lock{lookup_mutex};
+                lookup_cv.wait(lock, [this]() { return stopping || !lookup_requests.empty(); });
+                if (stopping) {
+                    return;
+                }
+                l = std::move(lookup_requests.front());
+                lookup_requests.pop_front();
+            }
+            std::vector<sockaddr_in> sa = tls_connection::get_sockaddr_in(l.hostname.c_str(), cfg.verbosity, l.port);
+            if (!sa.empty()) {
+                l.found = true;
+                l.address = sa[0];
+            }
+            {
+                std::lock_guard<std::mutex> lock{lookup_mutex};
+                lookup_results.push_back(std::move(l));
+            }
+            uint64_t one = 1;
+            if (::write(lookup_event_fd, &one, sizeof(one)) != sizeof(one)) {
+                ;   // the counter is already nonzero, so the event loop will be woken
+            }
+        }
+    }
+
+    void start(scan_target &&t, const result_handler &handle_result) {
+        uint32_t slot = free_slots.back();
+        free_slots.pop_back();
+        in_flight++;
+        connection &c = slots[slot];
+        c.serial = next_serial++;
+        if (next_serial == 0) {
+            next_serial = 1;
+        }
+        c.target = std::move(t);
+        c.start = c.connected = c.handshake_done = c.request_sent = clock::now();
+        c.request_offset = 0;
+        c.response.clear();
+
+        c.address = {};
+        c.address.sin_family = AF_INET;
+        c.address.sin_port = htons(c.target.port);
+        if (inet_pton(AF_INET, c.target.hostname.c_str(), &c.address.sin_addr) == 1) {
+            connect_to(slot, handle_result);
+            return;
+        }
+        c.state = phase::resolving;
+        {
+            std::lock_guard<std::mutex> lock{lookup_mutex};
+            lookup_requests.push_back({slot, c.serial, c.target.hostname, c.target.port});
+        }
+        lookup_cv.notify_one();
+    }
+
+    void process_lookups(const result_handler &handle_result) {
+        uint64_t counter;
+        if (read(lookup_event_fd, &counter, sizeof(counter)) != sizeof(counter)) {
+            ;   // spurious wakeup
+        }
+        std::deque<lookup> results;
+        {
+            std::lock_guard<std::mutex> lock{lookup_mutex};
+            results.swap(lookup_results);
+        }
+        for (const auto &l : results) {
+            connection &c = slots[l.slot];
+            if (c.serial != l.serial || c.state != phase::resolving) {
+                continue;
+            }
+            if (!l.found) {
+                complete(l.slot, scan_status::resolve_failed, handle_result);
+                continue;
+            }
+            c.address = l.address;
+            connect_to(l.slot, handle_result);
+        }
+    }
+
+    void connect_to(uint32_t slot, const result_handler &handle_result) {
+        connection &c = slots[slot];
+        c.start = clock::now();
+        c.state = phase::connecting;
+        c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (c.fd == -1) {
+            if (cfg.verbosity >= verbosity_level::warnings) {
+                fprintf(stderr, "warning: could not create socket (%s)\n", strerror(errno));
+            }
+            complete(slot, scan_status::connect_failed, handle_result);
+            return;
+        }
+        if (connect(c.fd, (struct sockaddr *)&c.address, sizeof(c.address)) == -1 && errno != EINPROGRESS) {
+            complete(slot, scan_status::connect_failed, handle_result);
+            return;
+        }
+        epoll_event ev{};
+        ev.events = c.events = EPOLLOUT;
+        ev.data.u64 = epoll_tag(slot, c.serial);
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c.fd, &ev) == -1) {
+            complete(slot, scan_status::connect_failed, handle_result);
+            return;
+        }
+        set_deadline(slot, cfg.connect_timeout_ms);
+    }
+
+    // advance(slot) moves the scan in slot as far along as it can go
+    // without blocking
+    //
+    void advance(uint32_t slot, const result_handler &handle_result) {
+        connection &c = slots[slot];
+        switch (c.state) {
+        case phase::connecting:
+            {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                if (getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+                    complete(slot, scan_status::connect_failed, handle_result);
+                    return;
+                }
+                c.connected = clock::now();
+                c.ssl = SSL_new(ctx);
+                if (c.ssl == nullptr || SSL_set_fd(c.ssl, c.fd) != 1) {
+                    if (cfg.verbosity >= verbosity_level::warnings) {
+                        tls_connection::fprint_openssl_err(stderr, "warning: could not create \"SSL\"");
+                    }
+                    complete(slot, scan_status::handshake_failed, handle_result);
+                    return;
+                }
+                if (!cfg.omit_sni) {
+                    SSL_set_tlsext_host_name(c.ssl, c.target.hostname.c_str());
+                }
+                c.state = phase::handshaking;
+                set_deadline(slot, cfg.handshake_timeout_ms);
+            }
+            [[fallthrough]];
+        case phase::handshaking:
+            {
+                int ret = SSL_connect(c.ssl);
+                if (ret != 1) {
+                    if (!wait_for_io(slot, ret)) {
+                        complete(slot, scan_status::handshake_failed, handle_result);
+                    }
+                    return;
+                }
+                c.handshake_done = clock::now();
+                if (c.target.request.empty()) {
+                    complete(slot, scan_status::ok, handle_result);
+                    return;
+                }
+                c.state = phase::requesting;
+                set_deadline(slot, cfg.response_timeout_ms);
+            }
+            [[fallthrough]];
+        case phase::requesting:
+            while (c.request_offset < c.target.request.size()) {
+                int ret = SSL_write(c.ssl, c.target.request.data() + c.request_offset, c.target.request.size() - c.request_offset);
+                if (ret <= 0) {
+                    if (!wait_for_io(slot, ret)) {
+                        complete(slot, scan_status::request_failed, handle_result);
+                    }
+                    return;
+                }
+                c.request_offset += ret;
+            }
+            c.request_sent = clock::now();
+            c.state = phase::responding;
+            [[fallthrough]];
+        case phase::responding:
+            while (true) {
+                int ret = SSL_read(c.ssl, read_buffer.data(), read_buffer.size());
+                if (ret <= 0) {
+                    int err = SSL_get_error(c.ssl, ret);
+                    if ((err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) && wait_for_io(slot, ret)) {
+                        return;
+                    }
+
+                    // the server closed the connection, as requested
+                    // by the Connection: close header, or it failed
+                    //
+                    complete(slot, c.response.empty() ? scan_status::response_failed : scan_status::ok, handle_result);
+                    return;
+                }
+                size_t len = std::min((size_t)ret, cfg.max_response_length - c.response.size());
+                c.response.insert(c.response.end(), read_buffer.data(), read_buffer.data() + len);
+                if (c.response.size() >= cfg.max_response_length) {
+                    complete(slot, scan_status::ok, handle_result);
+                    return;
+                }
+            }
+        case phase::idle:
+        case phase::resolving:
+            break;
+        }
+    }
+
+    // wait_for_io(slot, ret) arranges for the scan in slot to be
+    // advanced when its socket is ready for the I/O that OpenSSL is
+    // waiting for, after a call that returned ret, and returns true,
+    // or returns false if OpenSSL reported an error
+    //
+    bool wait_for_io(uint32_t slot, int ret) {
+        connection &c = slots[slot];
+        uint32_t events;
+        switch (SSL_get_error(c.ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            events = EPOLLIN;
+            break;
+        case SSL_ERROR_WANT_WRITE:
+            events = EPOLLOUT;
+            break;
+        default:
+            if (cfg.verbosity >= verbosity_level::notes) {
+                std::string tmp{"note: TLS error with "};
+                tmp += c.target.hostname;
+                tls_connection::fprint_openssl_err(stderr, tmp.c_str());
+            }
+            ERR_clear_error();
+            return false;
+        }
+        if (events != c.events) {
+            epoll_event ev{};
+            ev.events = c.events = events;
+            ev.data.u64 = epoll_tag(slot, c.serial);
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.fd, &ev) == -1) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void set_deadline(uint32_t slot, unsigned int timeout_ms) {
+        connection &c = slots[slot];
+        c.deadline = clock::now() + std::chrono::milliseconds(timeout_ms);
+        timers.push({c.deadline, slot, c.serial});
+    }
+
+    // wait_time_ms() returns the number of milliseconds until the
+    // earliest deadline, or -1 if there is none, for use as the
+    // epoll_wait() timeout
+    //
+    int wait_time_ms() {
+        while (!timers.empty()) {
+            const timer &t = timers.top();
+            const connection &c = slots[t.slot];
+            if (c.serial != t.serial || c.deadline != t.deadline || c.state == phase::idle) {
+                timers.pop();   // stale: the scan has completed or moved on to another phase
+                continue;
+            }
+            auto wait = std::chrono::ceil<std::chrono::milliseconds>(t.deadline - clock::now()).count();
+            return wait > 0 ? wait : 0;
+        }
+        return -1;
+    }
+
+    void expire_timers(const result_handler &handle_result) {
+        clock::time_point now = clock::now();
+        while (!timers.empty() && timers.top().deadline <= now) {
+            timer t = timers.top();
+            timers.pop();
+            connection &c = slots[t.slot];
+            if (c.serial != t.serial || c.deadline != t.deadline) {
+                continue;
+            }
+            switch (c.state) {
+            case phase::connecting:
+                complete(t.slot, scan_status::connect_timeout, handle_result);
+                break;
+            case phase::handshaking:
+                complete(t.slot, scan_status::handshake_timeout, handle_result);
+                break;
+            case phase::requesting:
+            case phase::responding:
+                complete(t.slot, c.response.empty() ? scan_status::response_timeout : scan_status::ok, handle_result);
+                break;
+            case phase::idle:
+            case phase::resolving:
+                break;
+            }
+        }
+    }
+
+    void complete(uint32_t slot, scan_status status, const result_handler &handle_result) {
+        connection &c = slots[slot];
+        clock::time_point now = clock::now();
+        auto us = [](clock::time_point a, clock::time_point b) {
+            return b > a ? (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(b - a).count() : 0;
+        };
+        bool handshake_complete = c.state == phase::requesting || c.state == phase::responding || status == scan_status::ok;
+        scan_result result{
+            c.target,
+            status,
+            c.address,
+            handshake_complete ? c.ssl : nullptr,
+            datum{c.response.data(), c.response.data() + c.response.size()},
+            us(c.start, c.connected),
+            us(c.connected, c.handshake_done),
+            c.state == phase::responding ? us(c.request_sent, now) : 0,
+            c.state == phase::resolving ? 0 : us(c.start, now)
+        };
+        stats.add(status, result.total_us);
+        handle_result(result);
+
+        release(c);
+        free_slots.push_back(slot);
+        in_flight--;
+    }
+
+    void release(connection &c) {
+        if (c.ssl != nullptr) {
+            SSL_free(c.ssl);
+            c.ssl = nullptr;
+        }
+        if (c.fd != -1) {
+            close(c.fd);    // also removes it from the epoll set
+            c.fd = -1;
+        }
+        c.state = phase::idle;
+        c.events = 0;
+    }
+
+};
+
+#endif // TLS_SCAN_ENGINE_HPP
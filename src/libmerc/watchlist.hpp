@@ -14,6 +14,7 @@
 #include <fstream>
 #include "datum.h"
 #include "lex.h"
+#include "resource_image.h"
 
 // get_datum(std::string &s) returns a datum that corresponds to the
 // std::string s.
@@ -559,6 +560,31 @@ public:
 
     watchlist() { }
 
+    // watchlist(r) reads a watchlist from a resource image (see
+    // write())
+    //
+    explicit watchlist(image_reader &r) {
+        size_t n;
+        const uint32_t *v4 = r.read_array<uint32_t>(n);
+        ipv4_addrs.insert(v4, v4 + n);
+        const ipv6_array_t *v6 = r.read_array<ipv6_array_t>(n);
+        ipv6_addrs.insert(v6, v6 + n);
+        string_table names{r};
+        for (size_t i = 0; i < names.size(); i++) {
+            dns_names.insert(names[i]);
+        }
+    }
+
+    // write(w) writes this watchlist to a resource image
+    //
+    void write(image_writer &w) const {
+        std::vector<uint32_t> v4{ipv4_addrs.begin(), ipv4_addrs.end()};
+        w.write_array(v4.data(), v4.size());
+        std::vector<ipv6_array_t> v6{ipv6_addrs.begin(), ipv6_addrs.end()};
+        w.write_array(v6.data(), v6.size());
+        string_table{std::vector<std::string>{dns_names.begin(), dns_names.end()}}.write(w);
+    }
+
     // contains(x) returns true if this watchlist contains x, and
     // false otherwise.
     //
@@ -8,72 +8,298 @@
 #ifndef LLQ_H
 #define LLQ_H
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sched.h>
+#include <atomic>
+#include <stdexcept>
 
-#define LLQ_MSG_SIZE 16384   /* The number of bytes allowed for each message in the lockless queue */
-#define LLQ_DEPTH    2048    /* The number of "buckets" (queue messages) allowed */
+#define LLQ_MSG_SIZE    65536     /* The maximum number of bytes in a message in the lockless queue */
+#define LLQ_BUFFER_SIZE (2 << 20) /* The number of bytes in the ring buffer of each lockless queue */
 #define LLQ_MAX_AGE  100000000 /* Maximum age (in nanoseconds) messages are allowed to sit in a queue */
 
-/* The message object suitable for the std::priority_queue */
+/*
+ * struct llq_msg is the header of a message in a lockless queue; it
+ * is followed in the queue by the len bytes of the message itself,
+ * which are accessed through buf()
+ */
 struct llq_msg {
-    volatile int used; /* The flag that says if this object is actually in use (if not, it's available) */
-    char buf[LLQ_MSG_SIZE];
-    ssize_t len;
-    struct timespec ts;
-
-    void send(ssize_t length) {
-        len = length;
-        // A full memory barrier prevents the following flag set from happening too soon
-        __sync_synchronize();
-        used = 1;
-    }
+    uint32_t len;        /* The number of bytes in the message */
+    uint32_t skip;       /* Nonzero if this header marks unused bytes at the end of the ring */
+    struct timespec ts;  /* The time used to order messages from different queues */
+
+    char *buf() { return (char *)(this + 1); }
+
+    const char *buf() const { return (const char *)(this + 1); }
 };
 
+/*
+ * struct llq_backoff implements the adaptive wait of a thread for
+ * room in a full queue: it spins briefly, then yields the processor,
+ * then sleeps for exponentially longer intervals, up to a
+ * millisecond, so that a short wait costs little latency and a long
+ * one costs little CPU time
+ */
+class llq_backoff {
+    unsigned int count = 0;
+
+    static constexpr unsigned int spin_limit = 64;
+    static constexpr unsigned int yield_limit = spin_limit + 16;
+    static constexpr unsigned int max_sleep_us = 1000;
+
+public:
+
+    void wait() {
+        if (count < spin_limit) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#elif defined(__aarch64__)
+            asm volatile("yield");
+#endif
+        } else if (count < yield_limit) {
+            sched_yield();
+        } else {
+            unsigned int shift = count - yield_limit;
+            usleep(shift < 10 ? 1u << shift : max_sleep_us);
+        }
+        count++;
+    }
+};
 
-/* a "lockless" queue */
+/*
+ * struct ll_queue is a "lockless" single-producer, single-consumer
+ * queue of variable-length messages, which passes the output of a
+ * packet processing thread to the output thread.  Each message is
+ * stored contiguously in a ring buffer as an llq_msg header followed
+ * by the message, padded to a multiple of eight bytes, so that a
+ * message takes only as much room as it needs.  The producer reserves
+ * room for a message of up to LLQ_MSG_SIZE bytes with init_msg(),
+ * writes the message in place, and publishes it with send(); when
+ * that room would extend past the end of the buffer, the producer
+ * skips to the start of the buffer, marking the skipped bytes if
+ * there is room for a header.  The consumer reads the oldest message
+ * with front() and removes it with pop(); alternatively, it can move
+ * past messages with advance(), and later return the room they take
+ * to the producer all at once with release(), so that it can write
+ * out several messages in place.
+ */
 struct ll_queue {
     int qnum;  /* This is the queue number and is only needed for debugging */
-    int ridx;  /* The read index */
-    int widx;  /* The write index */
-    struct llq_msg msgs[LLQ_DEPTH];
 
-    static const size_t msg_length = LLQ_DEPTH;
+private:
 
-    struct llq_msg *init_msg(bool blocking, unsigned int sec, unsigned int nsec) {
-        struct llq_msg *m = &msgs[widx];
-        if (blocking) {
-            while (m->used != 0) {
-                usleep(50); // sleep for fifty microseconds
+    static constexpr size_t cache_line_size = 64;
+    static constexpr size_t alignment = 8;
+    static constexpr size_t size = LLQ_BUFFER_SIZE;
+
+    static_assert((size & (size - 1)) == 0, "LLQ_BUFFER_SIZE must be a power of two");
+
+    alignas(cache_line_size) std::atomic<size_t> head;   /* written by consumer */
+    mutable size_t cached_tail;
+    size_t read;                                        /* position of the oldest unread message */
+    alignas(cache_line_size) std::atomic<size_t> tail;   /* written by producer */
+    size_t cached_head;
+    size_t reserved;                                    /* position of the message being written */
+
+    alignas(cache_line_size) char *buffer;
+
+    static size_t record_length(size_t len) {
+        return (sizeof(struct llq_msg) + len + alignment - 1) & ~(alignment - 1);
+    }
+
+    /* bytes_to_end(x) returns the number of bytes between the position x and the end of the buffer */
+    static size_t bytes_to_end(size_t x) { return size - (x & (size - 1)); }
+
+    struct llq_msg *msg_at(size_t x) const { return (struct llq_msg *)(buffer + (x & (size - 1))); }
+
+    /*
+     * read_position() returns the position of the oldest unread
+     * message, after any skipped bytes, or SIZE_MAX if there is none
+     */
+    size_t read_position() const {
+        size_t h = read;
+        if (h == cached_tail) {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (h == cached_tail) {
+                return SIZE_MAX;
             }
         }
-        if (m->used == 0) {
+        if (bytes_to_end(h) < sizeof(struct llq_msg) || msg_at(h)->skip) {
+            h += bytes_to_end(h);
+        }
+        return h;
+    }
+
+    static_assert(size >= 2 * (sizeof(struct llq_msg) + LLQ_MSG_SIZE + alignment),
+                  "LLQ_BUFFER_SIZE must hold at least two messages of LLQ_MSG_SIZE bytes");
+
+public:
+
+    /*
+     * When a queue is fed by a worker of the sharded pcap file
+     * reader, the reader counts the packets that it has assigned to
+     * the worker, and the worker counts the packets that it has
+     * finished processing (after any output message has been sent).
+     * When the counts are equal and the queue is empty, the worker is
+     * idle, and any message it sends later will be for a packet that
+     * was read after every message that is currently queued.
+     */
+    alignas(cache_line_size) std::atomic<uint64_t> pkts_assigned;
+    std::atomic<uint64_t> pkts_completed;
+
+    ll_queue() :
+        qnum{0},
+        head{0},
+        cached_tail{0},
+        read{0},
+        tail{0},
+        cached_head{0},
+        reserved{0},
+        buffer{(char *)malloc(size)},
+        pkts_assigned{0},
+        pkts_completed{0}
+    {
+        if (buffer == nullptr) {
+            throw std::runtime_error("error: could not allocate lockless queue");
+        }
+    }
+
+    ~ll_queue() { free(buffer); }
+
+    ll_queue(const ll_queue &) = delete;
+    ll_queue &operator=(const ll_queue &) = delete;
 
-            m->ts.tv_sec = sec;
-            m->ts.tv_nsec = nsec;
-            m->buf[0] = '\0';
+    bool is_idle() const {
+        uint64_t assigned = pkts_assigned.load(std::memory_order_acquire);
+        return pkts_completed.load(std::memory_order_acquire) == assigned && front() == nullptr;
+    }
 
-            return m;
+    /*
+     * init_msg(blocking, sec, nsec) reserves room for a message of up
+     * to LLQ_MSG_SIZE bytes with the time sec, nsec, and returns a
+     * pointer to its header, or nullptr if the queue is full and
+     * blocking is false; if blocking is true, it waits for room.  The
+     * message is not visible to the consumer until send() is called.
+     *
+     * This function MUST only be called from the producer thread.
+     */
+    struct llq_msg *init_msg(bool blocking, unsigned int sec, unsigned int nsec) {
+        const size_t len = record_length(LLQ_MSG_SIZE);
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t skip = bytes_to_end(t) < len ? bytes_to_end(t) : 0;
+        if (t + skip + len - cached_head > size) {
+            llq_backoff backoff;
+            while (true) {
+                cached_head = head.load(std::memory_order_acquire);
+                if (t + skip + len - cached_head <= size) {
+                    break;
+                }
+                if (!blocking) {
+                    // TODO: this is where we'd update an output drop counter
+                    // but currently this spot in the code doesn't have access to
+                    // any thread stats pointer or similar and I don't want
+                    // to update a global variable in this location.
+                    return nullptr;
+                }
+                backoff.wait();
+            }
         }
-        //fprintf(stderr, "DEBUG: queue bucket used!\n");
+        if (skip >= sizeof(struct llq_msg)) {
+            msg_at(t)->skip = 1;
+        }
+        reserved = t + skip;
+        struct llq_msg *m = msg_at(reserved);
+        m->len = 0;
+        m->skip = 0;
+        m->ts.tv_sec = sec;
+        m->ts.tv_nsec = nsec;
+        m->buf()[0] = '\0';
+        return m;
+    }
+
+    /*
+     * send(m, length) publishes the message m returned by the last
+     * call to init_msg(), which holds length bytes, to the consumer;
+     * length must be no greater than LLQ_MSG_SIZE.
+     *
+     * This function MUST only be called from the producer thread.
+     */
+    void send(struct llq_msg *m, size_t length) {
+        m->len = length;
+        tail.store(reserved + record_length(length), std::memory_order_release);
+    }
+
+    /*
+     * front() returns a pointer to the oldest unread message in the
+     * queue, or nullptr if there is none; the message remains in the
+     * queue until pop() or advance() is called.
+     *
+     * This function MUST only be called from the consumer thread.
+     */
+    const struct llq_msg *front() const {
+        size_t h = read_position();
+        return h == SIZE_MAX ? nullptr : msg_at(h);
+    }
 
-        // TODO: this is where we'd update an output drop counter
-        // but currently this spot in the code doesn't have access to
-        // any thread stats pointer or similar and I don't want
-        // to update a global variable in this location.
-        return nullptr;
+    /*
+     * advance() moves past the message returned by front(), which
+     * remains valid, and keeps its room in the queue, until release()
+     * is called
+     *
+     * This function MUST only be called from the consumer thread,
+     * after front() has returned a message.
+     */
+    void advance() {
+        size_t h = read_position();
+        read = h + record_length(msg_at(h)->len);
     }
-    void write_buffer_to_queue() {
+
+    /*
+     * release() returns the room taken by the messages that have been
+     * passed over by advance() to the producer
+     *
+     * This function MUST only be called from the consumer thread.
+     */
+    void release() {
+        head.store(read, std::memory_order_release);
     }
-    void increment_widx() {
-        widx = (widx + 1) % LLQ_DEPTH;
+
+    /*
+     * pop() removes the message returned by front() from the queue
+     *
+     * This function MUST only be called from the consumer thread,
+     * after front() has returned a message.
+     */
+    void pop() {
+        advance();
+        release();
     }
 };
 
 
+/*
+ * timespec_to_ns(ts) returns the time ts in nanoseconds
+ */
+static inline uint64_t timespec_to_ns(const struct timespec *ts) {
+    return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
 struct thread_queues {
     int qnum;             /* The number of queues that have been allocated */
     int qidx;             /* The index of the first free queue */
     struct ll_queue *queue;      /* The actual queue datastructure */
+    bool in_order;        /* Wait for idle queues, not LLQ_MAX_AGE, when a queue is empty */
+
+    /*
+     * When in_order is set, read_clock is the latest timestamp (in
+     * nanoseconds) of the packets that the sharded pcap file reader
+     * has assigned to the workers; it is updated before the packet
+     * is counted in pkts_assigned
+     */
+    std::atomic<uint64_t> read_clock;
 };
 
 
@@ -82,6 +308,7 @@ struct tourn_tree {
     int qp2;
     int *tree;
     int stalled;
+    uint64_t read_clock;  /* thread_queues::read_clock before the last full tournament */
 };
 
 #endif // LLQ_H
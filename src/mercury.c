@@ -41,6 +41,8 @@ char mercury_help[] =
     "   [-t or --threads] [num_threads | cpu] # set number of threads\n"
     "   [-u or --user] u                      # set UID and GID to those of user u\n"
     "   [-d or --directory] d                 # set working directory to d\n"
+    "   --fanout=[hash | flow | cpu]          # set how packets are spread over threads\n"
+    "   --cpus=list                           # pin threads to cpus in list (e.g. 0-3,8)\n"
     "GENERAL OPTIONS\n"
     "   --config c                            # read configuration from file c\n"
     "   [-a or --analysis]                    # analyze fingerprints\n"
@@ -49,12 +51,15 @@ char mercury_help[] =
     "   --stats=f                             # write stats to file f\n"
     "   --stats-time=T                        # write stats every T seconds\n"
     "   --stats-limit=L                       # limit stats to L entries\n"
+    "   --stats-queue-depth=D                 # queue up to D stats events per thread\n"
+    "   --stats-dump-threads=N                # format stats output with N threads\n"
     "   [-s or --select] filter               # select traffic by filter (see --help)\n"
     "   --nonselected-tcp-data                # tcp data for nonselected traffic\n"
     "   --nonselected-udp-data                # udp data for nonselected traffic\n"
     "   --tcp-reassembly                      # reassemble tcp data segments\n"
     "   [-l or --limit] l                     # rotate output file after l records\n"
     "   --output-time=T                       # rotate output file after T seconds\n"
+    "   --output-compression=gzip             # compress output file with gzip\n"
     "   --dns-json                            # output DNS as JSON, not base64\n"
     "   --certs-json                          # output certs as JSON, not base64\n"
     "   --metadata                            # output more protocol metadata in JSON\n"
@@ -75,6 +80,19 @@ char mercury_extended_help[] =
     "   is the available memory; USE b < 0.1 EXCEPT WHEN THERE ARE GIGABYTES OF SPARE\n"
     "   RAM to avoid OS failure due to memory starvation.\n"
     "\n"
+    "   \"--fanout=f\" sets how captured packets are spread over the worker threads.\n"
+    "   With \"hash\" (the default), the kernel uses its flow hash.  With \"flow\", a\n"
+    "   socket filter hashes the IP addresses and the TCP, UDP, or SCTP ports of each\n"
+    "   packet symmetrically, so that both directions of a flow, and all of the\n"
+    "   fragments of an IPv4 packet, go to the same thread.  With \"cpu\", each packet\n"
+    "   goes to the thread for the cpu on which it was received, which keeps each\n"
+    "   flow local to one cpu when the receive queues of the NIC are pinned to cpus\n"
+    "   (RSS).  \"--cpus=l\" pins worker thread i to the ith cpu in the list l, which\n"
+    "   is a comma-separated list of cpu numbers and ranges such as 0-3,8, reusing\n"
+    "   the list if there are more threads than cpus; the ring buffer and packet\n"
+    "   processor of each thread are then allocated from the memory that is local\n"
+    "   to its cpu.\n"
+    "\n"
     "   \"[-f or --fingerprint] f\" writes a JSON record for each fingerprint observed,\n"
     "   which incorporates the flow key and the time of observation, into the file f.\n"
     "   With [-a or --analysis], fingerprints and destinations are analyzed and the\n"
@@ -84,7 +102,10 @@ char mercury_extended_help[] =
     "   option [-s or --select], packets are filtered so that only ones with\n"
     "   fingerprint metadata are written.\n"
     "\n"
-    "   \"[r or --read] r\" reads packets from the file r, in PCAP format.\n"
+    "   \"[r or --read] r\" reads packets from the file r, in PCAP or PCAP-NG format.\n"
+    "   With [-t or --threads] t, where t is greater than one, one thread reads the\n"
+    "   file and assigns each flow to one of t worker threads, and the output of the\n"
+    "   workers is merged in timestamp order.\n"
     "\n"
     "   if neither -r nor -c is specified, then packets are read from standard input,\n"
     "   in PCAP format.\n"
@@ -160,6 +181,13 @@ char mercury_extended_help[] =
     "   object in the JSON records.   This option only works with the option\n"
     "   [-f or --fingerprint].\n"
     "\n"
+    "   \"--resources=f\" reads the analysis resources from the file f, which is\n"
+    "   either a resource archive or a resource image compiled from one by\n"
+    "   resource_compiler; an image is mapped into memory rather than parsed, so\n"
+    "   that it loads much faster, and its pages are shared between processes.\n"
+    "   Sending SIGHUP to mercury reloads the resource file, without stopping\n"
+    "   packet processing.\n"
+    "\n"
     "   \"--format=f\" reports fingerprints with formats(s) f, where f is either a\n"
     "   fingerprint protocol and format like \"tls/1\", or is a sequence of protocol\n"
     "   and format strings.\n"
@@ -167,6 +195,9 @@ char mercury_extended_help[] =
     "   \"[-l or --limit] l\" rotates output files so that each file has at most\n"
     "   l records or packets; filenames include a sequence number, date and time.\n"
     "\n"
+    "   --output-compression=gzip compresses the JSON output with gzip, in a separate\n"
+    "   thread; each output file is a complete gzip file.\n"
+    "\n"
     "   --dns-json writes out DNS responses as a JSON object; otherwise,\n"
     "   that data is output in base64 format, as a string with the key \"base64\".\n"
     "\n"
@@ -234,7 +265,7 @@ int main(int argc, char *argv[]) {
     std::string additional_args;
 
     while(1) {
-        enum opt { config=1, version=2, license=3, dns_json=4, certs_json=5, metadata=6, resources=7, tcp_init_data=8, udp_init_data=9, write_stats=10, stats_limit=11, stats_time=12, output_time=13, tcp_reassembly=14, format=15 };
+        enum opt { config=1, version=2, license=3, dns_json=4, certs_json=5, metadata=6, resources=7, tcp_init_data=8, udp_init_data=9, write_stats=10, stats_limit=11, stats_time=12, output_time=13, tcp_reassembly=14, format=15, stats_queue_depth=16, stats_dump_threads=17, output_compression=18, fanout=19, cpus=20 };
         int opt_idx = 0;
         static struct option long_opts[] = {
             { "config",      required_argument, NULL, config  },
@@ -249,7 +280,12 @@ int main(int argc, char *argv[]) {
             { "nonselected-udp-data", no_argument, NULL, udp_init_data },
             { "stats-limit", required_argument, NULL, stats_limit },
             { "stats-time",  required_argument, NULL, stats_time },
+            { "stats-queue-depth", required_argument, NULL, stats_queue_depth },
+            { "stats-dump-threads", required_argument, NULL, stats_dump_threads },
             { "output-time", required_argument, NULL, output_time },
+            { "output-compression", required_argument, NULL, output_compression },
+            { "fanout",      required_argument, NULL, fanout },
+            { "cpus",        required_argument, NULL, cpus },
             { "tcp-reassembly", no_argument,    NULL, tcp_reassembly },
             { "format",      required_argument, NULL, format },
             { "read",        required_argument, NULL, 'r' },
@@ -502,6 +538,20 @@ int main(int argc, char *argv[]) {
                 usage(argv[0], "option stats-limit requires a numeric argument", extended_help_off);
             }
             break;
+        case stats_queue_depth:
+            if (option_is_valid(optarg)) {
+                additional_args.append("stats-queue-depth=").append(optarg).append(";");
+            } else {
+                usage(argv[0], "option stats-queue-depth requires a numeric argument", extended_help_off);
+            }
+            break;
+        case stats_dump_threads:
+            if (option_is_valid(optarg)) {
+                additional_args.append("stats-dump-threads=").append(optarg).append(";");
+            } else {
+                usage(argv[0], "option stats-dump-threads requires a numeric argument", extended_help_off);
+            }
+            break;
         case output_time:
             if (option_is_valid(optarg)) {
                 errno = 0;
@@ -513,6 +563,27 @@ int main(int argc, char *argv[]) {
                 usage(argv[0], "option output-time requires a numeric argument", extended_help_off);
             }
             break;
+        case output_compression:
+            if (option_is_valid(optarg)) {
+                cfg.output_compression = optarg;
+            } else {
+                usage(argv[0], "option output-compression requires an argument", extended_help_off);
+            }
+            break;
+        case fanout:
+            if (option_is_valid(optarg)) {
+                cfg.fanout = optarg;
+            } else {
+                usage(argv[0], "option fanout requires an argument", extended_help_off);
+            }
+            break;
+        case cpus:
+            if (option_is_valid(optarg)) {
+                cfg.cpus = optarg;
+            } else {
+                usage(argv[0], "option cpus requires an argument", extended_help_off);
+            }
+            break;
         case 'p':
             if (option_is_valid(optarg)) {
                 errno = 0;
@@ -585,6 +656,18 @@ int main(int argc, char *argv[]) {
     if (cfg.fingerprint_filename && cfg.write_filename) {
         usage(argv[0], "both fingerprint [f] and write [w] specified on command line", extended_help_off);
     }
+    if (cfg.output_compression && strcmp(cfg.output_compression, "gzip") != 0) {
+        usage(argv[0], "unknown output-compression format (must be gzip)", extended_help_off);
+    }
+    if (cfg.output_compression && cfg.write_filename) {
+        usage(argv[0], "output-compression cannot be used with write [w]", extended_help_off);
+    }
+    if (cfg.fanout && strcmp(cfg.fanout, "hash") != 0 && strcmp(cfg.fanout, "flow") != 0 && strcmp(cfg.fanout, "cpu") != 0) {
+        usage(argv[0], "unknown fanout mode (must be hash, flow, or cpu)", extended_help_off);
+    }
+    if ((cfg.fanout || cfg.cpus) && cfg.capture_interface == NULL) {
+        usage(argv[0], "fanout and cpus options require capture [c]", extended_help_off);
+    }
     if (libmerc_cfg.max_stats_entries && cfg.stats_filename == NULL) {
         usage(argv[0], "stats-limit set, but no stats file specified", extended_help_off);
     }
@@ -691,6 +774,10 @@ int main(int argc, char *argv[]) {
         delete ctl;  // delete control thread, which will flush stats output (if any)
     }
 
+    if (cfg.verbosity && cfg.stats_filename) {
+        fprintf(stderr, "stats events dropped: %zu\n", get_stats_aggregator_num_dropped_events(mc));
+    }
+
     mercury_finalize(mc);
 
     return 0;
@@ -61,10 +61,13 @@ struct mercury_config {
     int adaptive;                   /* adaptively accept/skip packets for PCAP output */
     bool output_block;              /* use blocking output                            */
     size_t stats_rotation_duration; /* number of seconds between stats file rotation  */
-    size_t out_rotation_duration;   /* number of seconds between json file rotation  */}
+    size_t out_rotation_duration;   /* number of seconds between json file rotation  */
+    char *output_compression;       /* compression format for output files, if any    */
+    char *fanout;                   /* fanout mode (hash, flow, or cpu), if any       */
+    char *cpus;                     /* list of cpus for worker threads, if any        */}
 ;
 
-#define mercury_config_init() { NULL, NULL, NULL, NULL, NULL, NULL, O_EXCL, (char *)"w", 0, 8, 1, 0, NULL, 1, 0, 0, 0, false, 300, 0 }
+#define mercury_config_init() { NULL, NULL, NULL, NULL, NULL, NULL, O_EXCL, (char *)"w", 0, 8, 1, 0, NULL, 1, 0, 0, 0, false, 300, 0, NULL, NULL, NULL }
 
 
 #endif /* MERCURY_H */
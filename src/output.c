@@ -9,6 +9,7 @@
 #include <sys/time.h>
 #include <string.h>
 #include "output.h"
+#include "output_writer.h"
 #include "pcap_file_io.h"  // for write_pcap_file_header()
 #include "libmerc/utils.h"
 
@@ -17,33 +18,30 @@
 
 void thread_queues_init(struct thread_queues *tqs, int n) {
     tqs->qnum = n;
-    tqs->queue = (struct ll_queue *)calloc(n, sizeof(struct ll_queue));
-
-    if (tqs->queue == NULL) {
+    tqs->in_order = false;
+    tqs->read_clock.store(0);
+    try {
+        tqs->queue = new struct ll_queue[n];
+    }
+    catch (std::exception &e) {
         fprintf(stderr, "Failed to allocate memory for thread queues\n");
         exit(255);
     }
 
     for (int i = 0; i < n; i++) {
         tqs->queue[i].qnum = i; /* only needed for debug output */
-        tqs->queue[i].ridx = 0;
-        tqs->queue[i].widx = 0;
-
-        for (int j = 0; j < LLQ_DEPTH; j++) {
-            tqs->queue[i].msgs[j].used = 0;
-        }
     }
 }
 
 
 void thread_queues_free(struct thread_queues *tqs) {
-    free(tqs->queue);
+    delete[] tqs->queue;
     tqs->queue = NULL;
     tqs->qnum = 0;
 }
 
 
-int time_less(struct timespec *tsl, struct timespec *tsr) {
+int time_less(const struct timespec *tsl, const struct timespec *tsr) {
 
     if ((tsl->tv_sec < tsr->tv_sec) || ((tsl->tv_sec == tsr->tv_sec) && (tsl->tv_nsec < tsr->tv_nsec))) {
         return 1;
@@ -81,8 +79,8 @@ int queue_less(int ql, int qr, struct tourn_tree *t_tree, const struct thread_qu
      *
      * WARNING: This function is NOT thread safe!
      *
-     * Meaning the access to the 'used' member in the queue
-     * struct happens and then later the access to the
+     * Meaning the check for a message at the front of the
+     * queue happens and then later the access to the
      * struct timespec happens.
      * This function must be called by the output thread
      * and ONLY the output thread because if
@@ -95,17 +93,19 @@ int queue_less(int ql, int qr, struct tourn_tree *t_tree, const struct thread_qu
 
     /* check for a queue stall before we return anything otherwise
      * we could short-circuit logic before realizing one of the
-     * queues was stalled
+     * queues was stalled; when the queues are merged in order, an
+     * empty queue whose worker is idle does not stall the tree, but
+     * loses to every queue that holds a message
      */
     if ((ql >= 0) && (ql < tqs->qnum)) {
-        ql_used = tqs->queue[ql].msgs[tqs->queue[ql].ridx].used;
-        if (ql_used == 0) {
+        ql_used = tqs->queue[ql].front() != nullptr;
+        if (ql_used == 0 && !(tqs->in_order && tqs->queue[ql].is_idle())) {
             t_tree->stalled = 1;
         }
     }
     if ((qr >= 0) && (qr < tqs->qnum)) {
-        qr_used = tqs->queue[qr].msgs[tqs->queue[qr].ridx].used;
-        if (qr_used == 0) {
+        qr_used = tqs->queue[qr].front() != nullptr;
+        if (qr_used == 0 && !(tqs->in_order && tqs->queue[qr].is_idle())) {
             t_tree->stalled = 1;
         }
     }
@@ -145,8 +145,8 @@ int queue_less(int ql, int qr, struct tourn_tree *t_tree, const struct thread_qu
     } else if (qr_used == 0) {
         return 1;
     } else {
-        struct timespec *tsl = &(tqs->queue[ql].msgs[tqs->queue[ql].ridx].ts);
-        struct timespec *tsr = &(tqs->queue[qr].msgs[tqs->queue[qr].ridx].ts);
+        const struct timespec *tsl = &(tqs->queue[ql].front()->ts);
+        const struct timespec *tsr = &(tqs->queue[qr].front()->ts);
 
         return time_less(tsl, tsr);
     }
@@ -224,6 +224,22 @@ void run_tourn_for_entire_tree(struct tourn_tree *t_tree, const struct thread_qu
 }
 
 
+/*
+ * in_order_writable(t_tree, msg) returns 1 if msg, which has won the
+ * tournament, can be written out when the queues are merged in order,
+ * and 0 otherwise.  The tournament skips the empty queues whose
+ * workers are idle, and any message that such a worker sends later is
+ * for a packet that is read later, so its timestamp is no earlier
+ * than the read clock when the worker was found to be idle.  The
+ * winner can be written if it is no later than the read clock before
+ * the last full tournament, even though the tree is not updated when
+ * an idle worker sends a message.
+ */
+int in_order_writable(const struct tourn_tree *t_tree, const struct llq_msg *msg) {
+    return timespec_to_ns(&msg->ts) <= t_tree->read_clock;
+}
+
+
 void debug_print_tour_tree(struct tourn_tree *t_tree, const struct thread_queues *tqs) {
 
     fprintf(stderr, "Tourn Tree size: %d\n", (t_tree->qp2 - 1));
@@ -239,7 +255,7 @@ void debug_print_tour_tree(struct tourn_tree *t_tree, const struct thread_queues
 
     fprintf(stderr, "Ready queues:\n");
     for (int q = 0; q < t_tree->qnum; q++) {
-        if (tqs->queue[q].msgs[tqs->queue[q].ridx].used == 1) {
+        if (tqs->queue[q].front() != nullptr) {
             fprintf(stderr, "%d ", q);
         }
     }
@@ -528,6 +544,18 @@ void *output_thread_func(void *arg) {
      * dependant, or ethernet card dependant.  The exact situations
      * where packets can be recieved out of cronological order aren't
      * known (to me anyways).
+     *
+     * When the queues are fed by the sharded pcap file reader
+     * (qs.in_order is set), the packet timestamps are unrelated to
+     * the current time, so LLQ_MAX_AGE is not used.  Instead, an
+     * empty queue only stalls the tournament if its worker is not
+     * idle, that is, if it has not processed every packet assigned
+     * to it, and the winner is written only if it is no later than
+     * the read clock (see in_order_writable()); because the reader
+     * assigns packets in file order, the merged output is in
+     * timestamp order whenever the file is.  Each message costs a
+     * run of the tournament for one queue, and the entire tree is
+     * only re-run once per pass.
      */
 
     struct tourn_tree t_tree;
@@ -545,12 +573,28 @@ void *output_thread_func(void *arg) {
         t_tree.tree[i] = -1;
     }
 
+    /* The records are not written one at a time; instead, the
+     * writer gathers them, in place in the lockless queues, and
+     * writes many of them with a single writev() call, or passes
+     * them to a separate compression thread, if output compression
+     * is used.  The room that the records take in the queues is
+     * released only after they have been written or copied, so the
+     * writer must be flushed whenever the output thread is about to
+     * sleep, and must finish each output file before it is rotated
+     * or closed.
+     */
+    output_writer writer{out_ctx->compression};
+    uint64_t busy_ns = 0;
+
     int all_output_flushed = 0;
     enum status status = status_ok;
     while (all_output_flushed == 0) {
+        bool wrote_output = false;
+        auto pass_start = std::chrono::steady_clock::now();
 
         /* Bring the tree up-to-date */
         t_tree.stalled = 0;
+        t_tree.read_clock = out_ctx->qs.read_clock.load(std::memory_order_acquire);
         run_tourn_for_entire_tree(&t_tree, &out_ctx->qs);
         //for (int q = 0; q < t_tree.qp2; q += 2) {
         //run_tourn_for_queue(&t_tree, q, &out_ctx->qs);
@@ -565,16 +609,14 @@ void *output_thread_func(void *arg) {
         while (t_tree.stalled == 0) {
             wq = t_tree.tree[0]; /* the root node is always the winning queue */
 
-            struct llq_msg *wmsg = &(out_ctx->qs.queue[wq].msgs[out_ctx->qs.queue[wq].ridx]);
-            if (wmsg->used == 1) {
-                fwrite(wmsg->buf, wmsg->len, 1, out_ctx->file_pri);
-
-                /* A full memory barrier prevents the following flag (un)set from happening too soon */
-                __sync_synchronize();
-                wmsg->used = 0;
+            const struct llq_msg *wmsg = out_ctx->qs.queue[wq].front();
+            if (wmsg != nullptr && (!out_ctx->qs.in_order || in_order_writable(&t_tree, wmsg))) {
+                writer.append(out_ctx->file_pri, &out_ctx->qs.queue[wq], wmsg);
+                wrote_output = true;
 
                 /* Handle rotating file if needed */
                 if (output_file_needs_rotation(out_ctx)) {
+                    writer.finish_file(out_ctx->file_pri);
                     status = limit_rotate(out_ctx);
                     if (status) {
                         break;
@@ -582,14 +624,13 @@ void *output_thread_func(void *arg) {
                 }
 
                 if (out_ctx->time_rotation_req.load() == true) {
+                    writer.finish_file(out_ctx->file_pri);
                     status = time_rotate(out_ctx);
                     if (status) {
                         break;
                     }
                 }
 
-                out_ctx->qs.queue[wq].ridx = (out_ctx->qs.queue[wq].ridx + 1) % LLQ_DEPTH;
-
                 run_tourn_for_queue(&t_tree, wq, &out_ctx->qs);
             }
             else {
@@ -618,8 +659,8 @@ void *output_thread_func(void *arg) {
         while (old_done == 0) {
             wq = t_tree.tree[0];
 
-            struct llq_msg *wmsg = &(out_ctx->qs.queue[wq].msgs[out_ctx->qs.queue[wq].ridx]);
-            if (wmsg->used == 0) {
+            const struct llq_msg *wmsg = out_ctx->qs.queue[wq].front();
+            if (wmsg == nullptr) {
                 /* Even the top queue has nothing so we can just stop now */
                 old_done = 1;
 
@@ -629,16 +670,14 @@ void *output_thread_func(void *arg) {
                 }
 
                 break;
-            } else if (time_less(&(wmsg->ts), &old_ts) == 1) {
+            } else if (!out_ctx->qs.in_order && time_less(&(wmsg->ts), &old_ts) == 1) {
                 //fprintf(stderr, "DEBUG: writing old message from queue %d\n", wq);
-                fwrite(wmsg->buf, wmsg->len, 1, out_ctx->file_pri);
-
-                /* A full memory barrier prevents the following flag (un)set from happening too soon */
-                __sync_synchronize();
-                wmsg->used = 0;
+                writer.append(out_ctx->file_pri, &out_ctx->qs.queue[wq], wmsg);
+                wrote_output = true;
 
                 /* Handle rotating file if needed */
                 if (output_file_needs_rotation(out_ctx)) {
+                    writer.finish_file(out_ctx->file_pri);
                     status = limit_rotate(out_ctx);
                     if (status) {
                         break;
@@ -646,32 +685,48 @@ void *output_thread_func(void *arg) {
                 }
 
                 if (out_ctx->time_rotation_req.load() == true) {
+                    writer.finish_file(out_ctx->file_pri);
                     status = time_rotate(out_ctx);
                     if (status) {
                         break;
                     }
                 }
 
-                out_ctx->qs.queue[wq].ridx = (out_ctx->qs.queue[wq].ridx + 1) % LLQ_DEPTH;
-
                 run_tourn_for_queue(&t_tree, wq, &out_ctx->qs);
             } else {
                 old_done = 1;
             }
         }
 
-        /* This sleep slows us down so we don't spin the CPU.
-         * We probably could afford to call fflush() here
-         * the first time instead of sleeping and only sleep
-         * if we really aren't recieving any messages on
-         * any queues.
+        /* Write out the gathered records before sleeping; while
+         * records keep arriving, write them out once the oldest of
+         * them has waited for long enough.
          */
-        struct timespec sleep_ts;
-        sleep_ts.tv_sec = 0;
-        sleep_ts.tv_nsec = 1000000;
-        nanosleep(&sleep_ts, NULL);
+        if (wrote_output) {
+            writer.flush_if_stale();
+        } else {
+            writer.flush();
+        }
+        busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - pass_start).count();
+
+        /* This sleep slows us down so we don't spin the CPU when
+         * no messages are arriving.  If any messages were written
+         * during this pass, we go around again right away, so that
+         * busy queues are drained before they fill up.
+         */
+        if (!wrote_output) {
+            struct timespec sleep_ts;
+            sleep_ts.tv_sec = 0;
+            sleep_ts.tv_nsec = 1000000;
+            nanosleep(&sleep_ts, NULL);
+        }
     } /* End all_output_flushed == 0 meaning we got a signal to stop */
 
+    writer.finish_file(out_ctx->file_pri);
+    if (out_ctx->verbosity) {
+        writer.print_stats(stderr, busy_ns);
+    }
+
     if (t_tree.tree) {
         free(t_tree.tree);
     }
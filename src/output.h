@@ -39,6 +39,8 @@ struct output_file {
     pthread_cond_t t_output_c;
     pthread_mutex_t t_output_m;
     struct thread_queues qs;
+    const char *compression = nullptr;
+    int verbosity = 0;
     int sig_stop_output = 0;
 };
 
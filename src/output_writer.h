@@ -0,0 +1,412 @@
+/*
+ * output_writer.h
+ *
+ * batched and optionally compressed writing of the records merged by
+ * the output thread
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef OUTPUT_WRITER_H
+#define OUTPUT_WRITER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <zlib.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "llq.h"
+
+/*
+ * class output_codec is the interface to a streaming compression
+ * format for output files.  Each output file holds one stream, which
+ * is ended by finish(); after that, the codec starts a new stream.
+ * To add a format, derive a class from output_codec and add its name
+ * to output_codec::create().
+ */
+class output_codec {
+public:
+    virtual ~output_codec() { }
+
+    // compress(data, length, out) appends the compressed form of the
+    // length bytes at data to out
+    //
+    virtual void compress(const uint8_t *data, size_t length, std::vector<uint8_t> &out) = 0;
+
+    // finish(out) appends the end of the current stream to out
+    //
+    virtual void finish(std::vector<uint8_t> &out) = 0;
+
+    // create(name) returns a new codec for the format name, or
+    // nullptr if there is no such format
+    //
+    static output_codec *create(const char *name);
+};
+
+/*
+ * class gzip_codec writes gzip streams with zlib, at zlib's default
+ * compression level
+ */
+class gzip_codec : public output_codec {
+    z_stream z;
+
+    void deflate_into(std::vector<uint8_t> &out, int flush) {
+        do {
+            size_t offset = out.size();
+            out.resize(offset + chunk_size);
+            z.next_out = out.data() + offset;
+            z.avail_out = chunk_size;
+            int status = deflate(&z, flush);
+            if (status == Z_STREAM_ERROR) {
+                throw std::runtime_error("error: zlib deflate() failed");
+            }
+            out.resize(offset + chunk_size - z.avail_out);
+        } while (z.avail_out == 0);
+    }
+
+    static constexpr size_t chunk_size = 65536;
+
+public:
+
+    gzip_codec() {
+        memset(&z, 0, sizeof(z));
+        // a window size of 15 + 16 selects the gzip format
+        if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::runtime_error("error: could not initialize zlib");
+        }
+    }
+
+    ~gzip_codec() { deflateEnd(&z); }
+
+    void compress(const uint8_t *data, size_t length, std::vector<uint8_t> &out) override {
+        z.next_in = (Bytef *)data;
+        z.avail_in = length;
+        deflate_into(out, Z_NO_FLUSH);
+    }
+
+    void finish(std::vector<uint8_t> &out) override {
+        z.next_in = nullptr;
+        z.avail_in = 0;
+        deflate_into(out, Z_FINISH);
+        deflateReset(&z);
+    }
+};
+
+inline output_codec *output_codec::create(const char *name) {
+    if (strcmp(name, "gzip") == 0) {
+        return new gzip_codec;
+    }
+    return nullptr;
+}
+
+/*
+ * class output_writer writes the messages merged by the output
+ * thread.  Rather than copying each message into a stdio buffer, the
+ * output thread passes messages to append(), which gathers them in
+ * place (see ll_queue::advance()) into an array of iovecs; when that
+ * array is full, or when flush() is called, the messages are written
+ * with a single writev(), and their room is released to the queues
+ * that they came from.
+ *
+ * If a codec is used, the gathered messages are instead copied into
+ * a block, and their room is released right away; a separate
+ * compression thread compresses the blocks and writes them out, so
+ * that the output thread can merge messages while the previous ones
+ * are being compressed.  When the output file is about to be rotated
+ * or closed, the output thread calls finish_file(), which ends the
+ * compressed stream and waits until all of it has been written.
+ *
+ * The writer counts the time spent in each stage, so that
+ * print_stats() can show whether merging, compression, or writing is
+ * the bottleneck.
+ */
+class output_writer {
+
+    static constexpr int max_iov = IOV_MAX < 1024 ? IOV_MAX : 1024;
+    static constexpr size_t max_batch_bytes = 1 << 20;
+    static constexpr size_t max_blocks_in_flight = 4;
+    static constexpr std::chrono::milliseconds max_latency{10};
+
+    using clock = std::chrono::steady_clock;
+
+    // gather stage, used by the output thread
+    //
+    struct iovec iov[max_iov];
+    int iovcnt = 0;
+    size_t batch_bytes = 0;
+    FILE *batch_file = nullptr;
+    clock::time_point batch_start;
+    std::vector<struct ll_queue *> batch_queues;   // queues to release after writing
+
+    // compression stage, used by the compression thread
+    //
+    struct block {
+        std::vector<uint8_t> data;
+        FILE *file;
+        bool finish;
+    };
+    output_codec *codec = nullptr;
+    std::thread compressor;
+    std::mutex m;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    std::deque<block *> work;
+    std::vector<block *> free_blocks;
+    size_t in_flight = 0;
+    bool stop = false;
+
+    // statistics
+    //
+    uint64_t records = 0;
+    uint64_t bytes_in = 0;
+    uint64_t batches = 0;
+    std::atomic<uint64_t> bytes_out{0};
+    std::atomic<uint64_t> write_ns{0};
+    std::atomic<uint64_t> compress_ns{0};
+    uint64_t wait_ns = 0;
+    uint64_t flush_ns = 0;     // time that the output thread spent in flush()
+    bool write_error = false;
+
+    static uint64_t ns_since(clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+    }
+
+    // write_all(file, iov, count) writes out all of the data in the
+    // iovecs, continuing after partial writes
+    //
+    void write_all(FILE *file, struct iovec *v, int count) {
+        auto start = clock::now();
+
+        // data written through stdio (such as a pcap file header)
+        // must precede the data written here
+        //
+        fflush(file);
+        int fd = fileno(file);
+        while (count > 0) {
+            ssize_t n = writev(fd, v, count);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (!write_error) {
+                    perror("error: could not write output file");
+                    write_error = true;
+                }
+                break;
+            }
+            bytes_out += n;
+            while (count > 0 && (size_t)n >= v->iov_len) {
+                n -= v->iov_len;
+                v++;
+                count--;
+            }
+            if (count > 0) {
+                v->iov_base = (char *)v->iov_base + n;
+                v->iov_len -= n;
+            }
+        }
+        write_ns += ns_since(start);
+    }
+
+    void compress_blocks() {
+        std::vector<uint8_t> out;
+        while (true) {
+            block *b;
+            {
+                std::unique_lock<std::mutex> lock{m};
+                work_ready.wait(lock, [this]{ return stop || !work.empty(); });
+                if (work.empty()) {
+                    return;
+                }
+                b = work.front();
+                work.pop_front();
+            }
+            auto start = clock::now();
+            out.clear();
+            codec->compress(b->data.data(), b->data.size(), out);
+            if (b->finish) {
+                codec->finish(out);
+            }
+            compress_ns += ns_since(start);
+            struct iovec v = { out.data(), out.size() };
+            write_all(b->file, &v, 1);
+            {
+                std::unique_lock<std::mutex> lock{m};
+                free_blocks.push_back(b);
+                in_flight--;
+            }
+            work_done.notify_all();
+        }
+    }
+
+    // send_block(finish) passes the gathered messages to the
+    // compression thread, waiting if it is too far behind
+    //
+    void send_block(bool finish) {
+        block *b = nullptr;
+        {
+            auto start = clock::now();
+            std::unique_lock<std::mutex> lock{m};
+            if (in_flight >= max_blocks_in_flight) {
+                work_done.wait(lock, [this]{ return in_flight < max_blocks_in_flight; });
+                wait_ns += ns_since(start);
+            }
+            if (!free_blocks.empty()) {
+                b = free_blocks.back();
+                free_blocks.pop_back();
+            }
+        }
+        if (b == nullptr) {
+            b = new block;
+        }
+        b->data.clear();
+        for (int i = 0; i < iovcnt; i++) {
+            const uint8_t *p = (const uint8_t *)iov[i].iov_base;
+            b->data.insert(b->data.end(), p, p + iov[i].iov_len);
+        }
+        b->file = batch_file;
+        b->finish = finish;
+        {
+            std::unique_lock<std::mutex> lock{m};
+            work.push_back(b);
+            in_flight++;
+        }
+        work_ready.notify_one();
+    }
+
+    void release_queues() {
+        for (struct ll_queue *q : batch_queues) {
+            q->release();
+        }
+        batch_queues.clear();
+        iovcnt = 0;
+        batch_bytes = 0;
+    }
+
+public:
+
+    // construct an output_writer that uses the codec named
+    // compression, or no compression if it is nullptr
+    //
+    explicit output_writer(const char *compression) {
+        if (compression != nullptr) {
+            codec = output_codec::create(compression);
+            if (codec == nullptr) {
+                throw std::runtime_error("error: unknown output compression format");
+            }
+            compressor = std::thread{[this]{ compress_blocks(); }};
+        }
+    }
+
+    ~output_writer() {
+        if (codec) {
+            {
+                std::unique_lock<std::mutex> lock{m};
+                stop = true;
+            }
+            work_ready.notify_one();
+            compressor.join();
+            for (block *b : free_blocks) {
+                delete b;
+            }
+            delete codec;
+        }
+    }
+
+    output_writer(const output_writer &) = delete;
+    output_writer &operator=(const output_writer &) = delete;
+
+    // append(file, q, msg) gathers the message msg, which is at the
+    // front of the queue q, for writing to file, and advances q past
+    // it; the message is written out by the next flush()
+    //
+    void append(FILE *file, struct ll_queue *q, const struct llq_msg *msg) {
+        if (iovcnt == max_iov || batch_bytes + msg->len > max_batch_bytes || (file != batch_file && iovcnt > 0)) {
+            flush();
+        }
+        if (iovcnt == 0) {
+            batch_start = clock::now();
+        }
+        batch_file = file;
+        iov[iovcnt].iov_base = (void *)msg->buf();
+        iov[iovcnt].iov_len = msg->len;
+        iovcnt++;
+        batch_bytes += msg->len;
+        q->advance();
+        if (batch_queues.empty() || batch_queues.back() != q) {
+            batch_queues.push_back(q);
+        }
+        records++;
+        bytes_in += msg->len;
+    }
+
+    // flush() writes out, or passes to the compression thread, all of
+    // the messages gathered by append()
+    //
+    void flush() {
+        if (iovcnt == 0) {
+            return;
+        }
+        auto start = clock::now();
+        batches++;
+        if (codec) {
+            send_block(false);
+        } else {
+            write_all(batch_file, iov, iovcnt);
+        }
+        release_queues();
+        batch_start = clock::time_point{};
+        flush_ns += ns_since(start);
+    }
+
+    // flush_if_stale() calls flush() if the oldest message gathered
+    // by append() has been waiting for longer than max_latency, so
+    // that output is not held back indefinitely when messages arrive
+    // slowly but steadily
+    //
+    void flush_if_stale() {
+        if (iovcnt > 0 && clock::now() - batch_start > max_latency) {
+            flush();
+        }
+    }
+
+    // finish_file(file) writes out all of the output for file, which
+    // must be done before that file is rotated or closed
+    //
+    void finish_file(FILE *file) {
+        flush();
+        if (codec && file != nullptr) {
+            batch_file = file;
+            send_block(true);
+            std::unique_lock<std::mutex> lock{m};
+            work_done.wait(lock, [this]{ return in_flight == 0; });
+        }
+    }
+
+    // print_stats(f, busy_ns) writes the number of records and bytes
+    // written, and the time spent in each stage, to f; busy_ns is the
+    // time that the output thread spent merging and writing messages,
+    // that is, all of its time other than its sleeps
+    //
+    void print_stats(FILE *f, uint64_t busy_ns) const {
+        uint64_t merge_ns = busy_ns > flush_ns ? busy_ns - flush_ns : 0;
+        fprintf(f, "output records: %" PRIu64 "\tbytes: %" PRIu64 "\tbytes written: %" PRIu64 "\tbatches: %" PRIu64 "\n",
+                records, bytes_in, bytes_out.load(), batches);
+        fprintf(f, "output time (s): merge: %.3f\tcompression: %.3f\twrite: %.3f\twaiting for compression: %.3f\n",
+                merge_ns / 1e9, compress_ns.load() / 1e9, write_ns.load() / 1e9, wait_ns / 1e9);
+    }
+};
+
+#endif // OUTPUT_WRITER_H
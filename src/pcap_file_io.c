@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -30,6 +31,7 @@
 #include "libmerc/utils.h"
 #include "libmerc/bench.h"
 #include "llq.h"
+#include "pkt_shard.h"
 
 
 /*
@@ -69,6 +71,7 @@ struct pcap_packet_hdr {
    #define STREAM_BUFFER_SIZE FBUFSIZE
 #endif
 #define PRE_ALLOCATE_DISK_SPACE  (100 * ONE_MB)
+#define BUFLEN  pcap_file_max_packet_length
 
 static inline void set_file_io_buffer(struct pcap_file *f, const char *fname) {
     f->buffer = (unsigned char *) malloc(STREAM_BUFFER_SIZE);
@@ -103,6 +106,335 @@ enum status write_pcap_file_header(FILE *f) {
     return status_ok;
 }
 
+/*
+ * memory-mapped reading
+ *
+ * A regular file that is opened for reading is mapped into memory
+ * one window at a time, and packets are handed to the caller in
+ * place, without being copied.  The window slides forward through the
+ * file, so files larger than memory can be read; each window is
+ * advised as sequential, so that the kernel reads ahead and drops
+ * pages behind it, and as a candidate for huge pages where that is
+ * supported.  The window is mapped copy-on-write, so that a packet
+ * processor can modify a packet without changing the file.
+ */
+#define MAP_WINDOW_SIZE (64 * ONE_MB)
+
+static bool pcap_file_map_init(struct pcap_file *f) {
+    struct stat statbuf;
+    if (f->file_ptr == stdin || fstat(f->fd, &statbuf) != 0 || !S_ISREG(statbuf.st_mode)) {
+        return false;
+    }
+    f->file_size = statbuf.st_size;
+    return true;
+}
+
+static void pcap_file_unmap(struct pcap_file *f) {
+    if (f->map_addr != nullptr) {
+        if (munmap(f->map_addr, f->map_len) != 0) {
+            perror("warning: could not unmap read file window");
+        }
+        f->map_addr = nullptr;
+        f->map_len = 0;
+    }
+}
+
+/*
+ * pcap_file_map() returns a pointer to the length bytes of the file
+ * at offset, moving the mapped window if needed, or nullptr if those
+ * bytes are not all in the file or cannot be mapped
+ */
+static uint8_t *pcap_file_map(struct pcap_file *f, off_t offset, size_t length) {
+    if (offset + (off_t)length > f->file_size) {
+        return nullptr;
+    }
+    if (offset >= f->map_offset && offset + length <= f->map_offset + f->map_len && f->map_addr != nullptr) {
+        return f->map_addr + (offset - f->map_offset);
+    }
+    pcap_file_unmap(f);
+
+    static const off_t page_size = sysconf(_SC_PAGESIZE);
+    off_t start = offset & ~(page_size - 1);
+    size_t len = MAP_WINDOW_SIZE;
+    if (len < (offset - start) + length) {
+        len = (offset - start) + length;
+    }
+    if (start + (off_t)len > f->file_size) {
+        len = f->file_size - start;
+    }
+    void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, f->fd, start);
+    if (addr == MAP_FAILED) {
+        perror("error: could not map read file window");
+        return nullptr;
+    }
+    f->map_addr = (uint8_t *)addr;
+    f->map_len = len;
+    f->map_offset = start;
+
+#ifdef MADV_SEQUENTIAL
+    madvise(addr, len, MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_WILLNEED
+    madvise(addr, len, MADV_WILLNEED);
+#endif
+#ifdef MADV_HUGEPAGE
+    madvise(addr, len, MADV_HUGEPAGE);  // fails harmlessly where unsupported
+#endif
+
+    return f->map_addr + (offset - start);
+}
+
+/*
+ * PCAP-NG files are read only through memory mapping.  Each block
+ * starts with its type and total length, and ends with a copy of
+ * the total length; the byte order of a section is set by the byte
+ * order magic in its section header block.
+ */
+enum pcapng_block_type : uint32_t {
+    pcapng_interface_description = 0x00000001,
+    pcapng_simple_packet         = 0x00000003,
+    pcapng_enhanced_packet       = 0x00000006,
+    pcapng_section_header        = 0x0a0d0d0a,
+};
+
+static const uint32_t pcapng_byte_order_magic = 0x1a2b3c4d;
+static const uint16_t pcapng_if_tsresol = 9;    // interface option code
+
+static inline uint16_t pcapng_uint16(const uint8_t *p, bool byteswap) {
+    uint16_t x;
+    memcpy(&x, p, sizeof(x));
+    return byteswap ? __builtin_bswap16(x) : x;
+}
+
+static inline uint32_t pcapng_uint32(const uint8_t *p, bool byteswap) {
+    uint32_t x;
+    memcpy(&x, p, sizeof(x));
+    return byteswap ? __builtin_bswap32(x) : x;
+}
+
+static bool linktype_is_supported(uint32_t linktype) {
+    switch (linktype) {
+    case LINKTYPE_ETHERNET:
+    case LINKTYPE_PPP:
+    case LINKTYPE_RAW:
+        return true;
+    case LINKTYPE_NULL:
+        fprintf(stderr, "warning: pcap file linktype is NULL (0), assuming ETHERNET or PPP\n");
+        return true;
+    default:
+        fprintf(stderr, "error: pcap file linktype (%u) unsupported\n", linktype);
+    }
+    return false;
+}
+
+/*
+ * pcapng_file_read_block() maps the next block of a PCAP-NG file,
+ * and returns its type, and the location and length of its body
+ * (the bytes between the block total length fields).  Section header
+ * and interface description blocks are processed here.
+ */
+static enum status pcapng_file_read_block(struct pcap_file *f,
+                                          uint32_t *type,
+                                          const uint8_t **body,
+                                          size_t *body_len) {
+    const size_t block_overhead = 3 * sizeof(uint32_t);
+    const uint8_t *b = pcap_file_map(f, f->read_offset, block_overhead);
+    if (b == nullptr) {
+        return status_err_no_more_data;
+    }
+    *type = pcapng_uint32(b, f->byteswap);
+    if (*type == pcapng_section_header) {
+        uint32_t bom = pcapng_uint32(b + 8, false);
+        if (bom == pcapng_byte_order_magic) {
+            f->byteswap = 0;
+        } else if (bom == __builtin_bswap32(pcapng_byte_order_magic)) {
+            f->byteswap = 1;
+        } else {
+            fprintf(stderr, "error: invalid byte order magic (%08x) in pcap-ng section header\n", bom);
+            return status_err;
+        }
+    }
+    uint32_t block_len = pcapng_uint32(b + 4, f->byteswap);
+    if (block_len < block_overhead || block_len % 4 != 0) {
+        fprintf(stderr, "error: invalid pcap-ng block length %u\n", block_len);
+        return status_err;
+    }
+    b = pcap_file_map(f, f->read_offset, block_len);
+    if (b == nullptr) {
+        fprintf(stderr, "error: could not read pcap-ng block with length %u\n", block_len);
+        return status_err;
+    }
+    f->read_offset += block_len;
+    *body = b + 2 * sizeof(uint32_t);
+    *body_len = block_len - block_overhead;
+
+    if (*type == pcapng_section_header) {
+        f->interfaces.clear();
+
+    } else if (*type == pcapng_interface_description) {
+        if (*body_len < 8) {
+            fprintf(stderr, "error: pcap-ng interface description block too short\n");
+            return status_err;
+        }
+        struct pcapng_interface intf = { pcapng_uint16(*body, f->byteswap), 1000000 };
+        if (!linktype_is_supported(intf.linktype)) {
+            return status_err;
+        }
+
+        // scan options for the timestamp resolution; if the most
+        // significant bit of its value is set, the remaining bits are
+        // a negative power of two, and otherwise of ten
+        //
+        const uint8_t *opt = *body + 8;
+        const uint8_t *end = *body + *body_len;
+        while (opt + 4 <= end) {
+            uint16_t code = pcapng_uint16(opt, f->byteswap);
+            uint16_t len = pcapng_uint16(opt + 2, f->byteswap);
+            if (code == 0 || opt + 4 + len > end) {
+                break;
+            }
+            if (code == pcapng_if_tsresol && len == 1) {
+                uint8_t resol = opt[4];
+                if (resol & 0x80) {
+                    intf.ticks_per_second = (uint64_t)1 << ((resol & 0x7f) < 63 ? (resol & 0x7f) : 63);
+                } else {
+                    intf.ticks_per_second = 1;
+                    for (unsigned int i = 0; i < resol && i < 19; i++) {
+                        intf.ticks_per_second *= 10;
+                    }
+                }
+            }
+            opt += 4 + ((len + 3) & ~3);
+        }
+        f->interfaces.push_back(intf);
+    }
+
+    return status_ok;
+}
+
+static enum status pcapng_file_open(struct pcap_file *f, const char *fname) {
+    f->pcapng = true;
+    f->first_record = f->read_offset = 0;
+
+    // read up to the first interface description, to find the linktype
+    //
+    while (f->interfaces.empty()) {
+        uint32_t type;
+        const uint8_t *body;
+        size_t body_len;
+        if (pcapng_file_read_block(f, &type, &body, &body_len) != status_ok) {
+            fprintf(stderr, "error: no interface description found in pcap-ng file %s\n", fname);
+            return status_err;
+        }
+    }
+    f->linktype = f->interfaces[0].linktype;
+
+    return pcap_file_rewind(f);
+}
+
+static enum status pcapng_file_map_packet(struct pcap_file *f,
+                                          struct pcap_pkthdr *pkthdr,
+                                          uint8_t **packet) {
+    while (true) {
+        uint32_t type;
+        const uint8_t *body;
+        size_t body_len;
+        enum status status = pcapng_file_read_block(f, &type, &body, &body_len);
+        if (status != status_ok) {
+            return status;
+        }
+
+        uint32_t interface_id = 0;
+        uint64_t timestamp = 0;
+        uint32_t caplen = 0;
+        if (type == pcapng_enhanced_packet) {
+            if (body_len < 20) {
+                fprintf(stderr, "error: pcap-ng enhanced packet block too short\n");
+                return status_err;
+            }
+            interface_id = pcapng_uint32(body, f->byteswap);
+            timestamp = ((uint64_t)pcapng_uint32(body + 4, f->byteswap) << 32) | pcapng_uint32(body + 8, f->byteswap);
+            caplen = pcapng_uint32(body + 12, f->byteswap);
+            body += 20;
+            body_len -= 20;
+        } else if (type == pcapng_simple_packet) {
+            if (body_len < 4) {
+                fprintf(stderr, "error: pcap-ng simple packet block too short\n");
+                return status_err;
+            }
+            caplen = pcapng_uint32(body, f->byteswap);  // original length
+            body += 4;
+            body_len -= 4;
+            if (caplen > body_len) {
+                caplen = body_len;
+            }
+        } else {
+            continue;  // not a packet block
+        }
+        if (caplen > body_len) {
+            fprintf(stderr, "error: could not read packet with caplen %u\n", caplen);
+            return status_err;
+        }
+        if (interface_id >= f->interfaces.size()) {
+            fprintf(stderr, "error: pcap-ng packet with undescribed interface %u\n", interface_id);
+            return status_err;
+        }
+
+        const struct pcapng_interface &intf = f->interfaces[interface_id];
+        f->linktype = intf.linktype;
+        pkthdr->ts.tv_sec = timestamp / intf.ticks_per_second;
+        pkthdr->ts.tv_usec = (unsigned __int128)(timestamp % intf.ticks_per_second) * 1000000 / intf.ticks_per_second;
+        pkthdr->caplen = caplen;
+        if (caplen > BUFLEN) {
+            fprintf(stderr, "warning: buffer size %zu cannot store packet of length %u\n", BUFLEN, caplen);
+            pkthdr->len = caplen;
+            pkthdr->caplen = BUFLEN;
+        }
+        *packet = (uint8_t *)body;
+        return status_ok;
+    }
+}
+
+static enum status pcap_file_map_packet(struct pcap_file *f,
+                                        struct pcap_pkthdr *pkthdr,
+                                        uint8_t **packet) {
+    if (f->pcapng) {
+        return pcapng_file_map_packet(f, pkthdr, packet);
+    }
+
+    struct pcap_packet_hdr packet_hdr;
+    const uint8_t *p = pcap_file_map(f, f->read_offset, sizeof(packet_hdr));
+    if (p == nullptr) {
+        return status_err_no_more_data; /* could not read packet header from file */
+    }
+    memcpy(&packet_hdr, p, sizeof(packet_hdr));
+    if (f->byteswap) {
+        pkthdr->ts.tv_sec = ntohl(packet_hdr.ts_sec);
+        pkthdr->ts.tv_usec = ntohl(packet_hdr.ts_usec);
+        pkthdr->caplen = ntohl(packet_hdr.incl_len);
+    } else {
+        pkthdr->ts.tv_sec = packet_hdr.ts_sec;
+        pkthdr->ts.tv_usec = packet_hdr.ts_usec;
+        pkthdr->caplen = packet_hdr.incl_len;
+    }
+
+    uint32_t caplen = pkthdr->caplen;
+    if (caplen > BUFLEN) {
+        fprintf(stderr, "warning: buffer size %zu cannot store packet of length %u\n", BUFLEN, caplen);
+        pkthdr->len = caplen;
+        pkthdr->caplen = BUFLEN;
+    }
+    p = pcap_file_map(f, f->read_offset, sizeof(packet_hdr) + pkthdr->caplen);
+    if (p == nullptr) {
+        fprintf(stderr, "error: could not read packet with caplen %u\n", pkthdr->caplen);
+        return status_err;          /* could not read packet from file */
+    }
+    *packet = (uint8_t *)p + sizeof(packet_hdr);
+    f->read_offset += sizeof(packet_hdr) + caplen;  // skip the remainder of a long packet
+
+    return status_ok;
+}
+
 enum status pcap_file_open(struct pcap_file *f,
                            const char *fname,
                            enum io_direction dir,
@@ -219,11 +551,13 @@ enum status pcap_file_open(struct pcap_file *f,
         } else if (file_header.magic_number == cagim) {
             f->byteswap = 1;
             // printf("file is in pcap format\nbyteswap is needed\n");
+        } else if (file_header.magic_number == pcapng_section_header && pcap_file_map_init(f)) {
+            return pcapng_file_open(f, fname);
         } else {
             fprintf(stderr, "error: file %s not in pcap format (file header: %08x)\n",
                     fname, file_header.magic_number);
             if (file_header.magic_number == 0x0a0d0d0a) {
-                fprintf(stderr, "error: pcap-ng format found; this format is currently unsupported\n");
+                fprintf(stderr, "error: pcap-ng format found; this format is only supported for regular files\n");
             }
             exit(255); // TODO: return error, don't exit
         }
@@ -246,6 +580,10 @@ enum status pcap_file_open(struct pcap_file *f,
                 exit(EXIT_FAILURE); // TODO: return error, don't exit
             }
         }
+
+        if (pcap_file_map_init(f)) {
+            f->first_record = f->read_offset = sizeof(file_header);
+        }
     }
 
     return status_ok;
@@ -386,8 +724,6 @@ enum status advance(FILE *f, size_t length) {
     return status_ok;
 }
 
-#define BUFLEN  65536
-
 enum status pcap_file_read_packet(struct pcap_file *f,
                                   struct pcap_pkthdr *pkthdr, /* output */
                                   void *packet_data           /* output */
@@ -400,6 +736,15 @@ enum status pcap_file_read_packet(struct pcap_file *f,
         return status_err;
     }
 
+    if (f->file_size) {
+        uint8_t *packet;
+        enum status status = pcap_file_map_packet(f, pkthdr, &packet);
+        if (status == status_ok) {
+            memcpy(packet_data, packet, pkthdr->caplen);
+        }
+        return status;
+    }
+
     items_read = fread(&packet_hdr, sizeof(packet_hdr), 1, f->file_ptr);
     if (items_read == 0) {
         return status_err_no_more_data; /* could not read packet header from file */
@@ -434,7 +779,7 @@ enum status pcap_file_read_packet(struct pcap_file *f,
             return status_err;          /* could not read packet from file */
         }
     } else {
-        fprintf(stderr, "warning: buffer size %u cannot store packet of length %u\n", BUFLEN, pkthdr->caplen);
+        fprintf(stderr, "warning: buffer size %zu cannot store packet of length %u\n", BUFLEN, pkthdr->caplen);
         /*
          * The packet length is much bigger than BUFLEN.
          * Read BUFLEN bytes to process the packet and skip the remaining bytes.
@@ -457,6 +802,31 @@ enum status pcap_file_read_packet(struct pcap_file *f,
 }
 
 
+enum status pcap_file_next_packet(struct pcap_file *f,
+                                  struct pcap_pkthdr *pkthdr,
+                                  uint8_t *buffer,
+                                  uint8_t **packet) {
+    if (f->file_size) {
+        return pcap_file_map_packet(f, pkthdr, packet);
+    }
+    *packet = buffer;
+    return pcap_file_read_packet(f, pkthdr, buffer);
+}
+
+enum status pcap_file_rewind(struct pcap_file *f) {
+    if (f->file_size) {
+        f->read_offset = f->first_record;
+        f->interfaces.clear();
+        return status_ok;
+    }
+    // Rewind the file to the first packet after skipping file header.
+    if (fseek(f->file_ptr, sizeof(struct pcap_file_hdr), SEEK_SET) != 0) {
+        perror("error: could not rewind file pointer\n");
+        return status_err;
+    }
+    return status_ok;
+}
+
 void packet_info_init_from_pkthdr(struct packet_info *pi,
 				  struct pcap_pkthdr *pkthdr) {
     pi->len = pkthdr->caplen;
@@ -472,6 +842,7 @@ enum status pcap_file_dispatch_pkt_processor(struct pcap_file *f,
     enum status status = status_ok;
     struct pcap_pkthdr pkthdr;
     uint8_t packet_data[BUFLEN];
+    uint8_t *packet;
     unsigned long total_length = sizeof(struct pcap_file_hdr); // file header is already written
     unsigned long num_packets = 0;
     struct packet_info pi;
@@ -479,13 +850,13 @@ enum status pcap_file_dispatch_pkt_processor(struct pcap_file *f,
     benchmark::mean_and_standard_deviation s;
     for (int i=0; i < loop_count && sig_close_flag == 0; i++) {
         do {
-            status = pcap_file_read_packet(f, &pkthdr, packet_data);
+            status = pcap_file_next_packet(f, &pkthdr, packet_data, &packet);
             if (status == status_ok) {
                 packet_info_init_from_pkthdr(&pi, &pkthdr);
                 pi.linktype = f->linktype;
                 // process the packet that was read
                 benchmark::cycle_counter cc;
-                pkt_processor->apply(&pi, packet_data);
+                pkt_processor->apply(&pi, packet);
                 s += cc.delta();
                 num_packets++;
                 total_length += pkthdr.caplen + sizeof(struct pcap_packet_hdr);
@@ -493,9 +864,7 @@ enum status pcap_file_dispatch_pkt_processor(struct pcap_file *f,
         } while (status == status_ok && sig_close_flag == 0);
 
         if (i < loop_count - 1) {
-            // Rewind the file to the first packet after skipping file header.
-            if (fseek(f->file_ptr, sizeof(struct pcap_file_hdr), SEEK_SET) != 0) {
-                perror("error: could not rewind file pointer\n");
+            if (pcap_file_rewind(f) != status_ok) {
                 status = status_err;
             }
         }
@@ -518,7 +887,55 @@ enum status pcap_file_dispatch_pkt_processor(struct pcap_file *f,
     return status;
 }
 
+enum status pcap_file_dispatch_pkt_shards(struct pcap_file *f,
+                                          struct pkt_shard **shards,
+                                          unsigned int num_shards,
+                                          int loop_count,
+                                          int &sig_close_flag,
+                                          uint64_t &bytes_read,
+                                          uint64_t &packets_read) {
+    enum status status = status_ok;
+    struct pcap_pkthdr pkthdr;
+    uint8_t packet_data[BUFLEN];
+    uint8_t *packet;
+    unsigned long total_length = sizeof(struct pcap_file_hdr); // file header is already written
+    unsigned long num_packets = 0;
+    struct packet_info pi;
+
+    for (int i=0; i < loop_count && sig_close_flag == 0; i++) {
+        do {
+            status = pcap_file_next_packet(f, &pkthdr, packet_data, &packet);
+            if (status == status_ok) {
+                packet_info_init_from_pkthdr(&pi, &pkthdr);
+                pi.linktype = f->linktype;
+                shards[pkt_shard::index(&pi, packet, num_shards)]->assign(&pi, packet);
+                num_packets++;
+                total_length += pkthdr.caplen + sizeof(struct pcap_packet_hdr);
+            }
+        } while (status == status_ok && sig_close_flag == 0);
+
+        if (i < loop_count - 1) {
+            if (pcap_file_rewind(f) != status_ok) {
+                status = status_err;
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < num_shards; i++) {
+        shards[i]->ring.close();
+    }
+
+    bytes_read = total_length;
+    packets_read = num_packets;
+
+    if (status == status_err_no_more_data) {
+        return status_ok;
+    }
+    return status;
+}
+
 enum status pcap_file_close(struct pcap_file *f) {
+    pcap_file_unmap(f);
     if (f->file_ptr != stdin && fclose(f->file_ptr) != 0) {
         perror("could not close input pcap file");
         return status_err;
@@ -546,64 +963,37 @@ void pcap_queue_write(struct ll_queue *llq,
         return;  // error
     }
 
-    if (blocking) {
-        while (llq->msgs[llq->widx].used != 0) {
-            usleep(50); // sleep for fifty microseconds
-        }
+    struct llq_msg *msg = llq->init_msg(blocking, sec, nsec);
+    if (msg == nullptr) {
+        return;  // queue is full
     }
 
-    if (llq->msgs[llq->widx].used == 0) {
-
-        //char obuf[LLQ_MSG_SIZE];
-        int olen = LLQ_MSG_SIZE;
-        int ooff = 0;
-        int trunc = 0;
+    int olen = LLQ_MSG_SIZE;
+    int ooff = 0;
+    int trunc = 0;
 
-        llq->msgs[llq->widx].ts.tv_sec = sec;
-        llq->msgs[llq->widx].ts.tv_nsec = nsec;
-
-        //obuf[sizeof(struct timespec)] = '\0';
-        llq->msgs[llq->widx].buf[0] = '\0';
-
-        if (packet && !length) {
-            fprintf(stderr, "warning: attempt to write an empty packet\n");
-        }
-
-        /* note: we never perform byteswap when writing */
-        struct pcap_packet_hdr packet_hdr;
-        packet_hdr.ts_sec = sec;
-        packet_hdr.ts_usec = nsec;
-        packet_hdr.incl_len = length;
-        packet_hdr.orig_len = length;
-
-        // write the packet header
-        int r = append_memcpy(llq->msgs[llq->widx].buf, &ooff, olen, &trunc, &packet_hdr, sizeof(packet_hdr));
-
-        // write the packet
-        r += append_memcpy(llq->msgs[llq->widx].buf, &ooff, olen, &trunc, packet, length);
-
-        // f->bytes_written += length + sizeof(struct pcap_packet_hdr);
-        // f->packets_written++;
+    if (packet && !length) {
+        fprintf(stderr, "warning: attempt to write an empty packet\n");
+    }
 
-        if ((trunc == 0) && (r > 0)) {
+    /* note: we never perform byteswap when writing */
+    struct pcap_packet_hdr packet_hdr;
+    packet_hdr.ts_sec = sec;
+    packet_hdr.ts_usec = nsec;
+    packet_hdr.incl_len = length;
+    packet_hdr.orig_len = length;
 
-            llq->msgs[llq->widx].len = r;
+    // write the packet header
+    int r = append_memcpy(msg->buf(), &ooff, olen, &trunc, &packet_hdr, sizeof(packet_hdr));
 
-            //fprintf(stderr, "DEBUG: sent a message!\n");
-            __sync_synchronize(); /* A full memory barrier prevents the following flag set from happening too soon */
-            llq->msgs[llq->widx].used = 1;
+    // write the packet
+    r += append_memcpy(msg->buf(), &ooff, olen, &trunc, packet, length);
 
-            //llq->next_write();
-            llq->widx = (llq->widx + 1) % LLQ_DEPTH;
-        }
-    }
-    else {
-        //fprintf(stderr, "DEBUG: queue bucket used!\n");
+    // f->bytes_written += length + sizeof(struct pcap_packet_hdr);
+    // f->packets_written++;
 
-        // TODO: this is where we'd update an output drop counter
-        // but currently this spot in the code doesn't have access to
-        // any thread stats pointer or similar and I don't want
-        // to update a global variable in this location.
+    if ((trunc == 0) && (r > 0)) {
+        llq->send(msg, r);
     }
 
 }
@@ -15,6 +15,7 @@
 #include <fcntl.h>
 #include <utility>
 #include <stdexcept>
+#include <vector>
 #include "mercury.h"
 #include "packet.h"
 
@@ -34,6 +35,37 @@ enum status pcap_file_read_packet(struct pcap_file *f,
 				  void *packet_data           /* output */
 				  );
 
+// pcap_file_next_packet() reads the next packet from f, and sets
+// *packet to point to its data.  If f is memory-mapped, the data is
+// not copied, and *packet points into the mapping, where it remains
+// valid until the next call; otherwise, the data is read into
+// buffer, which must hold at least pcap_file_max_packet_length
+// bytes.
+//
+enum status pcap_file_next_packet(struct pcap_file *f,
+                                  struct pcap_pkthdr *pkthdr, /* output */
+                                  uint8_t *buffer,
+                                  uint8_t **packet            /* output */
+                                  );
+
+// pcap_file_rewind() sets f so that the next packet read will be its
+// first one
+//
+enum status pcap_file_rewind(struct pcap_file *f);
+
+// packets longer than pcap_file_max_packet_length are truncated to
+// that length when they are read
+//
+constexpr size_t pcap_file_max_packet_length = 65536;
+
+// struct pcapng_interface holds the properties of an interface
+// described in a PCAP-NG file
+//
+struct pcapng_interface {
+    uint16_t linktype;               // data link type
+    uint64_t ticks_per_second;       // timestamp resolution
+};
+
 struct pcap_file {
     FILE *file_ptr = nullptr;
     int fd = 0;                      // file descriptor returned by fileno()
@@ -46,6 +78,18 @@ struct pcap_file {
     uint64_t packets_written = 0;    // number of packets written to this file
     uint16_t linktype = LINKTYPE::NONE; // data link type
 
+    // a regular file opened for reading is memory-mapped, one window
+    // at a time, and packets are read in place from the mapping
+    //
+    uint8_t *map_addr = nullptr;     // start of mapped window
+    size_t map_len = 0;              // number of bytes in mapped window
+    off_t map_offset = 0;            // file offset of mapped window
+    off_t file_size = 0;             // size of file if it is mapped, and zero otherwise
+    off_t read_offset = 0;           // file offset of next record to read
+    off_t first_record = 0;          // file offset of first record, for rewinding
+    bool pcapng = false;             // true if file is in PCAP-NG format
+    std::vector<struct pcapng_interface> interfaces; // PCAP-NG interfaces in current section
+
     pcap_file() { }
 
     pcap_file(const char *fname, enum io_direction dir, int flags=0) {
@@ -101,6 +145,21 @@ enum status pcap_file_dispatch_pkt_processor(struct pcap_file *f,
                                              int loop_count,
                                              int &sig_close_flag);
 
+struct pkt_shard;
+
+// pcap_file_dispatch_pkt_shards() reads packets from a file and
+// assigns each one to one of the num_shards shards, by flow, then
+// closes the shards' rings; the number of bytes and packets read is
+// returned through bytes_read and packets_read
+//
+enum status pcap_file_dispatch_pkt_shards(struct pcap_file *f,
+                                          struct pkt_shard **shards,
+                                          unsigned int num_shards,
+                                          int loop_count,
+                                          int &sig_close_flag,
+                                          uint64_t &bytes_read,
+                                          uint64_t &packets_read);
+
 
 // pcap_queue_write() sends a packet to a lockless queue
 //
@@ -9,6 +9,7 @@
 #include "pcap_reader.h"
 #include "output.h"
 #include "pkt_processing.h"
+#include "pkt_shard.h"
 #include "libmerc/utils.h"
 
 extern int sig_close_flag;  // defined in signal_handling.c
@@ -64,15 +65,100 @@ void *pcap_file_processing_thread_func(void *userdata) {
     return NULL;
 }
 
-enum status open_and_dispatch(struct mercury_config *cfg, mercury_context mc, struct output_file *of) {
+void *pkt_shard_thread_func(void *userdata) {
+    struct pkt_shard *shard = (struct pkt_shard *)userdata;
+
+    shard->process();
+
+    return NULL;
+}
+
+/*
+ * open_and_dispatch_sharded() reads packets from a file in the
+ * calling thread, and distributes them by flow across
+ * cfg->num_threads worker threads, each of which has its own packet
+ * processor and output queue; the output thread merges the queues
+ * in order (see thread_queues::in_order)
+ */
+static enum status open_and_dispatch_sharded(struct mercury_config *cfg, mercury_context mc, struct output_file *of,
+                                             uint64_t &bytes_read, uint64_t &packets_read) {
     enum status status;
-    struct timer t;
-	u_int64_t nano_seconds = 0;
-	u_int64_t bytes_written = 0;
-	u_int64_t packets_written = 0;
+    struct pcap_file rf;
+    char input_filename[FILENAME_MAX];
 
-    timer_start(&t); // get timestamp before we start processing
+    status = filename_append(input_filename, cfg->read_filename, "/", NULL);
+    if (status) {
+        return status;
+    }
+    status = pcap_file_open(&rf, input_filename, io_direction_reader, cfg->flags);
+    if (status) {
+        printf("error: could not open pcap input file %s\n", cfg->read_filename);
+        return status;
+    }
+
+    unsigned int num_shards = cfg->num_threads;
+    struct pkt_shard **shards = (struct pkt_shard **)calloc(num_shards, sizeof(struct pkt_shard *));
+    if (shards == NULL) {
+        fprintf(stderr, "error: could not allocate worker thread storage\n");
+        exit(255);
+    }
+    for (unsigned int i = 0; i < num_shards; i++) {
+        struct pkt_proc *pkt_processor = pkt_proc_new_from_config(cfg, mc, i, &of->qs.queue[i]);
+        if (pkt_processor == NULL) {
+            printf("error: could not initialize frame handler\n");
+            for (unsigned int j = 0; j < i; j++) {
+                delete shards[j]->pkt_processor;
+                delete shards[j];
+            }
+            free(shards);
+            pcap_file_close(&rf);
+            return status_err;
+        }
+        shards[i] = new pkt_shard{pkt_processor, &of->qs.queue[i], &of->qs.read_clock};
+    }
+
+    /* Wake up output thread so it's polling the queues waiting for data */
+    of->qs.read_clock.store(0);
+    of->qs.in_order = true;
+    of->t_output_p = 1;
+    int err = pthread_cond_broadcast(&(of->t_output_c)); /* Wake up output */
+    if (err != 0) {
+        printf("%s: error broadcasting all clear on output start condition\n", strerror(err));
+        exit(255);
+    }
 
+    for (unsigned int i = 0; i < num_shards; i++) {
+        err = pthread_create(&(shards[i]->tid), NULL, pkt_shard_thread_func, shards[i]);
+        if (err) {
+            printf("%s: error creating worker thread\n", strerror(err));
+            exit(255);
+        }
+    }
+
+    status = pcap_file_dispatch_pkt_shards(&rf, shards, num_shards, cfg->loop_count, sig_close_flag, bytes_read, packets_read);
+    if (status) {
+        printf("error in pcap file dispatch (code: %d)\n", (int)status);
+    }
+
+    for (unsigned int i = 0; i < num_shards; i++) {
+        pthread_join(shards[i]->tid, NULL);
+        delete shards[i]->pkt_processor;
+        delete shards[i];
+    }
+    free(shards);
+    pcap_file_close(&rf);
+
+    return status;
+}
+
+/*
+ * open_and_dispatch_single() reads and processes packets from a
+ * file in a single thread, with one packet processor and output
+ * queue
+ */
+static enum status open_and_dispatch_single(struct mercury_config *cfg, mercury_context mc, struct output_file *of,
+                                            uint64_t &bytes_read, uint64_t &packets_read) {
+    enum status status;
     struct pcap_reader_thread_context tc;
 
     status = pcap_reader_thread_context_init_from_config(&tc, cfg, mc, 0, &of->qs.queue[0]);
@@ -102,10 +188,31 @@ enum status open_and_dispatch(struct mercury_config *cfg, mercury_context mc, st
     pthread_join(tc.tid, NULL);
 #endif
     //    struct pkt_proc_stats pkt_stats = tc.pkt_processor->get_stats();
-    bytes_written = tc.pkt_processor->bytes_written;
-    packets_written = tc.pkt_processor->packets_written;
+    bytes_read = tc.pkt_processor->bytes_written;
+    packets_read = tc.pkt_processor->packets_written;
     pcap_reader_thread_context_finalize(&tc);
 
+    return status_ok;
+}
+
+enum status open_and_dispatch(struct mercury_config *cfg, mercury_context mc, struct output_file *of) {
+    enum status status;
+    struct timer t;
+	u_int64_t nano_seconds = 0;
+	u_int64_t bytes_written = 0;
+	u_int64_t packets_written = 0;
+
+    timer_start(&t); // get timestamp before we start processing
+
+    if (cfg->num_threads > 1 && cfg->read_filename != NULL) {
+        status = open_and_dispatch_sharded(cfg, mc, of, bytes_written, packets_written);
+    } else {
+        status = open_and_dispatch_single(cfg, mc, of, bytes_written, packets_written);
+    }
+    if (status != status_ok) {
+        return status;
+    }
+
     nano_seconds = timer_stop(&t);
     double byte_rate = ((double)bytes_written * BILLION) / (double)nano_seconds;
     double packet_rate = ((double)packets_written * BILLION) / (double)nano_seconds;
@@ -116,4 +223,3 @@ enum status open_and_dispatch(struct mercury_config *cfg, mercury_context mc, st
 
     return status_ok;
 }
-
@@ -189,10 +189,9 @@ struct pkt_proc_json_writer_llq : public pkt_proc {
     void apply(struct packet_info *pi, uint8_t *eth) override {
         struct llq_msg *msg = llq->init_msg(block, pi->ts.tv_sec, pi->ts.tv_nsec);
         if (msg) {
-            size_t write_len = mercury_packet_processor_write_json_linktype(processor, msg->buf, LLQ_MSG_SIZE, eth, pi->len, &(msg->ts), pi->linktype);
+            size_t write_len = mercury_packet_processor_write_json_linktype(processor, msg->buf(), LLQ_MSG_SIZE, eth, pi->len, &(msg->ts), pi->linktype);
             if (write_len > 0) {
-                msg->send(write_len);
-                llq->increment_widx();
+                llq->send(msg, write_len);
             }
         }
     }
@@ -239,10 +238,9 @@ struct pkt_proc_json_writer_llq_CPP : public pkt_proc {
     void apply(struct packet_info *pi, uint8_t *eth) override {
         struct llq_msg *msg = llq->init_msg(block, pi->ts.tv_sec, pi->ts.tv_nsec);
         if (msg) {
-            size_t write_len = processor.write_json(msg->buf, LLQ_MSG_SIZE, eth, pi->len, &(msg->ts));
+            size_t write_len = processor.write_json(msg->buf(), LLQ_MSG_SIZE, eth, pi->len, &(msg->ts));
             if (write_len > 0) {
-                msg->send(write_len);
-                llq->increment_widx();
+                llq->send(msg, write_len);
             }
         }
     }
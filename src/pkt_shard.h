@@ -0,0 +1,279 @@
+/*
+ * pkt_shard.h
+ *
+ * distribution of packets read from a file across worker threads,
+ * by flow
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#ifndef PKT_SHARD_H
+#define PKT_SHARD_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <atomic>
+#include "llq.h"
+#include "pkt_processing.h"
+#include "libmerc/eth.h"
+#include "libmerc/ppp.h"
+#include "libmerc/ip.h"
+
+/*
+ * class packet_ring is a single-producer, single-consumer ring
+ * buffer of variable-length packets, which passes packets from the
+ * pcap file reader thread to one worker thread.  Each packet is
+ * stored contiguously as a packet_info header followed by the packet
+ * data, padded to a multiple of eight bytes; when a packet will not
+ * fit before the end of the buffer, the producer skips to the start
+ * of the buffer, marking the skipped bytes if there is room for a
+ * header.  Neither push() nor front() waits; the reader waits for
+ * room, and the worker waits for packets.
+ */
+class packet_ring {
+    static constexpr size_t cache_line_size = 64;
+    static constexpr size_t alignment = 8;
+    static constexpr uint32_t skip_marker = UINT32_MAX;
+
+    alignas(cache_line_size) std::atomic<size_t> head;   // written by consumer
+    size_t cached_tail;
+    alignas(cache_line_size) std::atomic<size_t> tail;   // written by producer
+    size_t cached_head;
+    std::atomic<bool> closed;
+
+    alignas(cache_line_size) size_t size;
+    uint8_t *buffer;
+
+    static size_t record_length(uint32_t caplen) {
+        return (sizeof(struct packet_info) + caplen + alignment - 1) & ~(alignment - 1);
+    }
+
+    // bytes_to_end(x) returns the number of bytes between the
+    // position x and the end of the buffer
+    //
+    size_t bytes_to_end(size_t x) const { return size - (x & (size - 1)); }
+
+public:
+
+    // construct a packet_ring with a buffer of (at least) length
+    // bytes; the length is rounded up to a power of two
+    //
+    explicit packet_ring(size_t length) :
+        head{0},
+        cached_tail{0},
+        tail{0},
+        cached_head{0},
+        closed{false},
+        size{1},
+        buffer{nullptr}
+    {
+        while (size < length || size < 2 * max_record_length) {
+            size <<= 1;
+        }
+        buffer = (uint8_t *)malloc(size);
+        if (buffer == nullptr) {
+            throw std::runtime_error("error: could not allocate packet ring");
+        }
+    }
+
+    ~packet_ring() { free(buffer); }
+
+    packet_ring(const packet_ring &) = delete;
+    packet_ring &operator=(const packet_ring &) = delete;
+
+    // the longest packet that can be pushed into a ring
+    //
+    static constexpr size_t max_packet_length = pcap_file_max_packet_length;
+    static constexpr size_t max_record_length = sizeof(struct packet_info) + max_packet_length + alignment;
+
+    // push(pi, packet) copies the packet_info pi and the pi->caplen
+    // bytes at packet into the ring and publishes them to the
+    // consumer; it returns true on success, and false if there is not
+    // enough room in the ring.
+    //
+    // This function MUST only be called from the producer thread.
+    //
+    bool push(const struct packet_info *pi, const uint8_t *packet) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t len = record_length(pi->caplen);
+        size_t skip = bytes_to_end(t) < len ? bytes_to_end(t) : 0;
+        if (t + skip + len - cached_head > size) {
+            cached_head = head.load(std::memory_order_acquire);
+            if (t + skip + len - cached_head > size) {
+                return false;
+            }
+        }
+        if (skip >= sizeof(struct packet_info)) {
+            struct packet_info *marker = (struct packet_info *)(buffer + (t & (size - 1)));
+            marker->caplen = skip_marker;
+        }
+        t += skip;
+        uint8_t *record = buffer + (t & (size - 1));
+        memcpy(record, pi, sizeof(struct packet_info));
+        memcpy(record + sizeof(struct packet_info), packet, pi->caplen);
+        tail.store(t + len, std::memory_order_release);
+        return true;
+    }
+
+    // front() returns a pointer to the packet_info of the oldest
+    // packet in the ring, which is followed by the packet data, or
+    // nullptr if the ring is empty; the packet remains in the ring
+    // until pop() is called.
+    //
+    // This function MUST only be called from the consumer thread.
+    //
+    struct packet_info *front() {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == cached_tail) {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (h == cached_tail) {
+                return nullptr;
+            }
+        }
+        if (bytes_to_end(h) < sizeof(struct packet_info)
+            || ((struct packet_info *)(buffer + (h & (size - 1))))->caplen == skip_marker) {
+            h += bytes_to_end(h);
+            head.store(h, std::memory_order_release);
+        }
+        return (struct packet_info *)(buffer + (h & (size - 1)));
+    }
+
+    // pop() removes the packet returned by front() from the ring
+    //
+    // This function MUST only be called from the consumer thread,
+    // after front() has returned a packet.
+    //
+    void pop() {
+        size_t h = head.load(std::memory_order_relaxed);
+        const struct packet_info *pi = (struct packet_info *)(buffer + (h & (size - 1)));
+        head.store(h + record_length(pi->caplen), std::memory_order_release);
+    }
+
+    // close() indicates that the producer will push no more packets
+    //
+    void close() { closed.store(true, std::memory_order_release); }
+
+    bool is_closed() const { return closed.load(std::memory_order_acquire); }
+};
+
+/*
+ * struct pkt_shard holds the state of a worker thread that processes
+ * the packets of the flows assigned to it by the pcap file reader
+ */
+struct pkt_shard {
+    struct pkt_proc *pkt_processor;
+    struct ll_queue *llq;        /* output queue of pkt_processor */
+    std::atomic<uint64_t> *read_clock;   /* see thread_queues::read_clock */
+    pthread_t tid;
+    packet_ring ring;
+
+    static constexpr size_t ring_length = 4 * 1024 * 1024;
+
+    pkt_shard(struct pkt_proc *proc, struct ll_queue *q, std::atomic<uint64_t> *clock) :
+        pkt_processor{proc},
+        llq{q},
+        read_clock{clock},
+        tid{},
+        ring{ring_length}
+    { }
+
+    // assign(pi, packet) passes a packet to the worker, waiting until
+    // there is room in its ring, and advances the read clock to its
+    // timestamp
+    //
+    void assign(const struct packet_info *pi, const uint8_t *packet) {
+        uint64_t ns = timespec_to_ns(&pi->ts);
+        if (ns > read_clock->load(std::memory_order_relaxed)) {
+            read_clock->store(ns, std::memory_order_release);
+        }
+        llq->pkts_assigned.store(llq->pkts_assigned.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        while (!ring.push(pi, packet)) {
+            usleep(50); // sleep for fifty microseconds
+        }
+    }
+
+    // process() runs in the worker thread, and applies pkt_processor
+    // to each packet in the ring until the ring is closed and empty
+    //
+    void process() {
+        while (true) {
+            struct packet_info *pi = ring.front();
+            if (pi == nullptr) {
+                if (ring.is_closed() && ring.front() == nullptr) {
+                    break;
+                }
+                usleep(50); // sleep for fifty microseconds
+                continue;
+            }
+            pkt_processor->apply(pi, (uint8_t *)(pi + 1));
+            ring.pop();
+            llq->pkts_completed.store(llq->pkts_completed.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+        pkt_processor->finalize();
+    }
+
+    // index(pi, packet, num_shards) returns the number of the shard
+    // to which a packet should be assigned; both directions of a TCP
+    // or UDP flow go to the same shard, as do all of the packets
+    // between two hosts for other IP protocols, and non-IP packets go
+    // to shard zero
+    //
+    static unsigned int index(const struct packet_info *pi, const uint8_t *packet, unsigned int num_shards) {
+        struct datum pkt{packet, packet + pi->caplen};
+        switch (pi->linktype) {
+        case LINKTYPE_ETHERNET:
+            if (!eth::get_ip(pkt)) {
+                return 0;
+            }
+            break;
+        case LINKTYPE_PPP:
+            if (!ppp::is_ip(pkt)) {
+                return 0;
+            }
+            break;
+        default:
+            break;
+        }
+        struct key k;
+        ip ip_pkt{pkt, k};
+        if (k.ip_vers == 0) {
+            return 0;
+        }
+        if (k.protocol == ip::protocol::tcp || k.protocol == ip::protocol::udp) {
+            pkt.read_uint16(&k.src_port);
+            pkt.read_uint16(&k.dst_port);
+        }
+
+        // sum the hashes of the two endpoints, so that the index does
+        // not depend on the direction of the packet
+        //
+        uint64_t src, dst;
+        if (k.ip_vers == 4) {
+            src = k.addr.ipv4.src;
+            dst = k.addr.ipv4.dst;
+        } else {
+            const ipv6_address &s = k.addr.ipv6.src;
+            const ipv6_address &d = k.addr.ipv6.dst;
+            src = ((uint64_t)(s.a ^ s.c) << 32) | (s.b ^ s.d);
+            dst = ((uint64_t)(d.a ^ d.c) << 32) | (d.b ^ d.d);
+        }
+        uint64_t h = mix(src ^ k.src_port) + mix(dst ^ k.dst_port) + k.protocol;
+        return mix(h) % num_shards;
+    }
+
+private:
+
+    static uint64_t mix(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+};
+
+#endif /* PKT_SHARD_H */
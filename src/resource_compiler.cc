@@ -0,0 +1,106 @@
+/*
+ * resource_compiler.cc
+ *
+ * compiles a resource archive into a resource image, which libmerc
+ * can load much faster than the archive (see libmerc/resource_image.h)
+ *
+ * Copyright (c) 2021 Cisco Systems, Inc.  All rights reserved.  License at
+ * https://github.com/cisco/mercury/blob/master/LICENSE
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "libmerc/analysis.h"
+#include "libmerc/utils.h"
+#include "options.h"
+
+using namespace mercury_option;
+
+int main(int argc, char *argv[]) {
+
+    const char summary[] =
+        "usage:\n"
+        "   resource_compiler --archive <archive> --output <image> [OPTIONS]\n"
+        "\n"
+        "The thresholds and --report-os option must be the same as those\n"
+        "that libmerc will be configured with when it loads the image.\n"
+        "\n"
+        "OPTIONS\n"
+        ;
+    class option_processor opt({
+        { argument::required,   "--archive",            "read resource archive <arg>" },
+        { argument::required,   "--output",             "write resource image <arg>" },
+        { argument::required,   "--decrypt",            "decrypt archive using key from file <arg>" },
+        { argument::required,   "--fp-proc-threshold",  "set fp_proc_threshold to <arg> (default: 0.0)" },
+        { argument::required,   "--proc-dst-threshold", "set proc_dst_threshold to <arg> (default: 0.0)" },
+        { argument::none,       "--report-os",          "report OS information" },
+        { argument::none,       "--help",               "print out help message" }
+    });
+    if (!opt.process_argv(argc, argv)) {
+        opt.usage(stderr, argv[0], summary);
+        return EXIT_FAILURE;
+    }
+
+    auto [ archive_is_set, archive ] = opt.get_value("--archive");
+    auto [ output_is_set, output ] = opt.get_value("--output");
+    auto [ key_is_set, key_str ] = opt.get_value("--decrypt");
+    auto [ fp_proc_is_set, fp_proc_str ] = opt.get_value("--fp-proc-threshold");
+    auto [ proc_dst_is_set, proc_dst_str ] = opt.get_value("--proc-dst-threshold");
+    bool report_os  = opt.is_set("--report-os");
+    bool print_help = opt.is_set("--help");
+
+    if (print_help) {
+        opt.usage(stdout, argv[0], summary);
+        return EXIT_SUCCESS;
+    }
+    if (!archive_is_set || !output_is_set) {
+        fprintf(stderr, "error: both --archive and --output must be specified on command line\n");
+        opt.usage(stderr, argv[0], summary);
+        return EXIT_FAILURE;
+    }
+    float fp_proc_threshold = fp_proc_is_set ? strtof(fp_proc_str.c_str(), nullptr) : 0.0;
+    float proc_dst_threshold = proc_dst_is_set ? strtof(proc_dst_str.c_str(), nullptr) : 0.0;
+
+    // set the key k to that provided in the file specified in the
+    // --decrypt option, if present, or to nullptr otherwise
+    //
+    uint8_t *k = nullptr;
+    unsigned char key[16] = { 0x00, };
+    if (key_is_set) {
+        FILE *keyfile = fopen(key_str.c_str(), "r");
+        if (keyfile == nullptr) {
+            fprintf(stderr, "error: could not open key file %s\n", key_str.c_str());
+            return EXIT_FAILURE;
+        }
+        char raw_key[33] = { 0x00, };
+        size_t bytes_read = fread(raw_key, sizeof(char), sizeof(raw_key) - 1, keyfile);
+        fclose(keyfile);
+        if (bytes_read != sizeof(raw_key) - 1 || hex_to_raw(key, sizeof(key), raw_key) != sizeof(key)) {
+            fprintf(stderr, "error: could not read key from file %s (expected 32 hex chars)\n", key_str.c_str());
+            return EXIT_FAILURE;
+        }
+        k = key;
+    }
+
+    try {
+        encrypted_compressed_archive resources{archive.c_str(), k};
+        classifier c{resources, fp_proc_threshold, proc_dst_threshold, report_os};
+
+        FILE *f = fopen(output.c_str(), "w");
+        if (f == nullptr) {
+            fprintf(stderr, "error: could not open output file %s\n", output.c_str());
+            return EXIT_FAILURE;
+        }
+        c.write_image(f);
+        if (fclose(f) != 0) {
+            fprintf(stderr, "error: could not write output file %s\n", output.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+    catch (std::exception &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
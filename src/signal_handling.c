@@ -14,6 +14,7 @@
 #include "signal_handling.h"
 
 int sig_close_flag = 0; /* Watched by the threads while processing packets */
+volatile sig_atomic_t sig_reload_flag = 0; /* Watched by the control thread */
 
 /*
  * sig_close() causes a graceful shutdown of the program after recieving
@@ -25,6 +26,14 @@ void sig_close (int signal_arg) {
     fclose(stdin);      /* if are reading from stdin, stop reading */
 }
 
+/*
+ * sig_reload() causes the control thread to reload the resource file
+ * after receiving SIGHUP
+ */
+void sig_reload (int) {
+    sig_reload_flag = 1;
+}
+
 /*
  * set up signal handlers, so that output is flushed upon close
  *
@@ -40,6 +49,11 @@ enum status setup_signal_handler(void) {
         return status_err;
     }
 
+    /* kill -1 causes the resource file to be reloaded */
+    if (signal(SIGHUP, sig_reload) == SIG_ERR) {
+        return status_err;
+    }
+
     return status_ok;
 }
 
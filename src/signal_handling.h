@@ -15,8 +15,12 @@
 
 extern int sig_close_flag; /* Watched by the threads while processing packets */
 
+extern volatile sig_atomic_t sig_reload_flag; /* Watched by the control thread */
+
 void sig_close (int signal_arg);
 
+void sig_reload (int signal_arg);
+
 enum status setup_signal_handler(void);
 
 void enable_all_signals(void);
@@ -21,9 +21,11 @@
 #include <stdexcept>
 #include <iostream>
 #include <fstream>
-#include <thread>
+#include <deque>
+#include <functional>
 #include <mutex>
 #include <chrono>
+#include <signal.h>
 
 #include "libmerc/x509.h"
 #include "libmerc/http.h"
@@ -33,6 +35,7 @@
 #include "libmerc/crypto_hash.hpp"
 #include "libmerc/verbosity.hpp"
 #include "libmerc/tls_connection.hpp"
+#include "libmerc/tls_scan_engine.hpp"
 #include "options.h"
 #include "pkcs8.hpp"
 
@@ -173,6 +176,7 @@ class tls_scanner {
     FILE *cert_output_file = nullptr;
     bool recurse = false;
     std::string user_agent;
+    uint16_t port = 443;
 
     verbosity_level verbosity;
 
@@ -200,26 +204,54 @@ public:
         verbosity{verb}
         { }
 
-    void scan(const std::vector<std::string> &scan_targets, std::string &second_host, bool doh) {
-        std::vector<std::thread> t;
-        t.reserve(scan_targets.size());
-        for (const auto &host : scan_targets) {
-            if (verbosity >= verbosity_level::notes) {
-                fprintf(stderr, "note: launching thread to scan host %s\n", host.c_str());
+    // scan(next_host, inner_hostname, doh, engine_config) scans each
+    // host (optionally with a path) that next_host provides, with a
+    // tls_scan_engine that has the configuration engine_config, and
+    // reports the result of each scan as soon as it completes.
+    // next_host sets its argument to the next host and returns true,
+    // or returns false when there are no more hosts.
+    //
+    void scan(const std::function<bool (std::string &)> &next_host,
+              const std::string &inner_hostname,
+              bool doh,
+              const tls_scan_engine::config &engine_config) {
+
+        std::deque<std::string> links_to_follow;
+        auto next_target = [&](scan_target &t) {
+            std::string h;
+            while (true) {
+                if (!links_to_follow.empty()) {
+                    h = links_to_follow.front();
+                    links_to_follow.pop_front();
+                    if (make_target(h, h, false, t)) {
+                        return true;
+                    }
+                } else if (next_host(h)) {
+                    if (make_target(h, inner_hostname, doh, t)) {
+                        return true;
+                    }
+                } else {
+                    return false;
+                }
             }
-            t.emplace_back(std::thread([&]() mutable { scan(host, second_host, doh); }));
-        }
-        std::this_thread::sleep_for(std::chrono::milliseconds(5000));
-        for (auto & thd : t) {
-            thd.join();
-        }
+        };
+
+        tls_scan_engine engine{engine_config};
+        engine.run(next_target, [&](const scan_result &r) { report(r, links_to_follow); });
+
         if (verbosity == verbosity_level::summary) {
             fputc('\n', stderr); // terminate summary line
         }
+        if (verbosity >= verbosity_level::summary) {
+            engine.get_statistics().fprint(stderr);
+        }
     }
 
-    void scan(std::string hostname, std::string inner_hostname, bool doh=false) {
-        std::string redirect = "";
+    // make_target(hostname, inner_hostname, doh, t) sets t to the scan
+    // target for hostname, and returns true, or returns false if
+    // hostname cannot be scanned
+    //
+    bool make_target(std::string hostname, std::string inner_hostname, bool doh, scan_target &t) {
         std::string &http_host_field = inner_hostname;
         bool trim_hostname = false;
         if (inner_hostname == "") {
@@ -242,7 +274,7 @@ public:
                 if (verbosity >= verbosity_level::errors) {
                     fprintf(stderr, "error: path set for DoH query\n");
                 }
-                return;
+                return false;
             }
         }
 
@@ -250,26 +282,45 @@ public:
             if (verbosity >= verbosity_level::errors) {
                 fprintf(stderr, "warning: empty hostname found\n");
             }
-            return;
+            return false;
         }
 
+        t.hostname = hostname;
+        t.port = port;
+        t.request.clear();
+        if (cert_output_file == nullptr) {
+            t.request = tls_connection::http_request_string(path, hostname, inner_hostname, user_agent, doh);
+        }
+        return true;
+    }
+
+    // report(r, links_to_follow) writes out the result of a scan as it
+    // completes, and appends to links_to_follow any src= links that
+    // should be scanned in turn
+    //
+    void report(const scan_result &r, std::deque<std::string> &links_to_follow) {
+        const std::string &hostname = r.target.hostname;
+
         ++scans;
-        tls_connection connection{hostname.c_str(), verbosity, 443};
-        if (!connection.is_valid()) {
-            if (verbosity >= verbosity_level::warnings) {
-                fprintf(stderr, "warning: connection to %s failed\n", hostname.c_str());
-            }
-            return;  // error: could not connect to host
+        if (r.tls != nullptr) {
+            ++scans_succeded;
         }
-        ++scans_succeded;
         if (verbosity == verbosity_level::summary) {
             fprintf(stderr, "\rTLS scans\ttotal: %zu\tsucceeded: %zu", scans, scans_succeded);
         }
+        write_scan_record(r);
+
+        if (r.tls == nullptr) {
+            if (verbosity >= verbosity_level::warnings) {
+                fprintf(stderr, "warning: connection to %s failed (%s)\n", hostname.c_str(), scan_status_string(r.status));
+            }
+            return;  // error: could not connect to host
+        }
         if (verbosity >= verbosity_level::notes) {
             fprintf(stderr, "note: connection to %s succeeded\n", hostname.c_str());
         }
 
-        raw_cert cert{connection.get_tls()};
+        raw_cert cert{r.tls};
         std::basic_string<uint8_t> cert_string = cert.get_bytestring();
         data.insert(cert_string, hostname);
 
@@ -281,7 +332,8 @@ public:
             return;
         }
 
-        std::set<std::string> src_links = connection.send_http_request(path, hostname, inner_hostname, user_agent, doh);
+        tls_connection::write_http_request_json(r.target.request);
+        std::set<std::string> src_links = tls_connection::process_http_response(r.response);
 
         // follow src= links, if any
         //
@@ -298,15 +350,41 @@ public:
                 std::string host = u.host.get_string();
 
                 if (!was_previously_visited(host) && recurse) {
-                    // append path to host, since scan() expects that
+                    // append path to host, since make_target() expects that
                     host += u.path.get_string();
-                    scan(host, host);
+                    links_to_follow.push_back(host);
                 }
             }
         }
 
     }
 
+    // write_scan_record(r) writes out the host, address, status, and
+    // phase times (in microseconds) of a scan as a JSON object
+    //
+    void write_scan_record(const scan_result &r) const {
+        char output_buffer[1024];
+        struct buffer_stream buf{output_buffer, sizeof(output_buffer)};
+        struct json_object record{&buf};
+        struct json_object scan{record, "tls_scan"};
+        scan.print_key_json_string("host", (const uint8_t *)r.target.hostname.data(), r.target.hostname.length());
+        scan.print_key_uint("port", r.target.port);
+        if (r.status != scan_status::resolve_failed) {
+            char addr[INET_ADDRSTRLEN];
+            if (inet_ntop(AF_INET, &r.address.sin_addr, addr, sizeof(addr)) != nullptr) {
+                scan.print_key_string("address", addr);
+            }
+        }
+        scan.print_key_string("status", scan_status_string(r.status));
+        scan.print_key_uint("connect_us", r.connect_us);
+        scan.print_key_uint("handshake_us", r.handshake_us);
+        scan.print_key_uint("response_us", r.response_us);
+        scan.print_key_uint("total_us", r.total_us);
+        scan.close();
+        record.close();
+        buf.write_line(stdout);
+    }
+
     bool was_previously_visited(std::string &) const {
         //
         // TODO: connect this to host_data
@@ -314,6 +392,10 @@ public:
         return false;
     }
 
+    void set_port(uint16_t p) {
+        port = p;
+    }
+
     host_data &get_host_data() {
         return data;
     }
@@ -851,6 +933,18 @@ private:
 
 using namespace mercury_option;
 
+// numeric_option(name, value) returns the value of the numeric option
+// name, or throws an exception if value is not a decimal number
+//
+static unsigned long numeric_option(const char *name, const std::string &value) {
+    char *end = nullptr;
+    unsigned long n = strtoul(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0') {
+        throw std::runtime_error{std::string{"invalid value '"} + value + "' for option " + name};
+    }
+    return n;
+}
+
 int main(int argc, char *argv[]) {
 
     // improve performance by not syncing stdio with iostreams
@@ -869,6 +963,12 @@ int main(int argc, char *argv[]) {
         "which contains the host names and the SHA1 hash of the corresponding\n"
         "certificates.\n"
         "\n"
+        "Up to --max-in-flight servers are scanned concurrently, by a single\n"
+        "event-driven thread.  As each scan completes, a tls_scan object that\n"
+        "reports its status and the time taken by each phase is written out,\n"
+        "and with a verbosity of summary or more, the scan rate and latency\n"
+        "percentiles are reported at the end.  Timeouts are in milliseconds.\n"
+        "\n"
         "OPTIONS\n";
 
     option_processor opt({
@@ -884,6 +984,11 @@ int main(int argc, char *argv[]) {
         { argument::none,       "--body",             "prints out HTTP response body" },
         { argument::none,       "--recurse",          "recursively follow src links and redirects" },
         { argument::required,   "--doh",              "send DoH query about <arg>" },
+        { argument::required,   "--port",             "sets the TCP port of the server(s) (default: 443)" },
+        { argument::required,   "--max-in-flight",    "sets the maximum number of concurrent scans (default: 1000)" },
+        { argument::required,   "--connect-timeout",  "sets the TCP connection timeout (default: 5000)" },
+        { argument::required,   "--handshake-timeout", "sets the TLS handshake timeout (default: 5000)" },
+        { argument::required,   "--response-timeout", "sets the HTTP request/response timeout (default: 10000)" },
         { argument::none,       "--help",             "prints out help message" },
         { argument::none,       "--version",          "prints out version" }
     });
@@ -900,6 +1005,11 @@ int main(int argc, char *argv[]) {
     auto [ write_certs, pem_outfile ] = opt.get_value("--write-certs");
     auto [ verb_is_set, verb ] = opt.get_value("--verbosity");
     auto [ doh, doh_query ] = opt.get_value("--doh");
+    auto [ port_is_set, port_str ] = opt.get_value("--port");
+    auto [ max_in_flight_is_set, max_in_flight_str ] = opt.get_value("--max-in-flight");
+    auto [ connect_timeout_is_set, connect_timeout_str ] = opt.get_value("--connect-timeout");
+    auto [ handshake_timeout_is_set, handshake_timeout_str ] = opt.get_value("--handshake-timeout");
+    auto [ response_timeout_is_set, response_timeout_str ] = opt.get_value("--response-timeout");
     bool list_uas    = opt.is_set("--list-user-agents");
     bool omit_sni    = opt.is_set("--no-server-name");
     bool print_certs = opt.is_set("--certs");
@@ -976,55 +1086,61 @@ int main(int argc, char *argv[]) {
         if (ua_is_set) {
             scanner.set_user_agent(ua_search_string);
         }
+        if (port_is_set) {
+            unsigned long port = numeric_option("--port", port_str);
+            if (port == 0 || port > 65535) {
+                throw std::runtime_error{"invalid port " + port_str};
+            }
+            scanner.set_port(port);
+        }
+
+        tls_scan_engine::config engine_config;
+        engine_config.omit_sni = omit_sni;
+        engine_config.verbosity = verbosity;
+        if (max_in_flight_is_set) {
+            engine_config.max_in_flight = numeric_option("--max-in-flight", max_in_flight_str);
+        }
+        if (connect_timeout_is_set) {
+            engine_config.connect_timeout_ms = numeric_option("--connect-timeout", connect_timeout_str);
+        }
+        if (handshake_timeout_is_set) {
+            engine_config.handshake_timeout_ms = numeric_option("--handshake-timeout", handshake_timeout_str);
+        }
+        if (response_timeout_is_set) {
+            engine_config.response_timeout_ms = numeric_option("--response-timeout", response_timeout_str);
+        }
+
+        // a server that closes a connection before we write to it
+        // must not terminate the scan
+        //
+        signal(SIGPIPE, SIG_IGN);
+
         if (host_file_is_set) {
 
             std::ifstream host_list{host_file};
             if (!host_list) {
                 throw std::runtime_error{"could not open file '" + host_file + "'"};
             }
-            while (true) {
-
-                // implementation note: The batch thread model used
-                // here aims to be simple and scalable.  We loop over
-                // target hosts, forming a batch of hosts, launching a
-                // scan thread for each host in a batch, and then
-                // waiting until all threads in a batch complete
-                // before moving on to the next batch.
-
-                // read a batch of target hosts from the host_list file
-                //
-                size_t max_batch_size = 1000;
-                std::string h;
-                std::vector<std::string> scan_targets;
-                while (std::getline(host_list, h)) {
-                    scan_targets.emplace_back(h);
-                    if (scan_targets.size() >= max_batch_size) {
-                        break;
-                    }
-                }
-                if (scan_targets.empty()) {
-                    break;  // no hosts to scan
-                }
 
-                // scan all targets in batch
-                //
-                scanner.scan(scan_targets, inner_hostname, doh);
-
-                // if the batch was smaller than the maximum, that
-                // means that we have read all of the entries in the
-                // host_list file, so we are done
-                //
-                if (scan_targets.size() < max_batch_size) {
-                    break;
-                }
-
-                // clear room for next set of target hosts
-                //
-                scan_targets.clear();
-            }
+            // implementation note: target hosts are read from the
+            // host_list file only as the scan engine has room for
+            // them, so that the number of hosts in the file is not
+            // limited by memory
+            //
+            auto next_host = [&host_list](std::string &h) { return (bool)std::getline(host_list, h); };
+            scanner.scan(next_host, inner_hostname, doh, engine_config);
 
         } else {
-            scanner.scan(hostname, inner_hostname, doh);
+            bool done = false;
+            auto next_host = [&](std::string &h) {
+                if (done) {
+                    return false;
+                }
+                h = hostname;
+                done = true;
+                return true;
+            };
+            scanner.scan(next_host, inner_hostname, doh, engine_config);
         }
 
         // output host data
@@ -0,0 +1,125 @@
+// analysis_cache_driver.cc
+//
+// benchmark for the per-thread analysis cache (analysis_cache.h): the
+// packets in a PCAP file are processed repeatedly with analysis
+// enabled, first by a packet processor whose cache is turned off
+// ("analysis-cache-size=0"), and then by one that uses the default
+// cache, as clients that connect to the same destination with the
+// same fingerprint would be.  The mean time per packet, the number of
+// cache hits and misses, and a checksum of the JSON output are
+// reported for each; the checksums must match, since a cached result
+// must be identical to the one that it replaces.
+//
+// usage: analysis_cache_driver pcap_file resource_file [passes]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include <zlib.h>
+#include "libmerc.h"
+
+struct packet {
+    struct timespec ts;
+    std::vector<uint8_t> data;
+};
+
+// read_pcap(filename) returns the packets in a PCAP file with
+// microsecond timestamps
+//
+static std::vector<packet> read_pcap(const char *filename) {
+    std::vector<packet> packets;
+    FILE *f = fopen(filename, "r");
+    if (f == nullptr) {
+        fprintf(stderr, "error: could not open pcap file %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    uint8_t file_header[24];
+    if (fread(file_header, sizeof(file_header), 1, f) != 1) {
+        fprintf(stderr, "error: could not read pcap file header\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t record_header[4];   // seconds, microseconds, captured length, length
+    while (fread(record_header, sizeof(record_header), 1, f) == 1) {
+        packet p;
+        p.ts.tv_sec = record_header[0];
+        p.ts.tv_nsec = record_header[1] * 1000;
+        p.data.resize(record_header[2]);
+        if (fread(p.data.data(), p.data.size(), 1, f) != 1) {
+            break;
+        }
+        packets.push_back(std::move(p));
+    }
+    fclose(f);
+    return packets;
+}
+
+static uLong run(const char *name,
+                 const char *config_string,
+                 const char *resource_file,
+                 const std::vector<packet> &packets,
+                 unsigned int passes) {
+
+    struct libmerc_config config{};
+    config.do_analysis = true;
+    config.resources = (char *)resource_file;
+    config.packet_filter_cfg = (char *)config_string;
+    mercury_context mc = mercury_init(&config, 0);
+    if (mc == nullptr) {
+        fprintf(stderr, "error: could not initialize mercury\n");
+        exit(EXIT_FAILURE);
+    }
+    mercury_packet_processor p = mercury_packet_processor_construct(mc);
+    if (p == nullptr) {
+        fprintf(stderr, "error: could not construct packet processor\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char buf[65536];
+    uLong checksum = crc32(0, nullptr, 0);
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < passes; i++) {
+        for (const auto &pkt : packets) {
+            struct timespec ts = pkt.ts;
+            size_t n = mercury_packet_processor_write_json(p, buf, sizeof(buf), (uint8_t *)pkt.data.data(), pkt.data.size(), &ts);
+            checksum = crc32(checksum, (const Bytef *)buf, n);
+        }
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    mercury_packet_processor_get_analysis_cache_stats(p, &hits, &misses);
+    printf("%-10s ns per packet: %9.1f\thits: %10lu\tmisses: %8lu\tchecksum: %08lx\n",
+           name, ns / ((double)passes * packets.size()), hits, misses, checksum);
+
+    mercury_packet_processor_destruct(p);
+    mercury_finalize(mc);
+    return checksum;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s pcap_file resource_file [passes]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    unsigned int passes = argc > 3 ? strtoul(argv[3], nullptr, 10) : 100;
+    if (passes == 0) {
+        passes = 1;
+    }
+
+    std::vector<packet> packets = read_pcap(argv[1]);
+    if (packets.empty()) {
+        fprintf(stderr, "error: no packets in %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    uLong uncached = run("uncached", "select=all;analysis-cache-size=0", argv[2], packets, passes);
+    uLong cached = run("cached", "all", argv[2], packets, passes);
+    if (cached != uncached) {
+        fprintf(stderr, "error: cached analysis results differ from uncached results\n");
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
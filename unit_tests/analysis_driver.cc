@@ -0,0 +1,103 @@
+// analysis_driver.cc
+//
+// microbenchmark for fingerprint analysis (classifier::perform_analysis
+// in analysis.h): the TLS client fingerprints, server names, and
+// destinations are read from a mercury JSON output file, and each of
+// them is analyzed repeatedly with the classifier built from a
+// resource archive, first with the destination address in binary
+// form, as in the packet processing path, and then as a string, as
+// in the cython interface.  A checksum of the results is printed, so
+// that implementations of the classifier can be compared for
+// equality as well as speed.
+//
+// usage: analysis_driver json_file resource_archive [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "analysis.h"
+
+struct session {
+    std::string fp;
+    std::string server_name;
+    std::string dst_ip;
+    destination_address dst_addr;
+    uint16_t dst_port;
+};
+
+static std::vector<session> read_sessions(const char *json_file) {
+    std::vector<session> sessions;
+    std::ifstream input{json_file};
+    std::string line;
+    while (std::getline(input, line)) {
+        rapidjson::Document d;
+        d.Parse(line.c_str());
+        if (d.HasParseError() || !d.HasMember("fingerprints") || !d["fingerprints"].HasMember("tls")) {
+            continue;
+        }
+        const char *server_name = "";
+        if (d.HasMember("tls") && d["tls"].HasMember("client") && d["tls"]["client"].HasMember("server_name")) {
+            server_name = d["tls"]["client"]["server_name"].GetString();
+        }
+        destination_address dst_addr;
+        dst_addr.parse(d["dst_ip"].GetString());
+        sessions.push_back({ d["fingerprints"]["tls"].GetString(),
+                             server_name,
+                             d["dst_ip"].GetString(),
+                             dst_addr,
+                             (uint16_t)d["dst_port"].GetUint() });
+    }
+    return sessions;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s json_file resource_archive [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    size_t iterations = argc > 3 ? strtoul(argv[3], nullptr, 10) : 1000;
+
+    std::vector<session> sessions = read_sessions(argv[1]);
+    if (sessions.empty()) {
+        fprintf(stderr, "error: no tls client fingerprints in %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    classifier *c = analysis_init_from_archive(0, argv[2], nullptr, enc_key_type_none, 0.0, 0.0, false);
+
+    // analyze each session once before timing, so that fingerprints
+    // that are not in the database have been added to the
+    // fingerprint prevalence table, and every run returns the same
+    // results
+    //
+    for (const auto &s : sessions) {
+        c->perform_analysis(s.fp.c_str(), s.server_name.c_str(), s.dst_addr, s.dst_port, nullptr);
+    }
+
+    auto run = [&](const char *name, auto analyze) {
+        uint64_t checksum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; i++) {
+            for (const auto &s : sessions) {
+                analysis_result r = analyze(s);
+                checksum = checksum * 31 + r.status + (uint64_t)(r.max_score * 1e12) + r.max_proc[0];
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - start).count() / (iterations * sessions.size());
+
+        printf("sessions: %zu\titerations: %zu\t%-8s analysis: %8.1f ns\tchecksum: %016lx\n",
+               sessions.size(), iterations, name, ns, checksum);
+    };
+    run("binary", [c](const session &s) {
+        return c->perform_analysis(s.fp.c_str(), s.server_name.c_str(), s.dst_addr, s.dst_port, nullptr);
+    });
+    run("string", [c](const session &s) {
+        return c->perform_analysis(s.fp.c_str(), s.server_name.c_str(), s.dst_ip.c_str(), s.dst_port, nullptr);
+    });
+
+    analysis_finalize(c);
+    return 0;
+}
@@ -0,0 +1,213 @@
+// asn_driver.cc
+//
+// microbenchmark for the longest prefix match of destination
+// addresses to BGP Autonomous System Numbers (subnet_data in addr.h),
+// which uses a level compressed trie for IPv4 and another one for
+// IPv6.  The IPv4 table is the pyasn.db file in a resource archive.
+// The IPv6 table is read from a file in the same format (such as
+// "2001:200::/32\t2500"), if one is provided; otherwise, it is
+// synthesized by embedding each IPv4 prefix in 2000::/4, so that it
+// has the same number of prefixes and the same structure as the IPv4
+// table.  Each lookup is for a random address inside a random prefix
+// of the table, and each IPv6 result is checked against a reference
+// longest prefix match; the driver exits with an error if any of them
+// differ.
+//
+// usage: asn_driver resource_archive [ipv6_table] [lookups]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include "addr.h"
+
+struct prefix_v6 {
+    ipv6_addr_t addr;   // host byte order
+    unsigned int len;
+    uint32_t asn;
+};
+
+static ipv6_addr_t mask_v6(ipv6_addr_t addr, unsigned int len) {
+    return len == 0 ? 0 : addr & (~(ipv6_addr_t)0 << (128 - len));
+}
+
+static destination_address to_destination_address(ipv6_addr_t addr) {
+    ipv6_addr_t a = hton(addr);
+    std::array<uint8_t, 16> bytes;
+    memcpy(bytes.data(), &a, sizeof(a));
+    return destination_address{bytes};
+}
+
+static std::string sprint_v6(const prefix_v6 &p) {
+    ipv6_addr_t a = hton(p.addr);
+    char addr_str[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, &a, addr_str, sizeof(addr_str));
+    return std::string{addr_str} + "/" + std::to_string(p.len) + "\t" + std::to_string(p.asn);
+}
+
+// reference longest prefix match, with one map per prefix length
+//
+class reference_table {
+    std::map<ipv6_addr_t, uint32_t> table[129];
+    std::vector<unsigned int> lengths;  // longest first
+
+public:
+    reference_table(const std::vector<prefix_v6> &prefixes) {
+        for (const auto &p : prefixes) {
+            table[p.len].emplace(p.addr, p.asn);
+        }
+        for (int len = 128; len > 0; len--) {
+            if (!table[len].empty()) {
+                lengths.push_back(len);
+            }
+        }
+    }
+
+    uint32_t find(ipv6_addr_t addr) const {
+        for (unsigned int len : lengths) {
+            auto it = table[len].find(mask_v6(addr, len));
+            if (it != table[len].end()) {
+                return it->second;
+            }
+        }
+        return 0;
+    }
+};
+
+template <typename F>
+static double time_ns(const std::vector<destination_address> &addrs, uint64_t &checksum, F f) {
+    checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto &a : addrs) {
+        checksum = checksum * 31 + f(a);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / addrs.size();
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s resource_archive [ipv6_table] [lookups]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *ipv6_table = argc > 2 ? argv[2] : nullptr;
+    size_t num_lookups = argc > 3 ? strtoul(argv[3], nullptr, 10) : 1000000;
+    std::mt19937_64 rng{1};
+
+    // read the IPv4 table from the resource archive
+    //
+    std::vector<std::string> lines;
+    std::vector<prefix_v6> v4_prefixes;     // IPv4 prefixes in the low 32 bits
+    encrypted_compressed_archive archive{argv[1]};
+    for (const archive_node *entry = archive.get_next_entry(); entry != nullptr; entry = archive.get_next_entry()) {
+        if (!entry->is_regular_file() || std::string{entry->get_name()} != "pyasn.db") {
+            continue;
+        }
+        std::string line;
+        while (archive.getline(line)) {
+            uint8_t d[4];
+            unsigned int len;
+            uint32_t asn;
+            if (sscanf(line.c_str(), "%hhu.%hhu.%hhu.%hhu/%u\t%u", d, d+1, d+2, d+3, &len, &asn) != 6 || len == 0 || len > 32) {
+                continue;
+            }
+            uint32_t addr = (uint32_t)d[0] << 24 | (uint32_t)d[1] << 16 | (uint32_t)d[2] << 8 | d[3];
+            v4_prefixes.push_back({ addr, len, asn });
+            lines.push_back(line);
+        }
+        break;
+    }
+    if (v4_prefixes.empty()) {
+        fprintf(stderr, "error: no IPv4 prefixes in %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    // read or synthesize the IPv6 table
+    //
+    std::vector<prefix_v6> v6_prefixes;
+    if (ipv6_table) {
+        std::ifstream input{ipv6_table};
+        std::string line;
+        while (std::getline(input, line)) {
+            char addr_str[INET6_ADDRSTRLEN];
+            unsigned int len;
+            uint32_t asn;
+            ipv6_addr_t addr;
+            if (sscanf(line.c_str(), "%45[0-9a-fA-F:]/%u\t%u", addr_str, &len, &asn) != 3 || len == 0 || len > 128 ||
+                inet_pton(AF_INET6, addr_str, &addr) != 1) {
+                continue;
+            }
+            v6_prefixes.push_back({ mask_v6(ntoh(addr), len), len, asn });
+        }
+        if (v6_prefixes.empty()) {
+            fprintf(stderr, "error: no IPv6 prefixes in %s\n", ipv6_table);
+            return EXIT_FAILURE;
+        }
+    } else {
+        for (const auto &p : v4_prefixes) {
+            ipv6_addr_t addr = (ipv6_addr_t)(0x2ULL << 60 | (uint64_t)p.addr << 28) << 64;
+            v6_prefixes.push_back({ mask_v6(addr, p.len + 4), p.len + 4, p.asn });
+        }
+    }
+    for (const auto &p : v6_prefixes) {
+        lines.push_back(sprint_v6(p));
+    }
+    printf("ipv4 prefixes: %zu\tipv6 prefixes: %zu (%s)\n", v4_prefixes.size(), v6_prefixes.size(), ipv6_table ? ipv6_table : "synthesized");
+
+    auto start = std::chrono::steady_clock::now();
+    subnet_data subnets;
+    for (auto &line : lines) {
+        if (subnets.process_line(line) != 0) {
+            return EXIT_FAILURE;
+        }
+    }
+    subnets.process_final();
+    auto end = std::chrono::steady_clock::now();
+    printf("build: %.1f ms\n", std::chrono::duration<double, std::milli>(end - start).count());
+
+    // random addresses inside random prefixes
+    //
+    std::vector<destination_address> v4_addrs;
+    std::vector<destination_address> v6_addrs;
+    std::vector<ipv6_addr_t> v6_keys;
+    for (size_t i = 0; i < num_lookups; i++) {
+        const prefix_v6 &p4 = v4_prefixes[rng() % v4_prefixes.size()];
+        uint32_t host_mask = p4.len == 32 ? 0 : 0xffffffff >> p4.len;
+        v4_addrs.emplace_back((uint32_t)(p4.addr | (rng() & host_mask)));
+
+        const prefix_v6 &p6 = v6_prefixes[rng() % v6_prefixes.size()];
+        ipv6_addr_t host = (ipv6_addr_t)rng() << 64 | rng();
+        ipv6_addr_t key = p6.addr | (host & ~mask_v6(~(ipv6_addr_t)0, p6.len));
+        v6_keys.push_back(key);
+        v6_addrs.push_back(to_destination_address(key));
+    }
+
+    // check the IPv6 trie against the reference
+    //
+    reference_table reference{v6_prefixes};
+    size_t mismatches = 0;
+    for (size_t i = 0; i < v6_keys.size(); i++) {
+        if (subnets.get_asn_info(v6_addrs[i]) != reference.find(v6_keys[i])) {
+            mismatches++;
+        }
+    }
+    if (mismatches) {
+        fprintf(stderr, "error: %zu of %zu IPv6 lookups differ from the reference\n", mismatches, v6_keys.size());
+        return EXIT_FAILURE;
+    }
+
+    uint64_t checksum;
+    auto lookup = [&subnets](const destination_address &a) { return subnets.get_asn_info(a); };
+    double ns = time_ns(v4_addrs, checksum, lookup);
+    printf("lookups: %zu\tipv4: %8.1f ns\tchecksum: %016lx\n", v4_addrs.size(), ns, checksum);
+    ns = time_ns(v6_addrs, checksum, lookup);
+    printf("lookups: %zu\tipv6: %8.1f ns\tchecksum: %016lx\n", v6_addrs.size(), ns, checksum);
+
+    return 0;
+}
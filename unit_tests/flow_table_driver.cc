@@ -0,0 +1,150 @@
+// flow_table_driver.cc
+//
+// microbenchmark for the flow_map (flow_map.h) that holds the
+// per-flow state in tcp.h, compared with the std::unordered_map that
+// it replaced.  For each table size, N random IPv4 flow keys are
+// inserted, looked up (all hits), looked up again with different keys
+// (all misses), and erased; a churn test then inserts and erases one
+// flow per step while N flows are live, as the TCP flow table does
+// with SYN and first data packets.
+//
+// usage: flow_table_driver [max_flows]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "tcp.h"
+
+static std::vector<key> random_keys(size_t n, uint32_t seed) {
+    std::mt19937 rng{seed};
+    std::vector<key> keys;
+    keys.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+        keys.emplace_back(rng() & 0xffff, 443, rng(), rng(), 6);
+    }
+    return keys;
+}
+
+template <typename F>
+static double ns_per_op(size_t n, F f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / n;
+}
+
+// the table wrappers give the two maps a common interface
+//
+struct unordered_table {
+    std::unordered_map<key, tcp_context> table;
+
+    explicit unordered_table(size_t) : table{} { }
+
+    void insert(const key &k, unsigned int sec) { table.insert({k, {sec, 0}}); }
+    bool find(const key &k) const { return table.find(k) != table.end(); }
+    void erase(const key &k) {
+        auto it = table.find(k);
+        if (it != table.end()) {
+            table.erase(it);
+        }
+    }
+};
+
+struct flow_map_table {
+    flow_map<key, tcp_context> table;
+
+    explicit flow_map_table(size_t capacity) : table{capacity} { }
+
+    void insert(const key &k, unsigned int sec) {
+        table.advance(sec);
+        table.emplace(k, sec + 30, sec, 0);
+    }
+    bool find(const key &k) const { return table.find(k) != table.nil; }
+    void erase(const key &k) {
+        auto it = table.find(k);
+        if (it != table.nil) {
+            table.erase(it);
+        }
+    }
+};
+
+template <typename T>
+static void run(const char *name, const std::vector<key> &keys, const std::vector<key> &other_keys) {
+    const size_t n = keys.size();
+    T t{n};
+    size_t found = 0;
+
+    double insert_ns = ns_per_op(n, [&]() {
+        for (size_t i = 0; i < n; i++) {
+            t.insert(keys[i], 0);
+        }
+    });
+    double hit_ns = ns_per_op(n, [&]() {
+        for (const auto &k : keys) {
+            found += t.find(k);
+        }
+    });
+    double miss_ns = ns_per_op(n, [&]() {
+        for (const auto &k : other_keys) {
+            found += t.find(k);
+        }
+    });
+    double erase_ns = ns_per_op(n, [&]() {
+        for (const auto &k : keys) {
+            t.erase(k);
+        }
+    });
+
+    // churn: keep n/2 flows live, inserting one and erasing the
+    // oldest at each step
+    //
+    const size_t live = n / 2;
+    for (size_t i = 0; i < live; i++) {
+        t.insert(keys[i], 0);
+    }
+    double churn_ns = ns_per_op(n - live, [&]() {
+        for (size_t i = live; i < n; i++) {
+            t.insert(keys[i], 0);
+            t.erase(keys[i - live]);
+        }
+    });
+
+    printf("%-14s flows: %9zu\tinsert: %7.1f ns\thit: %7.1f ns\tmiss: %7.1f ns\terase: %7.1f ns\tchurn: %7.1f ns\t(%zu)\n",
+           name, n, insert_ns, hit_ns, miss_ns, erase_ns, churn_ns, found);
+}
+
+int main(int argc, char *argv[]) {
+    size_t max_flows = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+
+    for (size_t n = 1000; n <= max_flows; n *= 10) {
+        std::vector<key> keys = random_keys(n, 1);
+        std::vector<key> other_keys = random_keys(n, 2);
+        run<unordered_table>("unordered_map", keys, other_keys);
+        run<flow_map_table>("flow_map", keys, other_keys);
+    }
+
+    // check the capacity limit, and that every entry is expired by
+    // the timer wheel after its deadline
+    //
+    flow_map<key, tcp_context> table{1000};
+    std::vector<key> keys = random_keys(2000, 3);
+    for (size_t i = 0; i < keys.size(); i++) {
+        table.advance(i);
+        table.emplace(keys[i], i + 10000, i, 0);
+    }
+    size_t full_size = table.size();
+    for (uint32_t t = keys.size(); t < keys.size() + 11000; t += 7) {
+        table.advance(t);
+    }
+    printf("capacity check: size: %zu\tinsertions: %lu\tevictions: %lu\texpirations: %lu\n",
+           full_size, table.insertions(), table.evictions(), table.expirations());
+    if (full_size != 1000 || table.size() != 0 || table.evictions() != 1000 || table.expirations() != 1000) {
+        fprintf(stderr, "error: unexpected flow_map occupancy\n");
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
@@ -10,6 +10,9 @@
 #include "bencode.h"
 #include "snmp.h"
 #include "tofsee.hpp"
+#include "stats.h"
+#include "tcp.h"
+#include "analysis_cache.h"
 
 /*
  * The unit_test() functions defined in header files
@@ -22,3 +25,483 @@ TEST_CASE("Testing unit_test() defined in class") {
     CHECK(snmp::unit_test() == true);
     CHECK(tofsee_initial_message::unit_test() == true);
 }
+
+// push_test_event() pushes an event from the IPv4 source address src
+// with fingerprint fp onto the message queue of producer p
+//
+static bool push_test_event(event_producer *p, uint32_t src, const std::string &fp) {
+    return p->push_event([&](event_record &ev, event_producer &prod) {
+        ev.src = {{src, 0, 0, 0}, 4};
+        ev.fp = prod.get_fingerprint_id(fp, std::hash<std::string>{}(fp));
+        ev.ua = prod.get_user_agent_id("test");
+        ev.dst = prod.get_destination_id("example.com", "192.0.2.1", "443");
+    });
+}
+
+TEST_CASE("data_aggregator reuses removed producers after their events are written") {
+    gzFile f = gzopen("/dev/null", "w");
+    REQUIRE(f != nullptr);
+    data_aggregator agg{0, 1024};
+    event_producer *keep = agg.add_producer();   // keeps the consumer running
+
+    event_producer *p = agg.add_producer();
+    CHECK(push_test_event(p, 0x0a000001, "fp-1"));
+    agg.remove_producer(p);
+
+    // p's event has not been written out, so p cannot be reused yet
+    //
+    event_producer *q = agg.add_producer();
+    CHECK(q != p);
+    CHECK(agg.get_num_producers() == 3);
+    agg.remove_producer(q);
+
+    agg.gzprint(f, "", 0, "");
+    CHECK(agg.add_producer() == p);
+    CHECK(agg.add_producer() == q);
+
+    // repeated add/remove/gzprint cycles do not allocate any more producers
+    //
+    for (size_t i = 0; i < 16; i++) {
+        event_producer *r = agg.add_producer();
+        CHECK(push_test_event(r, 0x0a000002, "fp-2"));
+        agg.remove_producer(r);
+        agg.gzprint(f, "", 0, "");
+    }
+    CHECK(agg.get_num_producers() == 4);
+    CHECK(agg.get_num_dropped_events() == 0);
+
+    agg.remove_producer(keep);
+    gzclose(f);
+}
+
+TEST_CASE("event_producer interns strings per dictionary epoch") {
+    std::atomic<uint32_t> epoch{0};
+    event_producer p{epoch, 16};
+    const std::string fp_a{"tls/(0303)(1301)"};
+    const std::string fp_b{"tls/(0303)(1302)"};
+    const uint64_t digest_a = std::hash<std::string>{}(fp_a);
+
+    // identical strings are given identical identifiers, whether or
+    // not their digests are used
+    //
+    uint32_t a = 0, b = 0, a_again = 0, ua = 0, ua_again = 0;
+    CHECK(p.push_event([&](event_record &, event_producer &prod) {
+        a = prod.get_fingerprint_id(fp_a, digest_a);
+        b = prod.get_fingerprint_id(fp_b, std::hash<std::string>{}(fp_b));
+        a_again = prod.get_fingerprint_id(fp_a, digest_a);
+        ua = prod.get_user_agent_id("curl/8.0");
+        ua_again = prod.get_user_agent_id("curl/8.0");
+    }));
+    CHECK(a != b);
+    CHECK(a == a_again);
+    CHECK(ua == ua_again);
+
+    // a digest collision falls back to comparing the strings
+    //
+    uint32_t collision = 0;
+    CHECK(p.push_event([&](event_record &, event_producer &prod) {
+        collision = prod.get_fingerprint_id(fp_b, digest_a);
+    }));
+    CHECK(collision != a);
+
+    auto maps = p.get_inverse_maps(0);
+    CHECK(event_producer::inverse_maps::lookup(maps.fp, a) == fp_a);
+    CHECK(event_producer::inverse_maps::lookup(maps.fp, b) == fp_b);
+    CHECK(event_producer::inverse_maps::lookup(maps.ua, ua) == "curl/8.0");
+    CHECK(event_producer::inverse_maps::lookup(maps.fp, 1000) == dict::unknown_fp_string);
+
+    // in a new epoch, the producer starts a fresh set of
+    // dictionaries, while those of the previous epoch remain
+    // readable
+    //
+    epoch.store(1);
+    uint32_t b_new = 0;
+    uint32_t record_epoch = 0;
+    CHECK(p.push_event([&](event_record &ev, event_producer &prod) {
+        record_epoch = ev.epoch;
+        b_new = prod.get_fingerprint_id(fp_b, std::hash<std::string>{}(fp_b));
+    }));
+    CHECK(record_epoch == 1);
+    CHECK(b_new == 0);
+    CHECK(p.get_inverse_maps(1).fp.size() == 1);
+    CHECK(event_producer::inverse_maps::lookup(p.get_inverse_maps(0).fp, b) == fp_b);
+
+    // a full queue drops events, and counts them
+    //
+    size_t pushed = 3;
+    while (p.push_event([](event_record &, event_producer &) { })) {
+        pushed++;
+    }
+    CHECK(pushed >= 16);
+    CHECK(p.drops() == 1);
+}
+
+// read_gz_file(path) returns the uncompressed contents of the file
+//
+static std::string read_gz_file(const char *path) {
+    std::string s;
+    gzFile f = gzopen(path, "r");
+    if (f != nullptr) {
+        char buf[4096];
+        int n;
+        while ((n = gzread(f, buf, sizeof(buf))) > 0) {
+            s.append(buf, n);
+        }
+        gzclose(f);
+    }
+    return s;
+}
+
+TEST_CASE("data_aggregator writes the events of each epoch once") {
+    char path[] = "/tmp/stats_test_XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd != -1);
+    close(fd);
+
+    data_aggregator agg{0, 1024};
+    event_producer *keep = agg.add_producer();   // keeps the consumer running
+    event_producer *p = agg.add_producer();
+    CHECK(push_test_event(p, 0x0a000001, "fp-first-epoch"));
+    CHECK(push_test_event(p, 0x0a000001, "fp-first-epoch"));
+    CHECK(push_test_event(p, 0x0a000002, "fp-other-source"));
+    agg.remove_producer(p);   // processes p's remaining events
+    CHECK(agg.get_num_entries() == 2);
+
+    gzFile f = gzopen(path, "w");
+    REQUIRE(f != nullptr);
+    agg.gzprint(f, "", 0, "");
+    gzclose(f);
+    std::string first = read_gz_file(path);
+    CHECK(first.find("fp-first-epoch") != std::string::npos);
+    CHECK(first.find("fp-other-source") != std::string::npos);
+    CHECK(agg.get_num_entries() == 0);
+
+    // events from the new epoch are written by the next gzprint(),
+    // and those already written are not repeated
+    //
+    event_producer *q = agg.add_producer();
+    CHECK(push_test_event(q, 0x0a000003, "fp-second-epoch"));
+    agg.remove_producer(q);
+    f = gzopen(path, "w");
+    REQUIRE(f != nullptr);
+    agg.gzprint(f, "", 0, "");
+    gzclose(f);
+    std::string second = read_gz_file(path);
+    CHECK(second.find("fp-second-epoch") != std::string::npos);
+    CHECK(second.find("fp-first-epoch") == std::string::npos);
+    CHECK(agg.get_num_dropped_events() == 0);
+
+    agg.remove_producer(keep);
+    unlink(path);
+}
+
+TEST_CASE("data_aggregator writes sources in the order of their strings") {
+    char path[] = "/tmp/stats_test_XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd != -1);
+    close(fd);
+
+    data_aggregator agg{0, 1024, 4};
+    event_producer *keep = agg.add_producer();   // keeps the consumer running
+    std::vector<std::string> expected;
+    for (int round = 0; round < 2; round++) {
+        event_producer *p = agg.add_producer();
+        for (uint32_t i = 0; i < 40; i++) {
+            CHECK(push_test_event(p, 0x0a000000 + i, "fp"));
+        }
+        agg.remove_producer(p);
+
+        gzFile f = gzopen(path, "w");
+        REQUIRE(f != nullptr);
+        agg.gzprint(f, "", 0, "");
+        gzclose(f);
+        std::string stats = read_gz_file(path);
+
+        // the anonymized source addresses are the hex strings of 0
+        // through 39, which are written in lexicographic order
+        //
+        std::vector<std::string> sources;
+        const std::string tag{"{\"src_ip\":\""};
+        for (size_t pos = stats.find(tag); pos != std::string::npos; pos = stats.find(tag, pos + 1)) {
+            size_t start = pos + tag.length();
+            sources.push_back(stats.substr(start, stats.find('"', start) - start));
+        }
+        CHECK(sources.size() == 40);
+        CHECK(std::is_sorted(sources.begin(), sources.end()));
+        if (round == 0) {
+            expected = sources;
+        } else {
+            CHECK(sources == expected);   // the same dump threads are reused
+        }
+    }
+    CHECK(expected.size() > 17);
+    CHECK(expected[1] == "1");
+    CHECK(expected[2] == "10");
+
+    agg.remove_producer(keep);
+    unlink(path);
+}
+
+TEST_CASE("data_aggregator applies the stats limit to distinct events") {
+    const size_t limit = 4;
+    data_aggregator agg{limit, 1024};
+    event_producer *keep = agg.add_producer();   // keeps the consumer running
+
+    // the same events, observed by several producers, are counted
+    // once against the limit
+    //
+    for (int t = 0; t < 3; t++) {
+        event_producer *p = agg.add_producer();
+        for (size_t i = 0; i < limit; i++) {
+            CHECK(push_test_event(p, 0x0a000001, "fp-" + std::to_string(i)));
+        }
+        agg.remove_producer(p);
+    }
+    CHECK(agg.get_num_entries() == limit);
+
+    // once the limit is reached, new events are discarded, while
+    // those already in the table are still counted
+    //
+    event_producer *p = agg.add_producer();
+    CHECK(push_test_event(p, 0x0a000001, "fp-new"));
+    CHECK(push_test_event(p, 0x0a000001, "fp-0"));
+    agg.remove_producer(p);
+    CHECK(agg.get_num_entries() == limit);
+
+    char path[] = "/tmp/stats_test_XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd != -1);
+    close(fd);
+    gzFile out = gzopen(path, "w");
+    REQUIRE(out != nullptr);
+    agg.gzprint(out, "", 0, "");
+    gzclose(out);
+    std::string stats = read_gz_file(path);
+    CHECK(stats.find("fp-new") == std::string::npos);
+    CHECK(stats.find("\"count\":4") != std::string::npos);
+    size_t num_counts = 0;
+    for (size_t pos = stats.find("\"count\":3"); pos != std::string::npos; pos = stats.find("\"count\":3", pos + 1)) {
+        num_counts++;
+    }
+    CHECK(num_counts == limit - 1);
+    unlink(path);
+
+    agg.remove_producer(keep);
+}
+
+TEST_CASE("flow_table_tcp retains a SYN context until the context timeout") {
+    flow_table_tcp table{64};
+    const key k1{49152, 25, 0x0a000001, 0x0a000002, 6};
+    const key k2{49153, 25, 0x0a000001, 0x0a000002, 6};
+    const key k3{49154, 25, 0x0a000001, 0x0a000002, 6};
+    const unsigned int syn_time = 1000;
+    const uint32_t isn = 5000;
+
+    // a first data packet that arrives a few seconds after the SYN,
+    // well after flow_table_tcp::timeout but within the context
+    // timeout, is recognized
+    //
+    table.syn_packet(k1, syn_time, isn);
+    CHECK(table.is_first_data_packet(k1, syn_time + 3, isn + 1) == true);
+    CHECK(table.is_first_data_packet(k1, syn_time + 3, isn + 1) == false);
+
+    // a data packet with an unexpected sequence number leaves the
+    // context in place; once the context has expired, the next data
+    // packet is treated as the first one in the flow
+    //
+    table.syn_packet(k2, syn_time, isn);
+    CHECK(table.is_first_data_packet(k2, syn_time + tcp_context::timeout - 1, isn + 100) == false);
+    CHECK(table.is_first_data_packet(k2, syn_time + tcp_context::timeout, isn + 200) == true);
+
+    // check_flow() recognizes the initial segment just before the
+    // context expires
+    //
+    const unsigned int t = syn_time + 100;
+    table.syn_packet(k3, t, isn);
+    bool initial_seq = false, expired = false;
+    CHECK(table.check_flow(k3, t + tcp_context::timeout - 1, isn + 1, initial_seq, expired) == isn + 1);
+    CHECK(initial_seq == true);
+    CHECK(expired == false);
+
+    // the context is reaped one second after it expires, so that a
+    // later data packet is not recognized
+    //
+    table.syn_packet(k3, t + 100, isn);
+    CHECK(table.is_first_data_packet(k3, t + 100 + tcp_context::timeout + 2, isn + 100) == false);
+}
+
+TEST_CASE("flow_map expires, evicts, and recycles entries") {
+    flow_map<uint32_t, uint32_t> m{4, 2};
+    std::vector<uint32_t> expired;
+    auto on_expire = [&expired](const uint32_t &k, uint32_t &) { expired.push_back(k); };
+
+    m.advance(100);
+    auto a = m.emplace(1, 110, 10);
+    m.emplace(2, 105, 20);
+    m.emplace(3, 120, 30);
+    CHECK(m.size() == 3);
+    CHECK(m.find(1) == a);
+    CHECK(m.value(a) == 10);
+    CHECK(m.find(4) == m.nil);
+
+    // an entry is erased when the time reaches its deadline
+    //
+    m.advance(104, on_expire);
+    CHECK(expired.empty());
+    m.advance(105, on_expire);
+    CHECK(expired == std::vector<uint32_t>{2});
+    CHECK(m.find(2) == m.nil);
+    CHECK(m.expirations() == 1);
+
+    // time does not run backwards
+    //
+    m.advance(50, on_expire);
+    CHECK(m.find(1) == a);
+
+    // extending a deadline keeps the entry past its original one
+    //
+    m.set_deadline(a, 130);
+    m.advance(115, on_expire);
+    CHECK(m.find(1) == a);
+
+    // when the table is full, the entry with the earliest deadline
+    // is evicted to make room for a new one
+    //
+    m.emplace(4, 200, 40);
+    m.emplace(5, 201, 50);
+    CHECK(m.size() == 4);
+    m.emplace(6, 202, 60);
+    CHECK(m.size() == 4);
+    CHECK(m.find(3) == m.nil);
+    CHECK(m.evictions() == 1);
+
+    // a large jump in time expires everything that is due
+    //
+    expired.clear();
+    m.advance(100000, on_expire);
+    CHECK(m.size() == 0);
+    std::sort(expired.begin(), expired.end());
+    CHECK(expired == std::vector<uint32_t>{1, 4, 5, 6});
+
+    // the table grows past its initial size, and erased entries are
+    // reused
+    //
+    flow_map<uint32_t, uint32_t> big{1 << 12, 16};
+    big.advance(0);
+    for (uint32_t i = 0; i < 1000; i++) {
+        big.emplace(i, 10 + i % 7, i * 3);
+    }
+    bool all_found = true;
+    for (uint32_t i = 0; i < 1000; i++) {
+        auto h = big.find(i);
+        all_found &= (h != big.nil && big.value(h) == i * 3);
+    }
+    CHECK(all_found);
+    big.erase(big.find(500));
+    CHECK(big.find(500) == big.nil);
+    CHECK(big.size() == 999);
+    CHECK(big.insertions() == 1000);
+}
+
+TEST_CASE("reassembly_pool recycles buffers by size class") {
+    reassembly_pool pool;
+    CHECK(pool.get_bytes_in_use() == 0);
+
+    size_t size = 100;
+    uint8_t *a = pool.allocate(size);
+    REQUIRE(a != nullptr);
+    CHECK(size == 128);
+    CHECK(pool.get_bytes_in_use() == 128);
+    const size_t allocated = pool.get_bytes_allocated();
+    CHECK(allocated >= 128);
+
+    size_t size_b = 128;
+    uint8_t *b = pool.allocate(size_b);
+    REQUIRE(b != nullptr);
+    CHECK(b != a);
+    CHECK(pool.get_bytes_allocated() == allocated);  // carved out of the same slab
+
+    pool.release(a, size);
+    CHECK(pool.get_bytes_in_use() == 128);
+    size_t size_c = 65;
+    CHECK(pool.allocate(size_c) == a);
+    CHECK(size_c == 128);
+
+    size_t too_big = (size_t)1 << 26;
+    CHECK(pool.allocate(too_big) == nullptr);
+
+    pool.release(a, size_c);
+    pool.release(b, size_b);
+    CHECK(pool.get_bytes_in_use() == 0);
+    CHECK(pool.get_bytes_allocated() == allocated);
+}
+
+// test_destination(sn, port) returns a destination_context for the
+// IPv4 address 192.0.2.1 with server name sn and port port
+//
+static destination_context test_destination(const char *sn, uint16_t port) {
+    destination_context dc;
+    snprintf(dc.sn_str, sizeof(dc.sn_str), "%s", sn);
+    dc.ua_str[0] = '\0';
+    dc.dst_port = port;
+    dc.dst_addr = destination_address{0xc0000201};
+    return dc;
+}
+
+TEST_CASE("analysis_cache returns stored results for identical keys only") {
+    analysis_cache cache{8};
+    const std::string fp{"tls/(0303)(1301)"};
+    const uint64_t digest = std::hash<std::string>{}(fp);
+    const uint64_t classifier = 1;
+    destination_context dc = test_destination("example.com", 443);
+    uint64_t hash = 0;
+
+    CHECK(cache.find(classifier, fp, digest, dc, hash) == nullptr);
+    cache.insert(hash, fp, dc, analysis_result{fingerprint_status_labeled, "firefox", 0.9, nullptr, 0, attribute_result{}});
+    const analysis_result *r = cache.find(classifier, fp, digest, dc, hash);
+    REQUIRE(r != nullptr);
+    CHECK(std::string{r->max_proc} == "firefox");
+    CHECK(cache.hits() == 1);
+    CHECK(cache.misses() == 1);
+
+    // any difference in the key is a miss, even with the same hash
+    //
+    destination_context other_port = test_destination("example.com", 8443);
+    CHECK(cache.find(classifier, fp, digest, other_port, hash) == nullptr);
+    destination_context other_name = test_destination("example.org", 443);
+    CHECK(cache.find(classifier, fp, digest, other_name, hash) == nullptr);
+    CHECK(cache.find(classifier, "tls/(0303)(1302)", digest, dc, hash) == nullptr);
+
+    // the cache is emptied when it is used with another classifier
+    //
+    CHECK(cache.find(classifier + 1, fp, digest, dc, hash) == nullptr);
+    CHECK(cache.find(classifier + 1, fp, digest, dc, hash) == nullptr);
+
+    // when a set is full, the entry with the fewest hits is replaced,
+    // so a popular entry survives a run of one-off entries, but makes
+    // way once it is no longer used
+    //
+    analysis_cache small{4};   // a single set of four ways
+    uint64_t h = 0;
+    CHECK(small.find(classifier, fp, digest, dc, h) == nullptr);
+    small.insert(h, fp, dc, analysis_result{fingerprint_status_labeled, "popular", 0.9, nullptr, 0, attribute_result{}});
+    for (int i = 0; i < 8; i++) {
+        CHECK(small.find(classifier, fp, digest, dc, h) != nullptr);
+    }
+    auto insert_one_offs = [&](uint16_t first_port, uint16_t count) {
+        for (uint16_t port = first_port; port < first_port + count; port++) {
+            destination_context one_off = test_destination("example.net", port);
+            CHECK(small.find(classifier, fp, digest, one_off, h) == nullptr);
+            small.insert(h, fp, one_off, analysis_result{fingerprint_status_labeled, "one-off", 0.5, nullptr, 0, attribute_result{}});
+        }
+    };
+    insert_one_offs(1, 6);
+    CHECK(small.evictions() == 3);   // the first three filled the set
+    r = small.find(classifier, fp, digest, dc, h);
+    REQUIRE(r != nullptr);
+    CHECK(std::string{r->max_proc} == "popular");
+    insert_one_offs(100, 16);
+    CHECK(small.evictions() == 19);
+    CHECK(small.find(classifier, fp, digest, dc, h) == nullptr);
+    CHECK(cache.evictions() == 0);
+}
@@ -0,0 +1,135 @@
+// intercept_driver.cc
+//
+// benchmark for the latency that intercept.so adds to the calls that
+// it intercepts: several threads each send() messages on their own
+// UDP socket, which is connected to a socket on the loopback
+// interface that is never read from (so that sends never block), and
+// the time taken by each send() is measured.  Every other message is
+// an HTTP request, which intercept.so recognizes and reports; the
+// others are not recognized.  The mean, median, 99th percentile and
+// maximum latency are reported for each kind of message.  Run it
+// with and without LD_PRELOAD=intercept.so, and with the
+// intercept_buffer_size and intercept_output_format variables set to
+// different values, to compare the latency of each configuration;
+// with intercept_stats=1, the number of records dropped is reported
+// in the output directory.
+//
+// usage: intercept_driver [name [threads [calls]]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+// connect_to_sink() returns a UDP socket that is connected to the
+// socket sink, which is bound to a port of 127.0.0.1
+//
+static int connect_to_sink(int sink) {
+    sockaddr_in sa{};
+    socklen_t len = sizeof(sa);
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd == -1
+        || getsockname(sink, (sockaddr *)&sa, &len) == -1
+        || connect(fd, (sockaddr *)&sa, sizeof(sa)) == -1) {
+        perror("error: could not connect UDP socket");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+// send_messages() sends calls messages on fd, alternating between
+// request and other, and appends the nanoseconds taken by each send()
+// to request_ns or other_ns
+//
+static void send_messages(int fd,
+                          size_t calls,
+                          const std::string &request,
+                          const std::string &other,
+                          std::vector<double> &request_ns,
+                          std::vector<double> &other_ns) {
+    for (size_t i = 0; i < calls; i++) {
+        const std::string &msg = (i % 2 == 0) ? request : other;
+        auto start = std::chrono::steady_clock::now();
+        if (send(fd, msg.data(), msg.length(), 0) < 0) {
+            perror("error: send()");
+            exit(EXIT_FAILURE);
+        }
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        ((i % 2 == 0) ? request_ns : other_ns).push_back(ns);
+    }
+}
+
+static void report(const char *name, const char *kind, std::vector<double> &ns) {
+    std::sort(ns.begin(), ns.end());
+    double sum = 0.0;
+    for (double x : ns) {
+        sum += x;
+    }
+    auto percentile = [&ns](double p) { return ns[(size_t)(p / 100.0 * (ns.size() - 1))]; };
+    printf("%-32s %-12s calls: %8zu\tns mean: %9.1f\tp50: %9.1f\tp99: %9.1f\tmax: %11.1f\n",
+           name, kind, ns.size(), sum / ns.size(), percentile(50), percentile(99), ns.back());
+}
+
+int main(int argc, char *argv[]) {
+    const char *name = argc > 1 ? argv[1] : "intercept_driver";
+    size_t threads = argc > 2 ? strtoul(argv[2], nullptr, 10) : 4;
+    size_t calls = argc > 3 ? strtoul(argv[3], nullptr, 10) : 20000;
+    if (threads == 0 || calls < 2) {
+        fprintf(stderr, "usage: %s [name [threads [calls]]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int sink = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    sockaddr_in sa{};
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sink == -1 || bind(sink, (sockaddr *)&sa, sizeof(sa)) == -1) {
+        perror("error: could not bind UDP socket");
+        return EXIT_FAILURE;
+    }
+
+    const std::string request =
+        "GET /index.html HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "User-Agent: intercept_driver\r\n"
+        "Accept: */*\r\n"
+        "\r\n";
+    std::string other(512, '\0');
+    for (size_t i = 0; i < other.length(); i++) {
+        other[i] = (char)(i * 131 + 7);
+    }
+
+    std::vector<std::vector<double>> request_ns(threads), other_ns(threads);
+    std::vector<std::thread> senders;
+    for (size_t t = 0; t < threads; t++) {
+        request_ns[t].reserve(calls / 2 + 1);
+        other_ns[t].reserve(calls / 2 + 1);
+        int fd = connect_to_sink(sink);
+        senders.emplace_back([&, t, fd]() {
+            send_messages(fd, calls, request, other, request_ns[t], other_ns[t]);
+            close(fd);
+        });
+    }
+    for (auto &s : senders) {
+        s.join();
+    }
+    close(sink);
+
+    std::vector<double> all_request_ns, all_other_ns;
+    for (size_t t = 0; t < threads; t++) {
+        all_request_ns.insert(all_request_ns.end(), request_ns[t].begin(), request_ns[t].end());
+        all_other_ns.insert(all_other_ns.end(), other_ns[t].begin(), other_ns[t].end());
+    }
+    report(name, "recognized", all_request_ns);
+    report(name, "unrecognized", all_other_ns);
+
+    return 0;
+}
@@ -143,6 +143,89 @@ TEST_CASE_METHOD(LibmercTestFixture, "test quic with resources-mp")
     }
 }
 
+TEST_CASE_METHOD(LibmercTestFixture, "test quic client hello reassembly with resources-mp")
+{
+    // quic_split_client_hello.pcap holds two QUIC connections whose
+    // client hellos are each split across two Initial packets, the
+    // second with its CRYPTO frames out of order; only a complete
+    // client hello has the quic_transport_parameters extension (0039)
+    //
+    int complete = 0;
+    auto complete_check_callback = [&complete](const analysis_context *ac)
+    {
+        if (strstr(analysis_context_get_fingerprint_string(ac), "(0039)") != nullptr) {
+            complete++;
+        }
+    };
+
+    // no analysis context is returned for an incomplete client hello,
+    // so every quic context that is returned has the complete one
+    //
+    auto quic_check = [&](int expected_count, const struct libmerc_config &config)
+    {
+        initialize(config);
+
+        complete = 0;
+        CHECK(expected_count == counter(fingerprint_type_quic, complete_check_callback));
+        CHECK(expected_count == complete);
+
+        deinitialize();
+    };
+
+    // the JSON record for an Initial packet whose client hello is
+    // incomplete is marked as truncated, and has neither a fingerprint
+    // nor an analysis
+    //
+    auto partial_check = [&](int expected_partial, const struct libmerc_config &config)
+    {
+        initialize(config);
+
+        std::vector<char> json(65536);
+        int partial = 0;
+        while (read_next_data_packet() == 0) {
+            size_t len = mercury_packet_processor_write_json(m_mpp, json.data(), json.size(),
+                                                             (unsigned char *)m_data_packet.first,
+                                                             m_data_packet.second - m_data_packet.first,
+                                                             &m_time);
+            std::string_view record{json.data(), len};
+            if (record.find("\"truncated\":true") != std::string_view::npos) {
+                partial++;
+                CHECK(record.find("\"fingerprints\"") == std::string_view::npos);
+                CHECK(record.find("\"analysis\"") == std::string_view::npos);
+            }
+        }
+        CHECK(expected_partial == partial);
+
+        deinitialize();
+    };
+
+    struct quic_reassembly_test {
+        test_config config;
+        int complete;
+        int partial;
+    };
+    std::vector<quic_reassembly_test> test_set_up{
+        {test_config{
+             .m_lc{.do_analysis = true, .resources = resources_mp_path,
+                .packet_filter_cfg = (char *)"quic"},
+             .m_pc{"quic_split_client_hello.pcap"}},
+         2, 2},
+        {test_config{
+             .m_lc{.do_analysis = true, .resources = resources_mp_path,
+                .packet_filter_cfg = (char *)"select=quic;quic-reassembly-max-flows=0"},
+             .m_pc{"quic_split_client_hello.pcap"}},
+         0, 4}
+    };
+
+    for (auto &t : test_set_up)
+    {
+        set_pcap(t.config.m_pc.c_str());
+        quic_check(t.complete, t.config.m_lc);
+        set_pcap(t.config.m_pc.c_str());
+        partial_check(t.partial, t.config.m_lc);
+    }
+}
+
 TEST_CASE_METHOD(LibmercTestFixture, "test SGT encapsulated TLS - analysis with resources-mp")
 {
     
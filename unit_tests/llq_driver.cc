@@ -0,0 +1,131 @@
+// llq_driver.cc
+//
+// microbenchmark and stress test for the lockless output queues
+// (llq.h): each producer thread owns one queue and sends messages
+// with random lengths, most of them a few hundred bytes long, as JSON
+// records are, and a few of them up to LLQ_MSG_SIZE bytes, while a
+// single consumer thread drains all of the queues in round-robin
+// order, as the output thread does.  Each message holds its producer
+// and sequence number, and the consumer checks that every message
+// arrives intact and in order.  The producers block when their queue
+// is full, as with the --output-block option.
+//
+// usage: llq_driver [seconds_per_run [max_threads]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+#include "llq.h"
+
+struct message_header {
+    uint32_t producer;
+    uint32_t length;
+    uint64_t sequence;
+};
+
+// fill(buf, h) writes the header h and a pattern that depends on it
+// into buf, which must hold h.length bytes
+//
+static void fill(char *buf, const message_header &h) {
+    memcpy(buf, &h, sizeof(h));
+    for (size_t i = sizeof(h); i < h.length; i++) {
+        buf[i] = (char)(h.sequence + i);
+    }
+}
+
+static bool check(const llq_msg *m, uint32_t producer, uint64_t sequence) {
+    message_header h;
+    memcpy(&h, m->buf(), sizeof(h));
+    if (h.producer != producer || h.sequence != sequence || h.length != m->len) {
+        return false;
+    }
+    for (size_t i = sizeof(h); i < h.length; i++) {
+        if (m->buf()[i] != (char)(h.sequence + i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// run(num_threads, seconds) returns false if any message was lost,
+// corrupted, or out of order
+//
+static bool run(unsigned int num_threads, double seconds) {
+    std::vector<ll_queue> queues(num_threads);
+    std::atomic<bool> stop{false};
+    std::atomic<unsigned int> running{num_threads};
+    std::vector<std::thread> producers;
+    for (unsigned int p = 0; p < num_threads; p++) {
+        producers.emplace_back([&, p]() {
+            std::mt19937 rng{p};
+            std::lognormal_distribution<double> length_dist{6.0, 0.7};  // median about 400 bytes
+            uint64_t sequence = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                size_t length = (rng() % 1024 == 0) ? LLQ_MSG_SIZE : (size_t)length_dist(rng);
+                length = std::max(length, sizeof(message_header));
+                length = std::min(length, (size_t)LLQ_MSG_SIZE);
+                llq_msg *m = queues[p].init_msg(true, 0, sequence);
+                fill(m->buf(), { p, (uint32_t)length, sequence });
+                queues[p].send(m, length);
+                sequence++;
+            }
+            running--;
+        });
+    }
+
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    std::vector<uint64_t> next_sequence(num_threads);
+    bool ok = true;
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::duration<double>(seconds);
+    while (true) {
+        bool done = running.load() == 0;  // read before draining, so that no message is missed
+        bool empty = true;
+        for (unsigned int p = 0; p < num_threads; p++) {
+            for (const llq_msg *m = queues[p].front(); m != nullptr; m = queues[p].front()) {
+                ok &= check(m, p, next_sequence[p]++);
+                messages++;
+                bytes += m->len;
+                queues[p].pop();
+                empty = false;
+            }
+        }
+        if (done && empty) {
+            break;
+        }
+        if (std::chrono::steady_clock::now() > deadline) {
+            stop.store(true);
+        }
+    }
+    for (auto &t : producers) {
+        t.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("threads: %3u\tmessages: %10.0f/s\tbytes: %8.1f MB/s\tmean length: %6.1f\tqueue memory: %6.1f MB\t%s\n",
+           num_threads, messages / elapsed, bytes / elapsed / 1e6, (double)bytes / messages,
+           (double)num_threads * LLQ_BUFFER_SIZE / (1 << 20), ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+    unsigned int max_threads = argc > 2 ? strtoul(argv[2], nullptr, 10) : 64;
+
+    bool ok = true;
+    for (unsigned int n = 1; n <= max_threads; n *= 4) {
+        ok &= run(n, seconds);
+    }
+    if (!ok) {
+        fprintf(stderr, "error: messages were lost, corrupted, or reordered\n");
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
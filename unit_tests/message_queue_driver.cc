@@ -0,0 +1,166 @@
+// message_queue_driver.cc
+//
+// microbenchmark for the stats event message_queue (queue.h): each
+// producer thread owns one queue and pushes event_records as fast as
+// it can, while a single consumer thread drains all of the queues in
+// round-robin order, as data_aggregator does.  For comparison, the
+// same workload is run through a mutex-guarded ring of four-string
+// tuples with the same depth, which was the previous design.
+//
+// usage: message_queue_driver [seconds_per_run [queue_depth]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "queue.h"
+
+typedef std::tuple<std::string, std::string, std::string, std::string> event_msg;
+
+// class mutex_queue is a mutex-guarded ring of event_msgs, which is
+// used as the baseline for comparison
+//
+class mutex_queue {
+    std::mutex m;
+    size_t first = 0;
+    size_t last = 0;
+    std::vector<event_msg> msg_buf;
+    uint64_t drop_count = 0;
+
+    size_t next_index(size_t idx) const { return (idx + 1) % msg_buf.size(); }
+
+public:
+    explicit mutex_queue(size_t depth) : msg_buf(depth) { }
+
+    bool push(const event_msg &ev) {
+        std::unique_lock<std::mutex> m_lock(m);
+        if (next_index(last) == first) {
+            drop_count++;
+            return false;
+        }
+        msg_buf[last] = ev;
+        last = next_index(last);
+        return true;
+    }
+
+    bool pop(event_msg &entry) {
+        std::unique_lock<std::mutex> m_lock(m);
+        if (first == last) {
+            return false;
+        }
+        entry = msg_buf[first];
+        first = next_index(first);
+        return true;
+    }
+
+    uint64_t drops() {
+        std::unique_lock<std::mutex> m_lock(m);
+        return drop_count;
+    }
+};
+
+// representative event field values, similar in length to those
+// produced by event_string::write_event()
+//
+static const char src_ip[] = "192.168.1.100";
+static const char fp[] = "tls/(0303)(130113031302c02bc02fcca9cca8c02cc030c00ac009c013c014009c009d002f0035)"
+    "((0000)(0017)(ff01)(000a000c000a001d00170018001900100011)(000b00020100)(0023)"
+    "(0010000e000c02683208687474702f312e31)(00050005010000000000)(0033)(002b0009080304030303020301)"
+    "(000d0018001604030503060308040805080604010501060102030201)(002d00020101)(001c00024001))";
+static const char ua[] = "Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0";
+static const char dst[] = "(www.example.com)(93.184.216.34)(443)";
+
+struct result {
+    double seconds;
+    uint64_t consumed;
+    uint64_t dropped;
+};
+
+template <typename queue_type, typename msg_type, typename push_func>
+result run(size_t num_producers, size_t depth, double seconds, push_func push) {
+    std::vector<queue_type *> queues;
+    for (size_t i = 0; i < num_producers; i++) {
+        queues.push_back(new queue_type{depth});
+    }
+
+    std::atomic<bool> stop{false};
+    std::atomic<size_t> producers_done{0};
+    uint64_t consumed = 0;
+
+    std::thread consumer{[&]() {
+        msg_type event;
+        while (true) {
+            bool done = producers_done.load() == num_producers;
+            bool got_any = false;
+            for (auto &q : queues) {
+                while (q->pop(event)) {
+                    consumed++;
+                    got_any = true;
+                }
+            }
+            if (done && !got_any) {
+                break;
+            }
+        }
+    }};
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> producers;
+    for (size_t i = 0; i < num_producers; i++) {
+        producers.emplace_back([&, i]() {
+            while (stop.load(std::memory_order_relaxed) == false) {
+                push(*queues[i]);
+            }
+            producers_done++;
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop.store(true);
+    for (auto &t : producers) {
+        t.join();
+    }
+    consumer.join();
+    auto end = std::chrono::steady_clock::now();
+
+    uint64_t dropped = 0;
+    for (auto &q : queues) {
+        dropped += q->drops();
+        delete q;
+    }
+    return { std::chrono::duration<double>(end - start).count(), consumed, dropped };
+}
+
+void report(const char *name, size_t num_producers, const result &r) {
+    double total = r.consumed + r.dropped;
+    printf("%-14s producers: %2zu\tevents/sec: %12.0f\tdropped: %6.2f%%\n",
+           name,
+           num_producers,
+           r.consumed / r.seconds,
+           total ? 100.0 * r.dropped / total : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+    size_t depth = argc > 2 ? strtoul(argv[2], nullptr, 10) : EVENT_BUF_SIZE;
+
+    const event_msg ev{src_ip, fp, ua, dst};
+
+    for (size_t n = 1; n <= 64; n *= 2) {
+        const event_record rec{ { { 0x6401a8c0, 0, 0, 0 }, 4 }, 0, 17, 3, 1024 };
+        result spsc = run<message_queue, event_record>(n, depth, seconds, [&rec](message_queue &q) {
+            q.push(rec);
+        });
+        report("message_queue", n, spsc);
+
+        result locked = run<mutex_queue, event_msg>(n, depth, seconds, [&ev](mutex_queue &q) {
+            q.push(ev);
+        });
+        report("mutex_queue", n, locked);
+    }
+
+    return 0;
+}
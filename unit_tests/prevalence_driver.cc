@@ -0,0 +1,135 @@
+// prevalence_driver.cc
+//
+// contention benchmark for the adaptive fingerprint prevalence cache
+// (fingerprint_prevalence in analysis.h, and clock_set.h): each of
+// several threads looks up and updates fingerprint digests as
+// classifier::lookup_fingerprint() does for unknown fingerprints,
+// drawing most of them from a set of recurring fingerprints that is
+// shared by all threads, and the rest from a stream of fingerprints
+// that are each seen only once.  For each number of threads, the
+// total number of lookups per second and the fraction of lookups of
+// recurring fingerprints that found them to be prevalent are
+// reported, for fingerprint_prevalence and for a baseline that guards
+// a single std::list LRU with a std::shared_mutex, as
+// fingerprint_prevalence did before; the baseline skips any update
+// for which it cannot get the lock at once, so its hit rate falls as
+// contention rises.
+//
+// usage: prevalence_driver [max_threads [seconds [recurring_fingerprints]]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "analysis.h"
+
+// class locked_lru is the baseline
+//
+class locked_lru {
+    mutable std::shared_mutex mutex_;
+    std::list<uint64_t> list_;
+    std::unordered_map<uint64_t, std::list<uint64_t>::iterator> set_;
+    size_t max_cache_size_;
+
+public:
+
+    explicit locked_lru(size_t max_cache_size) : max_cache_size_{max_cache_size} { }
+
+    bool contains(std::string_view, uint64_t digest) const {
+        std::shared_lock lock(mutex_);
+        return set_.find(digest) != set_.end();
+    }
+
+    void update(std::string_view, uint64_t digest) {
+        std::unique_lock lock(mutex_, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            return;
+        }
+        auto x = set_.find(digest);
+        if (x == set_.end()) {
+            if (list_.size() == max_cache_size_) {
+                set_.erase(list_.back());
+                list_.pop_back();
+            }
+        } else {
+            list_.erase(x->second);
+        }
+        list_.push_front(digest);
+        set_[digest] = list_.begin();
+    }
+};
+
+struct thread_stats {
+    uint64_t lookups = 0;
+    uint64_t recurring = 0;
+    uint64_t recurring_hits = 0;
+};
+
+template <typename T>
+static void work(T &cache,
+                 unsigned int thread_index,
+                 uint64_t num_recurring,
+                 std::chrono::steady_clock::time_point deadline,
+                 thread_stats &stats) {
+    uint64_t x = 0x9e3779b97f4a7c15ULL * (thread_index + 1);
+    uint64_t one_off = (uint64_t)(thread_index + 1) << 48;
+    while (std::chrono::steady_clock::now() < deadline) {
+        for (int i = 0; i < 1024; i++) {
+            x ^= x << 13;  // xorshift64
+            x ^= x >> 7;
+            x ^= x << 17;
+            bool is_recurring = (x % 10) != 0;
+            uint64_t digest = feature_hash(is_recurring ? (x >> 8) % num_recurring : num_recurring + one_off++);
+            bool hit = cache.contains(std::string_view{}, digest);
+            cache.update(std::string_view{}, digest);
+            stats.lookups++;
+            stats.recurring += is_recurring;
+            stats.recurring_hits += is_recurring && hit;
+        }
+    }
+}
+
+template <typename T>
+static void run(const char *name, unsigned int num_threads, double seconds, uint64_t num_recurring) {
+    T cache{100000};
+    std::vector<thread_stats> stats(num_threads);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+    for (unsigned int i = 0; i < num_threads; i++) {
+        threads.emplace_back(work<T>, std::ref(cache), i, num_recurring, deadline, std::ref(stats[i]));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    thread_stats total;
+    for (const auto &s : stats) {
+        total.lookups += s.lookups;
+        total.recurring += s.recurring;
+        total.recurring_hits += s.recurring_hits;
+    }
+    printf("%-24s threads: %3u\tlookups/s: %12.0f\trecurring hit rate: %6.4f\n",
+           name, num_threads, total.lookups / elapsed, total.recurring ? (double)total.recurring_hits / total.recurring : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int max_threads = argc > 1 ? strtoul(argv[1], nullptr, 10) : 32;
+    double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+    uint64_t num_recurring = argc > 3 ? strtoull(argv[3], nullptr, 10) : 50000;
+    if (max_threads == 0 || num_recurring == 0) {
+        fprintf(stderr, "usage: %s [max_threads [seconds [recurring_fingerprints]]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (unsigned int n = 1; n <= max_threads; n *= 2) {
+        run<locked_lru>("shared_mutex lru", n, seconds, num_recurring);
+        run<fingerprint_prevalence>("fingerprint_prevalence", n, seconds, num_recurring);
+    }
+    return 0;
+}
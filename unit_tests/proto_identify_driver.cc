@@ -0,0 +1,222 @@
+// proto_identify_driver.cc
+//
+// benchmark for protocol identification (protocol_identifier in
+// proto_identify.h): the TCP and UDP payloads in one or more PCAP
+// files are identified repeatedly, first by an ordered scan over all
+// of the matchers that the traffic_selector uses when all protocols
+// are selected, and then by the traffic_selector itself, whose
+// protocol_identifiers are compiled into jump tables.  The mean number
+// of cycles (or nanoseconds, on platforms without a timestamp counter)
+// per payload is reported for each, and the message types must match
+// for every payload.
+//
+// usage: proto_identify_driver pcap_file [pcap_file ...] [-p passes]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+#include "proto_identify.h"
+
+struct payload {
+    bool tcp;
+    std::vector<uint8_t> data;
+};
+
+// get_payload(frame, length, p) sets p to the TCP or UDP payload of an
+// Ethernet frame that carries IPv4 or IPv6, and returns true, or
+// returns false if there is no such payload
+//
+static bool get_payload(const uint8_t *frame, size_t length, payload &p) {
+    const uint8_t *end = frame + length;
+    const uint8_t *x = frame + 12;
+    if (x + 2 > end) {
+        return false;
+    }
+    uint16_t ethertype = x[0] << 8 | x[1];
+    x += 2;
+    while (ethertype == 0x8100 && x + 4 <= end) {   // VLAN tags
+        ethertype = x[2] << 8 | x[3];
+        x += 4;
+    }
+    uint8_t protocol;
+    if (ethertype == 0x0800) {
+        if (x + 20 > end || (((x[6] << 8) | x[7]) & 0x1fff) != 0) {
+            return false;    // truncated, or a non-initial fragment
+        }
+        protocol = x[9];
+        x += (x[0] & 0x0f) * 4;
+    } else if (ethertype == 0x86dd) {
+        if (x + 40 > end) {
+            return false;
+        }
+        protocol = x[6];
+        x += 40;
+    } else {
+        return false;
+    }
+    if (protocol == 6 && x + 20 <= end) {
+        p.tcp = true;
+        x += (x[12] >> 4) * 4;
+    } else if (protocol == 17 && x + 8 <= end) {
+        p.tcp = false;
+        x += 8;
+    } else {
+        return false;
+    }
+    if (x >= end) {
+        return false;
+    }
+    p.data.assign(x, end);
+    return true;
+}
+
+// read_payloads(filename, payloads) appends the TCP and UDP payloads in
+// a PCAP file to payloads
+//
+static void read_payloads(const char *filename, std::vector<payload> &payloads) {
+    FILE *f = fopen(filename, "r");
+    if (f == nullptr) {
+        fprintf(stderr, "error: could not open pcap file %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    uint8_t file_header[24];
+    if (fread(file_header, sizeof(file_header), 1, f) != 1) {
+        fprintf(stderr, "error: could not read pcap file header\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t record_header[4];   // seconds, microseconds, captured length, length
+    std::vector<uint8_t> frame;
+    while (fread(record_header, sizeof(record_header), 1, f) == 1) {
+        frame.resize(record_header[2]);
+        if (fread(frame.data(), frame.size(), 1, f) != 1) {
+            break;
+        }
+        payload p;
+        if (get_payload(frame.data(), frame.size(), p)) {
+            payloads.push_back(std::move(p));
+        }
+    }
+    fclose(f);
+}
+
+// class ordered_scan holds the matchers that traffic_selector uses
+// when all protocols are selected, in the same order, in
+// protocol_identifiers that are not compiled
+//
+class ordered_scan {
+    protocol_identifier<4> tcp4;
+    protocol_identifier<8> tcp;
+    protocol_identifier<8> udp;
+    protocol_identifier<16> udp16;
+
+public:
+
+    ordered_scan() {
+        tcp.add_protocol(tls_client_hello::matcher, tcp_msg_type_tls_client_hello);
+        tcp.add_protocol(tls_server_hello::matcher, tcp_msg_type_tls_server_hello);
+        tcp.add_protocol(tls_server_certificate::matcher, tcp_msg_type_tls_certificate);
+        tcp.add_protocol(ssh_init_packet::matcher, tcp_msg_type_ssh);
+        tcp.add_protocol(ssh_kex_init::matcher, tcp_msg_type_ssh_kex);
+        tcp.add_protocol(smtp_client::matcher, tcp_msg_type_smtp_client);
+        tcp.add_protocol(smtp_server::matcher, tcp_msg_type_smtp_server);
+        tcp.add_protocol(http_response::matcher, tcp_msg_type_http_response);
+        tcp.add_protocol(http_request::matcher, tcp_msg_type_http_request);
+        udp.add_protocol(dhcp_discover::matcher, udp_msg_type_dhcp);
+        udp.add_protocol(dns_packet::matcher, udp_msg_type_dns);
+        tcp.add_protocol(dns_packet::tcp_matcher, tcp_msg_type_dns);
+        udp16.add_protocol(dtls_client_hello::dtls_matcher, udp_msg_type_dtls_client_hello);
+        udp16.add_protocol(dtls_server_hello::dtls_matcher, udp_msg_type_dtls_server_hello);
+        udp.add_protocol(wireguard_handshake_init::matcher, udp_msg_type_wireguard);
+        udp.add_protocol(ssdp::matcher, udp_msg_type_ssdp);
+        udp.add_protocol(stun::message::matcher, udp_msg_type_stun);
+        tcp.add_protocol(smb1_packet::matcher, tcp_msg_type_smb1);
+        tcp.add_protocol(smb2_packet::matcher, tcp_msg_type_smb2);
+        tcp4.add_protocol(iec60870_5_104::matcher, tcp_msg_type_iec);
+        tcp4.add_protocol(dnp3::matcher, tcp_msg_type_dnp3);
+        udp.add_protocol(bittorrent_dht::matcher, udp_msg_type_dht);
+        udp.add_protocol(bittorrent_lsd::matcher, udp_msg_type_lsd);
+        tcp.add_protocol(bittorrent_handshake::matcher, tcp_msg_type_bittorrent);
+        tcp.add_protocol(mysql_server_greet::matcher, tcp_msg_type_mysql_server);
+        udp.add_protocol(quic_initial_packet::matcher, udp_msg_type_quic);
+    }
+
+    size_t get_tcp_msg_type(datum &pkt) const {
+        size_t type = tcp.get_msg_type(pkt);
+        if (type == tcp_msg_type_unknown)  {
+            type = tcp4.get_msg_type(pkt);
+        }
+        return type;
+    }
+
+    size_t get_udp_msg_type(datum &pkt) const {
+        size_t type = udp.get_msg_type(pkt);
+        if (type == udp_msg_type_unknown)  {
+            type = udp16.get_msg_type(pkt);
+        }
+        return type;
+    }
+};
+
+static uint64_t ticks() {
+#ifdef __x86_64__
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+template <typename T>
+static std::vector<size_t> run(const char *name, const T &identifier, const std::vector<payload> &payloads, unsigned int passes) {
+    std::vector<size_t> types(payloads.size());
+    uint64_t start = ticks();
+    for (unsigned int i = 0; i < passes; i++) {
+        for (size_t j = 0; j < payloads.size(); j++) {
+            datum pkt{payloads[j].data.data(), payloads[j].data.data() + payloads[j].data.size()};
+            types[j] = payloads[j].tcp ? identifier.get_tcp_msg_type(pkt) : identifier.get_udp_msg_type(pkt);
+        }
+    }
+    uint64_t elapsed = ticks() - start;
+    size_t identified = 0;
+    for (size_t t : types) {
+        identified += t != 0;
+    }
+#ifdef __x86_64__
+    const char *unit = "cycles";
+#else
+    const char *unit = "ns";
+#endif
+    printf("%-16s %s per payload: %8.1f\tidentified: %zu of %zu\n",
+           name, unit, (double)elapsed / ((double)passes * payloads.size()), identified, payloads.size());
+    return types;
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<payload> payloads;
+    unsigned int passes = 100;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            passes = strtoul(argv[++i], nullptr, 10);
+        } else {
+            read_payloads(argv[i], payloads);
+        }
+    }
+    if (payloads.empty() || passes == 0) {
+        fprintf(stderr, "usage: %s pcap_file [pcap_file ...] [-p passes]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    ordered_scan scan;
+    traffic_selector selector{{{"all", true}}};
+    std::vector<size_t> expected = run("ordered scan", scan, payloads, passes);
+    std::vector<size_t> actual = run("jump table", selector, payloads, passes);
+    if (actual != expected) {
+        fprintf(stderr, "error: jump table results differ from ordered scan results\n");
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
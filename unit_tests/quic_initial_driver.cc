@@ -0,0 +1,150 @@
+// quic_initial_driver.cc
+//
+// benchmark for the decryption of QUIC Initial packets
+// (quic_crypto_engine in quic.h): the QUIC Initial packets in one or
+// more PCAP files are decrypted repeatedly by a single
+// quic_crypto_engine, first each once per pass, and then each twice in
+// a row, as if every Initial were retransmitted; this is then repeated
+// with the version of each packet replaced by one that is not known,
+// so that every salt must be tried, and all of them fail.  The mean
+// time per decryption, the number of packets that were decrypted, and
+// a checksum of the plaintexts are reported for each.
+//
+// usage: quic_initial_driver pcap_file [pcap_file ...] [-p passes]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include <zlib.h>
+#include "quic.h"
+
+// get_udp_payload(frame, length, payload) sets payload to the UDP
+// payload of an Ethernet frame that carries IPv4 or IPv6, and returns
+// true, or returns false if there is no such payload
+//
+static bool get_udp_payload(const uint8_t *frame, size_t length, std::vector<uint8_t> &payload) {
+    const uint8_t *end = frame + length;
+    const uint8_t *x = frame + 12;
+    if (x + 2 > end) {
+        return false;
+    }
+    uint16_t ethertype = x[0] << 8 | x[1];
+    x += 2;
+    while (ethertype == 0x8100 && x + 4 <= end) {   // VLAN tags
+        ethertype = x[2] << 8 | x[3];
+        x += 4;
+    }
+    uint8_t protocol;
+    if (ethertype == 0x0800) {
+        if (x + 20 > end) {
+            return false;
+        }
+        protocol = x[9];
+        x += (x[0] & 0x0f) * 4;
+    } else if (ethertype == 0x86dd) {
+        if (x + 40 > end) {
+            return false;
+        }
+        protocol = x[6];
+        x += 40;
+    } else {
+        return false;
+    }
+    if (protocol != 17 || x + 8 >= end) {
+        return false;
+    }
+    payload.assign(x + 8, end);
+    return true;
+}
+
+// read_quic_initials(filename, packets) appends the UDP payloads in a
+// PCAP file that parse as QUIC Initial packets to packets
+//
+static void read_quic_initials(const char *filename, std::vector<std::vector<uint8_t>> &packets) {
+    FILE *f = fopen(filename, "r");
+    if (f == nullptr) {
+        fprintf(stderr, "error: could not open pcap file %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    uint8_t file_header[24];
+    if (fread(file_header, sizeof(file_header), 1, f) != 1) {
+        fprintf(stderr, "error: could not read pcap file header\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t record_header[4];   // seconds, microseconds, captured length, length
+    std::vector<uint8_t> frame;
+    while (fread(record_header, sizeof(record_header), 1, f) == 1) {
+        frame.resize(record_header[2]);
+        if (fread(frame.data(), frame.size(), 1, f) != 1) {
+            break;
+        }
+        std::vector<uint8_t> payload;
+        if (get_udp_payload(frame.data(), frame.size(), payload)) {
+            datum d{payload.data(), payload.data() + payload.size()};
+            quic_initial_packet initial{d};
+            if (initial.is_not_empty()) {
+                packets.push_back(std::move(payload));
+            }
+        }
+    }
+    fclose(f);
+}
+
+static void run(const char *name,
+                const std::vector<std::vector<uint8_t>> &packets,
+                unsigned int passes,
+                unsigned int repeats) {
+    quic_crypto_engine engine;
+    uLong checksum = crc32(0, nullptr, 0);
+    size_t decrypted = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < passes; i++) {
+        for (const auto &p : packets) {
+            for (unsigned int j = 0; j < repeats; j++) {
+                datum d{p.data(), p.data() + p.size()};
+                quic_initial_packet initial{d};
+                datum plaintext = engine.decrypt(initial);
+                if (plaintext.is_not_empty()) {
+                    decrypted++;
+                    checksum = crc32(checksum, plaintext.data, plaintext.length());
+                }
+            }
+        }
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    printf("%-32s ns per decryption: %9.1f\tdecrypted: %zu of %zu\tchecksum: %08lx\n",
+           name, ns / ((double)passes * repeats * packets.size()), decrypted / (passes * repeats), packets.size(), checksum);
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<std::vector<uint8_t>> packets;
+    unsigned int passes = 100;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            passes = strtoul(argv[++i], nullptr, 10);
+        } else {
+            read_quic_initials(argv[i], packets);
+        }
+    }
+    if (packets.empty() || passes == 0) {
+        fprintf(stderr, "usage: %s pcap_file [pcap_file ...] [-p passes]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    run("known version", packets, passes, 1);
+    run("known version, retransmitted", packets, passes, 2);
+
+    // replace the version of each packet with one that is reserved for
+    // version negotiation (RFC 9000, Section 15), which no salt is
+    // associated with
+    //
+    for (auto &p : packets) {
+        static constexpr uint8_t unknown_version[4] = { 0x1a, 0x2a, 0x3a, 0x4a };
+        memcpy(p.data() + 1, unknown_version, sizeof(unknown_version));
+    }
+    run("unknown version", packets, passes, 1);
+    run("unknown version, retransmitted", packets, passes, 2);
+
+    return 0;
+}
@@ -0,0 +1,176 @@
+// reload_driver.cc
+//
+// benchmark and stress test for reloading the resource file while
+// packets are being processed (mercury_reload_resources() in
+// libmerc.h): several packet processing threads repeatedly process
+// the packets in a PCAP file with analysis enabled, and record the
+// time taken for each packet, first for a while without reloads, and
+// then while the main thread reloads the resource file as fast as it
+// can.  The latency percentiles of the two phases are reported, so
+// that any stall caused by a reload shows up in the tail, along with
+// the time taken by each reload, and the driver checks that every
+// replaced classifier is freed once the threads have moved on.
+//
+// usage: reload_driver pcap_file resource_file [seconds_per_phase [threads]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "libmerc.h"
+#include "pkt_proc.h"
+
+struct packet {
+    struct timespec ts;
+    std::vector<uint8_t> data;
+};
+
+// read_pcap(filename) returns the packets in a PCAP file with
+// microsecond timestamps
+//
+static std::vector<packet> read_pcap(const char *filename) {
+    std::vector<packet> packets;
+    FILE *f = fopen(filename, "r");
+    if (f == nullptr) {
+        fprintf(stderr, "error: could not open pcap file %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    uint8_t file_header[24];
+    if (fread(file_header, sizeof(file_header), 1, f) != 1) {
+        fprintf(stderr, "error: could not read pcap file header\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t record_header[4];   // seconds, microseconds, captured length, length
+    while (fread(record_header, sizeof(record_header), 1, f) == 1) {
+        packet p;
+        p.ts.tv_sec = record_header[0];
+        p.ts.tv_nsec = record_header[1] * 1000;
+        p.data.resize(record_header[2]);
+        if (fread(p.data.data(), p.data.size(), 1, f) != 1) {
+            break;
+        }
+        packets.push_back(std::move(p));
+    }
+    fclose(f);
+    return packets;
+}
+
+struct phase_stats {
+    std::vector<uint32_t> latency_ns;
+    uint64_t bytes_out = 0;
+};
+
+static void process(mercury_context mc,
+                    const std::vector<packet> &packets,
+                    std::atomic<int> &phase,
+                    phase_stats *stats) {
+    mercury_packet_processor p = mercury_packet_processor_construct(mc);
+    if (p == nullptr) {
+        fprintf(stderr, "error: could not construct packet processor\n");
+        exit(EXIT_FAILURE);
+    }
+    char buf[65536];
+    int current;
+    while ((current = phase.load(std::memory_order_relaxed)) < 2) {
+        for (const auto &pkt : packets) {
+            struct timespec ts = pkt.ts;
+            auto start = std::chrono::steady_clock::now();
+            size_t n = mercury_packet_processor_write_json(p, buf, sizeof(buf), (uint8_t *)pkt.data.data(), pkt.data.size(), &ts);
+            auto end = std::chrono::steady_clock::now();
+            stats[current].latency_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+            stats[current].bytes_out += n;
+        }
+    }
+    mercury_packet_processor_destruct(p);
+}
+
+static void report(const char *name, std::vector<uint32_t> &latency) {
+    if (latency.empty()) {
+        return;
+    }
+    std::sort(latency.begin(), latency.end());
+    auto percentile = [&latency](double x) { return latency[(size_t)(x * (latency.size() - 1))]; };
+    printf("%-16s packets: %10zu\tp50: %6u ns\tp99: %6u ns\tp99.9: %7u ns\tp99.99: %8u ns\tmax: %9u ns\n",
+           name, latency.size(), percentile(0.5), percentile(0.99), percentile(0.999), percentile(0.9999), latency.back());
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s pcap_file resource_file [seconds_per_phase [threads]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    double seconds = argc > 3 ? atof(argv[3]) : 5.0;
+    unsigned int num_threads = argc > 4 ? strtoul(argv[4], nullptr, 10) : 4;
+
+    std::vector<packet> packets = read_pcap(argv[1]);
+    if (packets.empty()) {
+        fprintf(stderr, "error: no packets in %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    struct libmerc_config config{};
+    config.do_analysis = true;
+    config.resources = argv[2];
+    config.packet_filter_cfg = (char *)"all";
+    mercury_context mc = mercury_init(&config, 0);
+    if (mc == nullptr) {
+        fprintf(stderr, "error: could not initialize mercury\n");
+        return EXIT_FAILURE;
+    }
+
+    std::atomic<int> phase{0};
+    std::vector<std::vector<phase_stats>> stats(num_threads, std::vector<phase_stats>(2));
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < num_threads; i++) {
+        threads.emplace_back(process, mc, std::cref(packets), std::ref(phase), stats[i].data());
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    phase.store(1);
+
+    unsigned int reloads = 0;
+    double reload_ms = 0.0;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+    while (std::chrono::steady_clock::now() < deadline) {
+        auto start = std::chrono::steady_clock::now();
+        if (!mercury_reload_resources(mc, nullptr)) {
+            fprintf(stderr, "error: could not reload resources\n");
+            return EXIT_FAILURE;
+        }
+        reload_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        reloads++;
+    }
+    phase.store(2);
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    std::vector<uint32_t> latency[2];
+    for (auto &s : stats) {
+        for (int i = 0; i < 2; i++) {
+            latency[i].insert(latency[i].end(), s[i].latency_ns.begin(), s[i].latency_ns.end());
+        }
+    }
+    printf("threads: %u\treloads: %u\tmean reload time: %.1f ms\n", num_threads, reloads, reloads ? reload_ms / reloads : 0.0);
+    report("without reloads", latency[0]);
+    report("with reloads", latency[1]);
+
+    // the packet processors have been destroyed, so every replaced
+    // classifier should be freed by the next reload
+    //
+    if (!mercury_reload_resources(mc, nullptr)) {
+        fprintf(stderr, "error: could not reload resources\n");
+        return EXIT_FAILURE;
+    }
+    size_t retired = mc->c.num_retired();
+    mercury_finalize(mc);
+    if (retired != 0) {
+        fprintf(stderr, "error: %zu replaced classifiers were not freed\n", retired);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
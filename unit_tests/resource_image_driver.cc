@@ -0,0 +1,125 @@
+// resource_image_driver.cc
+//
+// benchmark for classifier startup from a resource archive and from a
+// resource image (resource_image.h): the classifier is loaded
+// repeatedly, each time in a new child process, as it would be in a
+// newly started mercury, and the time taken by
+// analysis_init_from_archive(), the peak resident set size of the
+// process, and the part of its memory that is private (that is, not
+// shared with other processes that load the same file) are reported
+// for each file.  The image should have been compiled from the
+// archive with resource_compiler; to check that the two classifiers
+// give the same results, run analysis_driver with each of them, and
+// compare the checksums.
+//
+// usage: resource_image_driver resource_archive resource_image [runs]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <chrono>
+#include "analysis.h"
+
+struct load_stats {
+    double init_ms;
+    size_t peak_rss_kb;
+    size_t private_kb;
+};
+
+// read_kb(file, field) returns the value of the field, in kilobytes,
+// from a file in /proc that has lines like "VmHWM:  1234 kB"
+//
+static size_t read_kb(const char *file, const char *field) {
+    size_t total = 0;
+    FILE *f = fopen(file, "r");
+    if (f == nullptr) {
+        return 0;
+    }
+    char line[256];
+    size_t field_length = strlen(field);
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, field, field_length) == 0 && line[field_length] == ':') {
+            total += strtoul(line + field_length + 1, nullptr, 10);
+        }
+    }
+    fclose(f);
+    return total;
+}
+
+// load(resource_file) loads a classifier from resource_file in a
+// child process, and returns its statistics
+//
+static load_stats load(const char *resource_file) {
+    int fd[2];
+    if (pipe(fd) != 0) {
+        perror("error: could not create pipe");
+        exit(EXIT_FAILURE);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("error: could not fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        close(fd[0]);
+        auto start = std::chrono::steady_clock::now();
+        classifier *c = analysis_init_from_archive(0, resource_file, nullptr, enc_key_type_none, 0.0, 0.0, false);
+        auto end = std::chrono::steady_clock::now();
+        if (c == nullptr) {
+            _exit(EXIT_FAILURE);
+        }
+        load_stats s;
+        s.init_ms = std::chrono::duration<double, std::milli>(end - start).count();
+        s.peak_rss_kb = read_kb("/proc/self/status", "VmHWM");
+        s.private_kb = read_kb("/proc/self/smaps_rollup", "Private_Clean") + read_kb("/proc/self/smaps_rollup", "Private_Dirty");
+        if (write(fd[1], &s, sizeof(s)) != sizeof(s)) {
+            _exit(EXIT_FAILURE);
+        }
+        _exit(0);
+    }
+    close(fd[1]);
+    load_stats s;
+    ssize_t n = read(fd[0], &s, sizeof(s));
+    close(fd[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (n != sizeof(s) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "error: could not load classifier from %s\n", resource_file);
+        exit(EXIT_FAILURE);
+    }
+    return s;
+}
+
+static void run(const char *resource_file, unsigned int runs) {
+    load_stats total{0, 0, 0};
+    for (unsigned int i = 0; i < runs; i++) {
+        load_stats s = load(resource_file);
+        total.init_ms += s.init_ms;
+        total.peak_rss_kb += s.peak_rss_kb;
+        total.private_kb += s.private_kb;
+    }
+    printf("init: %8.2f ms\tpeak rss: %8.1f MB\tprivate: %8.1f MB\t%s\n",
+           total.init_ms / runs, total.peak_rss_kb / 1024.0 / runs, total.private_kb / 1024.0 / runs, resource_file);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s resource_archive resource_image [runs]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    unsigned int runs = argc > 3 ? strtoul(argv[3], nullptr, 10) : 5;
+    if (runs == 0) {
+        runs = 1;
+    }
+    if (!resource_image_header::is_image(argv[2])) {
+        fprintf(stderr, "error: %s is not a resource image\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    run(argv[1], runs);
+    run(argv[2], runs);
+
+    return 0;
+}
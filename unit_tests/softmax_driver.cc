@@ -0,0 +1,232 @@
+// softmax_driver.cc
+//
+// microbenchmark for the exponentiation and reduction of classifier
+// scores (softmax.h) in fingerprint_data::perform_analysis(), compared
+// with the scalar expf() loop over std::bitset attributes that it
+// replaced.  The number of processes and the malware flags of each
+// fingerprint are taken from the fingerprint database in a resource
+// archive, and the scores and attribute tags are random; each
+// implementation that the CPU supports is timed over all of the
+// fingerprints, and then over synthetic fingerprints with many
+// processes, such as the most popular fingerprints in a large
+// resource file; the "default" implementation is the one chosen by
+// softmax_reduce() for each fingerprint.  The driver exits with an error if the
+// implementations do not return identical sums.
+//
+// usage: softmax_driver resource_archive [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <array>
+#include <bitset>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include "archive.h"
+#include "softmax.h"
+#include "rapidjson/document.h"
+
+constexpr size_t num_tags = 8;
+constexpr size_t malware_column = num_tags;
+
+struct fingerprint {
+    std::vector<long double> score;
+    std::vector<bool> malware;
+    std::vector<std::bitset<num_tags>> attr;
+
+    // column-major representation, as in fingerprint_data
+    //
+    size_t words_per_column;
+    std::vector<uint64_t> columns;
+    std::vector<uint8_t> active;
+
+    fingerprint(size_t n, std::vector<bool> mal, std::mt19937 &rng) :
+        score(n), malware{mal}, attr(n), words_per_column{(n + 63) / 64}, columns((num_tags + 1) * words_per_column) {
+
+        std::uniform_real_distribution<double> score_dist{-40.0, 0.0};
+        for (size_t i = 0; i < n; i++) {
+            score[i] = score_dist(rng);
+            for (size_t j = 0; j < num_tags; j++) {
+                attr[i][j] = (rng() % 16 == 0);
+                if (attr[i][j]) {
+                    columns[j * words_per_column + i / 64] |= (uint64_t)1 << (i % 64);
+                }
+            }
+            if (malware[i]) {
+                columns[malware_column * words_per_column + i / 64] |= (uint64_t)1 << (i % 64);
+            }
+        }
+        for (size_t j = 0; j <= num_tags; j++) {
+            for (size_t w = 0; w < words_per_column; w++) {
+                if (columns[j * words_per_column + w]) {
+                    active.push_back(j);
+                    break;
+                }
+            }
+        }
+    }
+
+    long double max_score() const {
+        long double m = score[0];
+        for (const auto &s : score) {
+            m = s > m ? s : m;
+        }
+        return m;
+    }
+};
+
+// previous implementation
+//
+static long double reduce_expf(const fingerprint &fp) {
+    long double max = fp.max_score();
+    long double sum = 0.0;
+    long double malware_prob = 0.0;
+    std::array<long double, num_tags> attr_prob;
+    attr_prob.fill(0.0);
+    for (size_t i = 0; i < fp.score.size(); i++) {
+        long double e = expf((float)(fp.score[i] - max));
+        sum += e;
+        if (fp.malware[i]) {
+            malware_prob += e;
+        }
+        for (size_t j = 0; j < num_tags; j++) {
+            if (fp.attr[i][j]) {
+                attr_prob[j] += e;
+            }
+        }
+    }
+    return sum + malware_prob + attr_prob[0];
+}
+
+// reduce_softmax(isa, fp, x) uses the implementation for isa, or the
+// one chosen by softmax_reduce() if isa is nullptr
+//
+static long double reduce_softmax(const softmax_isa *isa, const fingerprint &fp, std::vector<float> &x) {
+    long double max = fp.max_score();
+    const size_t n = fp.score.size();
+    x.resize(softmax_padded_length(n));
+    for (size_t i = 0; i < n; i++) {
+        x[i] = (float)(fp.score[i] - max);
+    }
+    std::fill(x.begin() + n, x.end(), softmax_min_arg);
+    double sum;
+    double column_sum[softmax_max_columns];
+    if (isa == nullptr) {
+        softmax_reduce(x.data(), n, fp.columns.data(), fp.words_per_column, fp.active.data(), fp.active.size(), sum, column_sum);
+    } else {
+        softmax_reduce(*isa, x.data(), n, fp.columns.data(), fp.words_per_column, fp.active.data(), fp.active.size(), sum, column_sum);
+    }
+    return (long double)sum + column_sum[malware_column] + column_sum[0];
+}
+
+template <typename F>
+static double time_ns(const std::vector<fingerprint> &fps, size_t iterations, long double &checksum, F f) {
+    checksum = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+        for (const auto &fp : fps) {
+            checksum += f(fp);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / (iterations * fps.size());
+}
+
+// run(name, fps, iterations) times each implementation, and returns
+// false if the softmax implementations disagree
+//
+static bool run(const char *name, const std::vector<fingerprint> &fps, size_t iterations) {
+    size_t total_processes = 0;
+    for (const auto &fp : fps) {
+        total_processes += fp.score.size();
+    }
+    printf("%s: fingerprints: %zu\tmean processes: %.1f\n", name, fps.size(), (double)total_processes / fps.size());
+
+    long double checksum;
+    double ns = time_ns(fps, iterations, checksum, reduce_expf);
+    printf("\t%-8s %10.1f ns\tchecksum: %.12Lg\n", "expf", ns, checksum);
+
+    std::vector<float> x;
+    bool first = true;
+    long double reference = 0.0;
+    bool match = true;
+    for (softmax_isa isa : { softmax_isa::scalar, softmax_isa::avx2, softmax_isa::avx512 }) {
+        if (!softmax_isa_supported(isa)) {
+            printf("\t%-8s not supported\n", softmax_isa_name(isa));
+            continue;
+        }
+        ns = time_ns(fps, iterations, checksum, [&](const fingerprint &fp) { return reduce_softmax(&isa, fp, x); });
+        printf("\t%-8s %10.1f ns\tchecksum: %.12Lg\n", softmax_isa_name(isa), ns, checksum);
+        if (first) {
+            reference = checksum;
+            first = false;
+        } else if (checksum != reference) {
+            match = false;
+        }
+    }
+    ns = time_ns(fps, iterations, checksum, [&](const fingerprint &fp) { return reduce_softmax(nullptr, fp, x); });
+    printf("\t%-8s %10.1f ns\tchecksum: %.12Lg\n", "default", ns, checksum);
+    return match && checksum == reference;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s resource_archive [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    size_t iterations = argc > 2 ? strtoul(argv[2], nullptr, 10) : 1000;
+    std::mt19937 rng{1};
+
+    // read the number of processes and malware flags of each
+    // fingerprint in the resource archive
+    //
+    std::vector<fingerprint> fps;
+    encrypted_compressed_archive archive{argv[1]};
+    for (const archive_node *entry = archive.get_next_entry(); entry != nullptr; entry = archive.get_next_entry()) {
+        if (!entry->is_regular_file() || std::string{entry->get_name()} != "fingerprint_db.json") {
+            continue;
+        }
+        std::string line;
+        while (archive.getline(line)) {
+            rapidjson::Document d;
+            d.Parse(line.c_str());
+            if (d.HasParseError() || !d.HasMember("process_info") || !d["process_info"].IsArray()) {
+                continue;
+            }
+            std::vector<bool> malware;
+            for (const auto &p : d["process_info"].GetArray()) {
+                malware.push_back(p.HasMember("malware") && p["malware"].IsBool() && p["malware"].GetBool());
+            }
+            if (!malware.empty()) {
+                fps.emplace_back(malware.size(), malware, rng);
+            }
+        }
+        break;
+    }
+    if (fps.empty()) {
+        fprintf(stderr, "error: no fingerprints in %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    bool match = run("resource file", fps, iterations);
+
+    for (size_t n = 64; n <= 16384; n *= 16) {
+        std::vector<fingerprint> large;
+        for (size_t i = 0; i < 16; i++) {
+            std::vector<bool> malware(n);
+            for (size_t j = 0; j < n; j++) {
+                malware[j] = (rng() % 8 == 0);
+            }
+            large.emplace_back(n, malware, rng);
+        }
+        std::string name = std::to_string(n) + " processes";
+        match &= run(name.c_str(), large, std::max(iterations * 16 / n, (size_t)1));
+    }
+
+    if (!match) {
+        fprintf(stderr, "error: softmax implementations returned different results\n");
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
@@ -0,0 +1,221 @@
+// tls_scan_driver.cc
+//
+// benchmark for the event-driven TLS scanner (tls_scan_engine in
+// tls_scan_engine.hpp): a local TLS server stand-in, which uses a
+// freshly generated self-signed certificate and answers each HTTP
+// request after a fixed delay, is scanned repeatedly over the
+// loopback interface, with increasing numbers of scans in flight.
+// The scan rate and the median and 99th percentile latency are
+// reported for each.  Then a server that accepts TCP connections but
+// never completes a TLS handshake is scanned, to check that every
+// scan of it ends with a handshake timeout, and that those timeouts
+// overlap.
+//
+// usage: tls_scan_driver [scans [delay_ms]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <openssl/ec.h>
+#include <openssl/x509.h>
+#include "http.h"
+#include "json_object.h"
+#include "dns.h"
+#include "base64.h"
+#include "tls_scan_engine.hpp"
+
+// listen_on_loopback(port) returns a TCP socket that is listening on
+// an ephemeral port of 127.0.0.1, and sets port to that port
+//
+static int listen_on_loopback(uint16_t &port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in sa{};
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sa);
+    if (fd == -1
+        || bind(fd, (sockaddr *)&sa, sizeof(sa)) == -1
+        || listen(fd, 4096) == -1
+        || getsockname(fd, (sockaddr *)&sa, &len) == -1) {
+        perror("error: could not create listening socket");
+        exit(EXIT_FAILURE);
+    }
+    port = ntohs(sa.sin_port);
+    return fd;
+}
+
+// class local_tls_server is the TLS server stand-in; each connection
+// is served by its own thread
+//
+class local_tls_server {
+    SSL_CTX *ctx = nullptr;
+    int listen_fd = -1;
+    uint16_t port = 0;
+    unsigned int delay_ms;
+    std::atomic<unsigned int> active{0};
+    std::thread acceptor;
+
+public:
+
+    local_tls_server(unsigned int delay) : delay_ms{delay} {
+        EVP_PKEY *key = nullptr;
+        EVP_PKEY_CTX *key_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+        if (key_ctx == nullptr
+            || EVP_PKEY_keygen_init(key_ctx) != 1
+            || EVP_PKEY_CTX_set_ec_paramgen_curve_nid(key_ctx, NID_X9_62_prime256v1) != 1
+            || EVP_PKEY_keygen(key_ctx, &key) != 1) {
+            fprintf(stderr, "error: could not generate server key\n");
+            exit(EXIT_FAILURE);
+        }
+        EVP_PKEY_CTX_free(key_ctx);
+
+        X509 *cert = X509_new();
+        X509_set_version(cert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 60 * 60);
+        X509_NAME *name = X509_get_subject_name(cert);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+        X509_set_issuer_name(cert, name);
+        X509_set_pubkey(cert, key);
+        ctx = SSL_CTX_new(TLS_server_method());
+        if (X509_sign(cert, key, EVP_sha256()) == 0
+            || ctx == nullptr
+            || SSL_CTX_use_certificate(ctx, cert) != 1
+            || SSL_CTX_use_PrivateKey(ctx, key) != 1) {
+            fprintf(stderr, "error: could not create server certificate\n");
+            exit(EXIT_FAILURE);
+        }
+        X509_free(cert);
+        EVP_PKEY_free(key);
+
+        listen_fd = listen_on_loopback(port);
+        acceptor = std::thread{[this]() { accept_connections(); }};
+    }
+
+    ~local_tls_server() {
+        shutdown(listen_fd, SHUT_RDWR);   // wakes up accept()
+        acceptor.join();
+        close(listen_fd);
+        while (active.load() != 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        SSL_CTX_free(ctx);
+    }
+
+    uint16_t get_port() const { return port; }
+
+private:
+
+    void accept_connections() {
+        while (true) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd == -1) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                return;
+            }
+            active++;
+            std::thread{[this, fd]() { serve(fd); active--; }}.detach();
+        }
+    }
+
+    void serve(int fd) {
+        SSL *ssl = SSL_new(ctx);
+        SSL_set_fd(ssl, fd);
+        if (SSL_accept(ssl) == 1) {
+            std::string request;
+            char buf[4096];
+            int len;
+            while (request.find("\r\n\r\n") == std::string::npos && (len = SSL_read(ssl, buf, sizeof(buf))) > 0) {
+                request.append(buf, len);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+            static const char response[] =
+                "HTTP/1.1 200 OK\r\n"
+                "Content-Type: text/html\r\n"
+                "Content-Length: 41\r\n"
+                "Connection: close\r\n"
+                "\r\n"
+                "<html><body>tls_scan_driver</body></html>";
+            SSL_write(ssl, response, sizeof(response) - 1);
+            SSL_shutdown(ssl);
+        }
+        SSL_free(ssl);
+        close(fd);
+    }
+};
+
+// run(name, port, scans, cfg) runs scans scans of 127.0.0.1:port,
+// reports the scan rate and latency, and returns the statistics
+//
+static scan_statistics run(const char *name, uint16_t port, size_t scans, const tls_scan_engine::config &cfg) {
+    std::string request = tls_connection::http_request_string("/", "localhost", "localhost", "tls_scan_driver", false);
+    size_t started = 0;
+    auto next_target = [&](scan_target &t) {
+        if (started == scans) {
+            return false;
+        }
+        started++;
+        t.hostname = "127.0.0.1";
+        t.port = port;
+        t.request = request;
+        return true;
+    };
+    tls_scan_engine engine{cfg};
+    engine.run(next_target, [](const scan_result &) { });
+    scan_statistics &stats = engine.get_statistics();
+    printf("%-20s in flight: %4zu\tscans/s: %8.1f\tp50 ms: %8.3f\tp99 ms: %8.3f\tsucceeded: %zu of %zu\tseconds: %.3f\n",
+           name, cfg.max_in_flight, stats.scans_per_second(), stats.latency_percentile(50), stats.latency_percentile(99),
+           stats.scans_with_status(scan_status::ok), stats.scans(), stats.seconds());
+    return stats;
+}
+
+int main(int argc, char *argv[]) {
+    size_t scans = argc > 1 ? strtoul(argv[1], nullptr, 10) : 500;
+    unsigned int delay_ms = argc > 2 ? strtoul(argv[2], nullptr, 10) : 10;
+    if (scans == 0) {
+        fprintf(stderr, "usage: %s [scans [delay_ms]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    {
+        local_tls_server server{delay_ms};
+        for (size_t in_flight : { 1, 16, 64, 256 }) {
+            tls_scan_engine::config cfg;
+            cfg.max_in_flight = in_flight;
+            scan_statistics stats = run("local server", server.get_port(), scans, cfg);
+            if (stats.scans_with_status(scan_status::ok) != scans) {
+                fprintf(stderr, "error: not every scan of the local server succeeded\n");
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    // a server whose listen queue is never drained completes TCP
+    // handshakes, but never TLS handshakes
+    //
+    uint16_t stalled_port;
+    int stalled_fd = listen_on_loopback(stalled_port);
+    tls_scan_engine::config cfg;
+    cfg.max_in_flight = 64;
+    cfg.handshake_timeout_ms = 200;
+    size_t stalled_scans = 256;
+    scan_statistics stats = run("stalled server", stalled_port, stalled_scans, cfg);
+    close(stalled_fd);
+    if (stats.scans_with_status(scan_status::handshake_timeout) != stalled_scans) {
+        fprintf(stderr, "error: not every scan of the stalled server timed out\n");
+        return EXIT_FAILURE;
+    }
+    double expected_seconds = (double)stalled_scans / cfg.max_in_flight * cfg.handshake_timeout_ms / 1000.0;
+    if (stats.seconds() > 2 * expected_seconds) {
+        fprintf(stderr, "error: handshake timeouts took %.3f seconds, expected %.3f\n", stats.seconds(), expected_seconds);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}